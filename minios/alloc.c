@@ -35,54 +35,174 @@
 
 #if MICROPY_EMIT_NATIVE
 
-//#if defined(__OpenBSD__) || defined(__MACH__)
+#ifdef __MINIOS__
+#include <mini-os/os.h>
+#include <mini-os/mm.h>
+#else
+#ifndef MAP_ANONYMOUS
 #define MAP_ANONYMOUS MAP_ANON
-//#endif
+#endif
+#endif
 
 // The memory allocated here is not on the GC heap (and it may contain pointers
-// that need to be GC'd) so we must somehow trace this memory.  We do it by
-// keeping a linked list of all mmap'd regions, and tracing them explicitly.
+// that need to be GC'd) so we must somehow trace this memory.
+//
+// Native code is carved out of large executable regions: requests are rounded
+// up to a power-of-2 size class and served from a per-class free list or by
+// bumping the high-water mark of the current region. Freed slots are cleared
+// and pushed back to their free list, which makes freeing O(1) (the caller
+// passes the size it got from us). Requests above the largest class get a
+// dedicated region. All regions are kept in a small static table and only
+// the used part of each region is traced on a collection.
 
-typedef struct _mmap_region_t {
-    void *ptr;
-    size_t len;
-    struct _mmap_region_t *next;
-} mmap_region_t;
+#define EXEC_REGION_SIZE    (256 * 1024)
+#define EXEC_REGION_MAX     (32)
+#define EXEC_MIN_SHIFT      (6) // 64 bytes
+#define EXEC_NB_CLASSES     (8) // 64 bytes .. 8 KiB
+#define EXEC_SLOT_SIZE(cls) (((size_t)1) << (EXEC_MIN_SHIFT + (cls)))
+#define EXEC_SLOT_MAX       EXEC_SLOT_SIZE(EXEC_NB_CLASSES - 1)
+
+typedef struct _exec_region_t {
+    byte *base;
+    size_t len;  // length of the mapping
+    size_t used; // high-water mark, everything below may hold code
+} exec_region_t;
+
+STATIC exec_region_t exec_regions[EXEC_REGION_MAX];
+STATIC exec_region_t *exec_cur_region = NULL;
+STATIC void *exec_free_list[EXEC_NB_CLASSES];
+
+STATIC void *exec_map(size_t len) {
+#ifdef __MINIOS__
+    // Mini-OS does not map memory non-executable
+    return (void *)alloc_pages(get_order(len));
+#else
+    void *ptr = mmap(NULL, len, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return (ptr == MAP_FAILED) ? NULL : ptr;
+#endif
+}
+
+STATIC void exec_unmap(void *ptr, size_t len) {
+#ifdef __MINIOS__
+    free_pages(ptr, get_order(len));
+#else
+    munmap(ptr, len);
+#endif
+}
+
+STATIC int exec_size_class(size_t size) {
+    for (int cls = 0; cls < EXEC_NB_CLASSES; cls++) {
+        if (size <= EXEC_SLOT_SIZE(cls)) {
+            return cls;
+        }
+    }
+    return -1;
+}
+
+STATIC exec_region_t *exec_region_new(size_t len) {
+    for (int i = 0; i < EXEC_REGION_MAX; i++) {
+        exec_region_t *rg = &exec_regions[i];
+        if (rg->base == NULL) {
+            rg->base = exec_map(len);
+            if (rg->base == NULL) {
+                return NULL;
+            }
+            rg->len = len;
+            rg->used = 0;
+            return rg;
+        }
+    }
+    return NULL;
+}
+
+// Hands the unused tail of a full region out to the free lists
+STATIC void exec_region_retire(exec_region_t *rg) {
+    for (int cls = EXEC_NB_CLASSES - 1; cls >= 0; cls--) {
+        while (rg->len - rg->used >= EXEC_SLOT_SIZE(cls)) {
+            void **slot = (void **)(rg->base + rg->used);
+            *slot = exec_free_list[cls];
+            exec_free_list[cls] = slot;
+            rg->used += EXEC_SLOT_SIZE(cls);
+        }
+    }
+}
 
 void mp_unix_alloc_exec(mp_uint_t min_size, void **ptr, mp_uint_t *size) {
-    // size needs to be a multiple of the page size
-    *size = (min_size + 0xfff) & (~0xfff);
-    *ptr = mmap(NULL, *size, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    if (*ptr == MAP_FAILED) {
-        *ptr = NULL;
+    int cls = exec_size_class(min_size);
+
+    *ptr = NULL;
+    *size = 0;
+
+    if (cls < 0) {
+        // dedicated region, size needs to be a multiple of the page size
+        exec_region_t *rg = exec_region_new((min_size + 0xfff) & (~0xfff));
+        if (rg != NULL) {
+            rg->used = rg->len;
+            *ptr = rg->base;
+            *size = rg->len;
+        }
+        return;
+    }
+
+    if (exec_free_list[cls] != NULL) {
+        void **slot = exec_free_list[cls];
+        exec_free_list[cls] = *slot;
+        *slot = NULL;
+        *ptr = slot;
+        *size = EXEC_SLOT_SIZE(cls);
+        return;
     }
 
-    // add new link to the list of mmap'd regions
-    mmap_region_t *rg = m_new_obj(mmap_region_t);
-    rg->ptr = *ptr;
-    rg->len = min_size;
-    rg->next = MP_STATE_VM(mmap_region_head);
-    MP_STATE_VM(mmap_region_head) = rg;
+    exec_region_t *rg = exec_cur_region;
+    if (rg == NULL || rg->len - rg->used < EXEC_SLOT_SIZE(cls)) {
+        exec_region_t *new_rg = exec_region_new(EXEC_REGION_SIZE);
+        if (new_rg == NULL) {
+            return;
+        }
+        if (rg != NULL) {
+            exec_region_retire(rg);
+        }
+        exec_cur_region = rg = new_rg;
+    }
+    *ptr = rg->base + rg->used;
+    *size = EXEC_SLOT_SIZE(cls);
+    rg->used += EXEC_SLOT_SIZE(cls);
 }
 
 void mp_unix_free_exec(void *ptr, mp_uint_t size) {
-    munmap(ptr, size);
-
-    // unlink the mmap'd region from the list
-    for (mmap_region_t **rg = (mmap_region_t**)&MP_STATE_VM(mmap_region_head); *rg != NULL; *rg = (*rg)->next) {
-        if ((*rg)->ptr == ptr) {
-            mmap_region_t *next = (*rg)->next;
-            m_del_obj(mmap_region_t, *rg);
-            *rg = next;
-            return;
+    int cls = exec_size_class(size);
+
+    if (cls < 0) {
+        for (int i = 0; i < EXEC_REGION_MAX; i++) {
+            exec_region_t *rg = &exec_regions[i];
+            if (rg->base == ptr) {
+                exec_unmap(rg->base, rg->len);
+                rg->base = NULL;
+                rg->len = 0;
+                rg->used = 0;
+                return;
+            }
         }
+        return;
     }
+
+    // stale code must not keep heap objects alive
+    memset(ptr, 0, EXEC_SLOT_SIZE(cls));
+    *(void **)ptr = exec_free_list[cls];
+    exec_free_list[cls] = ptr;
 }
 
-void mp_unix_mark_exec(void) {
-    for (mmap_region_t *rg = MP_STATE_VM(mmap_region_head); rg != NULL; rg = rg->next) {
-        gc_collect_root(rg->ptr, rg->len / sizeof(mp_uint_t));
+// Returns the number of words traced
+mp_uint_t mp_unix_mark_exec(void) {
+    mp_uint_t words = 0;
+    for (int i = 0; i < EXEC_REGION_MAX; i++) {
+        exec_region_t *rg = &exec_regions[i];
+        if (rg->base != NULL) {
+            gc_collect_root((void **)rg->base, rg->used / sizeof(mp_uint_t));
+            words += rg->used / sizeof(mp_uint_t);
+        }
     }
+    return words;
 }
 
 #endif // MICROPY_EMIT_NATIVE
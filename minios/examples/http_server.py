@@ -3,12 +3,36 @@ try:
 except:
     import socket
 
+try:
+    import xbuf
+except ImportError:
+    xbuf = None
+
+try:
+    import uhttp
+except ImportError:
+    uhttp = None
+
 def readfile(filename):
     f = open(filename, 'r')
-    s = f.read()
+    if xbuf:
+        # keep the file content off the GC heap
+        s = xbuf.readfile(f)
+    else:
+        s = f.read()
     f.close()    
     return s
 
+def read_request(client_s, parser):
+    # feeds recv chunks until the request headers are complete
+    parser.reset()
+    while not parser.headers_done():
+        buf = client_s.recv(4096)
+        if not buf:
+            return
+        parser.feed(buf)
+    print(parser.method(), parser.path(), parser.header('User-Agent'))
+
 def main():  
     s = socket.socket()
 
@@ -19,14 +43,21 @@ def main():
     s.bind(addr)
     s.listen(5)
     print("Listening, connect your browser to http://172.64.0.100:8080/")
+    parser = uhttp.parser(uhttp.REQUEST) if uhttp else None
 
     while True:
-        f = readfile("index.html")        
         res = s.accept()
         client_s = res[0]
         client_addr = res[1]
-        client_s.recv(4096)
-        client_s.send(f)
+        if parser:
+            read_request(client_s, parser)
+        else:
+            client_s.recv(4096)
+        if hasattr(client_s, 'sendfile'):
+            # streams the file without copying it through Python objects
+            client_s.sendfile("index.html")
+        else:
+            client_s.send(readfile("index.html"))
         client_s.close()
 
 main()
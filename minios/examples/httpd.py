@@ -0,0 +1,16 @@
+import lwip
+import httpd
+
+lwip.reset()
+eth = lwip.ether('172.64.0.100', '255.255.255.0', '0.0.0.0')
+
+# Objects on the SHFS volume are served without entering Python,
+# everything else ends up here, called from serve() between polls.
+def handler(method, path):
+    if path == '/stats':
+        return (200, 'text/plain', repr(httpd.stats()))
+    return None
+
+httpd.start(80, handler)
+print("Serving SHFS on http://172.64.0.100/")
+httpd.serve()
@@ -0,0 +1,19 @@
+import lwip
+import pcap
+import utime
+
+lwip.reset()
+eth = lwip.ether('172.64.0.100', '255.255.255.0', '172.64.0.1')
+
+# second disk (xvdb); only TCP traffic on port 80, 96 bytes per frame
+pcap.filter(6, 80)
+pcap.start(51728, 96)
+
+deadline = utime.time() + 30
+while utime.time() < deadline:
+    eth.poll()
+
+n = pcap.stop()
+print(pcap.stats())
+# on the host: head -c <n> /dev/<disk> > trace.pcap
+print("trace length:", n)
@@ -0,0 +1,31 @@
+import lwip
+import utime
+
+lwip.reset()
+eth = lwip.ether('172.64.0.100', '255.255.255.0', '172.64.0.1')
+
+# ARP frames only; each batch is (length, frame) records, no per-frame objects
+s = lwip.socket(lwip.AF_PACKET, lwip.SOCK_RAW, 0x0806)
+s.settimeout(1)
+buf = bytearray(16 * 1536)
+requests = replies = 0
+
+deadline = utime.time() + 30
+while utime.time() < deadline:
+    try:
+        n = s.recv_batch(buf, 16)
+    except OSError:
+        continue
+    off = 0
+    for i in range(n):
+        length = (buf[off] << 8) | buf[off + 1]
+        op = buf[off + 2 + 21]   # low byte of the ARP opcode
+        if op == 1:
+            requests += 1
+        elif op == 2:
+            replies += 1
+        off += 2 + length
+
+print("ARP requests:", requests, "replies:", replies)
+print(s.stats())
+s.close()
@@ -0,0 +1,35 @@
+import lwip
+import usocket as socket
+
+lwip.reset()
+eth = lwip.ether('172.64.0.100', '255.255.255.0', '0.0.0.0')
+
+# Closes a connection from its socket callback while sendfile() is still
+# streaming an SHFS object over it. The segments lwIP has queued point
+# into pinned cache buffers, so close() has to drop them first; sendfile()
+# then fails with EBADF. Fetch an object larger than CUTOFF, e.g.
+#   curl -o /dev/null http://172.64.0.100:8080/
+OBJECT = 'index.html'
+CUTOFF = 256 * 1024
+
+def on_event(c):
+    if c.stats()['tx_bytes'] > CUTOFF:
+        c.close()
+
+s = socket.socket()
+s.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+s.bind(socket.getaddrinfo("0.0.0.0", 8080)[0][-1])
+s.listen(1)
+print("Waiting on port 8080")
+
+while True:
+    c, addr = s.accept()
+    c.setsockopt(socket.SOL_SOCKET, lwip.SO_CALLBACK, on_event)
+    c.send(b'HTTP/1.0 200 OK\r\n\r\n')
+    try:
+        n = c.sendfile(OBJECT)
+        print("FAIL: sendfile() completed,", n, "bytes; object smaller than CUTOFF?")
+    except OSError as e:
+        print("OK: sendfile() aborted by close():", e)
+    c.close()
+    print(c)
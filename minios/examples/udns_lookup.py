@@ -0,0 +1,20 @@
+import lwip
+import uevent
+import udns
+
+lwip.reset()
+eth = lwip.ether('172.64.0.100', '255.255.255.0', '172.64.0.1')
+
+def lookup(name):
+    q = udns.query(name)
+    # sleeps until the answer arrives, other tasks keep running
+    yield q
+    try:
+        print(name, q.result())
+    except OSError as e:
+        print(name, "failed:", e)
+
+for name in ("example.com", "example.com", "no-such-host.invalid"):
+    uevent.create_task(lookup(name))
+uevent.run()
+print(udns.stats())
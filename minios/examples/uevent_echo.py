@@ -0,0 +1,41 @@
+import lwip
+import usocket as socket
+import uevent
+from uevent import IORead, IOWrite
+
+lwip.reset()
+eth = lwip.ether('172.64.0.100', '255.255.255.0', '0.0.0.0')
+
+def echo(c):
+    c.setblocking(False)
+    while True:
+        yield IORead(c)
+        data = c.recv(1024)
+        if not data:
+            break
+        while data:
+            yield IOWrite(c)
+            n = c.send(data)
+            data = data[n:]
+    c.close()
+
+def server(port):
+    s = socket.socket()
+    s.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    s.bind(socket.getaddrinfo("0.0.0.0", port)[0][-1])
+    s.listen(8)
+    s.setblocking(False)
+    print("Echo server listening on port", port)
+    while True:
+        yield IORead(s)
+        c, addr = s.accept()
+        yield echo(c)
+
+def ticker():
+    while True:
+        yield uevent.sleep_ms(10000)
+        print(uevent.stats())
+
+uevent.create_task(server(7))
+uevent.create_task(ticker())
+uevent.run()
@@ -0,0 +1,33 @@
+import lwip
+import uhttp
+
+lwip.reset()
+eth = lwip.ether('172.64.0.100', '255.255.255.0', '172.64.0.1')
+
+buf = bytearray(1024)
+
+def fetch_all(host, paths):
+    c = uhttp.connect(host, 80, 5)
+    # all requests go out before the first response is read
+    for p in paths:
+        c.request("GET", p, {"Accept": "*/*"})
+    for p in paths:
+        r = c.getresponse()
+        total = 0
+        while True:
+            n = c.readinto(buf)
+            if n == 0:
+                break
+            total += n
+        print(p, r.status(), total, "bytes")
+    # kept open for the next connect() to the same host
+    c.release()
+
+fetch_all("example.com", ["/", "/index.html", "/"])
+fetch_all("example.com", ["/"])
+
+c = uhttp.connect("example.com")
+c.request("HEAD", "/")
+print(c.getresponse().headers())
+c.release()
+print(uhttp.pool())
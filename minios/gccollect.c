@@ -25,13 +25,101 @@
  */
 
 #include <stdio.h>
+#include <string.h>
 
 #include "py/mpstate.h"
 #include "py/gc.h"
+#include "py/runtime.h"
+#include "py/nlr.h"
+#include "gccollect.h"
+#include "mods/modxbuf.h"
+
+#ifdef __MINIOS__
+#include <mini-os/time.h>
+#define gc_now_ns() ((uint64_t)monotonic_clock())
+#else
+#include <time.h>
+static inline uint64_t gc_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+#endif
 
 #if MICROPY_ENABLE_GC
 
-extern void mp_unix_mark_exec(void);
+extern mp_uint_t mp_unix_mark_exec(void);
+
+gc_collect_stats_t gc_collect_stats;
+STATIC uint8_t gc_next_reason = GC_REASON_AUTO;
+STATIC bool gc_in_hook = false;
+bool gc_hook_pending = false;
+STATIC uint64_t gc_hook_pause_ns;  // longest pause since the hook last ran
+
+void gc_collect_set_reason(uint8_t reason) {
+    gc_next_reason = reason;
+}
+
+void gc_collect_stats_reset(void) {
+    memset(&gc_collect_stats, 0, sizeof(gc_collect_stats));
+}
+
+STATIC void gc_collect_account(uint64_t ns, mp_uint_t freed, mp_uint_t marked,
+                               mp_uint_t stack_words, mp_uint_t skipped_words,
+                               mp_uint_t root_words) {
+    gc_collect_stats_t *st = &gc_collect_stats;
+    uint64_t us = ns / 1000;
+    mp_uint_t bucket = 0;
+
+    while (us != 0 && bucket < GC_STATS_HIST_BUCKETS - 1) {
+        us >>= 1;
+        bucket++;
+    }
+
+    st->count++;
+    st->count_reason[gc_next_reason]++;
+    st->total_ns += ns;
+    if (ns > st->max_ns) {
+        st->max_ns = ns;
+    }
+    st->last_ns = ns;
+    st->last_freed = freed;
+    st->last_marked = marked;
+    st->last_stack_words = stack_words;
+    st->last_skipped_words = skipped_words;
+    st->last_root_words = root_words;
+    st->last_reason = gc_next_reason;
+    st->hist[bucket]++;
+    gc_next_reason = GC_REASON_AUTO;
+}
+
+// A collection runs in the middle of an allocation, so the hook is only
+// noted here and called later from gc_collect_hook_run().
+STATIC void gc_collect_note_hook(uint64_t ns) {
+    if (MP_STATE_VM(gc_stats_hook) == MP_OBJ_NULL || gc_in_hook) {
+        return;
+    }
+    if (!gc_hook_pending || ns > gc_hook_pause_ns) {
+        gc_hook_pause_ns = ns;
+    }
+    gc_hook_pending = true;
+}
+
+// The hook may allocate and can therefore trigger another collection,
+// which is accounted but does not call the hook again.
+void gc_collect_hook_run(void) {
+    if (!gc_hook_pending || gc_in_hook) {
+        return;
+    }
+    gc_hook_pending = false;
+    if (MP_STATE_VM(gc_stats_hook) == MP_OBJ_NULL) {
+        return;
+    }
+    gc_in_hook = true;
+    mp_call_function_1_protected(MP_STATE_VM(gc_stats_hook),
+                                 MP_OBJ_NEW_SMALL_INT((mp_uint_t)(gc_hook_pause_ns / 1000) & MP_SMALL_INT_POSITIVE_MASK));
+    gc_in_hook = false;
+}
 
 // Even if we have specific support for an architecture, it is
 // possible to force use of setjmp-based implementation.
@@ -138,19 +226,160 @@ STATIC void gc_helper_get_regs(regs_t arr) {
 
 #endif // MICROPY_GCREGS_SETJMP
 
+// A C-only region lives in the frame of gc_conly_call(); frames between
+// its address (hi) and lo (NULL while the C code is still running) are
+// not scanned. Regions are linked from the innermost one outwards.
+#define GC_CONLY_MAGIC ((uintptr_t)0x67636f6eUL)
+
+typedef struct _gc_conly_region_t {
+    struct _gc_conly_region_t *prev;
+    void *lo;
+    uintptr_t magic;
+    regs_t regs; // callee-saved registers of the caller
+} gc_conly_region_t;
+
+STATIC gc_conly_region_t *gc_conly_head = NULL;
+
+void gc_conly_call(void (*fn)(void *), void *arg) {
+    gc_conly_region_t rg;
+    nlr_buf_t nlr;
+
+    gc_helper_get_regs(rg.regs);
+    rg.lo = NULL;
+    rg.magic = GC_CONLY_MAGIC ^ (uintptr_t)&rg;
+    rg.prev = gc_conly_head;
+    gc_conly_head = &rg;
+    if (nlr_push(&nlr) == 0) {
+        fn(arg);
+        nlr_pop();
+        gc_conly_head = rg.prev;
+    } else {
+        gc_conly_head = rg.prev;
+        nlr_jump(nlr.ret_val);
+    }
+}
+
+void *gc_conly_python_enter(void *sp) {
+    gc_conly_region_t *rg = gc_conly_head;
+
+    // only the innermost region, and only when we are still in its C part
+    if (rg == NULL || rg->lo != NULL) {
+        return NULL;
+    }
+    rg->lo = sp;
+    return rg;
+}
+
+void gc_conly_python_leave(void *cookie) {
+    if (cookie != NULL) {
+        ((gc_conly_region_t*)cookie)->lo = NULL;
+    }
+}
+
+// The region list has to describe the current stack: regions must be
+// ordered from sp towards stack_top and not overlap. If anything looks
+// wrong, the collector falls back to scanning the whole stack.
+STATIC bool gc_conly_valid(void **sp, void **top) {
+    void **cur = sp;
+
+    for (gc_conly_region_t *rg = gc_conly_head; rg != NULL; rg = rg->prev) {
+        void **hi = (void**)(void*)rg;
+        if (hi < cur || hi >= top || rg->magic != (GC_CONLY_MAGIC ^ (uintptr_t)rg)) {
+            return false;
+        }
+        if (rg->lo != NULL && ((void**)rg->lo < cur || (void**)rg->lo > hi)) {
+            return false;
+        }
+        cur = hi;
+    }
+    return true;
+}
+
+// Scans the C stack from sp up to stack_top, leaving out C-only regions.
+// Returns the number of words scanned.
+STATIC mp_uint_t gc_collect_stack(void **sp, mp_uint_t *skipped) {
+    void **top = (void**)MP_STATE_VM(stack_top);
+    void **cur = sp;
+    mp_uint_t words = 0;
+
+    *skipped = 0;
+    if (gc_conly_valid(sp, top)) {
+        for (gc_conly_region_t *rg = gc_conly_head; rg != NULL; rg = rg->prev) {
+            if (rg->lo == NULL) {
+                // collecting from within the C part: keep it
+                continue;
+            }
+            gc_collect_root(cur, (void**)rg->lo - cur);
+            words += (void**)rg->lo - cur;
+            *skipped += (void**)(void*)rg - (void**)rg->lo;
+            cur = (void**)(void*)rg; // the region itself holds the saved registers
+        }
+    }
+    gc_collect_root(cur, top - cur);
+    words += top - cur;
+    return words;
+}
+
+// Block allocation table as laid out by py/gc.c: 2 bits per block
+#define GC_BLOCKS_PER_ATB (4)
+#define GC_ATB_KIND(block) ((MP_STATE_MEM(gc_alloc_table_start)[(block) / GC_BLOCKS_PER_ATB] \
+                            >> (2 * ((block) & (GC_BLOCKS_PER_ATB - 1)))) & 3)
+#define GC_AT_FREE (0)
+
+// Stack scanned by gc_collect_scan_live(): from the registers saved by
+// gc_collect(), leaving out the frames of the scan itself
+STATIC void **gc_scan_sp = NULL;
+
+void gc_collect_scan_live(void (*fn)(void **ptrs, mp_uint_t len, void *arg), void *arg) {
+    if (gc_scan_sp == NULL) {
+        return;
+    }
+    fn(gc_scan_sp, (void**)MP_STATE_VM(stack_top) - gc_scan_sp, arg);
+
+    void **pool = (void**)(void*)MP_STATE_MEM(gc_pool_start);
+    mp_uint_t blocks = MP_STATE_MEM(gc_alloc_table_byte_len) * GC_BLOCKS_PER_ATB;
+    const mp_uint_t words = BYTES_PER_BLOCK / sizeof(void*);
+    mp_uint_t run = 0;
+    for (mp_uint_t b = 0; b <= blocks; b++) {
+        if (b < blocks && GC_ATB_KIND(b) != GC_AT_FREE) {
+            run++;
+        } else if (run > 0) {
+            fn(pool + (b - run) * words, run * words, arg);
+            run = 0;
+        }
+    }
+}
+
 void gc_collect(void) {
     //gc_dump_info();
+    mp_uint_t stack_words, skipped_words, root_words, used_before;
+    gc_info_t info;
+
+    // heap usage is sampled outside of the measured pause
+    gc_info(&info);
+    used_before = info.used;
+    uint64_t t0 = gc_now_ns();
 
     gc_collect_start();
     regs_t regs;
     gc_helper_get_regs(regs);
     // GC stack (and regs because we captured them)
     void **regs_ptr = (void**)(void*)&regs;
-    gc_collect_root(regs_ptr, ((uintptr_t)MP_STATE_VM(stack_top) - (uintptr_t)&regs) / sizeof(uintptr_t));
+    stack_words = gc_collect_stack(regs_ptr, &skipped_words);
+    root_words = stack_words;
     #if MICROPY_EMIT_NATIVE
-    mp_unix_mark_exec();
+    root_words += mp_unix_mark_exec();
     #endif
     gc_collect_end();
+    gc_scan_sp = regs_ptr;
+    xbuf_collect_held();
+    gc_scan_sp = NULL;
+
+    uint64_t t1 = gc_now_ns();
+    gc_info(&info);
+    gc_collect_account(t1 - t0, used_before - info.used, info.used / BYTES_PER_BLOCK,
+                       stack_words, skipped_words, root_words);
+    gc_collect_note_hook(t1 - t0);
 
     //printf("-----\n");
     //gc_dump_info();
@@ -0,0 +1,90 @@
+/*
+ * This file is part of the Micro Python project, http://micropython.org/
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2017 NEC Europe Ltd., NEC Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef MICROPY_INCLUDED_MINIOS_GCCOLLECT_H
+#define MICROPY_INCLUDED_MINIOS_GCCOLLECT_H
+
+#include <stdint.h>
+#include "py/mpconfig.h"
+
+// Why a collection was started (see gc_collect_set_reason())
+#define GC_REASON_AUTO     (0) // heap exhausted, or gc.collect()
+#define GC_REASON_EXPLICIT (1) // gcstats.collect()
+#define GC_REASON_XBUF     (2) // off-heap buffer memory exhausted
+#define GC_REASON_MAX      (3)
+
+// Pause histogram: bucket 0 counts pauses < 1us, bucket i (i > 0)
+// counts pauses in [2^(i-1), 2^i) us, the last bucket takes the rest
+#define GC_STATS_HIST_BUCKETS (24)
+
+typedef struct _gc_collect_stats_t {
+    mp_uint_t count;
+    mp_uint_t count_reason[GC_REASON_MAX];
+    uint64_t total_ns;
+    uint64_t max_ns;
+    // last collection
+    uint64_t last_ns;
+    mp_uint_t last_freed;       // bytes
+    mp_uint_t last_marked;      // blocks alive after the collection
+    mp_uint_t last_stack_words; // registers and C stack words scanned
+    mp_uint_t last_skipped_words; // C stack words skipped (C-only regions)
+    mp_uint_t last_root_words;  // stack plus native code regions
+    uint8_t last_reason;
+    mp_uint_t hist[GC_STATS_HIST_BUCKETS];
+} gc_collect_stats_t;
+
+extern gc_collect_stats_t gc_collect_stats;
+
+// Sets the reason reported for the next collection
+void gc_collect_set_reason(uint8_t reason);
+void gc_collect_stats_reset(void);
+// Passes the registers and C stack as seen by gc_collect(), then every
+// allocated heap block to fn, as ranges of words that may hold pointers.
+// Lets memory the GC does not manage be checked for references from live
+// objects; only works when called from within gc_collect() after the sweep.
+void gc_collect_scan_live(void (*fn)(void **ptrs, mp_uint_t len, void *arg), void *arg);
+
+// Calls the gcstats hook if there were collections since it last ran;
+// for places where running Python is safe (the VM loop hook, network
+// polling, gcstats). gc_hook_pending is set while a call is due.
+extern bool gc_hook_pending;
+void gc_collect_hook_run(void);
+
+// C-only stack regions
+//
+// gc_conly_call() runs fn(arg) and tells the collector that the frames
+// below it hold no references into the GC heap (lwIP, netfront, ...).
+// When such code calls back into Python, it brackets the call with
+// gc_conly_python_enter()/_leave(), so that only the C frames between
+// the two marks are skipped while the Python frames further down are
+// scanned as usual. Collections started from within the C-only frames
+// themselves scan the whole region. The registers of the caller are
+// saved on entry and stay visible to the collector; arg itself must not
+// be the only reference to a heap object.
+void gc_conly_call(void (*fn)(void *), void *arg);
+void *gc_conly_python_enter(void *sp);
+void gc_conly_python_leave(void *cookie);
+
+#endif // MICROPY_INCLUDED_MINIOS_GCCOLLECT_H
@@ -0,0 +1,185 @@
+# Socket layer benchmarks for the host build
+#
+#   ./minipython-host bench/netbench.py [accept|rps|bulk|udp ...] [n=<count>]
+#
+# Client and server run as uevent tasks on one lwIP stack, talking over the
+# interface's own address (looped back by lwIP), so the figures cover the
+# socket layer, lwIP and the event loop but not a driver.
+import sys
+import lwip
+import usocket as socket
+import uevent
+import utime
+from uevent import IORead, IOWrite
+
+IP = '10.0.0.1'
+PORT = 5001
+
+lwip.reset()
+eth = lwip.ether(IP, '255.255.255.0', '0.0.0.0')
+
+def addr(port):
+    return socket.getaddrinfo(IP, port)[0][-1]
+
+def listener(port):
+    s = socket.socket()
+    s.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    s.bind(addr(port))
+    s.listen(64)
+    s.setblocking(False)
+    return s
+
+def report(name, n, unit, t0):
+    us = utime.ticks_diff(t0, utime.ticks_us())
+    if us <= 0:
+        us = 1
+    print("%-8s %10d %-6s %8d ms %12.1f %s/s" % (name, n, unit, us // 1000, n * 1000000 / us, unit))
+
+# connections accepted per second; each one is closed right away
+def bench_accept(n):
+    s = listener(PORT)
+    def server():
+        for i in range(n):
+            yield IORead(s)
+            c, a = s.accept()
+            c.close()
+        s.close()
+    def client():
+        t0 = utime.ticks_us()
+        for i in range(n):
+            c = socket.socket()
+            c.connect(addr(PORT))
+            c.close()
+            yield
+        report("accept", n, "conn", t0)
+    uevent.create_task(server())
+    uevent.create_task(client())
+    uevent.run()
+
+# request/response round trips of 64 bytes on one connection
+def bench_rps(n):
+    s = listener(PORT + 1)
+    req = b'x' * 64
+    def server():
+        yield IORead(s)
+        c, a = s.accept()
+        c.setblocking(False)
+        s.close()
+        while True:
+            yield IORead(c)
+            data = c.recv(len(req))
+            if not data:
+                break
+            yield IOWrite(c)
+            c.send(data)
+        c.close()
+    def client():
+        c = socket.socket()
+        c.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        c.connect(addr(PORT + 1))
+        c.setblocking(False)
+        t0 = utime.ticks_us()
+        for i in range(n):
+            yield IOWrite(c)
+            c.send(req)
+            got = 0
+            while got < len(req):
+                yield IORead(c)
+                got += len(c.recv(len(req)))
+        report("rps", n, "req", t0)
+        c.close()
+    uevent.create_task(server())
+    uevent.create_task(client())
+    uevent.run()
+
+# one-way throughput in 16 KiB writes
+def bench_bulk(n):
+    s = listener(PORT + 2)
+    buf = b'x' * 16384
+    total = n * len(buf)
+    t = [0]
+    def server():
+        yield IORead(s)
+        c, a = s.accept()
+        c.setblocking(False)
+        s.close()
+        got = 0
+        while got < total:
+            yield IORead(c)
+            data = c.recv(65536)
+            if not data:
+                break
+            got += len(data)
+        report("bulk", got // 1024, "KiB", t[0])
+        c.close()
+    def client():
+        c = socket.socket()
+        c.connect(addr(PORT + 2))
+        c.setblocking(False)
+        t[0] = utime.ticks_us()
+        for i in range(n):
+            data = buf
+            while data:
+                yield IOWrite(c)
+                data = data[c.send(data):]
+        c.close()
+    uevent.create_task(server())
+    uevent.create_task(client())
+    uevent.run()
+
+# 64-byte datagrams; the receiver counts what survives
+def bench_udp(n):
+    r = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    r.bind(addr(PORT + 3))
+    r.setblocking(False)
+    msg = b'x' * 64
+    done = [False]
+    def receiver():
+        got = 0
+        t0 = utime.ticks_us()
+        while True:
+            if r.rxqueue()[0]:
+                r.recvfrom(len(msg))
+                got += 1
+            elif done[0]:
+                break
+            else:
+                yield
+        report("udp", got, "pkt", t0)
+        r.close()
+    def sender():
+        c = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        dst = addr(PORT + 3)
+        t0 = utime.ticks_us()
+        for i in range(n):
+            c.sendto(msg, dst)
+            if i % 64 == 63:
+                yield
+        report("udp-tx", n, "pkt", t0)
+        done[0] = True
+        c.close()
+    uevent.create_task(receiver())
+    uevent.create_task(sender())
+    uevent.run()
+
+BENCHES = {
+    'accept': (bench_accept, 2000),
+    'rps': (bench_rps, 20000),
+    'bulk': (bench_bulk, 4096),
+    'udp': (bench_udp, 100000),
+}
+
+names = []
+count = None
+for arg in sys.argv[2:]:
+    if arg.startswith('n='):
+        count = int(arg[2:])
+    else:
+        names.append(arg)
+if not names:
+    names = ['accept', 'rps', 'bulk', 'udp']
+
+for name in names:
+    fn, n = BENCHES[name]
+    fn(count or n)
+print(lwip.stats('tcp'))
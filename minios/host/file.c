@@ -0,0 +1,177 @@
+/*
+ * This file is part of the Micro Python project, http://micropython.org/
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2017 NEC Europe Ltd., NEC Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+// open() for the host build: plain POSIX files (builtin_open.c needs FatFs)
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "py/runtime.h"
+#include "py/stream.h"
+
+typedef struct _host_file_obj_t {
+    mp_obj_base_t base;
+    int fd;
+} host_file_obj_t;
+
+STATIC const mp_obj_type_t host_fileio_type;
+STATIC const mp_obj_type_t host_textio_type;
+
+STATIC void host_file_check(host_file_obj_t *o) {
+    if (o->fd < 0) {
+        nlr_raise(mp_obj_new_exception_msg(&mp_type_ValueError, "I/O operation on closed file"));
+    }
+}
+
+STATIC mp_uint_t host_file_read(mp_obj_t o_in, void *buf, mp_uint_t size, int *errcode) {
+    host_file_obj_t *o = MP_OBJ_TO_PTR(o_in);
+    host_file_check(o);
+    ssize_t r = read(o->fd, buf, size);
+    if (r < 0) {
+        *errcode = errno;
+        return MP_STREAM_ERROR;
+    }
+    return r;
+}
+
+STATIC mp_uint_t host_file_write(mp_obj_t o_in, const void *buf, mp_uint_t size, int *errcode) {
+    host_file_obj_t *o = MP_OBJ_TO_PTR(o_in);
+    host_file_check(o);
+    ssize_t r = write(o->fd, buf, size);
+    if (r < 0) {
+        *errcode = errno;
+        return MP_STREAM_ERROR;
+    }
+    return r;
+}
+
+STATIC mp_uint_t host_file_ioctl(mp_obj_t o_in, mp_uint_t request, uintptr_t arg, int *errcode) {
+    host_file_obj_t *o = MP_OBJ_TO_PTR(o_in);
+    host_file_check(o);
+    if (request == MP_STREAM_SEEK) {
+        struct mp_stream_seek_t *s = (struct mp_stream_seek_t*)arg;
+        off_t off = lseek(o->fd, s->offset, s->whence);
+        if (off < 0) {
+            *errcode = errno;
+            return MP_STREAM_ERROR;
+        }
+        s->offset = off;
+        return 0;
+    }
+    *errcode = EINVAL;
+    return MP_STREAM_ERROR;
+}
+
+STATIC mp_obj_t host_file_close(mp_obj_t o_in) {
+    host_file_obj_t *o = MP_OBJ_TO_PTR(o_in);
+    if (o->fd >= 0) {
+        close(o->fd);
+        o->fd = -1;
+    }
+    return mp_const_none;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_1(host_file_close_obj, host_file_close);
+
+STATIC mp_obj_t host_file___exit__(size_t n_args, const mp_obj_t *args) {
+    (void)n_args;
+    return host_file_close(args[0]);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(host_file___exit___obj, 4, 4, host_file___exit__);
+
+STATIC const mp_rom_map_elem_t host_file_locals_dict_table[] = {
+    { MP_ROM_QSTR(MP_QSTR_read), MP_ROM_PTR(&mp_stream_read_obj) },
+    { MP_ROM_QSTR(MP_QSTR_readinto), MP_ROM_PTR(&mp_stream_readinto_obj) },
+    { MP_ROM_QSTR(MP_QSTR_readline), MP_ROM_PTR(&mp_stream_unbuffered_readline_obj) },
+    { MP_ROM_QSTR(MP_QSTR_write), MP_ROM_PTR(&mp_stream_write_obj) },
+    { MP_ROM_QSTR(MP_QSTR_seek), MP_ROM_PTR(&mp_stream_seek_obj) },
+    { MP_ROM_QSTR(MP_QSTR_close), MP_ROM_PTR(&host_file_close_obj) },
+    { MP_ROM_QSTR(MP_QSTR___del__), MP_ROM_PTR(&host_file_close_obj) },
+    { MP_ROM_QSTR(MP_QSTR___enter__), MP_ROM_PTR(&mp_identity_obj) },
+    { MP_ROM_QSTR(MP_QSTR___exit__), MP_ROM_PTR(&host_file___exit___obj) },
+};
+STATIC MP_DEFINE_CONST_DICT(host_file_locals_dict, host_file_locals_dict_table);
+
+STATIC const mp_stream_p_t host_fileio_stream_p = {
+    .read = host_file_read,
+    .write = host_file_write,
+    .ioctl = host_file_ioctl,
+};
+
+STATIC const mp_obj_type_t host_fileio_type = {
+    { &mp_type_type },
+    .name = MP_QSTR_FileIO,
+    .getiter = mp_identity,
+    .iternext = mp_stream_unbuffered_iter,
+    .stream_p = &host_fileio_stream_p,
+    .locals_dict = (mp_obj_t)&host_file_locals_dict,
+};
+
+STATIC const mp_stream_p_t host_textio_stream_p = {
+    .read = host_file_read,
+    .write = host_file_write,
+    .ioctl = host_file_ioctl,
+    .is_text = true,
+};
+
+STATIC const mp_obj_type_t host_textio_type = {
+    { &mp_type_type },
+    .name = MP_QSTR_TextIOWrapper,
+    .getiter = mp_identity,
+    .iternext = mp_stream_unbuffered_iter,
+    .stream_p = &host_textio_stream_p,
+    .locals_dict = (mp_obj_t)&host_file_locals_dict,
+};
+
+// open(name, mode='r')
+STATIC mp_obj_t host_builtin_open(size_t n_args, const mp_obj_t *args, mp_map_t *kw_args) {
+    (void)kw_args;
+    const char *name = mp_obj_str_get_str(args[0]);
+    const char *mode = n_args > 1 ? mp_obj_str_get_str(args[1]) : "r";
+    const mp_obj_type_t *type = &host_textio_type;
+    int flags = 0;
+
+    for (const char *m = mode; *m; m++) {
+        switch (*m) {
+            case 'r': flags = O_RDONLY; break;
+            case 'w': flags = O_WRONLY | O_CREAT | O_TRUNC; break;
+            case 'a': flags = O_WRONLY | O_CREAT | O_APPEND; break;
+            case '+': flags = (flags & ~(O_RDONLY | O_WRONLY)) | O_RDWR; break;
+            case 'b': type = &host_fileio_type; break;
+            case 't': type = &host_textio_type; break;
+        }
+    }
+
+    int fd = open(name, flags, 0644);
+    if (fd < 0) {
+        nlr_raise(mp_obj_new_exception_arg1(&mp_type_OSError, MP_OBJ_NEW_SMALL_INT(errno)));
+    }
+    host_file_obj_t *o = m_new_obj_with_finaliser(host_file_obj_t);
+    o->base.type = type;
+    o->fd = fd;
+    return MP_OBJ_FROM_PTR(o);
+}
+MP_DEFINE_CONST_FUN_OBJ_KW(mp_builtin_open_obj, 1, host_builtin_open);
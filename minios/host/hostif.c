@@ -0,0 +1,197 @@
+/*
+ * This file is part of the Micro Python project, http://micropython.org/
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2017 NEC Europe Ltd., NEC Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+// Stand-ins for the Mini-OS netfront driver and Xenstore, so that the
+// lwip module runs unchanged on a Linux host (see include/mini-os/lwip-net.h)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/if.h>
+#include <linux/if_tun.h>
+
+#include "lwip/pbuf.h"
+#include "lwip/netif.h"
+#include "lwip/sys.h"
+#include <mini-os/lwip-net.h>
+#include <mini-os/time.h>
+#include "xenbus.h"
+
+#ifndef HOSTIF_MAX
+#define HOSTIF_MAX (8)
+#endif
+#ifndef HOSTIF_BURST
+#define HOSTIF_BURST (64) // frames read from a TAP device per poll
+#endif
+#define HOSTIF_MTU (1500)
+#define HOSTIF_FRAME_MAX (HOSTIF_MTU + 14)
+#define HOSTIF_VIFS_DEFAULT (2)
+
+// TAP device per vif, or -1 when the vif has no link: its frames are
+// dropped and only traffic between local addresses (looped back by
+// lwIP) gets through
+static int hostif_fds[HOSTIF_MAX];
+static uint8_t hostif_frame[HOSTIF_FRAME_MAX];
+
+u32_t sys_now(void) {
+    return (u32_t)NSEC_TO_MSEC(monotonic_clock());
+}
+
+static int hostif_count(void) {
+    const char *s = getenv("MINIPYTHON_VIFS");
+    int n = s ? atoi(s) : HOSTIF_VIFS_DEFAULT;
+    return n < 0 ? 0 : (n > HOSTIF_MAX ? HOSTIF_MAX : n);
+}
+
+static int hostif_tap_open(int vif) {
+    const char *pattern = getenv("MINIPYTHON_TAP");
+    struct ifreq ifr;
+    int fd;
+
+    if (pattern == NULL) {
+        return -1;
+    }
+    fd = open("/dev/net/tun", O_RDWR | O_NONBLOCK);
+    if (fd < 0) {
+        printk("hostif: /dev/net/tun: %s\n", strerror(errno));
+        return -1;
+    }
+    memset(&ifr, 0, sizeof(ifr));
+    ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+    snprintf(ifr.ifr_name, IFNAMSIZ, pattern, vif);
+    if (ioctl(fd, TUNSETIFF, &ifr) < 0) {
+        printk("hostif: %s: %s\n", ifr.ifr_name, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static err_t hostif_linkoutput(struct netif *netif, struct pbuf *p) {
+    int fd = hostif_fds[((struct netfrontif*)netif->state)->vif_id];
+
+    if (fd < 0) {
+        LINK_STATS_INC(link.drop);
+        return ERR_OK;
+    }
+    if (p->tot_len > sizeof(hostif_frame)) {
+        LINK_STATS_INC(link.lenerr);
+        return ERR_BUF;
+    }
+    pbuf_copy_partial(p, hostif_frame, p->tot_len, 0);
+    if (write(fd, hostif_frame, p->tot_len) < 0) {
+        LINK_STATS_INC(link.err);
+        return ERR_IF;
+    }
+    LINK_STATS_INC(link.xmit);
+    return ERR_OK;
+}
+
+err_t netfrontif_init(struct netif *netif) {
+    struct netfrontif *nfi = netif->state;
+    int fd;
+
+    if (nfi == NULL || nfi->vif_id < 0 || nfi->vif_id >= HOSTIF_MAX) {
+        return ERR_ARG;
+    }
+    fd = hostif_tap_open(nfi->vif_id);
+    hostif_fds[nfi->vif_id] = fd;
+
+    netif->name[0] = 'e';
+    netif->name[1] = 'n';
+    netif->output = etharp_output;
+    netif->linkoutput = hostif_linkoutput;
+    netif->mtu = HOSTIF_MTU;
+    netif->hwaddr_len = 6;
+    // locally administered, unique per vif
+    netif->hwaddr[0] = 0x02;
+    netif->hwaddr[1] = 'M';
+    netif->hwaddr[2] = 'P';
+    netif->hwaddr[3] = (getpid() >> 8) & 0xff;
+    netif->hwaddr[4] = getpid() & 0xff;
+    netif->hwaddr[5] = nfi->vif_id;
+    netif->flags = NETIF_FLAG_BROADCAST | NETIF_FLAG_ETHARP | NETIF_FLAG_LINK_UP;
+    #ifdef NETIF_FLAG_ETHERNET
+    netif->flags |= NETIF_FLAG_ETHERNET;
+    #endif
+    printk("hostif: vif%d %s\n", nfi->vif_id, fd >= 0 ? "on TAP" : "without link");
+    return ERR_OK;
+}
+
+void netfrontif_poll(struct netif *netif) {
+    int fd = hostif_fds[((struct netfrontif*)netif->state)->vif_id];
+
+    for (int n = 0; fd >= 0 && n < HOSTIF_BURST; n++) {
+        ssize_t len = read(fd, hostif_frame, sizeof(hostif_frame));
+        if (len <= 0) {
+            break;
+        }
+        struct pbuf *p = pbuf_alloc(PBUF_RAW, len, PBUF_POOL);
+        if (p == NULL) {
+            LINK_STATS_INC(link.memerr);
+            break;
+        }
+        pbuf_take(p, hostif_frame, len);
+        LINK_STATS_INC(link.recv);
+        if (netif->input(p, netif) != ERR_OK) {
+            pbuf_free(p);
+        }
+    }
+    #if LWIP_NETIF_LOOPBACK
+    netif_poll(netif);
+    #endif
+}
+
+char *xenbus_read(xenbus_transaction_t xbt, const char *path, char **value) {
+    char name[32];
+    int dom, vif, off = 0;
+    (void)xbt;
+
+    *value = NULL;
+    if (strcmp(path, "domid") == 0) {
+        *value = strdup("0");
+        return NULL;
+    }
+    if (sscanf(path, "/local/domain/0/backend/vif/%d/%d%n", &dom, &vif, &off) == 2
+        && vif >= 0 && vif < hostif_count()) {
+        if (path[off] == '\0') {
+            *value = strdup("0");
+            return NULL;
+        }
+        if (strcmp(path + off, "/ip") == 0) {
+            snprintf(name, sizeof(name), "MINIPYTHON_VIF%d_IP", vif);
+            if (getenv(name) != NULL) {
+                *value = strdup(getenv(name));
+                return NULL;
+            }
+        }
+    }
+    return strdup("ENOENT");
+}
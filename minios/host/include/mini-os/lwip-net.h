@@ -0,0 +1,45 @@
+/*
+ * This file is part of the Micro Python project, http://micropython.org/
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2017 NEC Europe Ltd., NEC Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef MINIPYTHON_HOST_MINIOS_LWIP_NET_H
+#define MINIPYTHON_HOST_MINIOS_LWIP_NET_H
+
+// Host build: stand-in for the netfront lwIP driver of Mini-OS. vifN is
+// the TAP device named by $MINIPYTHON_TAP (a printf pattern, e.g. "mp%d")
+// or, without it, has no link. netfrontif_poll() delivers the frames
+// received since the last call, as netfront does.
+
+#include <mini-os/lib.h>
+#include "lwip/netif.h"
+#include "netif/etharp.h"
+
+struct netfrontif {
+    int vif_id;
+};
+
+err_t netfrontif_init(struct netif *netif);
+void netfrontif_poll(struct netif *netif);
+
+#endif // MINIPYTHON_HOST_MINIOS_LWIP_NET_H
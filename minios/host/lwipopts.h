@@ -0,0 +1,76 @@
+/*
+ * This file is part of the Micro Python project, http://micropython.org/
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2017 NEC Europe Ltd., NEC Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef MINIPYTHON_HOST_LWIPOPTS_H
+#define MINIPYTHON_HOST_LWIPOPTS_H
+
+// Host build: lwIP without threads, polled by the lwip module like on
+// Mini-OS (CONFIG_LWIP_NOTHREADS, CONFIG_LWIP_MINIMAL)
+#define NO_SYS                      1
+#define LWIP_SOCKET                 0
+#define LWIP_NETCONN                0
+#define SYS_LIGHTWEIGHT_PROT        0
+
+#define MEM_ALIGNMENT               8
+#define MEM_SIZE                    (16 * 1024 * 1024)
+#define MEMP_NUM_PBUF               1024
+#define MEMP_NUM_UDP_PCB            64
+#define MEMP_NUM_TCP_PCB            1024
+#define MEMP_NUM_TCP_PCB_LISTEN     32
+#define MEMP_NUM_TCP_SEG            4096
+#define MEMP_NUM_REASSDATA          32
+#define MEMP_NUM_SYS_TIMEOUT        16
+#define PBUF_POOL_SIZE              4096
+#define PBUF_POOL_BUFSIZE           LWIP_MEM_ALIGN_SIZE(1536)
+
+#define LWIP_ARP                    1
+#define ETHARP_SUPPORT_STATIC_ENTRIES 1
+#define LWIP_ICMP                   1
+#define LWIP_UDP                    1
+#define LWIP_TCP                    1
+#define LWIP_DNS                    1
+#define LWIP_DHCP                   0
+#define LWIP_IGMP                   1
+#define IP_REASSEMBLY               1
+#define IP_FRAG                     1
+#define SO_REUSE                    1
+#define LWIP_TCP_KEEPALIVE          1
+#define LWIP_NETIF_LOOPBACK         1
+#define LWIP_HAVE_LOOPIF            0
+
+#define TCP_MSS                     1460
+#define TCP_WND                     (44 * TCP_MSS)
+#define TCP_SND_BUF                 (44 * TCP_MSS)
+#define TCP_SND_QUEUELEN            (4 * TCP_SND_BUF / TCP_MSS)
+#define TCP_LISTEN_BACKLOG          1
+#define TCP_OVERSIZE                TCP_MSS
+
+#define LWIP_STATS                  1
+#define LWIP_STATS_DISPLAY          0
+#define MIB2_STATS                  1
+
+#define LWIP_RAND()                 ((u32_t)rand())
+
+#endif // MINIPYTHON_HOST_LWIPOPTS_H
@@ -0,0 +1,49 @@
+/*
+ * This file is part of the Micro Python project, http://micropython.org/
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2017 NEC Europe Ltd., NEC Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+// Host build: the Mini-OS configuration without native code emitters,
+// file systems and the modules that need Xen devices
+#define MICROPY_EMIT_X64            (0)
+#define MICROPY_EMIT_X86            (0)
+#define MICROPY_EMIT_THUMB          (0)
+#define MICROPY_EMIT_ARM            (0)
+
+#include "../mpconfigport.h"
+
+#undef MICROPY_PY_MACHINE
+#define MICROPY_PY_MACHINE          (0)
+
+#undef MICROPY_PORT_BUILTIN_MODULES
+#define MICROPY_PORT_BUILTIN_MODULES \
+  { MP_OBJ_NEW_QSTR(MP_QSTR_usocket), (mp_obj_t)&mp_module_usocket }, \
+  { MP_ROM_QSTR(MP_QSTR_utime), MP_ROM_PTR(&mp_module_time) }, \
+  { MP_ROM_QSTR(MP_QSTR_lwip), MP_ROM_PTR(&mp_module_lwip) }, \
+  { MP_ROM_QSTR(MP_QSTR_xbuf), MP_ROM_PTR(&mp_module_xbuf) }, \
+  { MP_ROM_QSTR(MP_QSTR_gcstats), MP_ROM_PTR(&mp_module_gcstats) }, \
+  { MP_ROM_QSTR(MP_QSTR_uevent), MP_ROM_PTR(&mp_module_uevent) }, \
+  { MP_ROM_QSTR(MP_QSTR_uhttp), MP_ROM_PTR(&mp_module_uhttp) }, \
+  { MP_ROM_QSTR(MP_QSTR_udns), MP_ROM_PTR(&mp_module_udns) }, \
+
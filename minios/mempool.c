@@ -36,6 +36,9 @@
 
 #include <errno.h>
 #include "mempool.h"
+#ifndef __MINIOS__
+#include <sys/mman.h>
+#endif
 
 #ifdef MEMPOOL_DEBUG
 #define ENABLE_DEBUG
@@ -71,6 +74,51 @@ static inline size_t align_up(size_t size, size_t align)
   return (size + align - 1) & ~(align - 1);
 }
 
+/*
+ * Allocates the separate object data area of a pool.
+ * With large = 1, the area is requested 2 MiB-aligned and 2 MiB-sized so
+ * that it can be backed by superpages; NULL is returned if this is not
+ * possible and the caller falls back to a regular allocation.
+ */
+static void *_alloc_data_area(size_t *len, size_t align, int large)
+{
+  void *area;
+
+  if (!large)
+	return _xmalloc(*len, align);
+
+  if (align > MEMPOOL_LARGE_PAGE_SIZE)
+	return NULL;
+#ifdef __MINIOS__
+  /* Mini-OS maps its heap with 4 KiB pages only: a 2 MiB-aligned
+   * _xmalloc() area would not be superpage-backed */
+  return NULL;
+#else
+#ifdef MAP_HUGETLB
+  area = mmap(NULL, align_up(*len, MEMPOOL_LARGE_PAGE_SIZE),
+	      PROT_READ | PROT_WRITE,
+	      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (area == MAP_FAILED)
+	return NULL;
+#else
+  return NULL;
+#endif
+#endif
+  *len = align_up(*len, MEMPOOL_LARGE_PAGE_SIZE);
+  return area;
+}
+
+static void _free_data_area(void *area, size_t len, int large)
+{
+#ifndef __MINIOS__
+  if (large) {
+	munmap(area, len);
+	return;
+  }
+#endif
+  xfree(area);
+}
+
 struct mempool *alloc_enhanced_mempool(uint32_t nb_objs,
 					 size_t obj_size, size_t obj_data_align, size_t obj_headroom, size_t obj_tailroom, size_t obj_private_len, int sep_obj_data,
 					 void (*obj_init_func)(struct mempool_obj *, void *), void *obj_init_func_argp,
@@ -132,11 +180,25 @@ struct mempool *alloc_enhanced_mempool(uint32_t nb_objs,
         errno = ENOMEM;
         goto error;
     }
-    p->obj_data_area = _xmalloc(data_size, obj_data_align);
-    if (!p) {
+    p->obj_data_area_large = 0;
+    p->obj_data_area_len = data_size;
+    p->obj_data_area = NULL;
+    if (sep_obj_data == MEMPOOL_SEP_DATA_LARGE) {
+        p->obj_data_area = _alloc_data_area(&p->obj_data_area_len, obj_data_align, 1);
+        if (p->obj_data_area)
+            p->obj_data_area_large = 1;
+        else
+            printd("Large page data area not available, falling back to regular pages\n");
+    }
+    if (!p->obj_data_area) {
+        p->obj_data_area_len = data_size;
+        p->obj_data_area = _alloc_data_area(&p->obj_data_area_len, obj_data_align, 0);
+    }
+    if (!p->obj_data_area) {
         errno = ENOMEM;
         goto error_free_p;
     }
+    data_size = p->obj_data_area_len;
   } else {
     h_size = align_up(h_size, obj_data_align);
     o_size = align_up(o_size, obj_data_align);
@@ -149,6 +211,8 @@ struct mempool *alloc_enhanced_mempool(uint32_t nb_objs,
         goto error;
     }
     p->obj_data_area = NULL; /* no extra object data area*/
+    p->obj_data_area_len = 0;
+    p->obj_data_area_large = 0;
   }
 
   /* initialize pool management */
@@ -170,7 +234,7 @@ struct mempool *alloc_enhanced_mempool(uint32_t nb_objs,
          "  obj_size:            %"PRIu64"\n"
          "  obj_headroom:        %"PRIu64"\n"
          "  obj_tailroom:        %"PRIu64"\n"
-         "  obj_data_area:       %p (len: %"PRIu64")\n"
+         "  obj_data_area:       %p (len: %"PRIu64", large pages: %s)\n"
          "  free_objs_ring:      %p\n",
          p, pool_size,
          p->nb_objs,
@@ -179,6 +243,7 @@ struct mempool *alloc_enhanced_mempool(uint32_t nb_objs,
          p->obj_tailroom,
          p->obj_data_area,
          data_size,
+         p->obj_data_area_large ? "yes" : "no",
          p->free_objs,
          pool_size);
   
@@ -231,7 +296,7 @@ struct mempool *alloc_enhanced_mempool(uint32_t nb_objs,
 
  error_free_d:
   if (p->obj_data_area)
-     xfree(p->obj_data_area);
+     _free_data_area(p->obj_data_area, p->obj_data_area_len, p->obj_data_area_large);
  error_free_p:
   xfree(p);
  error:
@@ -285,7 +350,7 @@ void free_mempool(struct mempool *p)
 	BUG_ON(ring_count(p->free_objs) != p->nb_objs); /* some objects of this pool may be still in use */
 	free_ring(p->free_objs);
 	if (p->obj_data_area)
-	  xfree(p->obj_data_area);
+	  _free_data_area(p->obj_data_area, p->obj_data_area_len, p->obj_data_area_large);
 	xfree(p);
   }
 }
@@ -126,9 +126,28 @@ struct mempool {
   void *obj_put_func_argp;
   uint32_t nb_objs;
   size_t pool_size;
-  void *obj_data_area; /* points to data allocation when sep_obj_data = 1 */
+  void *obj_data_area; /* points to data allocation when sep_obj_data is set */
+  size_t obj_data_area_len; /* length of the separate data allocation */
+  int obj_data_area_large; /* data allocation is backed by large pages */
 };
 
+/*
+ * Values for sep_obj_data
+ *
+ * MEMPOOL_SEP_DATA_LARGE requests a data area that is aligned to and
+ * rounded up to MEMPOOL_LARGE_PAGE_SIZE, so that it can be mapped with
+ * superpages (fewer TLB entries for big pools, e.g., chunk caches).
+ * If the platform cannot provide such an area (Mini-OS never does), the
+ * allocator silently falls back to MEMPOOL_SEP_DATA. Use
+ * mempool_large_data() to find out what was granted.
+ */
+#define MEMPOOL_SEP_DATA        1
+#define MEMPOOL_SEP_DATA_LARGE  2
+
+#ifndef MEMPOOL_LARGE_PAGE_SIZE
+#define MEMPOOL_LARGE_PAGE_SIZE (2 * 1024 * 1024) /* 2 MiB (x86_64) */
+#endif
+
 /*
  * Callback obj_init_func will be called while objects are initialized for this memory pool
  *  void obj_init_func(struct mempool_obj *obj, void *argp)
@@ -136,7 +155,8 @@ struct mempool {
  *  void obj_pick_func(struct mempool_obj *obj, void *argp)
  * Callback obj_put_func will be called whenever objects are put back to this memory pool
  *  void obj_put_func(struct mempool_obj *obj, void *argp)
- * split_obj_data (bool) defines if object data shall be splitted from meta data allocation.
+ * sep_obj_data defines if object data shall be splitted from meta data allocation
+ *  (0, MEMPOOL_SEP_DATA or MEMPOOL_SEP_DATA_LARGE, see above).
  *  Depending on the object data alignments, this might be more memory space efficient
  */
 struct mempool *alloc_enhanced_mempool(uint32_t nb_objs,
@@ -215,6 +235,8 @@ static inline int mempool_pick_multiple(struct mempool *p, struct mempool_obj *o
 
 #define mempool_size(p) ((p)->pool_size)
 
+#define mempool_large_data(p) ((p)->obj_data_area_large)
+
 /*
  * Put an object back to its depending memory pool.
  * This is like free() for memory pool objects
@@ -140,6 +140,7 @@ PY_O_BASENAME = \
 	../extmod/modframebuf.o \
 	../extmod/fsusermount.o \
 	../extmod/modujson.o \
+	../extmod/moduselect.o \
 	../extmod/moduos_dupterm.o
 
 ifeq ($(CONFIG_SHFS),n)
@@ -187,6 +188,13 @@ APP_MODS_SRC_C = $(addprefix mods/,\
 	modtime.c                  \
         modos.c                    \
         modlwip.c                  \
+        modxbuf.c                  \
+        modgcstats.c               \
+        moduevent.c                \
+        modhttpd.c                 \
+        moduhttp.c                 \
+        moddns.c                   \
+        modpcap.c                  \
         )
 
 # prepend the build destination prefix to the py object files
@@ -0,0 +1,694 @@
+/*
+ * This file is part of the Micro Python project, http://micropython.org/
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2017 NEC Europe Ltd., NEC Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "py/nlr.h"
+#include "py/runtime.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+#include "modlwip.h"
+#include "moduevent.h"
+#include "moddns.h"
+
+#ifdef __MINIOS__
+#include <mini-os/time.h>
+#define dns_now_ns() ((uint64_t)monotonic_clock())
+#else
+#include <time.h>
+static inline uint64_t dns_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+#endif
+
+// Stub resolver with a cache of its own: it asks the servers configured
+// in lwIP for A records and keeps every address of an answer for the
+// record TTL. Names that do not exist are remembered for DNS_NEG_TTL_S.
+#ifndef DNS_CACHE_SIZE
+#define DNS_CACHE_SIZE (16)
+#endif
+#ifndef DNS_ADDRS_MAX
+#define DNS_ADDRS_MAX (8)
+#endif
+#ifndef DNS_TTL_MIN_S
+#define DNS_TTL_MIN_S (5)
+#endif
+#ifndef DNS_TTL_MAX_S
+#define DNS_TTL_MAX_S (3600)
+#endif
+#ifndef DNS_NEG_TTL_S
+#define DNS_NEG_TTL_S (30)
+#endif
+#ifndef DNS_RETRY_MS
+#define DNS_RETRY_MS (1000)
+#endif
+#ifndef DNS_TRIES
+#define DNS_TRIES (4) // spread over the configured servers
+#endif
+
+#define DNS_NAME_MAX (253)
+#define DNS_PORT (53)
+#define DNS_MSG_MAX (512)
+#define DNS_TMR_MS (250)
+
+// Lookup results besides 0, like the lwIP error codes raised before
+#define DNS_ERR_NOTFOUND (-2)
+#define DNS_ERR_TIMEOUT (ERR_TIMEOUT)
+
+#define MOD_NETWORK_AF_INET (2)
+#define MOD_NETWORK_SOCK_STREAM (1)
+
+#define NS(s) ((uint64_t)(s) * 1000000000ULL)
+
+typedef struct _dns_result_t {
+    int8_t err;
+    uint8_t naddr;
+    uint8_t addr[DNS_ADDRS_MAX][4];
+} dns_result_t;
+
+typedef struct _dns_entry_t {
+    uint64_t expires; // ns, 0 if unused
+    uint64_t used;
+    dns_result_t res;
+    char name[DNS_NAME_MAX + 1];
+} dns_entry_t;
+
+typedef struct _dns_query_obj_t {
+    mp_obj_base_t base;
+    struct _dns_query_obj_t *next; // pending queries
+    mp_obj_t task;                  // uevent task waiting for the result
+    uint64_t deadline;              // of the current try
+    struct udp_pcb *pcb;            // bound to a random port while pending
+    uint16_t id;                    // random
+    uint8_t tries;
+    uint8_t sent_to;                // mask of the server slots asked so far
+    bool done;
+    dns_result_t res;
+    char name[DNS_NAME_MAX + 1];
+} dns_query_obj_t;
+
+typedef struct _dns_state_t {
+    dns_query_obj_t *pending;
+    bool tmr_active;
+
+    mp_uint_t hits;
+    mp_uint_t negative_hits;
+    mp_uint_t misses;
+    mp_uint_t sent;
+    mp_uint_t timeouts;
+
+    dns_entry_t cache[DNS_CACHE_SIZE];
+} dns_state_t;
+
+STATIC void dns_recv(void *arg, struct udp_pcb *pcb, struct pbuf *p, const ip_addr_t *addr, u16_t port);
+
+STATIC dns_state_t *dns_get_state(void) {
+    dns_state_t *st = MP_STATE_PORT(dns_state);
+    if (st == NULL) {
+        st = m_new0(dns_state_t, 1);
+        MP_STATE_PORT(dns_state) = st;
+    }
+    return st;
+}
+
+// Query IDs and source ports are all that keeps an off-path attacker from
+// getting a forged answer into the cache, so they must not be guessable.
+// They come from RDRAND where the CPU has it; otherwise TSC and clock
+// jitter are folded into a xorshift state along with rand().
+STATIC uint64_t dns_rand_pool;
+#if defined(__x86_64__) || defined(__i386__)
+STATIC int8_t dns_have_rdrand = -1;
+#endif
+
+STATIC uint32_t dns_random(void) {
+    #if defined(__x86_64__) || defined(__i386__)
+    if (dns_have_rdrand < 0) {
+        unsigned int a, b, c, d;
+        dns_have_rdrand = __get_cpuid(1, &a, &b, &c, &d) && (c & bit_RDRND);
+    }
+    if (dns_have_rdrand) {
+        for (int i = 0; i < 10; i++) {
+            unsigned int r;
+            unsigned char ok;
+            __asm__ volatile ("rdrand %0; setc %1" : "=r" (r), "=qm" (ok) : : "cc");
+            if (ok) {
+                return r;
+            }
+        }
+    }
+    uint32_t lo, hi;
+    __asm__ volatile ("rdtsc" : "=a" (lo), "=d" (hi));
+    dns_rand_pool ^= ((uint64_t)hi << 32) | lo;
+    #endif
+    dns_rand_pool ^= dns_now_ns() ^ ((uint64_t)rand() << 32);
+    dns_rand_pool ^= dns_rand_pool >> 12;
+    dns_rand_pool ^= dns_rand_pool << 25;
+    dns_rand_pool ^= dns_rand_pool >> 27;
+    return (uint32_t)((dns_rand_pool * 0x2545f4914f6cdd1dULL) >> 32);
+}
+
+// Every query gets a pcb of its own on a random unprivileged port.
+// Returns an errno on failure.
+STATIC int dns_pcb_open(dns_query_obj_t *q) {
+    struct udp_pcb *pcb = udp_new();
+    if (pcb == NULL) {
+        return ENOMEM;
+    }
+    for (int i = 0; i < 8; i++) {
+        u16_t port = 1024 + dns_random() % (65536 - 1024);
+        if (udp_bind(pcb, IP_ADDR_ANY, port) == ERR_OK) {
+            udp_recv(pcb, dns_recv, NULL);
+            q->pcb = pcb;
+            return 0;
+        }
+    }
+    udp_remove(pcb);
+    return EADDRINUSE;
+}
+
+static inline char dns_lower(char c) {
+    return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+/******************************************************************************/
+// Cache
+
+STATIC dns_entry_t *dns_cache_find(dns_state_t *st, const char *name, uint64_t now) {
+    for (mp_uint_t i = 0; i < DNS_CACHE_SIZE; i++) {
+        dns_entry_t *e = &st->cache[i];
+        if (e->expires > now && strcmp(e->name, name) == 0) {
+            e->used = now;
+            return e;
+        }
+    }
+    return NULL;
+}
+
+// Replaces an entry for the same name, an expired one or the least
+// recently used one
+STATIC void dns_cache_store(dns_state_t *st, const char *name, const dns_result_t *res, uint32_t ttl) {
+    uint64_t now = dns_now_ns();
+    dns_entry_t *victim = &st->cache[0];
+
+    for (mp_uint_t i = 0; i < DNS_CACHE_SIZE; i++) {
+        dns_entry_t *e = &st->cache[i];
+        if (strcmp(e->name, name) == 0) {
+            victim = e;
+            break;
+        }
+        if (victim->expires > now && (e->expires <= now || e->used < victim->used)) {
+            victim = e;
+        }
+    }
+    strcpy(victim->name, name);
+    victim->res = *res;
+    victim->expires = now + NS(ttl);
+    victim->used = now;
+}
+
+/******************************************************************************/
+// Queries
+//
+// dns_recv() and dns_tmr() run from lwIP within poll_sockets(), so they
+// must not allocate from the GC heap: queries are allocated up front and
+// results go straight into them and into the cache.
+
+STATIC void dns_complete(dns_state_t *st, dns_query_obj_t *q) {
+    dns_query_obj_t **pp = &st->pending;
+    while (*pp != NULL && *pp != q) {
+        pp = &(*pp)->next;
+    }
+    if (*pp != NULL) {
+        *pp = q->next;
+    }
+    q->next = NULL;
+    q->done = true;
+    if (q->pcb != NULL) {
+        // lwIP does not touch the pcb after dns_recv() returns
+        udp_remove(q->pcb);
+        q->pcb = NULL;
+    }
+    if (q->task != MP_OBJ_NULL) {
+        uevent_wake(q->task);
+        q->task = MP_OBJ_NULL;
+    }
+}
+
+// Sends the next try of a query, rotating over the configured servers.
+// Returns false if there is none.
+STATIC bool dns_send(dns_state_t *st, dns_query_obj_t *q) {
+    uint8_t servers[DNS_MAX_SERVERS];
+    mp_uint_t nservers = 0;
+    for (mp_uint_t i = 0; i < DNS_MAX_SERVERS; i++) {
+        if (!ip_addr_isany(dns_getserver(i))) {
+            servers[nservers++] = i;
+        }
+    }
+    if (nservers == 0) {
+        return false;
+    }
+
+    byte msg[12 + DNS_NAME_MAX + 2 + 4];
+    mp_uint_t len = 12;
+    memset(msg, 0, 12);
+    msg[0] = q->id >> 8;
+    msg[1] = q->id & 0xff;
+    msg[2] = 0x01; // recursion desired
+    msg[5] = 1;    // one question
+    const char *label = q->name;
+    while (*label != '\0') {
+        const char *dot = strchr(label, '.');
+        mp_uint_t n = dot ? (mp_uint_t)(dot - label) : strlen(label);
+        msg[len++] = n;
+        memcpy(msg + len, label, n);
+        len += n;
+        label += n + (dot ? 1 : 0);
+    }
+    msg[len++] = 0;
+    msg[len++] = 0; msg[len++] = 1; // QTYPE A
+    msg[len++] = 0; msg[len++] = 1; // QCLASS IN
+
+    struct pbuf *p = pbuf_alloc(PBUF_TRANSPORT, len, PBUF_RAM);
+    if (p == NULL) {
+        return true; // retried on the next timeout
+    }
+    memcpy(p->payload, msg, len);
+    uint8_t slot = servers[q->tries % nservers];
+    q->sent_to |= 1 << slot;
+    udp_sendto(q->pcb, p, dns_getserver(slot), DNS_PORT);
+    pbuf_free(p);
+    st->sent++;
+    return true;
+}
+
+STATIC void dns_tmr(void *arg) {
+    dns_state_t *st = MP_STATE_PORT(dns_state);
+    uint64_t now = dns_now_ns();
+    (void)arg;
+
+    if (st == NULL) {
+        return;
+    }
+    dns_query_obj_t *q = st->pending;
+    while (q != NULL) {
+        dns_query_obj_t *next = q->next;
+        if (q->deadline <= now) {
+            if (++q->tries < DNS_TRIES && dns_send(st, q)) {
+                q->deadline = now + (uint64_t)DNS_RETRY_MS * 1000000ULL;
+            } else {
+                // not cached, the next lookup asks again
+                q->res.err = DNS_ERR_TIMEOUT;
+                st->timeouts++;
+                dns_complete(st, q);
+            }
+        }
+        q = next;
+    }
+    st->tmr_active = (st->pending != NULL);
+    if (st->tmr_active) {
+        sys_timeout(DNS_TMR_MS, dns_tmr, NULL);
+    }
+}
+
+// Matches the (uncompressed) name at off against name; returns the offset
+// following it or -1
+STATIC int dns_match_name(const byte *msg, int len, int off, const char *name) {
+    while (off < len && msg[off] != 0) {
+        int n = msg[off++];
+        if (n > 63 || off + n > len) {
+            return -1;
+        }
+        for (int i = 0; i < n; i++) {
+            if (dns_lower(msg[off + i]) != *name++) {
+                return -1;
+            }
+        }
+        off += n;
+        if (*name == '.') {
+            name++;
+        } else if (msg[off] != 0) {
+            return -1;
+        }
+    }
+    if (off >= len || *name != '\0') {
+        return -1;
+    }
+    return off + 1;
+}
+
+// Returns the offset following a possibly compressed name or -1
+STATIC int dns_skip_name(const byte *msg, int len, int off) {
+    while (off < len) {
+        int n = msg[off];
+        if (n == 0) {
+            return off + 1;
+        } else if ((n & 0xc0) == 0xc0) {
+            return off + 2;
+        }
+        off += n + 1;
+    }
+    return -1;
+}
+
+// Whether addr is one of the servers a query has been sent to; a late
+// answer to an earlier try still counts
+STATIC bool dns_asked(const dns_query_obj_t *q, const ip_addr_t *addr) {
+    for (mp_uint_t i = 0; i < DNS_MAX_SERVERS; i++) {
+        if ((q->sent_to & (1 << i)) && ip_addr_cmp(addr, dns_getserver(i))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+#define RD16(p) (((p)[0] << 8) | (p)[1])
+#define RD32(p) (((uint32_t)RD16(p) << 16) | RD16((p) + 2))
+
+STATIC void dns_recv(void *arg, struct udp_pcb *pcb, struct pbuf *p, const ip_addr_t *addr, u16_t port) {
+    dns_state_t *st = MP_STATE_PORT(dns_state);
+    byte msg[DNS_MSG_MAX];
+    int len = pbuf_copy_partial(p, msg, sizeof(msg), 0);
+    (void)arg;
+    pbuf_free(p);
+
+    if (st == NULL || port != DNS_PORT || len < 12 || !(msg[2] & 0x80)) {
+        return;
+    }
+    dns_query_obj_t *q;
+    for (q = st->pending; q != NULL && q->pcb != pcb; q = q->next) {
+    }
+    if (q == NULL || RD16(msg) != q->id || !dns_asked(q, addr) || RD16(msg + 4) != 1) {
+        return; // stray or forged
+    }
+    int off = dns_match_name(msg, len, 12, q->name);
+    if (off < 0 || off + 4 > len) {
+        return; // not an answer to this query
+    }
+    off += 4;
+
+    int rcode = msg[3] & 0x0f;
+    if (rcode != 0 && rcode != 3) {
+        // server failure or refusal: the next try goes to another server
+        q->deadline = 0;
+        return;
+    }
+
+    uint32_t ttl = DNS_TTL_MAX_S;
+    mp_uint_t answers = RD16(msg + 6);
+    q->res.naddr = 0;
+    while (rcode == 0 && answers-- > 0) {
+        off = dns_skip_name(msg, len, off);
+        if (off < 0 || off + 10 > len) {
+            break;
+        }
+        uint16_t type = RD16(msg + off);
+        uint16_t class = RD16(msg + off + 2);
+        uint32_t rttl = RD32(msg + off + 4);
+        uint16_t rdlen = RD16(msg + off + 8);
+        off += 10;
+        if (off + rdlen > len) {
+            break;
+        }
+        // the CNAME chain is followed by the servers, only A records count
+        if (type == 1 && class == 1 && rdlen == 4 && q->res.naddr < DNS_ADDRS_MAX) {
+            memcpy(q->res.addr[q->res.naddr++], msg + off, 4);
+            ttl = MIN(ttl, rttl);
+        }
+        off += rdlen;
+    }
+
+    if (q->res.naddr == 0) {
+        q->res.err = DNS_ERR_NOTFOUND;
+        ttl = DNS_NEG_TTL_S;
+    } else {
+        q->res.err = 0;
+        ttl = MAX(ttl, DNS_TTL_MIN_S);
+    }
+    dns_cache_store(st, q->name, &q->res, ttl);
+    dns_complete(st, q);
+}
+
+// Labels must be 1 to 63 bytes for dns_send() to encode the name
+STATIC void dns_check_name(const char *name) {
+    const char *label = name;
+    for (;;) {
+        const char *dot = strchr(label, '.');
+        mp_uint_t n = dot ? (mp_uint_t)(dot - label) : strlen(label);
+        if (n == 0 || n > 63) {
+            nlr_raise(mp_obj_new_exception_msg(&mp_type_ValueError, "invalid hostname label"));
+        }
+        if (dot == NULL) {
+            break;
+        }
+        label = dot + 1;
+    }
+}
+
+// Starts a lookup; the query is complete already for cached names and
+// numeric addresses
+STATIC dns_query_obj_t *dns_query_new(const char *host, mp_uint_t hlen) {
+    dns_state_t *st = dns_get_state();
+
+    if (hlen > 0 && host[hlen - 1] == '.') {
+        hlen--;
+    }
+    if (hlen == 0 || hlen > DNS_NAME_MAX) {
+        nlr_raise(mp_obj_new_exception_arg1(&mp_type_OSError, MP_OBJ_NEW_SMALL_INT(EINVAL)));
+    }
+
+    dns_query_obj_t *q = m_new_obj(dns_query_obj_t);
+    memset(q, 0, sizeof(*q));
+    q->base.type = &dns_query_type;
+    q->task = MP_OBJ_NULL;
+    for (mp_uint_t i = 0; i < hlen; i++) {
+        q->name[i] = dns_lower(host[i]);
+    }
+    q->name[hlen] = '\0';
+
+    ip4_addr_t ip;
+    if (ipaddr_aton(q->name, &ip)) {
+        memcpy(q->res.addr[0], &ip, 4);
+        q->res.naddr = 1;
+        q->done = true;
+        return q;
+    }
+    dns_check_name(q->name);
+
+    uint64_t now = dns_now_ns();
+    dns_entry_t *e = dns_cache_find(st, q->name, now);
+    if (e != NULL) {
+        if (e->res.err != 0) {
+            st->negative_hits++;
+        } else {
+            st->hits++;
+        }
+        q->res = e->res;
+        q->done = true;
+        return q;
+    }
+
+    st->misses++;
+    int err = dns_pcb_open(q);
+    if (err != 0) {
+        nlr_raise(mp_obj_new_exception_arg1(&mp_type_OSError, MP_OBJ_NEW_SMALL_INT(err)));
+    }
+    q->id = dns_random();
+    if (!dns_send(st, q)) {
+        // no server configured
+        q->res.err = DNS_ERR_NOTFOUND;
+        dns_complete(st, q);
+        return q;
+    }
+    q->deadline = now + (uint64_t)DNS_RETRY_MS * 1000000ULL;
+    q->next = st->pending;
+    st->pending = q;
+    if (!st->tmr_active) {
+        st->tmr_active = true;
+        sys_timeout(DNS_TMR_MS, dns_tmr, NULL);
+    }
+    return q;
+}
+
+// Waits for a query to complete, sleeping between network polls
+STATIC void dns_query_block(dns_query_obj_t *q) {
+    while (!q->done) {
+        lwip_poll_wait(dns_now_ns() + 10000000ULL);
+    }
+}
+
+STATIC void dns_query_check(dns_query_obj_t *q) {
+    if (!q->done) {
+        nlr_raise(mp_obj_new_exception_arg1(&mp_type_OSError, MP_OBJ_NEW_SMALL_INT(EINPROGRESS)));
+    }
+    if (q->res.err != 0) {
+        // TODO: CPython raises gaierror, we raise with native lwIP negative error
+        // values, to differentiate from normal errno's at least in such way.
+        nlr_raise(mp_obj_new_exception_arg1(&mp_type_OSError, MP_OBJ_NEW_SMALL_INT(q->res.err)));
+    }
+}
+
+void dns_query_wait(mp_obj_t query_in, mp_obj_t task) {
+    dns_query_obj_t *q = query_in;
+    if (q->done) {
+        uevent_wake(task);
+    } else if (q->task != MP_OBJ_NULL) {
+        nlr_raise(mp_obj_new_exception_arg1(&mp_type_OSError, MP_OBJ_NEW_SMALL_INT(EBUSY)));
+    } else {
+        q->task = task;
+    }
+}
+
+mp_obj_t dns_getaddrinfo(mp_obj_t host_in, mp_obj_t port_in) {
+    mp_uint_t hlen;
+    const char *host = mp_obj_str_get_data(host_in, &hlen);
+    mp_int_t port = mp_obj_get_int(port_in);
+
+    dns_query_obj_t *q = dns_query_new(host, hlen);
+    dns_query_block(q);
+    dns_query_check(q);
+
+    mp_obj_t list = mp_obj_new_list(0, NULL);
+    for (mp_uint_t i = 0; i < q->res.naddr; i++) {
+        mp_obj_tuple_t *tuple = mp_obj_new_tuple(5, NULL);
+        tuple->items[0] = MP_OBJ_NEW_SMALL_INT(MOD_NETWORK_AF_INET);
+        tuple->items[1] = MP_OBJ_NEW_SMALL_INT(MOD_NETWORK_SOCK_STREAM);
+        tuple->items[2] = MP_OBJ_NEW_SMALL_INT(0);
+        tuple->items[3] = MP_OBJ_NEW_QSTR(MP_QSTR_);
+        tuple->items[4] = netutils_format_inet_addr(q->res.addr[i], port, NETUTILS_BIG);
+        mp_obj_list_append(list, tuple);
+    }
+    return list;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_2(dns_getaddrinfo_obj, dns_getaddrinfo);
+
+/******************************************************************************/
+// Query objects
+
+STATIC void dns_query_print(const mp_print_t *print, mp_obj_t self_in, mp_print_kind_t kind) {
+    dns_query_obj_t *self = self_in;
+    mp_printf(print, "<DNSQuery %s %s>", self->name, self->done ? "done" : "pending");
+}
+
+STATIC mp_obj_t dns_query_done(mp_obj_t self_in) {
+    dns_query_obj_t *self = self_in;
+    return mp_obj_new_bool(self->done);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_1(dns_query_done_obj, dns_query_done);
+
+// result(): list of addresses; raises OSError(EINPROGRESS) while pending
+// and the lookup error if it failed
+STATIC mp_obj_t dns_query_result(mp_obj_t self_in) {
+    dns_query_obj_t *self = self_in;
+    dns_query_check(self);
+    mp_obj_t list = mp_obj_new_list(0, NULL);
+    for (mp_uint_t i = 0; i < self->res.naddr; i++) {
+        mp_obj_list_append(list, netutils_format_ipv4_addr(self->res.addr[i], NETUTILS_BIG));
+    }
+    return list;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_1(dns_query_result_obj, dns_query_result);
+
+// wait(): blocks until the query completes, returns result()
+STATIC mp_obj_t dns_query_wait_meth(mp_obj_t self_in) {
+    dns_query_block(self_in);
+    return dns_query_result(self_in);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_1(dns_query_wait_obj, dns_query_wait_meth);
+
+STATIC const mp_rom_map_elem_t dns_query_locals_dict_table[] = {
+    { MP_ROM_QSTR(MP_QSTR_done), MP_ROM_PTR(&dns_query_done_obj) },
+    { MP_ROM_QSTR(MP_QSTR_result), MP_ROM_PTR(&dns_query_result_obj) },
+    { MP_ROM_QSTR(MP_QSTR_wait), MP_ROM_PTR(&dns_query_wait_obj) },
+};
+STATIC MP_DEFINE_CONST_DICT(dns_query_locals_dict, dns_query_locals_dict_table);
+
+const mp_obj_type_t dns_query_type = {
+    { &mp_type_type },
+    .name = MP_QSTR_DNSQuery,
+    .print = dns_query_print,
+    .locals_dict = (mp_obj_t)&dns_query_locals_dict,
+};
+
+/******************************************************************************/
+// Module functions
+
+// query(host): starts a lookup without waiting for it; yield the query
+// from a uevent task to sleep until it completes
+STATIC mp_obj_t mod_udns_query(mp_obj_t host_in) {
+    mp_uint_t hlen;
+    const char *host = mp_obj_str_get_data(host_in, &hlen);
+    return dns_query_new(host, hlen);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_1(mod_udns_query_obj, mod_udns_query);
+
+// flush(): forgets all cached answers
+STATIC mp_obj_t mod_udns_flush(void) {
+    dns_state_t *st = dns_get_state();
+    memset(st->cache, 0, sizeof(st->cache));
+    return mp_const_none;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_0(mod_udns_flush_obj, mod_udns_flush);
+
+STATIC mp_obj_t mod_udns_stats(void) {
+    dns_state_t *st = dns_get_state();
+    uint64_t now = dns_now_ns();
+    mp_uint_t cached = 0;
+    for (mp_uint_t i = 0; i < DNS_CACHE_SIZE; i++) {
+        cached += (st->cache[i].expires > now);
+    }
+    mp_obj_t d = mp_obj_new_dict(0);
+    mp_obj_dict_store(d, MP_OBJ_NEW_QSTR(MP_QSTR_hits), mp_obj_new_int_from_uint(st->hits));
+    mp_obj_dict_store(d, MP_OBJ_NEW_QSTR(MP_QSTR_negative_hits), mp_obj_new_int_from_uint(st->negative_hits));
+    mp_obj_dict_store(d, MP_OBJ_NEW_QSTR(MP_QSTR_misses), mp_obj_new_int_from_uint(st->misses));
+    mp_obj_dict_store(d, MP_OBJ_NEW_QSTR(MP_QSTR_sent), mp_obj_new_int_from_uint(st->sent));
+    mp_obj_dict_store(d, MP_OBJ_NEW_QSTR(MP_QSTR_timeouts), mp_obj_new_int_from_uint(st->timeouts));
+    mp_obj_dict_store(d, MP_OBJ_NEW_QSTR(MP_QSTR_cached), mp_obj_new_int_from_uint(cached));
+    return d;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_0(mod_udns_stats_obj, mod_udns_stats);
+
+STATIC const mp_rom_map_elem_t mp_module_udns_globals_table[] = {
+    { MP_ROM_QSTR(MP_QSTR___name__), MP_ROM_QSTR(MP_QSTR_udns) },
+    { MP_ROM_QSTR(MP_QSTR_getaddrinfo), MP_ROM_PTR(&dns_getaddrinfo_obj) },
+    { MP_ROM_QSTR(MP_QSTR_query), MP_ROM_PTR(&mod_udns_query_obj) },
+    { MP_ROM_QSTR(MP_QSTR_flush), MP_ROM_PTR(&mod_udns_flush_obj) },
+    { MP_ROM_QSTR(MP_QSTR_stats), MP_ROM_PTR(&mod_udns_stats_obj) },
+};
+
+STATIC MP_DEFINE_CONST_DICT(mp_module_udns_globals, mp_module_udns_globals_table);
+
+const mp_obj_module_t mp_module_udns = {
+    .base = { &mp_type_module },
+    .name = MP_QSTR_udns,
+    .globals = (mp_obj_dict_t*)&mp_module_udns_globals,
+};
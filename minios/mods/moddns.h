@@ -0,0 +1,42 @@
+/*
+ * This file is part of the Micro Python project, http://micropython.org/
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2017 NEC Europe Ltd., NEC Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef MICROPY_INCLUDED_MINIOS_MODDNS_H
+#define MICROPY_INCLUDED_MINIOS_MODDNS_H
+
+#include "py/obj.h"
+
+// Pending or completed lookup, as returned by udns.query(); uevent tasks
+// may yield it to sleep until it completes
+extern const mp_obj_type_t dns_query_type;
+
+// Makes uevent resume task once the query has completed
+void dns_query_wait(mp_obj_t query_in, mp_obj_t task);
+
+// getaddrinfo() for lwip and usocket: resolves through the cache and
+// returns one entry per address
+mp_obj_t dns_getaddrinfo(mp_obj_t host_in, mp_obj_t port_in);
+
+#endif // MICROPY_INCLUDED_MINIOS_MODDNS_H
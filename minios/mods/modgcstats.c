@@ -0,0 +1,128 @@
+/*
+ * This file is part of the Micro Python project, http://micropython.org/
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2017 NEC Europe Ltd., NEC Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "py/nlr.h"
+#include "py/runtime.h"
+#include "py/gc.h"
+
+#include "gccollect.h"
+
+#if MICROPY_ENABLE_GC
+
+#define NS_TO_US(ns) mp_obj_new_int_from_ull((ns) / 1000ULL)
+
+STATIC const qstr gcstats_reason_qstr[GC_REASON_MAX] = {
+    MP_QSTR_auto,
+    MP_QSTR_explicit,
+    MP_QSTR_xbuf,
+};
+
+// gcstats.stats(): dict with totals and details of the last collection
+STATIC mp_obj_t mod_gcstats_stats(void) {
+    gc_collect_stats_t *st = &gc_collect_stats;
+    gc_collect_hook_run();
+    mp_obj_t d = mp_obj_new_dict(0);
+
+    mp_obj_dict_store(d, MP_OBJ_NEW_QSTR(MP_QSTR_count), mp_obj_new_int_from_uint(st->count));
+    mp_obj_dict_store(d, MP_OBJ_NEW_QSTR(MP_QSTR_count_auto), mp_obj_new_int_from_uint(st->count_reason[GC_REASON_AUTO]));
+    mp_obj_dict_store(d, MP_OBJ_NEW_QSTR(MP_QSTR_count_explicit), mp_obj_new_int_from_uint(st->count_reason[GC_REASON_EXPLICIT]));
+    mp_obj_dict_store(d, MP_OBJ_NEW_QSTR(MP_QSTR_count_xbuf), mp_obj_new_int_from_uint(st->count_reason[GC_REASON_XBUF]));
+    mp_obj_dict_store(d, MP_OBJ_NEW_QSTR(MP_QSTR_total_us), NS_TO_US(st->total_ns));
+    mp_obj_dict_store(d, MP_OBJ_NEW_QSTR(MP_QSTR_max_us), NS_TO_US(st->max_ns));
+    mp_obj_dict_store(d, MP_OBJ_NEW_QSTR(MP_QSTR_last_us), NS_TO_US(st->last_ns));
+    mp_obj_dict_store(d, MP_OBJ_NEW_QSTR(MP_QSTR_last_freed), mp_obj_new_int_from_uint(st->last_freed));
+    mp_obj_dict_store(d, MP_OBJ_NEW_QSTR(MP_QSTR_last_marked), mp_obj_new_int_from_uint(st->last_marked));
+    mp_obj_dict_store(d, MP_OBJ_NEW_QSTR(MP_QSTR_last_stack_words), mp_obj_new_int_from_uint(st->last_stack_words));
+    mp_obj_dict_store(d, MP_OBJ_NEW_QSTR(MP_QSTR_last_skipped_words), mp_obj_new_int_from_uint(st->last_skipped_words));
+    mp_obj_dict_store(d, MP_OBJ_NEW_QSTR(MP_QSTR_last_root_words), mp_obj_new_int_from_uint(st->last_root_words));
+    mp_obj_dict_store(d, MP_OBJ_NEW_QSTR(MP_QSTR_last_reason), MP_OBJ_NEW_QSTR(gcstats_reason_qstr[st->last_reason]));
+    return d;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_0(mod_gcstats_stats_obj, mod_gcstats_stats);
+
+// gcstats.histogram(): pause counts, entry 0 is < 1us, entry i is [2^(i-1), 2^i) us
+STATIC mp_obj_t mod_gcstats_histogram(void) {
+    mp_obj_t l = mp_obj_new_list(0, NULL);
+    for (mp_uint_t i = 0; i < GC_STATS_HIST_BUCKETS; i++) {
+        mp_obj_list_append(l, mp_obj_new_int_from_uint(gc_collect_stats.hist[i]));
+    }
+    return l;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_0(mod_gcstats_histogram_obj, mod_gcstats_histogram);
+
+STATIC mp_obj_t mod_gcstats_reset(void) {
+    gc_collect_stats_reset();
+    return mp_const_none;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_0(mod_gcstats_reset_obj, mod_gcstats_reset);
+
+// gcstats.collect(): like gc.collect() but accounted as explicit; returns freed bytes
+STATIC mp_obj_t mod_gcstats_collect(void) {
+    gc_collect_set_reason(GC_REASON_EXPLICIT);
+    gc_collect();
+    mp_uint_t freed = gc_collect_stats.last_freed;
+    gc_collect_hook_run();
+    return mp_obj_new_int_from_uint(freed);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_0(mod_gcstats_collect_obj, mod_gcstats_collect);
+
+// gcstats.hook(callable): called as callable(pause_us) after collections,
+// None removes it. A collection happens inside an allocation, where Python
+// cannot run, so the call is deferred to the next safe point: a backwards
+// jump or return in the bytecode VM, a network poll or another gcstats
+// call. Collections until then are coalesced into one call with the
+// longest pause; those triggered by the hook itself do not call it again.
+STATIC mp_obj_t mod_gcstats_hook(mp_obj_t hook_in) {
+    if (hook_in == mp_const_none) {
+        MP_STATE_VM(gc_stats_hook) = MP_OBJ_NULL;
+    } else {
+        if (!mp_obj_is_callable(hook_in)) {
+            nlr_raise(mp_obj_new_exception_msg(&mp_type_TypeError, "hook must be callable"));
+        }
+        MP_STATE_VM(gc_stats_hook) = hook_in;
+    }
+    return mp_const_none;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_1(mod_gcstats_hook_obj, mod_gcstats_hook);
+
+STATIC const mp_rom_map_elem_t mp_module_gcstats_globals_table[] = {
+    { MP_ROM_QSTR(MP_QSTR___name__), MP_ROM_QSTR(MP_QSTR_gcstats) },
+    { MP_ROM_QSTR(MP_QSTR_stats), MP_ROM_PTR(&mod_gcstats_stats_obj) },
+    { MP_ROM_QSTR(MP_QSTR_histogram), MP_ROM_PTR(&mod_gcstats_histogram_obj) },
+    { MP_ROM_QSTR(MP_QSTR_reset), MP_ROM_PTR(&mod_gcstats_reset_obj) },
+    { MP_ROM_QSTR(MP_QSTR_collect), MP_ROM_PTR(&mod_gcstats_collect_obj) },
+    { MP_ROM_QSTR(MP_QSTR_hook), MP_ROM_PTR(&mod_gcstats_hook_obj) },
+};
+
+STATIC MP_DEFINE_CONST_DICT(mp_module_gcstats_globals, mp_module_gcstats_globals_table);
+
+const mp_obj_module_t mp_module_gcstats = {
+    .base = { &mp_type_module },
+    .name = MP_QSTR_gcstats,
+    .globals = (mp_obj_dict_t*)&mp_module_gcstats_globals,
+};
+
+#endif // MICROPY_ENABLE_GC
@@ -0,0 +1,1105 @@
+/*
+ * This file is part of the Micro Python project, http://micropython.org/
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2017 NEC Europe Ltd., NEC Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+// Static HTTP/1.1 server on the lwIP raw TCP API. Requests are parsed and
+// answered from within the lwIP callbacks, objects are streamed from the
+// SHFS chunk cache without copying. Chunks are read asynchronously; the
+// serve() loop polls the block devices and resumes the connection once
+// its chunk is in. Only requests it cannot serve go to a Python handler,
+// which is called from the serve() loop rather than from lwIP.
+
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include "py/nlr.h"
+#include "py/runtime.h"
+
+#include "lwip/tcp.h"
+#include "lwip/tcp_impl.h"
+
+#include "modlwip.h"
+#if SHFS_ENABLE
+#include "shfs/shfs.h"
+#include "shfs/shfs_fio.h"
+#include "shfs/shfs_cache.h"
+#ifdef SHFS_STATS
+#include "shfs/shfs_stats.h"
+#endif
+#endif
+
+#ifndef HTTPD_REQ_MAX
+#define HTTPD_REQ_MAX (1024)     // request head incl. pipelined requests
+#endif
+#ifndef HTTPD_HDR_MAX
+#define HTTPD_HDR_MAX (384)      // response head
+#endif
+#ifndef HTTPD_CONN_DEFAULT
+#define HTTPD_CONN_DEFAULT (32)
+#endif
+#ifndef HTTPD_IDLE_TIMEOUT
+#define HTTPD_IDLE_TIMEOUT (30)  // s, for idle keep-alive connections
+#endif
+#define HTTPD_POLL_INTERVAL (2)  // in TCP coarse timer ticks (500 ms)
+
+#define HTTPD_SERVER "minipython"
+
+#define CONN_FREE     (0)
+#define CONN_READING  (1)  // waiting for (the rest of) a request head
+#define CONN_SENDING  (2)  // response is being queued to lwIP
+#define CONN_CLOSING  (3)  // response queued, close once sent
+#define CONN_PENDING  (4)  // request waits in req for the Python handler
+
+#define IO_NONE       (0)
+#define IO_READING    (1)  // waits for a chunk read into cce
+#define IO_RETRY      (2)  // the cache was out of buffers or AIO tokens
+
+typedef struct _httpd_conn_t {
+    struct tcp_pcb *pcb;
+    uint8_t state;
+    bool keepalive;
+    bool peer_closed;
+    uint8_t idle;            // poll intervals without progress
+    uint32_t discard;        // request body bytes still to be skipped
+
+    // request waiting for the Python handler, offsets into req
+    uint16_t py_method;
+    uint16_t py_path;
+    uint16_t py_len;
+    bool py_head;
+
+    uint16_t req_len;
+    char req[HTTPD_REQ_MAX];
+
+    uint16_t hdr_len;
+    uint16_t hdr_off;
+    char hdr[HTTPD_HDR_MAX];
+
+    // body from the Python handler, malloc()ed
+    byte *body;
+    size_t body_len;
+    size_t body_off;
+
+    #if SHFS_ENABLE
+    SHFS_FD f;
+    uint64_t foff;           // next byte to queue
+    uint64_t fend;           // end of the requested range
+    uint64_t fsize;
+    uint64_t fstart;
+    uint8_t io;
+    struct shfs_cache_entry *cce; // chunk being read
+    SHFS_AIO_TOKEN *cce_t;
+    lwip_pinq_t pins;        // chunks queued to lwIP by reference
+    #endif
+} httpd_conn_t;
+
+typedef struct _httpd_stats_t {
+    mp_uint_t requests;
+    mp_uint_t hits;        // served from SHFS
+    mp_uint_t misses;      // 404
+    mp_uint_t handled;     // passed to the Python handler
+    mp_uint_t ranges;      // 206
+    mp_uint_t errors;      // 4xx/5xx other than 404, I/O errors
+    mp_uint_t conns;
+    mp_uint_t refused;     // connections refused, all slots in use
+    uint64_t bytes;        // body bytes queued
+} httpd_stats_t;
+
+typedef struct _httpd_t {
+    struct tcp_pcb *listener;
+    httpd_conn_t *conns;
+    uint16_t max_conns;
+    uint16_t nconns;
+    uint16_t npending;   // connections in CONN_PENDING
+    uint16_t nio;        // connections waiting for the disk
+    httpd_conn_t *handler_conn; // connection the handler is running for
+    bool serving;
+    bool in_handler;
+    bool stopping;       // stop() called from the handler
+    httpd_stats_t stats;
+} httpd_t;
+
+STATIC httpd_t httpd;
+
+STATIC err_t httpd_process(httpd_conn_t *c);
+
+/******************************************************************************/
+// Connection handling
+
+STATIC void httpd_response_reset(httpd_conn_t *c) {
+    c->hdr_len = 0;
+    c->hdr_off = 0;
+    if (c->body != NULL) {
+        free(c->body);
+        c->body = NULL;
+    }
+    c->body_len = 0;
+    c->body_off = 0;
+    #if SHFS_ENABLE
+    if (c->f != NULL) {
+        #ifdef SHFS_STATS_HTTP
+        struct shfs_el_stats *es = shfs_stats_from_fd(c->f);
+        if (c->foff == c->fend && c->fend > c->fstart) {
+            ++es->c;
+        }
+        #ifdef SHFS_STATS_HTTP_DPC
+        for (int i = 0; i < SHFS_STATS_HTTP_DPCR; i++) {
+            if (c->foff >= SHFS_STATS_HTTP_DPC_THRESHOLD(i, c->fsize)
+                && c->fstart <= SHFS_STATS_HTTP_DPC_THRESHOLD(i, c->fsize)) {
+                ++es->p[i];
+            }
+        }
+        #endif
+        #endif
+        shfs_fio_close(c->f);
+        c->f = NULL;
+    }
+    #endif
+}
+
+#if SHFS_ENABLE
+STATIC void httpd_io_wait(httpd_conn_t *c, uint8_t io) {
+    c->io = io;
+    httpd.nio++;
+}
+
+STATIC void httpd_io_done(httpd_conn_t *c) {
+    c->io = IO_NONE;
+    httpd.nio--;
+}
+
+// Cancels a chunk read and drops the pins
+STATIC void httpd_io_abort(httpd_conn_t *c) {
+    if (c->io == IO_READING) {
+        shfs_cache_release_ioabort(c->cce, c->cce_t);
+        c->cce = NULL;
+        c->cce_t = NULL;
+    }
+    if (c->io != IO_NONE) {
+        httpd_io_done(c);
+    }
+    lwip_pinq_release(&c->pins, NULL);
+}
+#endif
+
+// Frees the slot; the pcb has been closed or freed by lwIP already
+STATIC void httpd_conn_free(httpd_conn_t *c) {
+    if (c->state == CONN_PENDING) {
+        httpd.npending--;
+    }
+    if (c == httpd.handler_conn) {
+        httpd.handler_conn = NULL;
+    }
+    #if SHFS_ENABLE
+    httpd_io_abort(c);
+    #endif
+    httpd_response_reset(c);
+    c->pcb = NULL;
+    c->state = CONN_FREE;
+    httpd.nconns--;
+}
+
+// Closes the connection. Returns ERR_ABRT if the pcb had to be aborted,
+// which has to be passed on to lwIP from within its callbacks.
+STATIC err_t httpd_conn_close(httpd_conn_t *c) {
+    struct tcp_pcb *pcb = c->pcb;
+    err_t ret = ERR_OK;
+
+    tcp_arg(pcb, NULL);
+    tcp_recv(pcb, NULL);
+    tcp_sent(pcb, NULL);
+    tcp_poll(pcb, NULL, 0);
+    tcp_err(pcb, NULL);
+    #if SHFS_ENABLE
+    c->pins.open = 0;
+    lwip_pinq_release(&c->pins, pcb);
+    if (c->pins.count != 0) {
+        // unacknowledged segments point into pinned chunks, which
+        // cannot be released while lwIP may still send them
+        tcp_abort(pcb);
+        ret = ERR_ABRT;
+    } else
+    #endif
+    if (tcp_close(pcb) != ERR_OK) {
+        tcp_abort(pcb);
+        ret = ERR_ABRT;
+    }
+    httpd_conn_free(c);
+    return ret;
+}
+
+// Aborts the connection, to be returned from lwIP callbacks
+STATIC err_t httpd_conn_abort(httpd_conn_t *c) {
+    struct tcp_pcb *pcb = c->pcb;
+
+    tcp_arg(pcb, NULL);
+    tcp_err(pcb, NULL);
+    tcp_abort(pcb);
+    httpd_conn_free(c);
+    return ERR_ABRT;
+}
+
+#if SHFS_ENABLE
+STATIC void _httpd_aio_done(SHFS_AIO_TOKEN *t, void *cookie, void *argp);
+
+// Pins a chunk that is ready to be sent from
+STATIC void httpd_pin(httpd_conn_t *c, struct shfs_cache_entry *cce) {
+    lwip_pinq_t *q = &c->pins;
+    uint8_t tail = (q->head + q->count) % LWIP_SENDFILE_PIN_MAX;
+
+    q->e[tail].cce = cce;
+    q->e[tail].end_seq = c->pcb->snd_lbb;
+    q->count++;
+    q->open = 1;
+}
+
+// Gets the chunk at c->foff from the cache. Returns ERR_OK once it is
+// pinned, ERR_INPROGRESS if the connection has to wait for the disk and
+// ERR_ABRT on errors.
+STATIC err_t httpd_read_chunk(httpd_conn_t *c) {
+    struct shfs_cache_entry *cce;
+    SHFS_AIO_TOKEN *t;
+
+    int ret = shfs_cache_aread(shfs_volchk_foff(c->f, c->foff), _httpd_aio_done, c, NULL, &cce, &t);
+    if (ret == -EAGAIN) {
+        httpd_io_wait(c, IO_RETRY);
+        return ERR_INPROGRESS;
+    }
+    if (ret < 0) {
+        // the head is out already, all we can do is to close
+        httpd.stats.errors++;
+        return ERR_ABRT;
+    }
+    if (ret == 1) {
+        c->cce = cce;
+        c->cce_t = t;
+        httpd_io_wait(c, IO_READING);
+        return ERR_INPROGRESS;
+    }
+    if (cce->invalid) {
+        shfs_cache_release(cce);
+        httpd.stats.errors++;
+        return ERR_ABRT;
+    }
+    httpd_pin(c, cce);
+    return ERR_OK;
+}
+#endif
+
+// Queues as much of the response as lwIP takes. Returns ERR_OK, also when
+// lwIP ran out of send buffers or the next chunk is still being read; the
+// response is complete once c->state is no longer CONN_SENDING.
+STATIC err_t httpd_push(httpd_conn_t *c) {
+    struct tcp_pcb *pcb = c->pcb;
+    err_t err = ERR_OK;
+    u16_t avail;
+
+    while (c->state == CONN_SENDING && (avail = tcp_sndbuf(pcb)) > 0) {
+        const void *data;
+        u16_t len;
+        bool more;
+
+        if (c->hdr_off < c->hdr_len) {
+            data = c->hdr + c->hdr_off;
+            len = MIN(avail, c->hdr_len - c->hdr_off);
+            more = (c->hdr_off + len < c->hdr_len) || c->body_off < c->body_len
+                #if SHFS_ENABLE
+                || c->foff < c->fend
+                #endif
+                ;
+            err = tcp_write(pcb, data, len, TCP_WRITE_FLAG_COPY | (more ? TCP_WRITE_FLAG_MORE : 0));
+            if (err != ERR_OK) {
+                break;
+            }
+            c->hdr_off += len;
+        } else if (c->body_off < c->body_len) {
+            data = c->body + c->body_off;
+            len = MIN(avail, c->body_len - c->body_off);
+            more = c->body_off + len < c->body_len;
+            err = tcp_write(pcb, data, len, TCP_WRITE_FLAG_COPY | (more ? TCP_WRITE_FLAG_MORE : 0));
+            if (err != ERR_OK) {
+                break;
+            }
+            c->body_off += len;
+            httpd.stats.bytes += len;
+        #if SHFS_ENABLE
+        } else if (c->foff < c->fend) {
+            lwip_pinq_t *q = &c->pins;
+            if (!q->open) {
+                if (c->io != IO_NONE || q->count == LWIP_SENDFILE_PIN_MAX) {
+                    // resumed once the chunk is in or ACKs unpin one
+                    break;
+                }
+                err = httpd_read_chunk(c);
+                if (err == ERR_INPROGRESS) {
+                    err = ERR_OK;
+                    break;
+                } else if (err != ERR_OK) {
+                    return err;
+                }
+            }
+            uint8_t last = (q->head + q->count - 1) % LWIP_SENDFILE_PIN_MAX;
+            uint64_t chk_off = shfs_volchkoff_foff(c->f, c->foff);
+            len = MIN(MIN((uint64_t)avail, shfs_vol.chunksize - chk_off), c->fend - c->foff);
+            more = c->foff + len < c->fend;
+            err = tcp_write(pcb, (uint8_t *)q->e[last].cce->buffer + chk_off, len,
+                            more ? TCP_WRITE_FLAG_MORE : 0);
+            if (err != ERR_OK) {
+                break;
+            }
+            q->e[last].end_seq = pcb->snd_lbb;
+            c->foff += len;
+            if (c->foff == c->fend || shfs_volchkoff_foff(c->f, c->foff) == 0) {
+                q->open = 0;
+            }
+            httpd.stats.bytes += len;
+        #endif
+        } else {
+            // everything is queued
+            httpd_response_reset(c);
+            c->state = c->keepalive ? CONN_READING : CONN_CLOSING;
+        }
+    }
+    if (err == ERR_MEM) {
+        // segment queue is full, continue from the sent or poll callback
+        err = ERR_OK;
+    }
+    tcp_output(pcb);
+    return err;
+}
+
+#if SHFS_ENABLE
+// Completion of a chunk read, called from shfs_poll_blkdevs() in the
+// serve() loop rather than from lwIP
+STATIC void _httpd_aio_done(SHFS_AIO_TOKEN *t, void *cookie, void *argp) {
+    httpd_conn_t *c = cookie;
+    struct shfs_cache_entry *cce = c->cce;
+    int ret = shfs_aio_finalize(t);
+    (void)argp;
+
+    c->cce = NULL;
+    c->cce_t = NULL;
+    httpd_io_done(c);
+    if (ret < 0) {
+        shfs_cache_release(cce);
+        httpd.stats.errors++;
+        httpd_conn_abort(c);
+        return;
+    }
+    httpd_pin(c, cce);
+    if (httpd_push(c) == ERR_ABRT) {
+        httpd_conn_abort(c);
+        return;
+    }
+    httpd_process(c);
+}
+
+// Polls the block devices for the connections waiting for chunks and
+// retries those the cache could not take on before
+STATIC void httpd_poll_io(void) {
+    shfs_poll_blkdevs();
+    for (uint16_t i = 0; i < httpd.max_conns && httpd.nio > 0; i++) {
+        httpd_conn_t *c = &httpd.conns[i];
+        if (c->io == IO_RETRY) {
+            httpd_io_done(c);
+            if (httpd_push(c) == ERR_ABRT) {
+                httpd_conn_abort(c);
+            } else {
+                httpd_process(c);
+            }
+        }
+    }
+}
+#endif
+
+/******************************************************************************/
+// Requests
+
+STATIC const char *httpd_reason(int status) {
+    switch (status) {
+        case 200: return "OK";
+        case 206: return "Partial Content";
+        case 400: return "Bad Request";
+        case 404: return "Not Found";
+        case 405: return "Method Not Allowed";
+        case 416: return "Range Not Satisfiable";
+        case 431: return "Request Header Fields Too Large";
+        case 500: return "Internal Server Error";
+        case 501: return "Not Implemented";
+        case 503: return "Service Unavailable";
+        default: return "";
+    }
+}
+
+// Formats the response head, extra are additional header lines
+STATIC void httpd_head(httpd_conn_t *c, int status, const char *mime, uint64_t len, const char *extra) {
+    int n = snprintf(c->hdr, sizeof(c->hdr),
+        "HTTP/1.1 %d %s\r\n"
+        "Server: " HTTPD_SERVER "\r\n"
+        "Content-Type: %s\r\n"
+        "Content-Length: %llu\r\n"
+        "%s"
+        "Connection: %s\r\n"
+        "\r\n",
+        status, httpd_reason(status), mime, (unsigned long long)len,
+        extra, c->keepalive ? "keep-alive" : "close");
+    c->hdr_len = MIN(n, (int)sizeof(c->hdr) - 1);
+    c->hdr_off = 0;
+    c->state = CONN_SENDING;
+}
+
+// Short error response with a text body
+STATIC void httpd_error(httpd_conn_t *c, int status, bool head_only) {
+    char body[64];
+    int n = snprintf(body, sizeof(body), "%d %s\n", status, httpd_reason(status));
+
+    if (status == 404) {
+        httpd.stats.misses++;
+    } else {
+        httpd.stats.errors++;
+    }
+    httpd_head(c, status, "text/plain", n, "");
+    if (!head_only && (c->body = malloc(n)) != NULL) {
+        memcpy(c->body, body, n);
+        c->body_len = n;
+    }
+}
+
+// Case-insensitive compare of a header name at line
+STATIC bool httpd_is_header(const char *line, const char *name) {
+    size_t n = strlen(name);
+    return strncasecmp(line, name, n) == 0 && line[n] == ':';
+}
+
+STATIC const char *httpd_header_value(const char *line) {
+    line = strchr(line, ':') + 1;
+    while (*line == ' ' || *line == '\t') {
+        line++;
+    }
+    return line;
+}
+
+#if SHFS_ENABLE
+// Parses "bytes=a-b", "bytes=a-" and "bytes=-n". Returns 1 and sets
+// [*start, *end) on success, 0 if the header is to be ignored and -1 if
+// the range cannot be satisfied.
+STATIC int httpd_parse_range(const char *v, uint64_t size, uint64_t *start, uint64_t *end) {
+    char *e;
+
+    if (strncmp(v, "bytes=", 6) != 0 || strchr(v, ',') != NULL) {
+        // other units and multipart ranges are answered with the whole object
+        return 0;
+    }
+    v += 6;
+    if (*v == '-') {
+        uint64_t n = strtoull(v + 1, &e, 10);
+        if (e == v + 1) {
+            return 0;
+        }
+        if (n == 0 || size == 0) {
+            return -1;
+        }
+        *start = (n > size) ? 0 : size - n;
+        *end = size;
+        return 1;
+    }
+    *start = strtoull(v, &e, 10);
+    if (e == v || *e != '-') {
+        return 0;
+    }
+    v = e + 1;
+    if (*v == '\0') {
+        *end = size;
+    } else {
+        *end = strtoull(v, &e, 10) + 1;
+        if (e == v) {
+            return 0;
+        }
+        if (*end > size) {
+            *end = size;
+        }
+    }
+    if (*start >= size || *start >= *end) {
+        return -1;
+    }
+    return 1;
+}
+
+// Serves path from SHFS, returns false if there is no such object
+STATIC bool httpd_serve_shfs(httpd_conn_t *c, const char *path, const char *range, bool head_only) {
+    SHFS_FD f;
+    char mime[64];
+    char extra[96];
+    uint64_t size, start, end;
+
+    if (!shfs_mounted) {
+        return false;
+    }
+    if (*path == '\0') {
+        if (shfs_vol.def_bentry == NULL) {
+            return false;
+        }
+        f = shfs_fio_openf(shfs_vol.def_bentry);
+    } else {
+        f = shfs_fio_open(path);
+    }
+    if (f == NULL) {
+        return false;
+    }
+    if (shfs_fio_islink(f)) {
+        shfs_fio_close(f);
+        return false;
+    }
+
+    shfs_fio_size(f, &size);
+    shfs_fio_mime(f, mime, sizeof(mime));
+    if (mime[0] == '\0') {
+        strcpy(mime, "application/octet-stream");
+    }
+
+    start = 0;
+    end = size;
+    int r = (range != NULL) ? httpd_parse_range(range, size, &start, &end) : 0;
+    if (r < 0) {
+        shfs_fio_close(f);
+        snprintf(extra, sizeof(extra), "Content-Range: bytes */%llu\r\n", (unsigned long long)size);
+        httpd.stats.errors++;
+        httpd_head(c, 416, "text/plain", 0, extra);
+        return true;
+    } else if (r > 0) {
+        snprintf(extra, sizeof(extra), "Accept-Ranges: bytes\r\nContent-Range: bytes %llu-%llu/%llu\r\n",
+            (unsigned long long)start, (unsigned long long)end - 1, (unsigned long long)size);
+        httpd.stats.ranges++;
+        httpd_head(c, 206, mime, end - start, extra);
+    } else {
+        httpd_head(c, 200, mime, size, "Accept-Ranges: bytes\r\n");
+    }
+    httpd.stats.hits++;
+
+    c->f = f;
+    c->fsize = size;
+    c->fstart = start;
+    c->foff = start;
+    c->fend = head_only ? start : end;
+    return true;
+}
+#endif
+
+// Leaves the request in c->req for the Python handler, which must not run
+// from within the lwIP callbacks. Returns false if there is no handler.
+STATIC bool httpd_defer_python(httpd_conn_t *c, const char *method, const char *path, bool head_only) {
+    mp_obj_t handler = MP_STATE_PORT(httpd_handler);
+
+    if (handler == MP_OBJ_NULL || handler == mp_const_none) {
+        return false;
+    }
+    c->py_method = method - c->req;
+    c->py_path = path - c->req;
+    c->py_head = head_only;
+    c->state = CONN_PENDING;
+    httpd.npending++;
+    return true;
+}
+
+// Passes a pending request to the Python handler: handler(method, path)
+// returns None (404), a str/bytes body or a (status, content_type, body)
+// tuple. The connection may go away while the handler runs, since it can
+// poll the network itself.
+STATIC void httpd_serve_python(httpd_conn_t *c) {
+    mp_obj_t handler = MP_STATE_PORT(httpd_handler);
+    const char *path = c->req + c->py_path;
+    bool head_only = c->py_head;
+    mp_obj_t ret = mp_const_none;
+    bool failed = false;
+
+    httpd.stats.handled++;
+    httpd.handler_conn = c;
+    httpd.in_handler = true;
+    nlr_buf_t nlr;
+    if (nlr_push(&nlr) == 0) {
+        mp_obj_t args[2] = {
+            mp_obj_new_str(c->req + c->py_method, strlen(c->req + c->py_method), false),
+            mp_obj_new_str(path, strlen(path), false),
+        };
+        ret = mp_call_function_n_kw(handler, 2, 0, args);
+        if (httpd.handler_conn == NULL) {
+            // closed by the peer in the meantime
+            nlr_pop();
+            httpd.in_handler = false;
+            return;
+        }
+        c->state = CONN_READING;
+        httpd.npending--;
+
+        int status = 200;
+        const char *mime = "text/html";
+        mp_obj_t body = ret;
+        if (MP_OBJ_IS_TYPE(ret, &mp_type_tuple)) {
+            mp_obj_t *items;
+            mp_obj_get_array_fixed_n(ret, 3, &items);
+            status = mp_obj_get_int(items[0]);
+            mime = mp_obj_str_get_str(items[1]);
+            body = items[2];
+        }
+        if (ret == mp_const_none) {
+            httpd_error(c, 404, head_only);
+        } else {
+            mp_buffer_info_t bufinfo;
+            mp_get_buffer_raise(body, &bufinfo, MP_BUFFER_READ);
+            httpd_head(c, status, mime, bufinfo.len, "");
+            if (!head_only && bufinfo.len > 0) {
+                c->body = malloc(bufinfo.len);
+                if (c->body == NULL) {
+                    nlr_raise(mp_obj_new_exception_arg1(&mp_type_OSError, MP_OBJ_NEW_SMALL_INT(ENOMEM)));
+                }
+                memcpy(c->body, bufinfo.buf, bufinfo.len);
+                c->body_len = bufinfo.len;
+            }
+        }
+        nlr_pop();
+    } else {
+        mp_printf(&mp_plat_print, "httpd: handler failed for %s\n", path);
+        mp_obj_print_exception(&mp_plat_print, nlr.ret_val);
+        failed = true;
+    }
+    httpd.in_handler = false;
+    if (httpd.handler_conn == NULL) {
+        return;
+    }
+    httpd.handler_conn = NULL;
+
+    if (failed) {
+        if (c->state == CONN_PENDING) {
+            c->state = CONN_READING;
+            httpd.npending--;
+        }
+        httpd_response_reset(c);
+        httpd_error(c, 500, head_only);
+    }
+
+    // drop the request from the buffer, pipelined ones stay
+    memmove(c->req, c->req + c->py_len, c->req_len - c->py_len);
+    c->req_len -= c->py_len;
+    c->idle = 0;
+    if (httpd_push(c) == ERR_ABRT) {
+        httpd_conn_abort(c);
+        return;
+    }
+    httpd_process(c);
+}
+
+// Runs the handler for the requests that were left pending by the lwIP
+// callbacks, until stop() is called from it
+STATIC void httpd_run_pending(void) {
+    for (uint16_t i = 0; i < httpd.max_conns && httpd.npending > 0 && !httpd.stopping; i++) {
+        if (httpd.conns[i].state == CONN_PENDING) {
+            httpd_serve_python(&httpd.conns[i]);
+        }
+    }
+}
+
+// Parses and answers the request head in c->req[0..len). Terminates the
+// strings in place.
+STATIC void httpd_request(httpd_conn_t *c, char *req, size_t len) {
+    char *method, *target, *version, *line, *next;
+    const char *range = NULL;
+    bool keepalive;
+
+    httpd.stats.requests++;
+
+    // request line
+    method = req;
+    next = strstr(req, "\r\n");
+    *next = '\0';
+    next += 2;
+    target = strchr(method, ' ');
+    version = (target != NULL) ? strchr(target + 1, ' ') : NULL;
+    if (version == NULL || strncmp(version + 1, "HTTP/1.", 7) != 0) {
+        c->keepalive = false;
+        httpd_error(c, 400, false);
+        return;
+    }
+    *target++ = '\0';
+    *version++ = '\0';
+    keepalive = (version[7] != '0'); // HTTP/1.1 defaults to persistent connections
+
+    // headers
+    c->discard = 0;
+    for (line = next; *line != '\0' && !(line[0] == '\r' && line[1] == '\n'); line = next) {
+        next = strstr(line, "\r\n");
+        *next = '\0';
+        next += 2;
+        if (httpd_is_header(line, "Connection")) {
+            const char *v = httpd_header_value(line);
+            if (strncasecmp(v, "close", 5) == 0) {
+                keepalive = false;
+            } else if (strncasecmp(v, "keep-alive", 10) == 0) {
+                keepalive = true;
+            }
+        } else if (httpd_is_header(line, "Range")) {
+            range = httpd_header_value(line);
+        } else if (httpd_is_header(line, "Content-Length")) {
+            c->discard = strtoul(httpd_header_value(line), NULL, 10);
+        } else if (httpd_is_header(line, "Transfer-Encoding")) {
+            // cannot find the end of a chunked body
+            keepalive = false;
+        }
+    }
+    c->keepalive = keepalive && !c->peer_closed;
+
+    bool get = (strcmp(method, "GET") == 0);
+    bool head = (strcmp(method, "HEAD") == 0);
+    if (*target != '/') {
+        httpd_error(c, 400, head);
+        return;
+    }
+    target++;
+
+    if (get || head) {
+        #if SHFS_ENABLE
+        // "?<hash>" addresses an object by hash, otherwise a query is ignored
+        char *query = strchr(target, '?');
+        if (query != NULL && query != target) {
+            *query = '\0';
+        }
+        if (httpd_serve_shfs(c, target, range, head)) {
+            return;
+        }
+        if (query != NULL && query != target) {
+            *query = '?';
+        }
+        #else
+        (void)range;
+        #endif
+    }
+    if (httpd_defer_python(c, method, target - 1, head)) {
+        return;
+    }
+    httpd_error(c, (get || head) ? 404 : 501, head);
+}
+
+// Answers complete requests in the receive buffer, one at a time so that
+// pipelined responses go out in order
+STATIC err_t httpd_process(httpd_conn_t *c) {
+    err_t err = ERR_OK;
+
+    while (c->state == CONN_READING) {
+        if (c->discard > 0) {
+            size_t n = MIN(c->discard, c->req_len);
+            memmove(c->req, c->req + n, c->req_len - n);
+            c->req_len -= n;
+            c->discard -= n;
+            if (c->discard > 0) {
+                break;
+            }
+        }
+        c->req[c->req_len] = '\0';
+        char *end = strstr(c->req, "\r\n\r\n");
+        if (end == NULL) {
+            if (c->req_len >= HTTPD_REQ_MAX - 1) {
+                c->keepalive = false;
+                httpd_error(c, 431, false);
+                c->req_len = 0;
+            } else if (c->peer_closed) {
+                return httpd_conn_close(c);
+            } else {
+                break;
+            }
+        } else {
+            size_t len = end + 4 - c->req;
+            char saved = c->req[len];
+            c->req[len] = '\0';
+            httpd_request(c, c->req, len);
+            c->req[len] = saved;
+            if (c->state == CONN_PENDING) {
+                // consumed once the handler has answered it
+                c->py_len = len;
+                break;
+            }
+            memmove(c->req, c->req + len, c->req_len - len);
+            c->req_len -= len;
+        }
+        c->idle = 0;
+        if ((err = httpd_push(c)) != ERR_OK) {
+            break;
+        }
+    }
+    if (err == ERR_ABRT) {
+        return httpd_conn_abort(c);
+    }
+    if (c->state == CONN_CLOSING && c->pcb->snd_queuelen == 0) {
+        return httpd_conn_close(c);
+    }
+    return err;
+}
+
+/******************************************************************************/
+// lwIP callbacks
+
+STATIC err_t _httpd_recv(void *arg, struct tcp_pcb *pcb, struct pbuf *p, err_t err) {
+    httpd_conn_t *c = arg;
+
+    if (p == NULL) {
+        c->peer_closed = true;
+        if (c->state == CONN_READING) {
+            return httpd_process(c);
+        }
+        c->keepalive = false;
+        return ERR_OK;
+    }
+    if (c->state != CONN_READING && c->req_len + p->tot_len >= HTTPD_REQ_MAX) {
+        // pipelined requests beyond the buffer, lwIP hands them in again later
+        return ERR_MEM;
+    }
+    u16_t off = 0;
+    if (c->req_len == 0 && c->discard > 0) {
+        // request body, not passed on
+        off = MIN(c->discard, p->tot_len);
+        c->discard -= off;
+    }
+    u16_t len = MIN(p->tot_len - off, HTTPD_REQ_MAX - 1 - c->req_len);
+    pbuf_copy_partial(p, c->req + c->req_len, len, off);
+    c->req_len += len;
+    // anything beyond a full buffer is answered with 431 and dropped
+    tcp_recved(pcb, p->tot_len);
+    pbuf_free(p);
+
+    if (c->state == CONN_READING) {
+        return httpd_process(c);
+    }
+    return ERR_OK;
+}
+
+STATIC err_t _httpd_sent(void *arg, struct tcp_pcb *pcb, u16_t len) {
+    httpd_conn_t *c = arg;
+    err_t err;
+
+    c->idle = 0;
+    #if SHFS_ENABLE
+    lwip_pinq_release(&c->pins, pcb);
+    #endif
+    if (c->state == CONN_SENDING && (err = httpd_push(c)) != ERR_OK) {
+        return (err == ERR_ABRT) ? httpd_conn_abort(c) : err;
+    }
+    return httpd_process(c);
+}
+
+STATIC err_t _httpd_poll(void *arg, struct tcp_pcb *pcb) {
+    httpd_conn_t *c = arg;
+
+    if (c->state == CONN_READING && c->req_len == 0
+        && ++c->idle > HTTPD_IDLE_TIMEOUT * 2 / HTTPD_POLL_INTERVAL) {
+        return httpd_conn_close(c);
+    }
+    // retry after lwIP ran out of memory
+    return _httpd_sent(arg, pcb, 0);
+}
+
+STATIC void _httpd_error(void *arg, err_t err) {
+    httpd_conn_t *c = arg;
+
+    // lwIP has freed the pcb already
+    if (c != NULL) {
+        httpd_conn_free(c);
+    }
+}
+
+STATIC err_t _httpd_accept(void *arg, struct tcp_pcb *pcb, err_t err) {
+    httpd_conn_t *c = NULL;
+
+    tcp_accepted(httpd.listener);
+    for (uint16_t i = 0; i < httpd.max_conns; i++) {
+        if (httpd.conns[i].state == CONN_FREE) {
+            c = &httpd.conns[i];
+            break;
+        }
+    }
+    if (c == NULL) {
+        httpd.stats.refused++;
+        return ERR_MEM;
+    }
+
+    memset(c, 0, offsetof(httpd_conn_t, req));
+    c->pcb = pcb;
+    c->state = CONN_READING;
+    httpd.nconns++;
+    httpd.stats.conns++;
+
+    tcp_arg(pcb, c);
+    tcp_recv(pcb, _httpd_recv);
+    tcp_sent(pcb, _httpd_sent);
+    tcp_err(pcb, _httpd_error);
+    tcp_poll(pcb, _httpd_poll, HTTPD_POLL_INTERVAL);
+    return ERR_OK;
+}
+
+/******************************************************************************/
+// Module functions
+
+STATIC void httpd_shutdown(void) {
+    if (httpd.listener != NULL) {
+        tcp_close(httpd.listener);
+        httpd.listener = NULL;
+    }
+    if (httpd.conns != NULL) {
+        for (uint16_t i = 0; i < httpd.max_conns; i++) {
+            if (httpd.conns[i].state != CONN_FREE) {
+                httpd_conn_close(&httpd.conns[i]);
+            }
+        }
+        free(httpd.conns);
+        httpd.conns = NULL;
+    }
+    httpd.serving = false;
+    httpd.stopping = false;
+    MP_STATE_PORT(httpd_handler) = MP_OBJ_NULL;
+}
+
+// start(port, handler=None, max_conns=32)
+STATIC mp_obj_t mod_httpd_start(mp_uint_t n_args, const mp_obj_t *args) {
+    mp_int_t port = mp_obj_get_int(args[0]);
+    mp_obj_t handler = (n_args > 1) ? args[1] : mp_const_none;
+    mp_int_t max_conns = (n_args > 2) ? mp_obj_get_int(args[2]) : HTTPD_CONN_DEFAULT;
+
+    if (httpd.stopping) {
+        httpd_shutdown();
+    }
+    if (httpd.listener != NULL) {
+        nlr_raise(mp_obj_new_exception_arg1(&mp_type_OSError, MP_OBJ_NEW_SMALL_INT(EALREADY)));
+    }
+    if (max_conns < 1 || max_conns > 0xffff) {
+        nlr_raise(mp_obj_new_exception_msg(&mp_type_ValueError, "max_conns out of range"));
+    }
+
+    httpd.max_conns = max_conns;
+    httpd.conns = calloc(httpd.max_conns, sizeof(httpd_conn_t));
+    if (httpd.conns == NULL) {
+        nlr_raise(mp_obj_new_exception_arg1(&mp_type_OSError, MP_OBJ_NEW_SMALL_INT(ENOMEM)));
+    }
+    httpd.nconns = 0;
+    httpd.npending = 0;
+    httpd.nio = 0;
+
+    struct tcp_pcb *pcb = tcp_new();
+    if (pcb == NULL) {
+        httpd_shutdown();
+        nlr_raise(mp_obj_new_exception_arg1(&mp_type_OSError, MP_OBJ_NEW_SMALL_INT(ENOMEM)));
+    }
+    ip_set_option(pcb, SOF_REUSEADDR);
+    if (tcp_bind(pcb, IP_ADDR_ANY, port) != ERR_OK) {
+        tcp_close(pcb);
+        httpd_shutdown();
+        nlr_raise(mp_obj_new_exception_arg1(&mp_type_OSError, MP_OBJ_NEW_SMALL_INT(EADDRINUSE)));
+    }
+    httpd.listener = tcp_listen_with_backlog(pcb, MIN(httpd.max_conns, 0xff));
+    if (httpd.listener == NULL) {
+        tcp_close(pcb);
+        httpd_shutdown();
+        nlr_raise(mp_obj_new_exception_arg1(&mp_type_OSError, MP_OBJ_NEW_SMALL_INT(ENOMEM)));
+    }
+    tcp_accept(httpd.listener, _httpd_accept);
+
+    MP_STATE_PORT(httpd_handler) = handler;
+    return mp_const_none;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(mod_httpd_start_obj, 1, 3, mod_httpd_start);
+
+// serve(): polls the network interfaces until stop() or an exception
+STATIC mp_obj_t mod_httpd_serve(void) {
+    if (httpd.listener == NULL) {
+        nlr_raise(mp_obj_new_exception_arg1(&mp_type_OSError, MP_OBJ_NEW_SMALL_INT(ENOTCONN)));
+    }
+    httpd.serving = true;
+    while (httpd.serving) {
+        lwip_poll_hook(0, -1);
+        #if SHFS_ENABLE
+        if (httpd.nio > 0) {
+            httpd_poll_io();
+        }
+        #endif
+        httpd_run_pending();
+        if (httpd.stopping) {
+            httpd_shutdown();
+            break;
+        }
+        if (MP_STATE_VM(mp_pending_exception) != MP_OBJ_NULL) {
+            mp_obj_t obj = MP_STATE_VM(mp_pending_exception);
+            MP_STATE_VM(mp_pending_exception) = MP_OBJ_NULL;
+            httpd.serving = false;
+            nlr_raise(obj);
+        }
+    }
+    return mp_const_none;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_0(mod_httpd_serve_obj, mod_httpd_serve);
+
+// stop(): closes the listener and all connections; from within the handler
+// this happens once the current request is answered
+STATIC mp_obj_t mod_httpd_stop(void) {
+    if (httpd.in_handler) {
+        httpd.stopping = true;
+        httpd.serving = false;
+        return mp_const_none;
+    }
+    httpd_shutdown();
+    return mp_const_none;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_0(mod_httpd_stop_obj, mod_httpd_stop);
+
+STATIC mp_obj_t mod_httpd_stats(void) {
+    mp_obj_t d = mp_obj_new_dict(0);
+
+    mp_obj_dict_store(d, MP_OBJ_NEW_QSTR(MP_QSTR_requests), mp_obj_new_int_from_uint(httpd.stats.requests));
+    mp_obj_dict_store(d, MP_OBJ_NEW_QSTR(MP_QSTR_hits), mp_obj_new_int_from_uint(httpd.stats.hits));
+    mp_obj_dict_store(d, MP_OBJ_NEW_QSTR(MP_QSTR_misses), mp_obj_new_int_from_uint(httpd.stats.misses));
+    mp_obj_dict_store(d, MP_OBJ_NEW_QSTR(MP_QSTR_handled), mp_obj_new_int_from_uint(httpd.stats.handled));
+    mp_obj_dict_store(d, MP_OBJ_NEW_QSTR(MP_QSTR_ranges), mp_obj_new_int_from_uint(httpd.stats.ranges));
+    mp_obj_dict_store(d, MP_OBJ_NEW_QSTR(MP_QSTR_errors), mp_obj_new_int_from_uint(httpd.stats.errors));
+    mp_obj_dict_store(d, MP_OBJ_NEW_QSTR(MP_QSTR_conns), mp_obj_new_int_from_uint(httpd.stats.conns));
+    mp_obj_dict_store(d, MP_OBJ_NEW_QSTR(MP_QSTR_active), mp_obj_new_int_from_uint(httpd.nconns));
+    mp_obj_dict_store(d, MP_OBJ_NEW_QSTR(MP_QSTR_refused), mp_obj_new_int_from_uint(httpd.stats.refused));
+    mp_obj_dict_store(d, MP_OBJ_NEW_QSTR(MP_QSTR_bytes), mp_obj_new_int_from_ull(httpd.stats.bytes));
+    return d;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_0(mod_httpd_stats_obj, mod_httpd_stats);
+
+STATIC const mp_rom_map_elem_t mp_module_httpd_globals_table[] = {
+    { MP_ROM_QSTR(MP_QSTR___name__), MP_ROM_QSTR(MP_QSTR_httpd) },
+    { MP_ROM_QSTR(MP_QSTR_start), MP_ROM_PTR(&mod_httpd_start_obj) },
+    { MP_ROM_QSTR(MP_QSTR_serve), MP_ROM_PTR(&mod_httpd_serve_obj) },
+    { MP_ROM_QSTR(MP_QSTR_stop), MP_ROM_PTR(&mod_httpd_stop_obj) },
+    { MP_ROM_QSTR(MP_QSTR_stats), MP_ROM_PTR(&mod_httpd_stats_obj) },
+};
+
+STATIC MP_DEFINE_CONST_DICT(mp_module_httpd_globals, mp_module_httpd_globals_table);
+
+const mp_obj_module_t mp_module_httpd = {
+    .base = { &mp_type_module },
+    .name = MP_QSTR_httpd,
+    .globals = (mp_obj_dict_t*)&mp_module_httpd_globals,
+};
@@ -32,6 +32,7 @@
 #include "py/nlr.h"
 #include "py/objlist.h"
 #include "py/runtime.h"
+#include "py/builtin.h"
 #include "py/stream.h"
 #include "py/mphal.h"
 
@@ -45,9 +46,25 @@
 #include "lwip/tcp_impl.h"
 #include "lwip/netif.h"
 #include "lwip/inet.h"
+#include "lwip/memp.h"
+#include "lwip/stats.h"
 #include <mini-os/lwip-net.h>
+#include <mini-os/time.h>
 #include "modlwip.h"
+#include "modxbuf.h"
+#include "gccollect.h"
+#include "moduevent.h"
+#include "moddns.h"
+#include "modpcap.h"
 #include "xenbus.h"
+#ifndef __MINIOS__
+#include <unistd.h>
+#endif
+#if SHFS_ENABLE
+#include "shfs/shfs.h"
+#include "shfs/shfs_fio.h"
+#include "shfs/shfs_cache.h"
+#endif
 
 #if 0 // print debugging info
 #define DEBUG_printf DEBUG_printf
@@ -79,6 +96,17 @@ typedef struct _lwip_ether_obj_t {
   ip4_addr_t        ip;
   ip4_addr_t        mask;
   ip4_addr_t        gw;
+  // netfront handlers, called through the counting wrappers below
+  netif_input_fn    input;
+  netif_linkoutput_fn linkoutput;
+  struct {
+    mp_uint_t rx_packets;
+    mp_uint_t rx_bytes;
+    mp_uint_t rx_errors; // refused by lwIP
+    mp_uint_t tx_packets;
+    mp_uint_t tx_bytes;
+    mp_uint_t tx_errors;
+  } stats;
 } lwip_ether_obj_t;
 
 STATIC const mp_obj_type_t lwip_ether_type;
@@ -86,9 +114,71 @@ STATIC const mp_obj_type_t lwip_ether_type;
 static lwip_ether_obj_t lwip_ether_objs[ETHER_MAX];
 static int lwip_ether_objs_count = 0;
 
+// Interface polling, NAPI style: a pass polls the interfaces round-robin
+// until budget frames came in, and waits busy poll while frames keep
+// arriving but block the domain once idle passes in a row found nothing
+#define LWIP_POLL_BUDGET_DEFAULT 64
+#define LWIP_POLL_IDLE_DEFAULT 32
+#define LWIP_POLL_SLEEP_MAX_MS 10 // also bounds the lwIP timer latency
+
+typedef struct _lwip_poll_t {
+  mp_uint_t budget;
+  mp_uint_t idle;
+  mp_uint_t empty;  // passes in a row without frames
+  int       next;   // interface polled first by the next pass
+  bool      busy;   // busy polling, otherwise waits sleep
+  struct {
+    mp_uint_t passes;
+    mp_uint_t frames;
+    mp_uint_t exhausted; // passes cut short by the budget
+    mp_uint_t busy_waits;
+    mp_uint_t sleeps;
+    mp_uint_t to_busy;
+    mp_uint_t to_sleep;
+  } stats;
+} lwip_poll_t;
+
+STATIC lwip_poll_t lwip_poll = {
+  .budget = LWIP_POLL_BUDGET_DEFAULT,
+  .idle = LWIP_POLL_IDLE_DEFAULT,
+};
+
 STATIC int lwip_find_ip(const char *ip, char *found_ip);
 STATIC int lwip_find_next_noip(int offset);
 STATIC lwip_ether_obj_t *lwip_addif(const ip4_addr_t *ip, const ip4_addr_t *mask, const ip4_addr_t *gw);
+STATIC void lwip_cb_dispatch(void);
+STATIC void lwip_raw_input(struct pbuf *p);
+
+#define LWIP_ETHER_OF(nif) ((lwip_ether_obj_t*)((char*)(nif) - offsetof(lwip_ether_obj_t, netif)))
+
+// Frame counters and the pcap tap of an interface: netfront hands
+// received frames to netif->input and transmits through netif->linkoutput
+STATIC err_t lwip_ether_input(struct pbuf *p, struct netif *netif) {
+    lwip_ether_obj_t *obj = LWIP_ETHER_OF(netif);
+    obj->stats.rx_packets++;
+    obj->stats.rx_bytes += p->tot_len;
+    lwip_poll.stats.frames++;
+    PCAP_TAP(obj->nfi.vif_id, p);
+    lwip_raw_input(p);
+    err_t err = obj->input(p, netif);
+    if (err != ERR_OK) {
+        obj->stats.rx_errors++;
+    }
+    return err;
+}
+
+STATIC err_t lwip_ether_linkoutput(struct netif *netif, struct pbuf *p) {
+    lwip_ether_obj_t *obj = LWIP_ETHER_OF(netif);
+    PCAP_TAP(obj->nfi.vif_id, p);
+    err_t err = obj->linkoutput(netif, p);
+    if (err == ERR_OK) {
+        obj->stats.tx_packets++;
+        obj->stats.tx_bytes += p->tot_len;
+    } else {
+        obj->stats.tx_errors++;
+    }
+    return err;
+}
 
 STATIC lwip_ether_obj_t *lwip_addif(const ip4_addr_t *ip,
                                     const ip4_addr_t *mask,
@@ -154,6 +244,11 @@ STATIC lwip_ether_obj_t *lwip_addif(const ip4_addr_t *ip,
               &obj->nfi,
               netfrontif_init,
               ethernet_input);
+    memset(&obj->stats, 0, sizeof(obj->stats));
+    obj->input = obj->netif.input;
+    obj->netif.input = lwip_ether_input;
+    obj->linkoutput = obj->netif.linkoutput;
+    obj->netif.linkoutput = lwip_ether_linkoutput;
     if (lwip_ether_objs_count == 0)
         netif_set_default(&obj->netif);
     netif_set_up(&obj->netif);
@@ -191,17 +286,44 @@ STATIC mp_obj_t lwip_ether_make_new(const mp_obj_type_t *type_in,
     return lwip_addif(&ip, &mask, &gw);
 }
 
+STATIC void lwip_ether_poll_conly(void *arg) {
+  netfrontif_poll((struct netif *)arg);
+}
+
 STATIC mp_obj_t lwip_ether_poll(mp_obj_t e) {
   lwip_ether_obj_t *obj = (lwip_ether_obj_t*)e;
-  netfrontif_poll(&obj->netif);
+  gc_conly_call(lwip_ether_poll_conly, &obj->netif);
+  lwip_cb_dispatch();
   return mp_const_none;
 }
 STATIC MP_DEFINE_CONST_FUN_OBJ_1(lwip_ether_poll_obj, lwip_ether_poll);
 
+STATIC void lwip_stats_store(mp_obj_t d, qstr key, mp_uint_t val) {
+    mp_obj_dict_store(d, MP_OBJ_NEW_QSTR(key), mp_obj_new_int_from_uint(val));
+}
+
+STATIC mp_obj_t lwip_ether_stats_dict(lwip_ether_obj_t *obj) {
+    mp_obj_t d = mp_obj_new_dict(0);
+    lwip_stats_store(d, MP_QSTR_vif, obj->nfi.vif_id);
+    lwip_stats_store(d, MP_QSTR_rx_packets, obj->stats.rx_packets);
+    lwip_stats_store(d, MP_QSTR_rx_bytes, obj->stats.rx_bytes);
+    lwip_stats_store(d, MP_QSTR_rx_errors, obj->stats.rx_errors);
+    lwip_stats_store(d, MP_QSTR_tx_packets, obj->stats.tx_packets);
+    lwip_stats_store(d, MP_QSTR_tx_bytes, obj->stats.tx_bytes);
+    lwip_stats_store(d, MP_QSTR_tx_errors, obj->stats.tx_errors);
+    return d;
+}
+
+STATIC mp_obj_t lwip_ether_stats(mp_obj_t e) {
+    return lwip_ether_stats_dict(e);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_1(lwip_ether_stats_obj, lwip_ether_stats);
+
 
 
 STATIC const mp_map_elem_t lwip_ether_locals_dict_table[] = {
   { MP_OBJ_NEW_QSTR(MP_QSTR_poll), (mp_obj_t)&lwip_ether_poll_obj },
+  { MP_OBJ_NEW_QSTR(MP_QSTR_stats), (mp_obj_t)&lwip_ether_stats_obj },
 };
 
 STATIC MP_DEFINE_CONST_DICT(lwip_ether_locals_dict, lwip_ether_locals_dict_table);
@@ -369,57 +491,342 @@ static const int error_lookup_table[] = {
 
 #define MOD_NETWORK_AF_INET (2)
 #define MOD_NETWORK_AF_INET6 (10)
+#define MOD_NETWORK_AF_PACKET (17)
 
 #define MOD_NETWORK_SOCK_STREAM (1)
 #define MOD_NETWORK_SOCK_DGRAM (2)
 #define MOD_NETWORK_SOCK_RAW (3)
 
+// Polling runs the netfront and lwIP input paths which never call back
+// into Python (socket callbacks are queued, see lwip_cb_dispatch()) but
+// when the callback batch is full, so their frames are skipped by the
+// garbage collector.
+//
+// netfrontif_poll() drains a whole receive ring, so the budget is checked
+// between interfaces: those skipped by an exhausted budget go first in
+// the next pass, otherwise the first interface rotates.
+STATIC void poll_sockets_conly(void *arg) {
+    mp_uint_t frames = lwip_poll.stats.frames;
+    int count = lwip_ether_objs_count;
+    int i = lwip_poll.next % MAX(count, 1);
+    int n;
+
+    for (n = 0; n < count; n++) {
+        netfrontif_poll(&lwip_ether_objs[i].netif);
+        i = (i + 1) % count;
+        if (lwip_poll.stats.frames - frames >= lwip_poll.budget) {
+            lwip_poll.stats.exhausted++;
+            n++;
+            break;
+        }
+    }
+    lwip_poll.next = n < count ? i : (i + 1) % MAX(count, 1);
+    lwip_poll.stats.passes++;
+
+    if (lwip_poll.stats.frames != frames) {
+        lwip_poll.empty = 0;
+        if (!lwip_poll.busy) {
+            lwip_poll.busy = true;
+            lwip_poll.stats.to_busy++;
+        }
+    } else if (lwip_poll.busy && ++lwip_poll.empty >= lwip_poll.idle) {
+        lwip_poll.busy = false;
+        lwip_poll.stats.to_sleep++;
+    }
+
+    // retransmissions, delayed ACKs, ARP and DNS retries
+    sys_check_timeouts();
+}
+
 static inline void poll_sockets(void) {
-    int i;
+    gc_conly_call(poll_sockets_conly, NULL);
+    lwip_cb_dispatch();
+    gc_collect_hook_run();
+}
 
-    for (i = 0; i < lwip_ether_objs_count; i++)
-        netfrontif_poll(&lwip_ether_objs[i].netif);
+/*******************************************************************************/
+// Socket timeouts are kept in microseconds; blocking calls compute a
+// deadline on the monotonic clock and poll the interfaces until it passes.
+
+#define SOCKET_TIMEOUT_NONE ((uint64_t)-1)
+#define SOCKET_TIMEOUT_MAX_S (SOCKET_TIMEOUT_NONE / 1000000 - 1)
+// Latest deadline that can still be converted to ns for lwip_poll_wait()
+#define SOCKET_DEADLINE_MAX (UINT64_MAX / 1000)
+
+static inline uint64_t lwip_now_us(void) {
+    return (uint64_t)NSEC_TO_USEC(monotonic_clock());
+}
+
+// Returns the deadline of a wait starting now, 0 if there is none; one
+// beyond SOCKET_DEADLINE_MAX is as good as none
+static inline uint64_t socket_deadline(lwip_socket_obj_t *socket) {
+    uint64_t now = lwip_now_us();
+    if (socket->timeout == SOCKET_TIMEOUT_NONE || socket->timeout >= SOCKET_DEADLINE_MAX - now) {
+        return 0;
+    }
+    return now + socket->timeout;
+}
+
+static inline bool deadline_passed(uint64_t deadline) {
+    return deadline != 0 && lwip_now_us() >= deadline;
+}
+
+// Waits for network events until the monotonic clock reaches until_ns,
+// then polls once. Under load the interfaces are polled right away; once
+// idle, the domain blocks until an event (netfront raises one when frames
+// arrive) or until_ns, whichever comes first.
+void lwip_poll_wait(uint64_t until_ns) {
+    if (lwip_poll.busy) {
+        lwip_poll.stats.busy_waits++;
+    } else {
+        uint64_t now = monotonic_clock();
+        if (until_ns > now) {
+            lwip_poll.stats.sleeps++;
+            #ifdef __MINIOS__
+            block_domain((s_time_t)until_ns);
+            #else
+            usleep((until_ns - now) / 1000);
+            #endif
+        }
+    }
+    if (lwip_ether_objs_count > 0) {
+        poll_sockets();
+    }
+}
+
+// Blocking calls wait here between checks of their condition
+STATIC void socket_wait(uint64_t deadline) {
+    uint64_t until = monotonic_clock() + MILLISECS(LWIP_POLL_SLEEP_MAX_MS);
+    if (deadline != 0 && deadline * 1000 < until) {
+        until = deadline * 1000;
+    }
+    lwip_poll_wait(until);
+}
+
+/*******************************************************************************/
+// Receive queue helpers
+
+#define RXQ_EMPTY(socket) ((socket)->rxq.count == 0)
+#define RXQ_HEAD(socket) (&(socket)->rxq.slot[(socket)->rxq.head])
+
+static inline lwip_rxq_slot_t *rxq_push(lwip_socket_obj_t *socket) {
+    if (socket->rxq.count >= socket->rxq.depth) {
+        socket->rxq.drops++;
+        return NULL;
+    }
+    lwip_rxq_slot_t *slot = &socket->rxq.slot[(socket->rxq.head + socket->rxq.count) % LWIP_SOCKET_RXQ_MAX];
+    socket->rxq.count++;
+    return slot;
+}
+
+static inline void rxq_advance(lwip_socket_obj_t *socket) {
+    RXQ_HEAD(socket)->pbuf = NULL;
+    socket->rxq.head = (socket->rxq.head + 1) % LWIP_SOCKET_RXQ_MAX;
+    socket->rxq.count--;
+}
+
+// Frees the pbuf at the head of the queue
+static inline void rxq_pop(lwip_socket_obj_t *socket) {
+    pbuf_free(RXQ_HEAD(socket)->pbuf);
+    rxq_advance(socket);
+}
+
+static inline void rxq_init(lwip_socket_obj_t *socket) {
+    socket->rxq.head = 0;
+    socket->rxq.count = 0;
+    socket->rxq.depth = LWIP_SOCKET_RXQ_DEFAULT;
+    socket->rxq.drops = 0;
+}
+
+static inline void rxq_flush(lwip_socket_obj_t *socket) {
+    while (!RXQ_EMPTY(socket)) {
+        rxq_pop(socket);
+    }
+}
+
+/*******************************************************************************/
+// Socket callbacks (SO_CALLBACK) run in batches: the lwIP callbacks below
+// only queue the socket, once however many events it gets meanwhile, and
+// poll_sockets() calls them when polling returned, outside the C-only
+// region and under a single nlr frame. The batch is a GC root, so a
+// callback dropping the last reference to another queued socket is fine.
+
+#define LWIP_CB_BATCH_MAX (64)
+
+typedef struct _lwip_cb_batch_t {
+    lwip_socket_obj_t *socket[LWIP_CB_BATCH_MAX];
+    mp_uint_t len;
+    bool running;
+    mp_uint_t calls;
+    mp_uint_t coalesced; // events merged into a queued call
+    mp_uint_t direct;    // called from lwIP since the batch was full
+} lwip_cb_batch_t;
+
+STATIC void lwip_cb_batch_init(void) {
+    if (MP_STATE_PORT(lwip_cb_batch) == NULL) {
+        MP_STATE_PORT(lwip_cb_batch) = m_new0(lwip_cb_batch_t, 1);
+    }
+}
+
+static inline void queue_user_callback(lwip_socket_obj_t *socket) {
+    lwip_cb_batch_t *b = MP_STATE_PORT(lwip_cb_batch);
+
+    if (socket->callback == MP_OBJ_NULL) {
+        return;
+    }
+    if (socket->flags & SOCKET_FLAG_CB_QUEUED) {
+        b->coalesced++;
+        return;
+    }
+    if (b->len < LWIP_CB_BATCH_MAX) {
+        socket->flags |= SOCKET_FLAG_CB_QUEUED;
+        b->socket[b->len++] = socket;
+        return;
+    }
+    // batch full: call it from here, as without batching
+    int sp_mark;
+    void *gc_cookie = gc_conly_python_enter(&sp_mark);
+    b->direct++;
+    mp_call_function_1_protected(socket->callback, socket);
+    gc_conly_python_leave(gc_cookie);
+}
+
+// Calls the queued callbacks, skipping sockets closed in the meantime.
+// Events raised while they run (e.g. by a callback that polls) are queued
+// behind them and handled by the same loop. Exceptions are printed, as
+// by mp_call_function_1_protected(), and the batch goes on.
+STATIC void lwip_cb_dispatch(void) {
+    lwip_cb_batch_t *b = MP_STATE_PORT(lwip_cb_batch);
+    volatile mp_uint_t i = 0;
+
+    if (b == NULL || b->len == 0 || b->running) {
+        return;
+    }
+    b->running = true;
+    while (i < b->len) {
+        nlr_buf_t nlr;
+        if (nlr_push(&nlr) == 0) {
+            for (; i < b->len; i++) {
+                lwip_socket_obj_t *socket = b->socket[i];
+                // a stale entry would keep the socket alive until the
+                // slot is reused
+                b->socket[i] = NULL;
+                socket->flags &= ~SOCKET_FLAG_CB_QUEUED;
+                if (socket->callback != MP_OBJ_NULL && socket->pcb.tcp != NULL) {
+                    b->calls++;
+                    mp_call_function_1(socket->callback, socket);
+                }
+            }
+            nlr_pop();
+        } else {
+            i++;
+            mp_obj_print_exception(&mp_plat_print, (mp_obj_t)nlr.ret_val);
+        }
+    }
+    b->len = 0;
+    b->running = false;
 }
 
 /*******************************************************************************/
 // Callback functions for the lwIP raw API.
 
-static inline void exec_user_callback(lwip_socket_obj_t *socket) {
-    if (socket->callback != MP_OBJ_NULL) {
-        mp_call_function_1_protected(socket->callback, socket);
+// Wakes uevent tasks waiting on the socket
+static inline void notify_waiters(lwip_socket_obj_t *socket) {
+    if (socket->io_slot >= 0) {
+        uevent_socket_notify(socket);
     }
 }
 
-// Callback for incoming UDP packets. We simply stash the packet and the source address,
+// Callback for incoming UDP packets. We simply queue the packet and the source address,
 // in case we need it for recvfrom.
 STATIC void _lwip_udp_incoming(void *arg, struct udp_pcb *upcb, struct pbuf *p, const ip_addr_t *addr, u16_t port) {
     lwip_socket_obj_t *socket = (lwip_socket_obj_t*)arg;
+    lwip_rxq_slot_t *slot = rxq_push(socket);
 
-    if (socket->incoming.pbuf != NULL) {
+    if (slot == NULL) {
         // That's why they call it "unreliable". No room in the inn, drop the packet.
         pbuf_free(p);
     } else {
-        socket->incoming.pbuf = p;
-        socket->peer_port = (mp_uint_t)port;
-        memcpy(&socket->peer, addr, sizeof(socket->peer));
+        slot->pbuf = p;
+        slot->peer_port = port;
+        memcpy(slot->peer, addr, sizeof(slot->peer));
+        socket->stats.rx_bytes += p->tot_len;
+        socket->stats.rx_packets++;
+        notify_waiters(socket);
+    }
+}
+
+#if SHFS_ENABLE
+// Releases acknowledged entries; everything if pcb is NULL (lwIP has
+// dropped all segments referencing them)
+void lwip_pinq_release(lwip_pinq_t *q, struct tcp_pcb *pcb) {
+    while (q->count != 0) {
+        if (pcb != NULL) {
+            if (q->open && q->count == 1) {
+                break;
+            }
+            if (TCP_SEQ_GT(q->e[q->head].end_seq, pcb->lastack)) {
+                break;
+            }
+        }
+        shfs_cache_release(q->e[q->head].cce);
+        q->head = (q->head + 1) % LWIP_SENDFILE_PIN_MAX;
+        q->count--;
+    }
+    if (pcb == NULL) {
+        q->open = 0;
+    }
+}
+
+#endif
+
+// Callback for acknowledged data: frees send buffer space and, while in
+// sendfile(), pinned cache buffers
+STATIC err_t _lwip_tcp_sent(void *arg, struct tcp_pcb *tpcb, u16_t len) {
+    lwip_socket_obj_t *socket = (lwip_socket_obj_t*)arg;
+    if (socket == NULL) {
+        return ERR_OK;
+    }
+
+    socket->stats.tx_bytes += len;
+    #if SHFS_ENABLE
+    if (socket->pinq != NULL) {
+        lwip_pinq_release(socket->pinq, tpcb);
     }
+    #endif
+    notify_waiters(socket);
+    return ERR_OK;
 }
 
 // Callback for general tcp errors.
 STATIC void _lwip_tcp_error(void *arg, err_t err) {
     lwip_socket_obj_t *socket = (lwip_socket_obj_t*)arg;
+    if (socket == NULL) {
+        return;
+    }
 
     // Pass the error code back via the connection variable.
     socket->state = err;
     // If we got here, the lwIP stack either has deallocated or will deallocate the pcb.
     socket->pcb.tcp = NULL;
+    #if SHFS_ENABLE
+    if (socket->pinq != NULL) {
+        lwip_pinq_release(socket->pinq, NULL);
+    }
+    #endif
+    notify_waiters(socket);
 }
 
 // Callback for tcp connection requests. Error code err is unused. (See tcp.h)
 STATIC err_t _lwip_tcp_connected(void *arg, struct tcp_pcb *tpcb, err_t err) {
     lwip_socket_obj_t *socket = (lwip_socket_obj_t*)arg;
+    if (socket == NULL) {
+        tcp_abort(tpcb);
+        return ERR_ABRT;
+    }
 
     socket->state = STATE_CONNECTED;
+    notify_waiters(socket);
     return ERR_OK;
 }
 
@@ -432,40 +839,68 @@ STATIC err_t _lwip_tcp_recv_unaccepted(void *arg, struct tcp_pcb *pcb, struct pb
     return ERR_BUF;
 }
 
+// Error callback of a connection waiting in the accept queue. Its
+// argument is the queue slot, which is cleared since lwIP frees the pcb.
+STATIC void _lwip_tcp_error_unaccepted(void *arg, err_t err) {
+    lwip_rxq_slot_t *slot = (lwip_rxq_slot_t*)arg;
+
+    slot->connection = NULL;
+}
+
 // Callback for incoming tcp connections.
 STATIC err_t _lwip_tcp_accept(void *arg, struct tcp_pcb *newpcb, err_t err) {
     lwip_socket_obj_t *socket = (lwip_socket_obj_t*)arg;
-    tcp_recv(newpcb, _lwip_tcp_recv_unaccepted);
+    if (socket == NULL) {
+        // lwIP aborts the connection
+        return ERR_MEM;
+    }
+    lwip_rxq_slot_t *slot = rxq_push(socket);
 
-    if (socket->incoming.connection != NULL) {
-        DEBUG_printf("_lwip_tcp_accept: Tried to queue >1 pcb waiting for accept\n");
-        // We need to handle this better. This single-level structure makes the
-        // backlog setting kind of pointless. FIXME
-        return ERR_BUF;
-    } else {
-        socket->incoming.connection = newpcb;
-        exec_user_callback(socket);
-        return ERR_OK;
+    if (slot == NULL) {
+        DEBUG_printf("_lwip_tcp_accept: accept queue full (%d)\n", socket->rxq.depth);
+        // lwIP aborts the connection
+        return ERR_MEM;
     }
+    slot->connection = newpcb;
+    tcp_arg(newpcb, slot);
+    tcp_recv(newpcb, _lwip_tcp_recv_unaccepted);
+    tcp_err(newpcb, _lwip_tcp_error_unaccepted);
+    queue_user_callback(socket);
+    notify_waiters(socket);
+    return ERR_OK;
 }
 
 // Callback for inbound tcp packets.
 STATIC err_t _lwip_tcp_recv(void *arg, struct tcp_pcb *tcpb, struct pbuf *p, err_t err) {
     lwip_socket_obj_t *socket = (lwip_socket_obj_t*)arg;
+    if (socket == NULL) {
+        // the socket is closed: nobody reads this any more
+        if (p != NULL) {
+            tcp_recved(tcpb, p->tot_len);
+            pbuf_free(p);
+        }
+        return ERR_OK;
+    }
 
     if (p == NULL) {
         // Other side has closed connection.
         DEBUG_printf("_lwip_tcp_recv[%p]: other side closed connection\n", socket);
         socket->state = STATE_PEER_CLOSED;
-        exec_user_callback(socket);
+        queue_user_callback(socket);
+        notify_waiters(socket);
         return ERR_OK;
-    } else if (socket->incoming.pbuf != NULL) {
+    }
+    lwip_rxq_slot_t *slot = rxq_push(socket);
+    if (slot == NULL) {
         // No room in the inn, let LWIP know it's still responsible for delivery later
         return ERR_BUF;
     }
-    socket->incoming.pbuf = p;
+    slot->pbuf = p;
+    socket->stats.rx_bytes += p->tot_len;
+    socket->stats.rx_packets++;
 
-    exec_user_callback(socket);
+    queue_user_callback(socket);
+    notify_waiters(socket);
 
     return ERR_OK;
 }
@@ -474,6 +909,11 @@ STATIC err_t _lwip_tcp_recv(void *arg, struct tcp_pcb *tcpb, struct pbuf *p, err
 // Functions for socket send/recieve operations. Socket send/recv and friends call
 // these to do the work.
 
+// Payloads from this size on are sent by reference (PBUF_REF)
+#ifndef LWIP_UDP_REF_THRESHOLD
+#define LWIP_UDP_REF_THRESHOLD (512)
+#endif
+
 // Helper function for send/sendto to handle UDP packets.
 STATIC mp_uint_t lwip_udp_send(lwip_socket_obj_t *socket, const byte *buf, mp_uint_t len, byte *ip, mp_uint_t port, int *_errno) {
     if (len > 0xffff) {
@@ -481,15 +921,26 @@ STATIC mp_uint_t lwip_udp_send(lwip_socket_obj_t *socket, const byte *buf, mp_ui
         len = 0xffff;
     }
 
-    // FIXME: maybe PBUF_ROM?
-    struct pbuf *p = pbuf_alloc(PBUF_TRANSPORT, len, PBUF_RAM);
+    // Larger payloads are referenced rather than copied: lwIP prepends the
+    // headers in a separate pbuf, and the frame is copied out by netfront
+    // before udp_sendto() returns.
+    struct pbuf *p;
+    if (len >= LWIP_UDP_REF_THRESHOLD) {
+        p = pbuf_alloc(PBUF_TRANSPORT, len, PBUF_REF);
+        if (p != NULL) {
+            p->payload = (void*)buf;
+        }
+    } else {
+        p = pbuf_alloc(PBUF_TRANSPORT, len, PBUF_RAM);
+        if (p != NULL) {
+            memcpy(p->payload, buf, len);
+        }
+    }
     if (p == NULL) {
         *_errno = ENOMEM;
         return -1;
     }
 
-    memcpy(p->payload, buf, len);
-
     err_t err;
     if (ip == NULL) {
         err = udp_send(socket->pcb.udp, p);
@@ -509,39 +960,46 @@ STATIC mp_uint_t lwip_udp_send(lwip_socket_obj_t *socket, const byte *buf, mp_ui
         return -1;
     }
 
+    socket->stats.tx_bytes += len;
+    socket->stats.tx_packets++;
     return len;
 }
 
-// Helper function for recv/recvfrom to handle UDP packets
-STATIC mp_uint_t lwip_udp_receive(lwip_socket_obj_t *socket, byte *buf, mp_uint_t len, byte *ip, mp_uint_t *port, int *_errno) {
+// Helper function for UDP receive paths: waits until a datagram is queued.
+// Returns 1 if there is one and -1 on timeout.
+STATIC mp_uint_t lwip_udp_wait_data(lwip_socket_obj_t *socket, int *_errno) {
+    uint64_t deadline = socket_deadline(socket);
 
-    if (socket->incoming.pbuf == NULL) {
-        if (socket->timeout != -1) {
-            for (mp_uint_t retries = socket->timeout / 100; retries--;) {
-                mp_hal_delay_ms(100);
-                if (socket->incoming.pbuf != NULL) break;
-            }
-            if (socket->incoming.pbuf == NULL) {
-                *_errno = ETIMEDOUT;
-                return -1;
-            }
-        } else {
-            while (socket->incoming.pbuf == NULL) {
-                poll_sockets();
-            }
+    while (RXQ_EMPTY(socket)) {
+        if (socket->timeout == 0) {
+            *_errno = EAGAIN;
+            return -1;
         }
+        socket_wait(deadline);
+        if (RXQ_EMPTY(socket) && deadline_passed(deadline)) {
+            *_errno = ETIMEDOUT;
+            return -1;
+        }
+    }
+    return 1;
+}
+
+// Helper function for recv/recvfrom to handle UDP packets
+STATIC mp_uint_t lwip_udp_receive(lwip_socket_obj_t *socket, byte *buf, mp_uint_t len, byte *ip, mp_uint_t *port, int *_errno) {
+    if (lwip_udp_wait_data(socket, _errno) != 1) {
+        return -1;
     }
 
+    lwip_rxq_slot_t *slot = RXQ_HEAD(socket);
     if (ip != NULL) {
-        memcpy(ip, &socket->peer, sizeof(socket->peer));
-        *port = socket->peer_port;
+        memcpy(ip, slot->peer, sizeof(slot->peer));
+        *port = slot->peer_port;
     }
 
-    struct pbuf *p = socket->incoming.pbuf;
+    struct pbuf *p = slot->pbuf;
 
     u16_t result = pbuf_copy_partial(p, buf, ((p->tot_len > len) ? len : p->tot_len), 0);
-    pbuf_free(p);
-    socket->incoming.pbuf = NULL;
+    rxq_pop(socket);
 
     return (mp_uint_t) result;
 }
@@ -555,33 +1013,107 @@ STATIC mp_uint_t lwip_udp_receive(lwip_socket_obj_t *socket, byte *buf, mp_uint_
         assert(socket->pcb.tcp);
 
 
+// Smallest SO_SNDBUF/SO_RCVBUF accepted; lower values are rounded up
+#ifndef LWIP_SOCKET_BUF_MIN
+#define LWIP_SOCKET_BUF_MIN (TCP_MSS)
+#endif
+
+// Space left in the send buffer, within the SO_SNDBUF limit
+STATIC u16_t lwip_tcp_sndbuf(lwip_socket_obj_t *socket) {
+    mp_uint_t available = tcp_sndbuf(socket->pcb.tcp);
+    if (socket->sndbuf != 0) {
+        mp_uint_t queued = TCP_SND_BUF - available;
+        available = (queued >= socket->sndbuf) ? 0 : MIN(available, socket->sndbuf - queued);
+    }
+    return available;
+}
+
+// Hands data queued by tcp_write() to lwIP for transmission. A corked
+// socket only pushes once a full segment is pending, or when forced.
+STATIC void lwip_tcp_push(lwip_socket_obj_t *socket, bool force) {
+    struct tcp_pcb *pcb = socket->pcb.tcp;
+    if (pcb == NULL || socket->state < STATE_CONNECTED) {
+        return;
+    }
+    if (!force && (socket->flags & SOCKET_FLAG_CORK) && socket->unpushed < tcp_mss(pcb)) {
+        return;
+    }
+    socket->unpushed = 0;
+    tcp_output(pcb);
+}
+
+// Opens the receive window by n bytes consumed by the application, less
+// what a reduced SO_RCVBUF still has to withhold
+STATIC void lwip_tcp_recved(lwip_socket_obj_t *socket, mp_uint_t n) {
+    mp_uint_t withheld = MIN(socket->rcv_withheld, n);
+    socket->rcv_withheld -= withheld;
+    n -= withheld;
+    if (n != 0) {
+        tcp_recved(socket->pcb.tcp, n);
+    }
+}
+
+// Resizes the receive window to size bytes (0: lwIP default). Listening
+// pcbs have no window; connections accepted from them apply the limit.
+STATIC void lwip_tcp_set_rcvbuf(lwip_socket_obj_t *socket, mp_uint_t size) {
+    struct tcp_pcb *pcb = socket->pcb.tcp;
+    mp_uint_t cur = socket->rcvbuf ? socket->rcvbuf : TCP_WND;
+    mp_uint_t new = size ? size : TCP_WND;
+    socket->rcvbuf = size;
+    if (pcb == NULL || pcb->state == LISTEN) {
+        return;
+    }
+    if (new > cur) {
+        mp_uint_t grow = new - cur;
+        mp_uint_t withheld = MIN(socket->rcv_withheld, grow);
+        socket->rcv_withheld -= withheld;
+        if (grow > withheld) {
+            tcp_recved(pcb, grow - withheld);
+        }
+    } else if (new < cur) {
+        // the window can only close as far as it is open; the rest is
+        // taken off data consumed later
+        mp_uint_t shrink = cur - new;
+        mp_uint_t now = MIN(shrink, pcb->rcv_wnd);
+        pcb->rcv_wnd -= now;
+        if (pcb->state == CLOSED) {
+            // nothing announced yet, the SYN carries the smaller window
+            pcb->rcv_ann_wnd = pcb->rcv_wnd;
+        }
+        socket->rcv_withheld += shrink - now;
+    }
+}
+
 // Helper function for send/sendto to handle TCP packets
 STATIC mp_uint_t lwip_tcp_send(lwip_socket_obj_t *socket, const byte *buf, mp_uint_t len, int *_errno) {
     // Check for any pending errors
     STREAM_ERROR_CHECK(socket);
 
-    u16_t available = tcp_sndbuf(socket->pcb.tcp);
+    u16_t available = lwip_tcp_sndbuf(socket);
 
     if (available == 0) {
+        // corked data has to go out before the buffer can drain
+        lwip_tcp_push(socket, true);
+
         // Non-blocking socket
         if (socket->timeout == 0) {
             *_errno = EAGAIN;
             return MP_STREAM_ERROR;
         }
 
-        mp_uint_t start = mp_hal_ticks_ms();
+        uint64_t deadline = socket_deadline(socket);
         // Assume that STATE_PEER_CLOSED may mean half-closed connection, where peer closed it
         // sending direction, but not receiving. Consequently, check for both STATE_CONNECTED
         // and STATE_PEER_CLOSED as normal conditions and still waiting for buffers to be sent.
         // If peer fully closed socket, we would have socket->state set to ERR_RST (connection
         // reset) by error callback.
         // Avoid sending too small packets, so wait until at least 16 bytes available
-        while (socket->state >= STATE_CONNECTED && (available = tcp_sndbuf(socket->pcb.tcp)) < 16) {
-            if (socket->timeout != -1 && mp_hal_ticks_ms() - start > socket->timeout) {
+        while (socket->state >= STATE_CONNECTED && (available = lwip_tcp_sndbuf(socket)) < 16) {
+            if (deadline_passed(deadline)) {
                 *_errno = ETIMEDOUT;
                 return MP_STREAM_ERROR;
             }
-            poll_sockets();
+            socket_wait(deadline);
         }
 
         // While we waited, something could happen
@@ -590,22 +1122,29 @@ STATIC mp_uint_t lwip_tcp_send(lwip_socket_obj_t *socket, const byte *buf, mp_ui
 
     u16_t write_len = MIN(available, len);
 
-    err_t err = tcp_write(socket->pcb.tcp, buf, write_len, TCP_WRITE_FLAG_COPY);
+    u8_t flags = TCP_WRITE_FLAG_COPY;
+    if (socket->flags & SOCKET_FLAG_CORK) {
+        flags |= TCP_WRITE_FLAG_MORE;
+    }
+    err_t err = tcp_write(socket->pcb.tcp, buf, write_len, flags);
 
     if (err != ERR_OK) {
         *_errno = error_lookup_table[-err];
         return MP_STREAM_ERROR;
     }
 
+    socket->unpushed += write_len;
+    lwip_tcp_push(socket, false);
     return write_len;
 }
 
-// Helper function for recv/recvfrom to handle TCP packets
-STATIC mp_uint_t lwip_tcp_receive(lwip_socket_obj_t *socket, byte *buf, mp_uint_t len, int *_errno) {
+// Helper function for TCP receive paths: waits until data is queued. Returns 1 if
+// there is data, 0 on end of stream and -1 on error.
+STATIC mp_uint_t lwip_tcp_wait_data(lwip_socket_obj_t *socket, int *_errno) {
     // Check for any pending errors
     STREAM_ERROR_CHECK(socket);
 
-    if (socket->incoming.pbuf == NULL) {
+    if (RXQ_EMPTY(socket)) {
 
         // Non-blocking socket
         if (socket->timeout == 0) {
@@ -616,17 +1155,17 @@ STATIC mp_uint_t lwip_tcp_receive(lwip_socket_obj_t *socket, byte *buf, mp_uint_
             return -1;
         }
 
-        mp_uint_t start = mp_hal_ticks_ms();
-        while (socket->state == STATE_CONNECTED && socket->incoming.pbuf == NULL) {
-            if (socket->timeout != -1 && mp_hal_ticks_ms() - start > socket->timeout) {
+        uint64_t deadline = socket_deadline(socket);
+        while (socket->state == STATE_CONNECTED && RXQ_EMPTY(socket)) {
+            if (deadline_passed(deadline)) {
                 *_errno = ETIMEDOUT;
                 return -1;
             }
-            poll_sockets();
+            socket_wait(deadline);
         }
 
         if (socket->state == STATE_PEER_CLOSED) {
-            if (socket->incoming.pbuf == NULL) {
+            if (RXQ_EMPTY(socket)) {
                 // socket closed and no data left in buffer
                 return 0;
             }
@@ -638,8 +1177,17 @@ STATIC mp_uint_t lwip_tcp_receive(lwip_socket_obj_t *socket, byte *buf, mp_uint_
     }
 
     assert(socket->pcb.tcp != NULL);
+    return 1;
+}
+
+// Helper function for recv/recvfrom to handle TCP packets
+STATIC mp_uint_t lwip_tcp_receive(lwip_socket_obj_t *socket, byte *buf, mp_uint_t len, int *_errno) {
+    mp_uint_t ret = lwip_tcp_wait_data(socket, _errno);
+    if (ret != 1) {
+        return ret;
+    }
 
-    struct pbuf *p = socket->incoming.pbuf;
+    struct pbuf *p = RXQ_HEAD(socket)->pbuf;
 
     if (socket->leftover_count == 0) {
         socket->leftover_count = p->tot_len;
@@ -650,113 +1198,787 @@ STATIC mp_uint_t lwip_tcp_receive(lwip_socket_obj_t *socket, byte *buf, mp_uint_
         // More left over...
         socket->leftover_count -= len;
     } else {
-        pbuf_free(p);
-        socket->incoming.pbuf = NULL;
+        rxq_pop(socket);
         socket->leftover_count = 0;
     }
 
-    tcp_recved(socket->pcb.tcp, result);
+    lwip_tcp_recved(socket, result);
     return (mp_uint_t) result;
 }
 
 /*******************************************************************************/
-// The socket functions provided by lwip.socket.
+// Read-only views on received pbufs, returned by socket.recv_view(). A view
+// holds a reference on its pbuf until it is released or collected.
 
-STATIC const mp_obj_type_t lwip_socket_type;
+typedef struct _lwip_pbufview_obj_t {
+    mp_obj_base_t base;
+    struct pbuf *pbuf;
+    const byte *data;
+    mp_uint_t len;
+} lwip_pbufview_obj_t;
+
+STATIC const mp_obj_type_t lwip_pbufview_type;
+
+// Takes over the reference on p
+STATIC mp_obj_t lwip_pbufview_new(struct pbuf *p, const byte *data, mp_uint_t len) {
+    lwip_pbufview_obj_t *view = m_new_obj_with_finaliser(lwip_pbufview_obj_t);
+    view->base.type = &lwip_pbufview_type;
+    view->pbuf = p;
+    view->data = data;
+    view->len = len;
+    return view;
+}
 
-void lwip_socket_print(const mp_print_t *print, mp_obj_t self_in, mp_print_kind_t kind) {
-    lwip_socket_obj_t *self = self_in;
-    mp_printf(print, "<socket state=%d timeout=%d incoming=%p remaining=%d>", self->state, self->timeout,
-        self->incoming.pbuf, self->leftover_count);
+STATIC void lwip_pbufview_print(const mp_print_t *print, mp_obj_t self_in, mp_print_kind_t kind) {
+    lwip_pbufview_obj_t *self = self_in;
+    mp_printf(print, "<pbufview len=%u%s>", (unsigned int)self->len, self->pbuf ? "" : " released");
 }
 
-// FIXME: Only supports two arguments at present
-mp_obj_t lwip_socket_make_new(const mp_obj_type_t *type, mp_uint_t n_args,
-    mp_uint_t n_kw, const mp_obj_t *args) {
-    mp_arg_check_num(n_args, n_kw, 0, 4, false);
+STATIC mp_obj_t lwip_pbufview_unary_op(mp_uint_t op, mp_obj_t self_in) {
+    lwip_pbufview_obj_t *self = self_in;
+    switch (op) {
+        case MP_UNARY_OP_BOOL: return mp_obj_new_bool(self->len != 0);
+        case MP_UNARY_OP_LEN: return MP_OBJ_NEW_SMALL_INT(self->len);
+        default: return MP_OBJ_NULL; // op not supported
+    }
+}
 
-    if (!LWIP_INIT) {
-      lwip_init();
-      LWIP_INIT = true;      
+STATIC mp_int_t lwip_pbufview_get_buffer(mp_obj_t self_in, mp_buffer_info_t *bufinfo, mp_uint_t flags) {
+    lwip_pbufview_obj_t *self = self_in;
+    if (flags & MP_BUFFER_WRITE) {
+        return 1;
     }
-    
-    lwip_socket_obj_t *socket = m_new_obj_with_finaliser(lwip_socket_obj_t);
-    socket->base.type = (mp_obj_t)&lwip_socket_type;
-    socket->domain = MOD_NETWORK_AF_INET;
-    socket->type = MOD_NETWORK_SOCK_STREAM;
-    socket->callback = MP_OBJ_NULL;
-    if (n_args >= 1) {
-        socket->domain = mp_obj_get_int(args[0]);
-        if (n_args >= 2) {
-            socket->type = mp_obj_get_int(args[1]);
-        }
+    bufinfo->buf = (void*)self->data;
+    bufinfo->len = self->len;
+    bufinfo->typecode = 'B';
+    return 0;
+}
+
+STATIC mp_obj_t lwip_pbufview_release(mp_obj_t self_in) {
+    lwip_pbufview_obj_t *self = self_in;
+    if (self->pbuf != NULL) {
+        pbuf_free(self->pbuf);
+        self->pbuf = NULL;
+        self->data = NULL;
+        self->len = 0;
     }
+    return mp_const_none;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_1(lwip_pbufview_release_obj, lwip_pbufview_release);
 
-    switch (socket->type) {
-        case MOD_NETWORK_SOCK_STREAM: socket->pcb.tcp = tcp_new(); break;
-        case MOD_NETWORK_SOCK_DGRAM: socket->pcb.udp = udp_new(); break;
-        //case MOD_NETWORK_SOCK_RAW: socket->pcb.raw = raw_new(); break;
-        default: nlr_raise(mp_obj_new_exception_arg1(&mp_type_OSError, MP_OBJ_NEW_SMALL_INT(EINVAL)));
+STATIC const mp_map_elem_t lwip_pbufview_locals_dict_table[] = {
+    { MP_OBJ_NEW_QSTR(MP_QSTR___del__), (mp_obj_t)&lwip_pbufview_release_obj },
+    { MP_OBJ_NEW_QSTR(MP_QSTR_release), (mp_obj_t)&lwip_pbufview_release_obj },
+};
+STATIC MP_DEFINE_CONST_DICT(lwip_pbufview_locals_dict, lwip_pbufview_locals_dict_table);
+
+STATIC const mp_obj_type_t lwip_pbufview_type = {
+    { &mp_type_type },
+    .name = MP_QSTR_pbufview,
+    .print = lwip_pbufview_print,
+    .unary_op = lwip_pbufview_unary_op,
+    .buffer_p = { .get_buffer = lwip_pbufview_get_buffer },
+    .locals_dict = (mp_obj_t)&lwip_pbufview_locals_dict,
+};
+
+// Returns a view on the next contiguous part of the head TCP segment (at
+// most len bytes), which is consumed from the socket.
+STATIC mp_obj_t lwip_tcp_receive_view(lwip_socket_obj_t *socket, mp_uint_t len, int *_errno) {
+    mp_uint_t ret = lwip_tcp_wait_data(socket, _errno);
+    if (ret != 1) {
+        return ret == 0 ? mp_const_empty_bytes : MP_OBJ_NULL;
     }
-    if (socket->pcb.tcp == NULL) {
-        nlr_raise(mp_obj_new_exception_arg1(&mp_type_OSError, MP_OBJ_NEW_SMALL_INT(ENOMEM)));
+
+    struct pbuf *p = RXQ_HEAD(socket)->pbuf;
+    if (socket->leftover_count == 0) {
+        socket->leftover_count = p->tot_len;
     }
-    
-    switch (socket->type) {
-        case MOD_NETWORK_SOCK_STREAM: {
-            // Register the socket object as our callback argument.
-            tcp_arg(socket->pcb.tcp, (void*)socket);
-            // Register our error callback.
-            tcp_err(socket->pcb.tcp, _lwip_tcp_error);
-            break;
-        }
-        case MOD_NETWORK_SOCK_DGRAM: {
-            // Register our receive callback now. Since UDP sockets don't require binding or connection
-            // before use, there's no other good time to do it.
-            udp_recv(socket->pcb.udp, _lwip_udp_incoming, (void*)socket);
-            break;
-        }
+
+    // find the pbuf of the chain holding the first unread byte
+    struct pbuf *q = p;
+    mp_uint_t off = p->tot_len - socket->leftover_count;
+    while (off >= q->len) {
+        off -= q->len;
+        q = q->next;
     }
-    socket->incoming.pbuf = NULL;
-    socket->timeout = -1;
-    socket->state = STATE_NEW;
-    socket->leftover_count = 0;
-    return socket;
-}
+    mp_uint_t n = MIN(q->len - off, len);
 
-mp_obj_t lwip_socket_close(mp_obj_t self_in) {
-    lwip_socket_obj_t *socket = self_in;
-    bool socket_is_listener = false;
+    // the view keeps q, and with it the rest of the chain, alive
+    pbuf_ref(q);
+    socket->leftover_count -= n;
+    if (socket->leftover_count == 0) {
+        rxq_pop(socket);
+    }
+    lwip_tcp_recved(socket, n);
+    return lwip_pbufview_new(q, (const byte*)q->payload + off, n);
+}
 
-    if (socket->pcb.tcp == NULL) {
-        return mp_const_none;
+// Returns a view on the next datagram; datagrams split over several
+// pbufs are copied into a single one first.
+STATIC mp_obj_t lwip_udp_receive_view(lwip_socket_obj_t *socket, int *_errno) {
+    if (lwip_udp_wait_data(socket, _errno) != 1) {
+        return MP_OBJ_NULL;
     }
 
-    switch (socket->type) {
-        case MOD_NETWORK_SOCK_STREAM: {
-            if (socket->pcb.tcp->state == LISTEN) {
-                socket_is_listener = true;
-            }
-            if (tcp_close(socket->pcb.tcp) != ERR_OK) {
-                DEBUG_printf("lwip_close: had to call tcp_abort()\n");
-                tcp_abort(socket->pcb.tcp);
-            }
-            break;
+    struct pbuf *p = RXQ_HEAD(socket)->pbuf;
+    if (p->len != p->tot_len) {
+        struct pbuf *flat = pbuf_alloc(PBUF_RAW, p->tot_len, PBUF_RAM);
+        if (flat == NULL) {
+            *_errno = ENOMEM;
+            return MP_OBJ_NULL;
         }
-        case MOD_NETWORK_SOCK_DGRAM: udp_remove(socket->pcb.udp); break;
-        //case MOD_NETWORK_SOCK_RAW: raw_remove(socket->pcb.raw); break;
+        pbuf_copy(flat, p);
+        rxq_pop(socket);
+        p = flat;
+    } else {
+        pbuf_ref(p);
+        rxq_pop(socket);
     }
-    
-    socket->pcb.tcp = NULL;
-    socket->state = _ERR_BADF;
-    if (socket->incoming.pbuf != NULL) {
-        if (!socket_is_listener) {
-            pbuf_free(socket->incoming.pbuf);
+    return lwip_pbufview_new(p, p->payload, p->len);
+}
+
+/*******************************************************************************/
+// WebSocket framing (RFC 6455) directly on the receive queue and tcp_write(),
+// for socket.ws_recv_frames() and socket.ws_send(). A frame that lies in a
+// single received pbuf is unmasked in place and returned as a pbufview;
+// others are reassembled into a bytes object, across as many calls as it
+// takes for them to arrive.
+
+#define LWIP_WS_FIN (0x80)
+#define LWIP_WS_MASK (0x80)
+#define LWIP_WS_OP_TEXT (0x1)
+#define LWIP_WS_OP_BINARY (0x2)
+#define LWIP_WS_OP_CLOSE (0x8)
+#define LWIP_WS_OP_PING (0x9)
+#define LWIP_WS_OP_PONG (0xa)
+
+// Largest payload accepted; longer frames fail with EMSGSIZE and their
+// payload is discarded as it arrives
+#ifndef LWIP_WS_FRAME_MAX
+#define LWIP_WS_FRAME_MAX (1024 * 1024)
+#endif
+// Frames returned by one ws_recv_frames() call if no limit is given
+#ifndef LWIP_WS_BATCH_DEFAULT
+#define LWIP_WS_BATCH_DEFAULT (32)
+#endif
+
+// Frame being reassembled
+typedef struct _lwip_ws_rx_t {
+    byte hdr[14];
+    uint8_t hlen;       // header bytes received
+    bool in_payload;    // header complete, payload allocated
+    mp_uint_t got;      // payload bytes received
+    uint64_t skip;      // payload bytes of a refused frame still to drop
+    vstr_t payload;
+} lwip_ws_rx_t;
+
+// XORs len bytes at buf with the masking key, starting at key byte phase;
+// word by word once buf is aligned, as the key repeats every 4 bytes
+STATIC void lwip_ws_unmask(byte *buf, mp_uint_t len, const byte *key, mp_uint_t phase) {
+    for (; len > 0 && ((uintptr_t)buf & (sizeof(mp_uint_t) - 1)); len--) {
+        *buf++ ^= key[phase++ & 3];
+    }
+    if (len >= sizeof(mp_uint_t)) {
+        mp_uint_t k;
+        for (mp_uint_t i = 0; i < sizeof(k); i++) {
+            ((byte*)&k)[i] = key[(phase + i) & 3];
+        }
+        mp_uint_t *w = (mp_uint_t*)buf;
+        for (; len >= sizeof(k); len -= sizeof(k)) {
+            *w++ ^= k;
+        }
+        buf = (byte*)w;
+    }
+    for (; len > 0; len--) {
+        *buf++ ^= key[phase++ & 3];
+    }
+}
+
+// Size of the header starting with h[0], h[1]
+static inline mp_uint_t lwip_ws_hdr_len(const byte *h) {
+    mp_uint_t n = 2 + ((h[1] & LWIP_WS_MASK) ? 4 : 0);
+    switch (h[1] & 0x7f) {
+        case 126: return n + 2;
+        case 127: return n + 8;
+        default: return n;
+    }
+}
+
+// Payload length of a complete header, (uint64_t)-1 if it is not valid
+STATIC uint64_t lwip_ws_payload_len(const byte *h) {
+    uint64_t len = h[1] & 0x7f;
+    if (len == 126) {
+        len = (h[2] << 8) | h[3];
+    } else if (len == 127) {
+        len = 0;
+        for (int i = 2; i < 10; i++) {
+            len = (len << 8) | h[i];
+        }
+        if (len >> 63) {
+            return (uint64_t)-1;
+        }
+    }
+    return len;
+}
+
+STATIC mp_obj_t lwip_ws_frame_new(byte b0, mp_obj_t payload) {
+    mp_obj_t t[3] = {
+        MP_OBJ_NEW_SMALL_INT(b0 & 0x0f),
+        mp_obj_new_bool(b0 & LWIP_WS_FIN),
+        payload,
+    };
+    return mp_obj_new_tuple(3, t);
+}
+
+// Consumes up to len queued bytes into buf without waiting, returns how
+// many or -1 on error
+STATIC mp_uint_t lwip_ws_take(lwip_socket_obj_t *socket, byte *buf, mp_uint_t len, int *_errno) {
+    mp_uint_t got = 0;
+    while (got < len && !RXQ_EMPTY(socket)) {
+        mp_uint_t n = lwip_tcp_receive(socket, buf + got, len - got, _errno);
+        if (n == (mp_uint_t)-1) {
+            return n;
+        }
+        got += n;
+    }
+    return got;
+}
+
+// Drops up to len queued bytes without waiting, returns how many
+STATIC mp_uint_t lwip_ws_drop(lwip_socket_obj_t *socket, uint64_t len) {
+    mp_uint_t got = 0;
+    while (got < len && !RXQ_EMPTY(socket)) {
+        if (socket->leftover_count == 0) {
+            socket->leftover_count = RXQ_HEAD(socket)->pbuf->tot_len;
+        }
+        mp_uint_t n = MIN(len - got, socket->leftover_count);
+        socket->leftover_count -= n;
+        if (socket->leftover_count == 0) {
+            rxq_pop(socket);
+        }
+        got += n;
+    }
+    lwip_tcp_recved(socket, got);
+    return got;
+}
+
+// Returns the next frame as (opcode, fin, payload), MP_OBJ_NULL if it is
+// not complete yet (*_errno 0) or on error
+STATIC mp_obj_t lwip_ws_recv_frame(lwip_socket_obj_t *socket, int *_errno) {
+    *_errno = 0;
+    if (socket->ws_rx != NULL && socket->ws_rx->skip > 0) {
+        // the next header follows the payload of a refused frame
+        socket->ws_rx->skip -= lwip_ws_drop(socket, socket->ws_rx->skip);
+        if (socket->ws_rx->skip > 0) {
+            return MP_OBJ_NULL;
+        }
+    }
+    if (RXQ_EMPTY(socket)) {
+        return MP_OBJ_NULL;
+    }
+
+    if (socket->ws_rx == NULL || socket->ws_rx->hlen == 0) {
+        // fast path: header and payload in the pbuf holding the next byte
+        struct pbuf *p = RXQ_HEAD(socket)->pbuf;
+        if (socket->leftover_count == 0) {
+            socket->leftover_count = p->tot_len;
+        }
+        struct pbuf *q = p;
+        mp_uint_t off = p->tot_len - socket->leftover_count;
+        while (off >= q->len) {
+            off -= q->len;
+            q = q->next;
+        }
+        byte *h = (byte*)q->payload + off;
+        mp_uint_t avail = q->len - off;
+        mp_uint_t hlen;
+        uint64_t plen;
+        if (avail >= 2 && avail >= (hlen = lwip_ws_hdr_len(h))
+            && (plen = lwip_ws_payload_len(h)) <= avail - hlen) {
+            byte *data = h + hlen;
+            if (h[1] & LWIP_WS_MASK) {
+                lwip_ws_unmask(data, plen, data - 4, 0);
+            }
+            byte b0 = h[0];
+            pbuf_ref(q);
+            socket->leftover_count -= hlen + plen;
+            if (socket->leftover_count == 0) {
+                rxq_pop(socket);
+            }
+            lwip_tcp_recved(socket, hlen + plen);
+            return lwip_ws_frame_new(b0, lwip_pbufview_new(q, data, plen));
+        }
+    }
+
+    // the frame spans pbufs: reassemble it
+    if (socket->ws_rx == NULL) {
+        socket->ws_rx = m_new0(lwip_ws_rx_t, 1);
+    }
+    lwip_ws_rx_t *rx = socket->ws_rx;
+    while (!rx->in_payload) {
+        mp_uint_t need = rx->hlen < 2 ? 2 : lwip_ws_hdr_len(rx->hdr);
+        if (rx->hlen == need) {
+            uint64_t plen = lwip_ws_payload_len(rx->hdr);
+            if (plen > LWIP_WS_FRAME_MAX) {
+                rx->hlen = 0;
+                rx->skip = plen;
+                *_errno = EMSGSIZE;
+                return MP_OBJ_NULL;
+            }
+            vstr_init_len(&rx->payload, plen);
+            rx->got = 0;
+            rx->in_payload = true;
+            break;
+        }
+        mp_uint_t n = lwip_ws_take(socket, rx->hdr + rx->hlen, need - rx->hlen, _errno);
+        if (n == (mp_uint_t)-1) {
+            return MP_OBJ_NULL;
+        }
+        rx->hlen += n;
+        if (rx->hlen < need) {
+            return MP_OBJ_NULL;
+        }
+    }
+
+    mp_uint_t n = lwip_ws_take(socket, (byte*)rx->payload.buf + rx->got, rx->payload.len - rx->got, _errno);
+    if (n == (mp_uint_t)-1) {
+        return MP_OBJ_NULL;
+    }
+    rx->got += n;
+    if (rx->got < rx->payload.len) {
+        return MP_OBJ_NULL;
+    }
+    if (rx->hdr[1] & LWIP_WS_MASK) {
+        mp_uint_t hlen = lwip_ws_hdr_len(rx->hdr);
+        lwip_ws_unmask((byte*)rx->payload.buf, rx->payload.len, rx->hdr + hlen - 4, 0);
+    }
+    rx->hlen = 0;
+    rx->in_payload = false;
+    return lwip_ws_frame_new(rx->hdr[0], mp_obj_new_str_from_vstr(&mp_type_bytes, &rx->payload));
+}
+
+// Writes all of buf to the send buffer, waiting for room as send() does
+STATIC mp_uint_t lwip_ws_write(lwip_socket_obj_t *socket, const byte *buf, mp_uint_t len, int *_errno) {
+    while (len > 0) {
+        mp_uint_t n = lwip_tcp_send(socket, buf, len, _errno);
+        if (n == (mp_uint_t)-1) {
+            return n;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Masking keys for frames sent by clients; they need not be strong, only
+// unpredictable to intermediaries
+STATIC uint32_t lwip_ws_key_state;
+
+STATIC uint32_t lwip_ws_key(void) {
+    uint32_t x = lwip_ws_key_state;
+    if (x == 0) {
+        x = (uint32_t)lwip_now_us() | 1;
+    }
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    lwip_ws_key_state = x;
+    return x;
+}
+
+// Queues one frame. Its header goes with tcp_write() right in front of
+// the payload, into the same segment; masked payloads are copied through
+// a small buffer, anything else goes straight from the caller's buffer.
+STATIC mp_uint_t lwip_ws_send_frame(lwip_socket_obj_t *socket, byte b0, const byte *buf, mp_uint_t len, bool mask, int *_errno) {
+    byte hdr[14];
+    mp_uint_t hlen = 2;
+    hdr[0] = b0;
+    if (len < 126) {
+        hdr[1] = len;
+    } else if (len < 0x10000) {
+        hdr[1] = 126;
+        hdr[2] = len >> 8;
+        hdr[3] = len;
+        hlen = 4;
+    } else {
+        hdr[1] = 127;
+        for (int i = 0; i < 8; i++) {
+            hdr[9 - i] = (uint64_t)len >> (8 * i);
+        }
+        hlen = 10;
+    }
+    if (!mask) {
+        if (lwip_ws_write(socket, hdr, hlen, _errno) != 0) {
+            return -1;
+        }
+        return lwip_ws_write(socket, buf, len, _errno);
+    }
+
+    hdr[1] |= LWIP_WS_MASK;
+    uint32_t k = lwip_ws_key();
+    memcpy(hdr + hlen, &k, 4);
+    const byte *key = hdr + hlen;
+    hlen += 4;
+    if (lwip_ws_write(socket, hdr, hlen, _errno) != 0) {
+        return -1;
+    }
+    byte chunk[256] __attribute__((aligned(sizeof(mp_uint_t))));
+    for (mp_uint_t off = 0; off < len;) {
+        mp_uint_t n = MIN(len - off, sizeof(chunk));
+        memcpy(chunk, buf + off, n);
+        lwip_ws_unmask(chunk, n, key, off);
+        if (lwip_ws_write(socket, chunk, n, _errno) != 0) {
+            return -1;
+        }
+        off += n;
+    }
+    return 0;
+}
+
+/*******************************************************************************/
+// Raw sockets: frames received by any interface are copied, at the netif
+// input hook, into a ring of fixed-size slots allocated with the socket, so
+// receiving allocates nothing per frame. lwIP still processes every frame.
+// AF_PACKET sockets get whole Ethernet frames of the given ethertype, and
+// AF_INET ones IPv4 packets (with their header) of the given protocol;
+// 0 selects all. Frames longer than a slot are cut short.
+
+#ifndef LWIP_RAW_SOCKETS_MAX
+#define LWIP_RAW_SOCKETS_MAX (4)
+#endif
+#ifndef LWIP_RAW_SLOTS
+#define LWIP_RAW_SLOTS (64)
+#endif
+#ifndef LWIP_RAW_SLOT_SIZE
+#define LWIP_RAW_SLOT_SIZE (1536)
+#endif
+
+#define LWIP_RAW_ETHTYPE_IP (0x0800)
+#define LWIP_RAW_ETH_HLEN (14)
+
+// Rings are about 100 KiB and hold no object references: they live in an
+// _xmalloc() area, freed on close (or by the finaliser), not on the GC heap
+typedef struct _lwip_raw_ring_t {
+    uint16_t proto;         // ethertype or IP protocol, 0: all
+    uint16_t head;
+    volatile uint16_t count;
+    mp_uint_t drops;        // frames arriving on a full ring
+    mp_uint_t truncated;
+    uint16_t len[LWIP_RAW_SLOTS];
+    byte slot[LWIP_RAW_SLOTS][LWIP_RAW_SLOT_SIZE];
+} lwip_raw_ring_t;
+
+// Not GC roots: the finaliser closes a raw socket, which removes it
+STATIC lwip_socket_obj_t *lwip_raw_sockets[LWIP_RAW_SOCKETS_MAX];
+STATIC mp_uint_t lwip_raw_count = 0;
+
+STATIC lwip_raw_ring_t *lwip_raw_open(lwip_socket_obj_t *socket, mp_uint_t proto) {
+    if (socket->domain != MOD_NETWORK_AF_INET && socket->domain != MOD_NETWORK_AF_PACKET) {
+        nlr_raise(mp_obj_new_exception_arg1(&mp_type_OSError, MP_OBJ_NEW_SMALL_INT(EAFNOSUPPORT)));
+    }
+    if (lwip_raw_count == LWIP_RAW_SOCKETS_MAX) {
+        nlr_raise(mp_obj_new_exception_arg1(&mp_type_OSError, MP_OBJ_NEW_SMALL_INT(ENFILE)));
+    }
+    lwip_raw_ring_t *ring = _xmalloc(sizeof(lwip_raw_ring_t), __alignof__(lwip_raw_ring_t));
+    if (ring == NULL) {
+        nlr_raise(mp_obj_new_exception_arg1(&mp_type_OSError, MP_OBJ_NEW_SMALL_INT(ENOMEM)));
+    }
+    ring->proto = proto;
+    ring->head = ring->count = 0;
+    ring->drops = ring->truncated = 0;
+    lwip_raw_sockets[lwip_raw_count++] = socket;
+    return ring;
+}
+
+STATIC void lwip_raw_close(lwip_socket_obj_t *socket) {
+    for (mp_uint_t i = 0; i < lwip_raw_count; i++) {
+        if (lwip_raw_sockets[i] == socket) {
+            lwip_raw_sockets[i] = lwip_raw_sockets[--lwip_raw_count];
+            lwip_raw_sockets[lwip_raw_count] = NULL;
+            break;
+        }
+    }
+    xfree(socket->pcb.raw);
+}
+
+STATIC void lwip_raw_push(lwip_socket_obj_t *socket, struct pbuf *p, u16_t off) {
+    lwip_raw_ring_t *ring = socket->pcb.raw;
+    if (ring->count == LWIP_RAW_SLOTS) {
+        ring->drops++;
+        return;
+    }
+    mp_uint_t i = (ring->head + ring->count) % LWIP_RAW_SLOTS;
+    u16_t len = MIN(p->tot_len - off, LWIP_RAW_SLOT_SIZE);
+    if (len < p->tot_len - off) {
+        ring->truncated++;
+    }
+    ring->len[i] = pbuf_copy_partial(p, ring->slot[i], len, off);
+    ring->count++;
+    socket->stats.rx_bytes += len;
+    socket->stats.rx_packets++;
+    queue_user_callback(socket);
+    notify_waiters(socket);
+}
+
+// Called by lwip_ether_input() for every received frame
+STATIC void lwip_raw_input(struct pbuf *p) {
+    byte hdr[LWIP_RAW_ETH_HLEN + 10];
+    if (lwip_raw_count == 0
+        || pbuf_copy_partial(p, hdr, sizeof(hdr), 0) < LWIP_RAW_ETH_HLEN) {
+        return;
+    }
+    mp_uint_t type = (hdr[12] << 8) | hdr[13];
+    for (mp_uint_t i = 0; i < lwip_raw_count; i++) {
+        lwip_socket_obj_t *socket = lwip_raw_sockets[i];
+        mp_uint_t proto = socket->pcb.raw->proto;
+        if (socket->domain == MOD_NETWORK_AF_PACKET) {
+            if (proto == 0 || proto == type) {
+                lwip_raw_push(socket, p, 0);
+            }
+        } else if (type == LWIP_RAW_ETHTYPE_IP && p->tot_len >= sizeof(hdr)) {
+            if (proto == 0 || proto == hdr[LWIP_RAW_ETH_HLEN + 9]) {
+                lwip_raw_push(socket, p, LWIP_RAW_ETH_HLEN);
+            }
+        }
+    }
+}
+
+STATIC mp_uint_t lwip_raw_wait_data(lwip_socket_obj_t *socket, int *_errno) {
+    uint64_t deadline = socket_deadline(socket);
+
+    while (socket->pcb.raw->count == 0) {
+        if (socket->timeout == 0) {
+            *_errno = EAGAIN;
+            return -1;
+        }
+        socket_wait(deadline);
+        if (socket->pcb.raw == NULL) {
+            *_errno = EBADF;
+            return -1;
+        }
+        if (socket->pcb.raw->count == 0 && deadline_passed(deadline)) {
+            *_errno = ETIMEDOUT;
+            return -1;
+        }
+    }
+    return 1;
+}
+
+// Sends one frame (AF_PACKET) through the default interface, or one IPv4
+// payload (AF_INET) to dest with the protocol of the socket
+STATIC mp_uint_t lwip_raw_send(lwip_socket_obj_t *socket, const byte *buf, mp_uint_t len, const ip4_addr_t *dest, int *_errno) {
+    struct netif *netif = netif_default;
+    if (socket->domain == MOD_NETWORK_AF_PACKET && netif == NULL) {
+        *_errno = ENETUNREACH;
+        return -1;
+    }
+    if (len > 0xffff) {
+        *_errno = EMSGSIZE;
+        return -1;
+    }
+    struct pbuf *p = pbuf_alloc(socket->domain == MOD_NETWORK_AF_PACKET ? PBUF_RAW : PBUF_IP, len, PBUF_RAM);
+    if (p == NULL) {
+        *_errno = ENOMEM;
+        return -1;
+    }
+    pbuf_take(p, buf, len);
+    err_t err;
+    if (socket->domain == MOD_NETWORK_AF_PACKET) {
+        err = netif->linkoutput(netif, p);
+    } else {
+        err = ip4_output(p, NULL, dest, 64, 0, socket->pcb.raw->proto);
+    }
+    pbuf_free(p);
+    if (err != ERR_OK) {
+        *_errno = error_lookup_table[-err];
+        return -1;
+    }
+    socket->stats.tx_bytes += len;
+    socket->stats.tx_packets++;
+    return len;
+}
+
+// Takes the oldest frame, cut to len, for recv() and read(); src gets the
+// source address of an IPv4 packet, 0.0.0.0 for Ethernet frames
+STATIC mp_uint_t lwip_raw_receive(lwip_socket_obj_t *socket, byte *buf, mp_uint_t len, byte *src, int *_errno) {
+    if (socket->pcb.raw == NULL) {
+        *_errno = EBADF;
+        return -1;
+    }
+    if (lwip_raw_wait_data(socket, _errno) != 1) {
+        return -1;
+    }
+    lwip_raw_ring_t *ring = socket->pcb.raw;
+    const byte *frame = ring->slot[ring->head];
+    mp_uint_t flen = ring->len[ring->head];
+    if (src != NULL) {
+        if (socket->domain == MOD_NETWORK_AF_INET && flen >= 20) {
+            memcpy(src, frame + 12, 4);
         } else {
-            tcp_abort(socket->incoming.connection);
+            memset(src, 0, 4);
+        }
+    }
+    len = MIN(len, flen);
+    memcpy(buf, frame, len);
+    ring->head = (ring->head + 1) % LWIP_RAW_SLOTS;
+    ring->count--;
+    return len;
+}
+
+// Sends to ip, which send() and write() do not have: only AF_PACKET
+// sockets can do without
+STATIC mp_uint_t lwip_raw_sendto(lwip_socket_obj_t *socket, const byte *buf, mp_uint_t len, const uint8_t *ip, int *_errno) {
+    ip4_addr_t dest;
+    if (socket->pcb.raw == NULL) {
+        *_errno = EBADF;
+        return -1;
+    }
+    if (socket->domain == MOD_NETWORK_AF_INET) {
+        if (ip == NULL || socket->pcb.raw->proto == 0) {
+            *_errno = EDESTADDRREQ;
+            return -1;
+        }
+        IP4_ADDR(&dest, ip[0], ip[1], ip[2], ip[3]);
+    }
+    return lwip_raw_send(socket, buf, len, &dest, _errno);
+}
+
+/*******************************************************************************/
+// The socket functions provided by lwip.socket.
+
+
+void lwip_socket_print(const mp_print_t *print, mp_obj_t self_in, mp_print_kind_t kind) {
+    lwip_socket_obj_t *self = self_in;
+    mp_printf(print, "<socket state=%d timeout=", self->state);
+    if (self->timeout == SOCKET_TIMEOUT_NONE) {
+        mp_print_str(print, "None");
+    } else {
+        mp_obj_print_helper(print, mp_obj_new_int_from_ull(self->timeout), PRINT_REPR);
+    }
+    mp_printf(print, " queued=%d/%d drops=%u remaining=%d>",
+        self->rxq.count, self->rxq.depth, (unsigned int)self->rxq.drops, self->leftover_count);
+}
+
+// FIXME: Only supports two arguments at present
+mp_obj_t lwip_socket_make_new(const mp_obj_type_t *type, mp_uint_t n_args,
+    mp_uint_t n_kw, const mp_obj_t *args) {
+    mp_arg_check_num(n_args, n_kw, 0, 4, false);
+
+    if (!LWIP_INIT) {
+      lwip_init();
+      LWIP_INIT = true;      
+    }
+    
+    lwip_socket_obj_t *socket = m_new_obj_with_finaliser(lwip_socket_obj_t);
+    socket->base.type = (mp_obj_t)&lwip_socket_type;
+    socket->domain = MOD_NETWORK_AF_INET;
+    socket->type = MOD_NETWORK_SOCK_STREAM;
+    socket->callback = MP_OBJ_NULL;
+    socket->flags = 0;
+    socket->sndbuf = socket->rcvbuf = 0;
+    socket->rcv_withheld = socket->unpushed = 0;
+    memset(&socket->stats, 0, sizeof(socket->stats));
+    socket->pinq = NULL;
+    socket->ws_rx = NULL;
+    socket->io_task[0] = socket->io_task[1] = MP_OBJ_NULL;
+    socket->io_slot = -1;
+    if (n_args >= 1) {
+        socket->domain = mp_obj_get_int(args[0]);
+        if (n_args >= 2) {
+            socket->type = mp_obj_get_int(args[1]);
+        }
+    }
+
+    switch (socket->type) {
+        case MOD_NETWORK_SOCK_STREAM: socket->pcb.tcp = tcp_new(); break;
+        case MOD_NETWORK_SOCK_DGRAM: socket->pcb.udp = udp_new(); break;
+        case MOD_NETWORK_SOCK_RAW:
+            socket->pcb.raw = lwip_raw_open(socket, n_args >= 3 ? mp_obj_get_int(args[2]) : 0);
+            break;
+        default: nlr_raise(mp_obj_new_exception_arg1(&mp_type_OSError, MP_OBJ_NEW_SMALL_INT(EINVAL)));
+    }
+    if (socket->pcb.tcp == NULL) {
+        nlr_raise(mp_obj_new_exception_arg1(&mp_type_OSError, MP_OBJ_NEW_SMALL_INT(ENOMEM)));
+    }
+    
+    switch (socket->type) {
+        case MOD_NETWORK_SOCK_STREAM: {
+            // Register the socket object as our callback argument.
+            tcp_arg(socket->pcb.tcp, (void*)socket);
+            // Register our error callback.
+            tcp_err(socket->pcb.tcp, _lwip_tcp_error);
+            tcp_sent(socket->pcb.tcp, _lwip_tcp_sent);
+            break;
+        }
+        case MOD_NETWORK_SOCK_DGRAM: {
+            // Register our receive callback now. Since UDP sockets don't require binding or connection
+            // before use, there's no other good time to do it.
+            udp_recv(socket->pcb.udp, _lwip_udp_incoming, (void*)socket);
+            break;
+        }
+    }
+    rxq_init(socket);
+    socket->timeout = SOCKET_TIMEOUT_NONE;
+    socket->state = STATE_NEW;
+    socket->leftover_count = 0;
+    return socket;
+}
+
+mp_obj_t lwip_socket_close(mp_obj_t self_in) {
+    lwip_socket_obj_t *socket = self_in;
+    bool socket_is_listener = false;
+
+    if (socket->pcb.tcp == NULL) {
+        return mp_const_none;
+    }
+
+    switch (socket->type) {
+        case MOD_NETWORK_SOCK_STREAM: {
+            // the pcb may outlive the socket (FIN_WAIT, TIME_WAIT): keep
+            // lwIP from calling back into it
+            struct tcp_pcb *pcb = socket->pcb.tcp;
+            tcp_arg(pcb, NULL);
+            if (pcb->state == LISTEN) {
+                socket_is_listener = true;
+                tcp_accept(pcb, NULL);
+            } else {
+                tcp_recv(pcb, NULL);
+                tcp_sent(pcb, NULL);
+                tcp_err(pcb, NULL);
+            }
+            #if SHFS_ENABLE
+            if (socket->pinq != NULL && socket->pinq->count != 0) {
+                // closed during sendfile(): queued segments still point
+                // into pinned cache buffers, drop them before the pins
+                tcp_abort(pcb);
+                lwip_pinq_release(socket->pinq, NULL);
+                break;
+            }
+            #endif
+            if (tcp_close(socket->pcb.tcp) != ERR_OK) {
+                DEBUG_printf("lwip_close: had to call tcp_abort()\n");
+                tcp_abort(socket->pcb.tcp);
+            }
+            break;
+        }
+        case MOD_NETWORK_SOCK_DGRAM: udp_remove(socket->pcb.udp); break;
+        case MOD_NETWORK_SOCK_RAW: lwip_raw_close(socket); break;
+    }
+    
+    socket->pcb.tcp = NULL;
+    socket->state = _ERR_BADF;
+    socket->ws_rx = NULL;
+    if (socket_is_listener) {
+        while (!RXQ_EMPTY(socket)) {
+            if (RXQ_HEAD(socket)->connection != NULL) {
+                tcp_abort(RXQ_HEAD(socket)->connection);
+            }
+            rxq_advance(socket);
         }
-        socket->incoming.pbuf = NULL;
+    } else {
+        rxq_flush(socket);
     }
+    notify_waiters(socket);
 
     return mp_const_none;
 }
@@ -998,6 +2220,14 @@ mp_obj_t lwip_socket_listen(mp_obj_t self_in, mp_obj_t backlog_in) {
         nlr_raise(mp_obj_new_exception_arg1(&mp_type_OSError, MP_OBJ_NEW_SMALL_INT(EOPNOTSUPP)));
     }
 
+    // The accept queue holds as many connections as lwIP lets through
+    if (backlog < 1) {
+        backlog = 1;
+    } else if (backlog > LWIP_SOCKET_RXQ_MAX) {
+        backlog = LWIP_SOCKET_RXQ_MAX;
+    }
+    socket->rxq.depth = backlog;
+
     struct tcp_pcb *new_pcb = tcp_listen_with_backlog(socket->pcb.tcp, (u8_t)backlog);
     if (new_pcb == NULL) {
         nlr_raise(mp_obj_new_exception_arg1(&mp_type_OSError, MP_OBJ_NEW_SMALL_INT(ENOMEM)));
@@ -1024,43 +2254,63 @@ mp_obj_t lwip_socket_accept(mp_obj_t self_in) {
         nlr_raise(mp_obj_new_exception_arg1(&mp_type_OSError, MP_OBJ_NEW_SMALL_INT(EINVAL)));
     }
 
-    // accept incoming connection
-    if (socket->incoming.connection == NULL) {
-        if (socket->timeout != -1) {
-            for (mp_uint_t retries = socket->timeout / 100; retries--;) {
-                mp_hal_delay_ms(100);
-                if (socket->incoming.connection != NULL) break;
+    // accept incoming connection, skipping those reset while queued
+    struct tcp_pcb *newpcb = NULL;
+    uint64_t deadline = socket_deadline(socket);
+    do {
+        while (RXQ_EMPTY(socket)) {
+            if (socket->timeout == 0) {
+                nlr_raise(mp_obj_new_exception_arg1(&mp_type_OSError, MP_OBJ_NEW_SMALL_INT(EAGAIN)));
             }
-            if (socket->incoming.connection == NULL) {
+            socket_wait(deadline);
+            if (RXQ_EMPTY(socket) && deadline_passed(deadline)) {
                 nlr_raise(mp_obj_new_exception_arg1(&mp_type_OSError, MP_OBJ_NEW_SMALL_INT(ETIMEDOUT)));
             }
-        } else {
-            while (socket->incoming.connection == NULL) {
-	      poll_sockets();
-            }
         }
-    }
+        newpcb = RXQ_HEAD(socket)->connection;
+        rxq_advance(socket);
+        if (newpcb == NULL) {
+            tcp_accepted(listener);
+        }
+    } while (newpcb == NULL);
 
     // create new socket object
     lwip_socket_obj_t *socket2 = m_new_obj_with_finaliser(lwip_socket_obj_t);
     socket2->base.type = (mp_obj_t)&lwip_socket_type;
 
     // We get a new pcb handle...
-    socket2->pcb.tcp = socket->incoming.connection;
-    socket->incoming.connection = NULL;
+    socket2->pcb.tcp = newpcb;
 
     // ...and set up the new socket for it.
     socket2->domain = MOD_NETWORK_AF_INET;
     socket2->type = MOD_NETWORK_SOCK_STREAM;
-    socket2->incoming.pbuf = NULL;
+    rxq_init(socket2);
     socket2->timeout = socket->timeout;
     socket2->state = STATE_CONNECTED;
     socket2->leftover_count = 0;
     socket2->callback = MP_OBJ_NULL;
+    socket2->flags = socket->flags;
+    socket2->pinq = NULL;
+    socket2->ws_rx = NULL;
+    socket2->io_task[0] = socket2->io_task[1] = MP_OBJ_NULL;
+    socket2->io_slot = -1;
     tcp_arg(socket2->pcb.tcp, (void*)socket2);
     tcp_err(socket2->pcb.tcp, _lwip_tcp_error);
+    tcp_sent(socket2->pcb.tcp, _lwip_tcp_sent);
     tcp_recv(socket2->pcb.tcp, _lwip_tcp_recv);
 
+    // TCP options and buffer limits are inherited from the listener
+    socket2->sndbuf = socket->sndbuf;
+    socket2->rcvbuf = 0;
+    socket2->rcv_withheld = socket2->unpushed = 0;
+    memset(&socket2->stats, 0, sizeof(socket2->stats));
+    if (socket->rcvbuf != 0) {
+        lwip_tcp_set_rcvbuf(socket2, socket->rcvbuf);
+    }
+    if (socket2->flags & SOCKET_FLAG_NODELAY) {
+        tcp_nagle_disable(socket2->pcb.tcp);
+    }
+
     tcp_accepted(listener);
 
     // make the return value
@@ -1127,18 +2377,12 @@ mp_obj_t lwip_socket_connect(mp_obj_t self_in, mp_obj_t addr_in) {
             socket->peer_port = (mp_uint_t)port;
             memcpy(socket->peer, &dest, sizeof(socket->peer));
             // And now we wait...
-            if (socket->timeout != -1) {
-                for (mp_uint_t retries = socket->timeout / 100; retries--;) {
-                    mp_hal_delay_ms(100);
-                    if (socket->state != STATE_CONNECTING) break;
-                }
-                if (socket->state == STATE_CONNECTING) {
+            uint64_t deadline = socket_deadline(socket);
+            while (socket->state == STATE_CONNECTING) {
+                socket_wait(deadline);
+                if (socket->state == STATE_CONNECTING && deadline_passed(deadline)) {
                     nlr_raise(mp_obj_new_exception_arg1(&mp_type_OSError, MP_OBJ_NEW_SMALL_INT(ETIMEDOUT)));
                 }
-            } else {
-                while (socket->state == STATE_CONNECTING) {
-                    poll_sockets();
-                }
             }
             if (socket->state == STATE_CONNECTED) {
                err = ERR_OK;
@@ -1187,6 +2431,10 @@ mp_obj_t lwip_socket_send(mp_obj_t self_in, mp_obj_t buf_in) {
             ret = lwip_udp_send(socket, bufinfo.buf, bufinfo.len, NULL, 0, &_errno);
             break;
         }
+        case MOD_NETWORK_SOCK_RAW: {
+            ret = lwip_raw_sendto(socket, bufinfo.buf, bufinfo.len, NULL, &_errno);
+            break;
+        }
     }
     if (ret == -1) {
         nlr_raise(mp_obj_new_exception_arg1(&mp_type_OSError, MP_OBJ_NEW_SMALL_INT(_errno)));
@@ -1203,25 +2451,45 @@ mp_obj_t lwip_socket_recv(mp_obj_t self_in, mp_obj_t len_in) {
     lwip_socket_check_connected(socket);
 
     mp_int_t len = mp_obj_get_int(len_in);
+    xbuf_obj_t *xb = NULL;
     vstr_t vstr;
-    vstr_init_len(&vstr, len);
+    byte *buf;
+    if (socket->flags & SOCKET_FLAG_XBUF) {
+        // payload is kept off the GC heap
+        xb = xbuf_new(len);
+        buf = xb->data;
+    } else {
+        vstr_init_len(&vstr, len);
+        buf = (byte*)vstr.buf;
+    }
 
     mp_uint_t ret = 0;
     switch (socket->type) {
         case MOD_NETWORK_SOCK_STREAM: {
-            ret = lwip_tcp_receive(socket, (byte*)vstr.buf, len, &_errno);
+            ret = lwip_tcp_receive(socket, buf, len, &_errno);
 	    
             break;
         }
         case MOD_NETWORK_SOCK_DGRAM: {
-            ret = lwip_udp_receive(socket, (byte*)vstr.buf, len, NULL, NULL, &_errno);
+            ret = lwip_udp_receive(socket, buf, len, NULL, NULL, &_errno);
             break;
         }
-    }
+        case MOD_NETWORK_SOCK_RAW: {
+            ret = lwip_raw_receive(socket, buf, len, NULL, &_errno);
+            break;
+        }
+    }
     if (ret == -1) {
+        if (xb != NULL) {
+            xbuf_release(xb);
+        }
         nlr_raise(mp_obj_new_exception_arg1(&mp_type_OSError, MP_OBJ_NEW_SMALL_INT(_errno)));
     }
 
+    if (xb != NULL) {
+        xb->len = ret;
+        return xb;
+    }
     if (ret == 0) {
         return mp_const_empty_bytes;
     }
@@ -1230,6 +2498,251 @@ mp_obj_t lwip_socket_recv(mp_obj_t self_in, mp_obj_t len_in) {
 }
 STATIC MP_DEFINE_CONST_FUN_OBJ_2(lwip_socket_recv_obj, lwip_socket_recv);
 
+mp_obj_t lwip_socket_recv_into(mp_uint_t n_args, const mp_obj_t *args) {
+    lwip_socket_obj_t *socket = args[0];
+    int _errno;
+
+    lwip_socket_check_connected(socket);
+
+    mp_buffer_info_t bufinfo;
+    mp_get_buffer_raise(args[1], &bufinfo, MP_BUFFER_WRITE);
+    mp_uint_t len = bufinfo.len;
+    if (n_args > 2) {
+        len = MIN((mp_uint_t)mp_obj_get_int(args[2]), len);
+    }
+
+    mp_uint_t ret = 0;
+    switch (socket->type) {
+        case MOD_NETWORK_SOCK_STREAM:
+            ret = lwip_tcp_receive(socket, bufinfo.buf, len, &_errno);
+            break;
+        case MOD_NETWORK_SOCK_DGRAM:
+            ret = lwip_udp_receive(socket, bufinfo.buf, len, NULL, NULL, &_errno);
+            break;
+    }
+    if (ret == -1) {
+        nlr_raise(mp_obj_new_exception_arg1(&mp_type_OSError, MP_OBJ_NEW_SMALL_INT(_errno)));
+    }
+    return mp_obj_new_int_from_uint(ret);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(lwip_socket_recv_into_obj, 2, 3, lwip_socket_recv_into);
+
+mp_obj_t lwip_socket_recv_view(mp_uint_t n_args, const mp_obj_t *args) {
+    lwip_socket_obj_t *socket = args[0];
+    int _errno;
+
+    lwip_socket_check_connected(socket);
+
+    mp_uint_t len = (mp_uint_t)-1;
+    if (n_args > 1) {
+        len = mp_obj_get_int(args[1]);
+    }
+
+    mp_obj_t view = MP_OBJ_NULL;
+    switch (socket->type) {
+        case MOD_NETWORK_SOCK_STREAM:
+            view = lwip_tcp_receive_view(socket, len, &_errno);
+            break;
+        case MOD_NETWORK_SOCK_DGRAM:
+            view = lwip_udp_receive_view(socket, &_errno);
+            break;
+    }
+    if (view == MP_OBJ_NULL) {
+        nlr_raise(mp_obj_new_exception_arg1(&mp_type_OSError, MP_OBJ_NEW_SMALL_INT(_errno)));
+    }
+    return view;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(lwip_socket_recv_view_obj, 1, 2, lwip_socket_recv_view);
+
+// ws_recv_frames([max]): WebSocket frames received, as a list of (opcode,
+// fin, payload). Waits as recv() does until at least one frame is complete,
+// then returns all complete ones (at most max) without waiting further. An
+// empty list means the peer closed the connection. Payloads are pbufviews
+// or bytes.
+mp_obj_t lwip_socket_ws_recv_frames(mp_uint_t n_args, const mp_obj_t *args) {
+    lwip_socket_obj_t *socket = args[0];
+    int _errno;
+
+    lwip_socket_check_connected(socket);
+    if (socket->type != MOD_NETWORK_SOCK_STREAM) {
+        nlr_raise(mp_obj_new_exception_arg1(&mp_type_OSError, MP_OBJ_NEW_SMALL_INT(EOPNOTSUPP)));
+    }
+    mp_uint_t max = n_args > 1 ? mp_obj_get_int(args[1]) : LWIP_WS_BATCH_DEFAULT;
+
+    mp_obj_t list = mp_obj_new_list(0, NULL);
+    mp_obj_list_t *l = list;
+    do {
+        mp_uint_t ret = lwip_tcp_wait_data(socket, &_errno);
+        if (ret == 0) {
+            break;
+        }
+        if (ret == (mp_uint_t)-1) {
+            nlr_raise(mp_obj_new_exception_arg1(&mp_type_OSError, MP_OBJ_NEW_SMALL_INT(_errno)));
+        }
+        while (l->len < max) {
+            mp_obj_t frame = lwip_ws_recv_frame(socket, &_errno);
+            if (frame == MP_OBJ_NULL) {
+                if (_errno != 0 && l->len == 0) {
+                    nlr_raise(mp_obj_new_exception_arg1(&mp_type_OSError, MP_OBJ_NEW_SMALL_INT(_errno)));
+                }
+                break;
+            }
+            mp_obj_list_append(list, frame);
+        }
+    } while (l->len == 0);
+    return list;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(lwip_socket_ws_recv_frames_obj, 1, 2, lwip_socket_ws_recv_frames);
+
+// ws_send(payload[, opcode[, mask]]): sends payload, or each payload of a
+// list, as one WebSocket frame; opcode defaults to binary. Clients must
+// mask their frames. The frames leave together once all are queued.
+mp_obj_t lwip_socket_ws_send(mp_uint_t n_args, const mp_obj_t *args) {
+    lwip_socket_obj_t *socket = args[0];
+    int _errno;
+
+    lwip_socket_check_connected(socket);
+    if (socket->type != MOD_NETWORK_SOCK_STREAM) {
+        nlr_raise(mp_obj_new_exception_arg1(&mp_type_OSError, MP_OBJ_NEW_SMALL_INT(EOPNOTSUPP)));
+    }
+    byte b0 = LWIP_WS_FIN | (n_args > 2 ? (mp_obj_get_int(args[2]) & 0x0f) : LWIP_WS_OP_BINARY);
+    bool mask = n_args > 3 && mp_obj_is_true(args[3]);
+
+    size_t n;
+    mp_obj_t *items;
+    mp_buffer_info_t bufinfo;
+    if (mp_get_buffer(args[1], &bufinfo, MP_BUFFER_READ)) {
+        n = 1;
+        items = (mp_obj_t*)&args[1];
+    } else {
+        mp_obj_get_array(args[1], &n, &items);
+    }
+
+    if (socket->timeout == 0) {
+        // as sendall(): either all frames fit in the buffer or none is sent
+        mp_uint_t total = 0;
+        for (size_t i = 0; i < n; i++) {
+            mp_get_buffer_raise(items[i], &bufinfo, MP_BUFFER_READ);
+            total += bufinfo.len + 14;
+        }
+        if (total > lwip_tcp_sndbuf(socket)) {
+            nlr_raise(mp_obj_new_exception_arg1(&mp_type_OSError, MP_OBJ_NEW_SMALL_INT(EAGAIN)));
+        }
+    }
+
+    // corked meanwhile, so that segments are only sent when full
+    uint8_t corked = socket->flags & SOCKET_FLAG_CORK;
+    socket->flags |= SOCKET_FLAG_CORK;
+    mp_uint_t ret = 0;
+    for (size_t i = 0; i < n && ret == 0; i++) {
+        mp_get_buffer_raise(items[i], &bufinfo, MP_BUFFER_READ);
+        ret = lwip_ws_send_frame(socket, b0, bufinfo.buf, bufinfo.len, mask, &_errno);
+    }
+    socket->flags = (socket->flags & ~SOCKET_FLAG_CORK) | corked;
+    if (!corked) {
+        lwip_tcp_push(socket, true);
+    }
+    if (ret != 0) {
+        nlr_raise(mp_obj_new_exception_arg1(&mp_type_OSError, MP_OBJ_NEW_SMALL_INT(_errno)));
+    }
+    return mp_obj_new_int_from_uint(n);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(lwip_socket_ws_send_obj, 2, 4, lwip_socket_ws_send);
+
+// recv_batch(buf, n): copies up to n received frames of a raw socket into
+// buf, each as a 2-byte length (big endian) followed by the frame, for as
+// many as fit. Waits as recv() does for the first; returns the count.
+mp_obj_t lwip_socket_recv_batch(mp_obj_t self_in, mp_obj_t buf_in, mp_obj_t n_in) {
+    lwip_socket_obj_t *socket = self_in;
+    int _errno;
+
+    lwip_socket_check_connected(socket);
+    if (socket->type != MOD_NETWORK_SOCK_RAW) {
+        nlr_raise(mp_obj_new_exception_arg1(&mp_type_OSError, MP_OBJ_NEW_SMALL_INT(EOPNOTSUPP)));
+    }
+    mp_buffer_info_t bufinfo;
+    mp_get_buffer_raise(buf_in, &bufinfo, MP_BUFFER_WRITE);
+    mp_int_t n = mp_obj_get_int(n_in);
+    if (n < 0) {
+        nlr_raise(mp_obj_new_exception_msg(&mp_type_ValueError, "n must not be negative"));
+    }
+
+    if (n > 0 && lwip_raw_wait_data(socket, &_errno) != 1) {
+        nlr_raise(mp_obj_new_exception_arg1(&mp_type_OSError, MP_OBJ_NEW_SMALL_INT(_errno)));
+    }
+    lwip_raw_ring_t *ring = socket->pcb.raw;
+    byte *out = bufinfo.buf;
+    mp_uint_t off = 0, count = 0;
+    while (count < (mp_uint_t)n && ring->count > 0) {
+        mp_uint_t len = ring->len[ring->head];
+        if (off + 2 + len > bufinfo.len) {
+            if (count == 0) {
+                nlr_raise(mp_obj_new_exception_msg(&mp_type_ValueError, "buffer too small"));
+            }
+            break;
+        }
+        out[off] = len >> 8;
+        out[off + 1] = len;
+        memcpy(out + off + 2, ring->slot[ring->head], len);
+        off += 2 + len;
+        ring->head = (ring->head + 1) % LWIP_RAW_SLOTS;
+        ring->count--;
+        count++;
+    }
+    return MP_OBJ_NEW_SMALL_INT(count);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_3(lwip_socket_recv_batch_obj, lwip_socket_recv_batch);
+
+// send_batch(buf, n[, addr]): sends up to n frames laid out in buf as by
+// recv_batch(); AF_INET sockets send IPv4 payloads to addr. Returns the
+// count sent, raising only if the first one fails.
+mp_obj_t lwip_socket_send_batch(mp_uint_t n_args, const mp_obj_t *args) {
+    lwip_socket_obj_t *socket = args[0];
+    int _errno = 0;
+
+    lwip_socket_check_connected(socket);
+    if (socket->type != MOD_NETWORK_SOCK_RAW) {
+        nlr_raise(mp_obj_new_exception_arg1(&mp_type_OSError, MP_OBJ_NEW_SMALL_INT(EOPNOTSUPP)));
+    }
+    mp_buffer_info_t bufinfo;
+    mp_get_buffer_raise(args[1], &bufinfo, MP_BUFFER_READ);
+    mp_int_t n = mp_obj_get_int(args[2]);
+    if (n < 0) {
+        nlr_raise(mp_obj_new_exception_msg(&mp_type_ValueError, "n must not be negative"));
+    }
+
+    ip4_addr_t dest;
+    if (socket->domain == MOD_NETWORK_AF_INET) {
+        if (n_args < 4 || socket->pcb.raw->proto == 0) {
+            nlr_raise(mp_obj_new_exception_arg1(&mp_type_OSError, MP_OBJ_NEW_SMALL_INT(EDESTADDRREQ)));
+        }
+        uint8_t ip[NETUTILS_IPV4ADDR_BUFSIZE];
+        netutils_parse_inet_addr(args[3], ip, NETUTILS_BIG);
+        IP4_ADDR(&dest, ip[0], ip[1], ip[2], ip[3]);
+    }
+
+    const byte *in = bufinfo.buf;
+    mp_uint_t off = 0, count = 0;
+    while (count < (mp_uint_t)n && off + 2 <= bufinfo.len) {
+        mp_uint_t len = (in[off] << 8) | in[off + 1];
+        if (off + 2 + len > bufinfo.len) {
+            nlr_raise(mp_obj_new_exception_msg(&mp_type_ValueError, "truncated frame"));
+        }
+        if (lwip_raw_send(socket, in + off + 2, len, &dest, &_errno) == -1) {
+            break;
+        }
+        off += 2 + len;
+        count++;
+    }
+    poll_sockets();
+
+    if (count == 0 && _errno != 0) {
+        nlr_raise(mp_obj_new_exception_arg1(&mp_type_OSError, MP_OBJ_NEW_SMALL_INT(_errno)));
+    }
+    return MP_OBJ_NEW_SMALL_INT(count);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(lwip_socket_send_batch_obj, 3, 4, lwip_socket_send_batch);
+
 mp_obj_t lwip_socket_sendto(mp_obj_t self_in, mp_obj_t data_in, mp_obj_t addr_in) {
     lwip_socket_obj_t *socket = self_in;
     int _errno;
@@ -1252,6 +2765,10 @@ mp_obj_t lwip_socket_sendto(mp_obj_t self_in, mp_obj_t data_in, mp_obj_t addr_in
             ret = lwip_udp_send(socket, bufinfo.buf, bufinfo.len, ip, port, &_errno);
             break;
         }
+        case MOD_NETWORK_SOCK_RAW: {
+            ret = lwip_raw_sendto(socket, bufinfo.buf, bufinfo.len, ip, &_errno);
+            break;
+        }
     }
     if (ret == -1) {
         nlr_raise(mp_obj_new_exception_arg1(&mp_type_OSError, MP_OBJ_NEW_SMALL_INT(_errno)));
@@ -1261,6 +2778,43 @@ mp_obj_t lwip_socket_sendto(mp_obj_t self_in, mp_obj_t data_in, mp_obj_t addr_in
 }
 STATIC MP_DEFINE_CONST_FUN_OBJ_3(lwip_socket_sendto_obj, lwip_socket_sendto);
 
+// sendmany(iterable): sends each (data, addr) item with a single Python call
+// and polls the network once at the end. Returns the number of datagrams
+// sent; an error on the first one raises, a later one ends the batch.
+mp_obj_t lwip_socket_sendmany(mp_obj_t self_in, mp_obj_t items_in) {
+    lwip_socket_obj_t *socket = self_in;
+    int _errno = 0;
+
+    lwip_socket_check_connected(socket);
+    if (socket->type != MOD_NETWORK_SOCK_DGRAM) {
+        nlr_raise(mp_obj_new_exception_arg1(&mp_type_OSError, MP_OBJ_NEW_SMALL_INT(EOPNOTSUPP)));
+    }
+
+    mp_obj_t iter = mp_getiter(items_in);
+    mp_obj_t item;
+    mp_uint_t count = 0;
+    while ((item = mp_iternext(iter)) != MP_OBJ_STOP_ITERATION) {
+        mp_obj_t *elem;
+        mp_obj_get_array_fixed_n(item, 2, &elem);
+        mp_buffer_info_t bufinfo;
+        mp_get_buffer_raise(elem[0], &bufinfo, MP_BUFFER_READ);
+        uint8_t ip[NETUTILS_IPV4ADDR_BUFSIZE];
+        mp_uint_t port = netutils_parse_inet_addr(elem[1], ip, NETUTILS_BIG);
+
+        if (lwip_udp_send(socket, bufinfo.buf, bufinfo.len, ip, port, &_errno) == -1) {
+            break;
+        }
+        count++;
+    }
+    poll_sockets();
+
+    if (count == 0 && _errno != 0) {
+        nlr_raise(mp_obj_new_exception_arg1(&mp_type_OSError, MP_OBJ_NEW_SMALL_INT(_errno)));
+    }
+    return mp_obj_new_int_from_uint(count);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_2(lwip_socket_sendmany_obj, lwip_socket_sendmany);
+
 mp_obj_t lwip_socket_recvfrom(mp_obj_t self_in, mp_obj_t len_in) {
     lwip_socket_obj_t *socket = self_in;
     int _errno;
@@ -1268,8 +2822,16 @@ mp_obj_t lwip_socket_recvfrom(mp_obj_t self_in, mp_obj_t len_in) {
     lwip_socket_check_connected(socket);
 
     mp_int_t len = mp_obj_get_int(len_in);
+    xbuf_obj_t *xb = NULL;
     vstr_t vstr;
-    vstr_init_len(&vstr, len);
+    byte *buf;
+    if (socket->flags & SOCKET_FLAG_XBUF) {
+        xb = xbuf_new(len);
+        buf = xb->data;
+    } else {
+        vstr_init_len(&vstr, len);
+        buf = (byte*)vstr.buf;
+    }
     byte ip[4];
     mp_uint_t port;
 
@@ -1278,20 +2840,31 @@ mp_obj_t lwip_socket_recvfrom(mp_obj_t self_in, mp_obj_t len_in) {
         case MOD_NETWORK_SOCK_STREAM: {
             memcpy(ip, &socket->peer, sizeof(socket->peer));
             port = (mp_uint_t) socket->peer_port;
-            ret = lwip_tcp_receive(socket, (byte*)vstr.buf, len, &_errno);
+            ret = lwip_tcp_receive(socket, buf, len, &_errno);
             break;
         }
         case MOD_NETWORK_SOCK_DGRAM: {
-            ret = lwip_udp_receive(socket, (byte*)vstr.buf, len, ip, &port, &_errno);
+            ret = lwip_udp_receive(socket, buf, len, ip, &port, &_errno);
+            break;
+        }
+        case MOD_NETWORK_SOCK_RAW: {
+            ret = lwip_raw_receive(socket, buf, len, ip, &_errno);
+            port = 0;
             break;
         }
     }
     if (ret == -1) {
+        if (xb != NULL) {
+            xbuf_release(xb);
+        }
         nlr_raise(mp_obj_new_exception_arg1(&mp_type_OSError, MP_OBJ_NEW_SMALL_INT(_errno)));
     }
 
     mp_obj_t tuple[2];
-    if (ret == 0) {
+    if (xb != NULL) {
+        xb->len = ret;
+        tuple[0] = xb;
+    } else if (ret == 0) {
         tuple[0] = mp_const_empty_bytes;
     } else {
         vstr.len = ret;
@@ -1319,7 +2892,7 @@ mp_obj_t lwip_socket_sendall(mp_obj_t self_in, mp_obj_t buf_in) {
                 // way to determine how much data, if any, was successfully sent." Then, the
                 // most useful behavior is: check whether we will be able to send all of input
                 // data without EAGAIN, and if won't be, raise it without sending any.
-                if (bufinfo.len > tcp_sndbuf(socket->pcb.tcp)) {
+                if (bufinfo.len > lwip_tcp_sndbuf(socket)) {
                     nlr_raise(mp_obj_new_exception_arg1(&mp_type_OSError, MP_OBJ_NEW_SMALL_INT(EAGAIN)));
                 }
             }
@@ -1336,6 +2909,7 @@ mp_obj_t lwip_socket_sendall(mp_obj_t self_in, mp_obj_t buf_in) {
             break;
         }
         case MOD_NETWORK_SOCK_DGRAM:
+        case MOD_NETWORK_SOCK_RAW:
             mp_not_implemented("");
             break;
     }
@@ -1344,17 +2918,309 @@ mp_obj_t lwip_socket_sendall(mp_obj_t self_in, mp_obj_t buf_in) {
 }
 STATIC MP_DEFINE_CONST_FUN_OBJ_2(lwip_socket_sendall_obj, lwip_socket_sendall);
 
+#if SHFS_ENABLE
+// Helper function for sendfile: pushes out queued data and waits one poll. Returns 0,
+// or -1 if the connection failed or nothing went out within the socket timeout.
+STATIC int lwip_tcp_sendfile_wait(lwip_socket_obj_t *socket, uint64_t deadline, int *_errno) {
+    if (socket->pcb.tcp != NULL) {
+        tcp_output(socket->pcb.tcp);
+    }
+    socket_wait(deadline);
+    if (socket->state < 0) {
+        *_errno = error_lookup_table[-socket->state];
+        return -1;
+    }
+    if (socket->state < STATE_CONNECTED || socket->pcb.tcp == NULL) {
+        *_errno = ENOTCONN;
+        return -1;
+    }
+    if (deadline_passed(deadline)) {
+        *_errno = ETIMEDOUT;
+        return -1;
+    }
+    return 0;
+}
+
+// Sends count bytes of an SHFS file starting at offset. Chunks are taken from
+// the SHFS cache and handed to lwIP by reference; they are pinned in pinq
+// and released as the peer acknowledges them, and the call returns once
+// everything is acked.
+STATIC mp_uint_t lwip_tcp_sendfile_pinned(lwip_socket_obj_t *socket, lwip_pinq_t *q, SHFS_FD f,
+                                          uint64_t offset, uint64_t count, int *_errno) {
+    chk_t chk = shfs_volchk_foff(f, offset);
+    uint64_t chk_off = shfs_volchkoff_foff(f, offset);
+    uint64_t chk_left = 0;
+    struct shfs_cache_entry *cce = NULL;
+    mp_uint_t sent = 0;
+    uint64_t deadline = socket_deadline(socket);
+    int ret = 0;
+
+    while (count != 0) {
+        if (!q->open) {
+            // wait for a free pin slot
+            while (q->count == LWIP_SENDFILE_PIN_MAX) {
+                if ((ret = lwip_tcp_sendfile_wait(socket, deadline, _errno)) < 0) {
+                    goto out;
+                }
+            }
+            cce = shfs_cache_read(chk);
+            if (cce == NULL) {
+                *_errno = errno;
+                ret = -1;
+                goto out;
+            }
+            uint8_t tail = (q->head + q->count) % LWIP_SENDFILE_PIN_MAX;
+            q->e[tail].cce = cce;
+            q->e[tail].end_seq = socket->pcb.tcp->snd_lbb;
+            q->count++;
+            q->open = 1;
+            chk_left = MIN(shfs_vol.chunksize - chk_off, count);
+        }
+
+        u16_t len = MIN(MIN(chk_left, 0xffff), lwip_tcp_sndbuf(socket));
+        err_t err = ERR_MEM;
+        if (len != 0) {
+            err = tcp_write(socket->pcb.tcp, (uint8_t *)cce->buffer + chk_off, len,
+                            (count > len) ? TCP_WRITE_FLAG_MORE : 0);
+        }
+        if (err == ERR_MEM) {
+            // send buffer or segment queue full
+            if ((ret = lwip_tcp_sendfile_wait(socket, deadline, _errno)) < 0) {
+                goto out;
+            }
+            continue;
+        } else if (err != ERR_OK) {
+            *_errno = error_lookup_table[-err];
+            ret = -1;
+            goto out;
+        }
+
+        q->e[(q->head + q->count - 1) % LWIP_SENDFILE_PIN_MAX].end_seq = socket->pcb.tcp->snd_lbb;
+        chk_off += len;
+        chk_left -= len;
+        count -= len;
+        sent += len;
+        deadline = socket_deadline(socket);
+        if (chk_left == 0) {
+            q->open = 0;
+            chk++;
+            chk_off = 0;
+        }
+    }
+
+    // lwIP references the buffers until they are acknowledged
+    q->open = 0;
+    lwip_pinq_release(q, socket->pcb.tcp);
+    while (q->count != 0) {
+        if ((ret = lwip_tcp_sendfile_wait(socket, deadline, _errno)) < 0) {
+            goto out;
+        }
+        lwip_pinq_release(q, socket->pcb.tcp);
+    }
+
+ out:
+    return (ret < 0) ? (mp_uint_t)-1 : sent;
+}
+
+// Drops what is still pinned; lwIP cannot take back the buffers of queued
+// segments, so the connection is aborted if there are any
+STATIC void lwip_tcp_sendfile_unpin(lwip_socket_obj_t *socket, lwip_pinq_t *q) {
+    if (q->count != 0 && socket->pcb.tcp != NULL) {
+        tcp_abort(socket->pcb.tcp);
+    }
+    lwip_pinq_release(q, NULL);
+    socket->pinq = NULL;
+}
+
+STATIC mp_uint_t lwip_tcp_sendfile_shfs(lwip_socket_obj_t *socket, SHFS_FD f, uint64_t offset,
+                                        uint64_t count, int *_errno) {
+    lwip_pinq_t pinq;
+    mp_uint_t ret;
+
+    pinq.head = 0;
+    pinq.count = 0;
+    pinq.open = 0;
+    socket->pinq = &pinq;
+
+    // the queue is on this stack: callbacks run while waiting may raise
+    nlr_buf_t nlr;
+    if (nlr_push(&nlr) == 0) {
+        ret = lwip_tcp_sendfile_pinned(socket, &pinq, f, offset, count, _errno);
+        nlr_pop();
+    } else {
+        lwip_tcp_sendfile_unpin(socket, &pinq);
+        nlr_jump(nlr.ret_val);
+    }
+    lwip_tcp_sendfile_unpin(socket, &pinq);
+    return ret;
+}
+#endif
+
+// Reusable buffer for sending from streams; aligned so that FatFs can read
+// whole sectors straight into it
+#ifndef LWIP_SENDFILE_BUFSIZE
+#define LWIP_SENDFILE_BUFSIZE (16 * 1024)
+#endif
+STATIC byte lwip_sendfile_buf[LWIP_SENDFILE_BUFSIZE] __attribute__((aligned(64)));
+STATIC bool lwip_sendfile_buf_busy = false;
+
+// Copies up to count bytes (all if count is -1) from the stream through buf
+STATIC mp_uint_t lwip_tcp_sendfile_copy(lwip_socket_obj_t *socket, mp_obj_t file, const mp_stream_p_t *stream_p,
+                                        byte *buf, mp_uint_t count, int *_errno) {
+    mp_uint_t sent = 0;
+
+    while (count != 0) {
+        mp_uint_t len = stream_p->read(file, buf, MIN(count, LWIP_SENDFILE_BUFSIZE), _errno);
+        if (len == MP_STREAM_ERROR) {
+            return -1;
+        }
+        if (len == 0) {
+            break;
+        }
+        for (mp_uint_t off = 0; off < len;) {
+            mp_uint_t ret = lwip_tcp_send(socket, buf + off, len - off, _errno);
+            if (ret == MP_STREAM_ERROR) {
+                return -1;
+            }
+            off += ret;
+        }
+        sent += len;
+        if (count != (mp_uint_t)-1) {
+            count -= len;
+        }
+    }
+    return sent;
+}
+
+// Sends up to count bytes (all if count is -1) read from a stream object
+STATIC mp_uint_t lwip_tcp_sendfile_stream(lwip_socket_obj_t *socket, mp_obj_t file,
+                                          mp_uint_t count, int *_errno) {
+    const mp_obj_type_t *type = mp_obj_get_type(file);
+    if (type->stream_p == NULL || type->stream_p->read == NULL) {
+        nlr_raise(mp_obj_new_exception_msg(&mp_type_TypeError, "stream expected"));
+    }
+    byte *buf = lwip_sendfile_buf;
+    mp_uint_t sent;
+
+    // a callback may call sendfile() on another socket while we wait
+    if (lwip_sendfile_buf_busy) {
+        buf = m_new(byte, LWIP_SENDFILE_BUFSIZE);
+    } else {
+        lwip_sendfile_buf_busy = true;
+    }
+
+    // read() and the callbacks run while waiting may raise
+    nlr_buf_t nlr;
+    if (nlr_push(&nlr) == 0) {
+        sent = lwip_tcp_sendfile_copy(socket, file, type->stream_p, buf, count, _errno);
+        nlr_pop();
+    } else {
+        if (buf == lwip_sendfile_buf) {
+            lwip_sendfile_buf_busy = false;
+        }
+        nlr_jump(nlr.ret_val);
+    }
+
+    if (buf == lwip_sendfile_buf) {
+        lwip_sendfile_buf_busy = false;
+    } else {
+        m_del(byte, buf, LWIP_SENDFILE_BUFSIZE);
+    }
+    return sent;
+}
+
+// sendfile(file[, offset[, count]]): file is an open file object or a path.
+// With SHFS, paths are looked up on the SHFS volume and sent without copying.
+mp_obj_t lwip_socket_sendfile(mp_uint_t n_args, const mp_obj_t *args) {
+    lwip_socket_obj_t *socket = args[0];
+    lwip_socket_check_connected(socket);
+
+    if (socket->type != MOD_NETWORK_SOCK_STREAM) {
+        nlr_raise(mp_obj_new_exception_arg1(&mp_type_OSError, MP_OBJ_NEW_SMALL_INT(EOPNOTSUPP)));
+    }
+    if (socket->timeout == 0) {
+        nlr_raise(mp_obj_new_exception_msg(&mp_type_ValueError, "non-blocking sockets are not supported"));
+    }
+
+    mp_uint_t offset = 0;
+    mp_uint_t count = (mp_uint_t)-1;
+    if (n_args > 2) {
+        offset = mp_obj_get_int(args[2]);
+    }
+    if (n_args > 3 && args[3] != mp_const_none) {
+        count = mp_obj_get_int(args[3]);
+    }
+
+    int _errno;
+    mp_uint_t ret;
+    mp_obj_t file = args[1];
+    #if SHFS_ENABLE
+    if (MP_OBJ_IS_STR(file) && shfs_mounted) {
+        SHFS_FD f = shfs_fio_open(mp_obj_str_get_str(file));
+        if (f == NULL) {
+            nlr_raise(mp_obj_new_exception_arg1(&mp_type_OSError, MP_OBJ_NEW_SMALL_INT(errno)));
+        }
+        uint64_t fsize;
+        shfs_fio_size(f, &fsize);
+        if (shfs_fio_islink(f) || offset > fsize) {
+            shfs_fio_close(f);
+            nlr_raise(mp_obj_new_exception_arg1(&mp_type_OSError, MP_OBJ_NEW_SMALL_INT(EINVAL)));
+        }
+        if (count > fsize - offset) {
+            count = fsize - offset;
+        }
+        ret = lwip_tcp_sendfile_shfs(socket, f, offset, count, &_errno);
+        shfs_fio_close(f);
+    } else
+    #endif
+    {
+        bool opened = false;
+        mp_obj_t dest[3];
+        if (MP_OBJ_IS_STR(file)) {
+            file = mp_call_function_2((mp_obj_t)&mp_builtin_open_obj, file, MP_OBJ_NEW_QSTR(MP_QSTR_rb));
+            opened = true;
+        }
+        if (offset != 0) {
+            mp_load_method(file, MP_QSTR_seek, dest);
+            dest[2] = mp_obj_new_int_from_uint(offset);
+            mp_call_method_n_kw(1, 0, dest);
+        }
+        ret = lwip_tcp_sendfile_stream(socket, file, count, &_errno);
+        if (opened) {
+            mp_load_method(file, MP_QSTR_close, dest);
+            mp_call_method_n_kw(0, 0, dest);
+        }
+    }
+    if (ret == (mp_uint_t)-1) {
+        nlr_raise(mp_obj_new_exception_arg1(&mp_type_OSError, MP_OBJ_NEW_SMALL_INT(_errno)));
+    }
+    return mp_obj_new_int_from_uint(ret);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(lwip_socket_sendfile_obj, 2, 4, lwip_socket_sendfile);
+
 mp_obj_t lwip_socket_settimeout(mp_obj_t self_in, mp_obj_t timeout_in) {
     lwip_socket_obj_t *socket = self_in;
-    mp_uint_t timeout;
+    uint64_t timeout;
     if (timeout_in == mp_const_none) {
-        timeout = -1;
+        timeout = SOCKET_TIMEOUT_NONE;
     } else {
         #if MICROPY_PY_BUILTINS_FLOAT
-        timeout = 1000 * mp_obj_get_float(timeout_in);
+        mp_float_t t = mp_obj_get_float(timeout_in);
         #else
-        timeout = 1000 * mp_obj_get_int(timeout_in);
+        mp_int_t t = mp_obj_get_int(timeout_in);
         #endif
+        if (t < 0) {
+            nlr_raise(mp_obj_new_exception_msg(&mp_type_ValueError, "timeout must be non-negative"));
+        }
+        if (t > SOCKET_TIMEOUT_MAX_S) {
+            timeout = SOCKET_TIMEOUT_NONE - 1;
+        } else {
+            timeout = (uint64_t)(t * 1000000);
+            if (timeout == 0 && t > 0) {
+                // sub-microsecond timeouts still poll once
+                timeout = 1;
+            }
+        }
     }
     socket->timeout = timeout;
     return mp_const_none;
@@ -1365,7 +3231,7 @@ mp_obj_t lwip_socket_setblocking(mp_obj_t self_in, mp_obj_t flag_in) {
     lwip_socket_obj_t *socket = self_in;
     bool val = mp_obj_is_true(flag_in);
     if (val) {
-        socket->timeout = -1;
+        socket->timeout = SOCKET_TIMEOUT_NONE;
     } else {
         socket->timeout = 0;
     }
@@ -1378,10 +3244,11 @@ mp_obj_t lwip_socket_setsockopt(mp_uint_t n_args, const mp_obj_t *args) {
     lwip_socket_obj_t *socket = args[0];
 
     int opt = mp_obj_get_int(args[2]);
-    if (opt == 20) {
+    if (opt == MOD_LWIP_SO_CALLBACK) {
         if (args[3] == mp_const_none) {
             socket->callback = MP_OBJ_NULL;
         } else {
+            lwip_cb_batch_init();
             socket->callback = args[3];
         }
         return mp_const_none;
@@ -1389,15 +3256,96 @@ mp_obj_t lwip_socket_setsockopt(mp_uint_t n_args, const mp_obj_t *args) {
 
     // Integer options
     mp_int_t val = mp_obj_get_int(args[3]);
+    if (mp_obj_get_int(args[1]) == MOD_LWIP_IPPROTO_TCP) {
+        if (socket->type != MOD_NETWORK_SOCK_STREAM) {
+            nlr_raise(mp_obj_new_exception_arg1(&mp_type_OSError, MP_OBJ_NEW_SMALL_INT(EOPNOTSUPP)));
+        }
+        if (socket->pcb.tcp == NULL) {
+            // closed, or the connection was reset
+            nlr_raise(mp_obj_new_exception_arg1(&mp_type_OSError, MP_OBJ_NEW_SMALL_INT(EBADF)));
+        }
+        switch (opt) {
+            case MOD_LWIP_TCP_NODELAY:
+                // kept in flags as well, listening pcbs pass it on via accept()
+                if (val) {
+                    socket->flags |= SOCKET_FLAG_NODELAY;
+                    if (socket->pcb.tcp->state != LISTEN) {
+                        tcp_nagle_disable(socket->pcb.tcp);
+                    }
+                } else {
+                    socket->flags &= ~SOCKET_FLAG_NODELAY;
+                    if (socket->pcb.tcp->state != LISTEN) {
+                        tcp_nagle_enable(socket->pcb.tcp);
+                    }
+                }
+                break;
+            case MOD_LWIP_TCP_CORK:
+                // writes are coalesced until uncorked, flush() or a full segment
+                if (val) {
+                    socket->flags |= SOCKET_FLAG_CORK;
+                } else {
+                    socket->flags &= ~SOCKET_FLAG_CORK;
+                    lwip_tcp_push(socket, true);
+                }
+                break;
+            default:
+                printf("Warning: lwip.setsockopt() not implemented\n");
+        }
+        return mp_const_none;
+    }
+
     switch (opt) {
         case SOF_REUSEADDR:
             // Options are common for UDP and TCP pcb's.
+            if (socket->type == MOD_NETWORK_SOCK_RAW) {
+                break;
+            }
+            if (socket->pcb.tcp == NULL) {
+                nlr_raise(mp_obj_new_exception_arg1(&mp_type_OSError, MP_OBJ_NEW_SMALL_INT(EBADF)));
+            }
             if (val) {
                 ip_set_option(socket->pcb.tcp, SOF_REUSEADDR);
             } else {
                 ip_reset_option(socket->pcb.tcp, SOF_REUSEADDR);
             }
             break;
+        case MOD_LWIP_SO_XBUF:
+            if (val) {
+                socket->flags |= SOCKET_FLAG_XBUF;
+            } else {
+                socket->flags &= ~SOCKET_FLAG_XBUF;
+            }
+            break;
+        case MOD_LWIP_SO_RXQUEUE:
+            // Packets already queued beyond a reduced depth are kept
+            if (val < 1 || val > LWIP_SOCKET_RXQ_MAX) {
+                nlr_raise(mp_obj_new_exception_arg1(&mp_type_OSError, MP_OBJ_NEW_SMALL_INT(EINVAL)));
+            }
+            socket->rxq.depth = val;
+            break;
+        case MOD_LWIP_SO_SNDBUF:
+        case MOD_LWIP_SO_RCVBUF: {
+            // 0 restores the lwIP default; limits cannot exceed it
+            if (socket->type != MOD_NETWORK_SOCK_STREAM) {
+                break;
+            }
+            if (val < 0) {
+                nlr_raise(mp_obj_new_exception_arg1(&mp_type_OSError, MP_OBJ_NEW_SMALL_INT(EINVAL)));
+            }
+            mp_uint_t max = (opt == MOD_LWIP_SO_SNDBUF) ? TCP_SND_BUF : TCP_WND;
+            if (val != 0) {
+                val = MAX(val, LWIP_SOCKET_BUF_MIN);
+            }
+            if ((mp_uint_t)val >= max) {
+                val = 0;
+            }
+            if (opt == MOD_LWIP_SO_SNDBUF) {
+                socket->sndbuf = val;
+            } else {
+                lwip_tcp_set_rcvbuf(socket, val);
+            }
+            break;
+        }
         default:
             printf("Warning: lwip.setsockopt() not implemented\n");
     }
@@ -1405,6 +3353,43 @@ mp_obj_t lwip_socket_setsockopt(mp_uint_t n_args, const mp_obj_t *args) {
 }
 STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(lwip_socket_setsockopt_obj, 4, 4, lwip_socket_setsockopt);
 
+// Hands data held back by TCP_CORK (or the Nagle algorithm) to lwIP,
+// e.g. once per response instead of once per send()
+mp_obj_t lwip_socket_flush(mp_obj_t self_in) {
+    lwip_socket_obj_t *socket = self_in;
+    if (socket->type == MOD_NETWORK_SOCK_STREAM) {
+        lwip_tcp_push(socket, true);
+    }
+    return mp_const_none;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_1(lwip_socket_flush_obj, lwip_socket_flush);
+
+// Returns a dict of the traffic counters of the socket
+mp_obj_t lwip_socket_stats(mp_obj_t self_in) {
+    lwip_socket_obj_t *socket = self_in;
+    mp_obj_t d = mp_obj_new_dict(0);
+    lwip_stats_store(d, MP_QSTR_rx_bytes, socket->stats.rx_bytes);
+    lwip_stats_store(d, MP_QSTR_rx_packets, socket->stats.rx_packets);
+    lwip_stats_store(d, MP_QSTR_tx_bytes, socket->stats.tx_bytes);
+    lwip_stats_store(d, MP_QSTR_tx_packets, socket->stats.tx_packets);
+    lwip_stats_store(d, MP_QSTR_drops, socket->rxq.drops);
+    lwip_stats_store(d, MP_QSTR_queued, socket->rxq.count);
+    return d;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_1(lwip_socket_stats_obj, lwip_socket_stats);
+
+// Returns (queued, depth, drops) of the receive queue
+mp_obj_t lwip_socket_rxqueue(mp_obj_t self_in) {
+    lwip_socket_obj_t *socket = self_in;
+    mp_obj_t tuple[3] = {
+        MP_OBJ_NEW_SMALL_INT(socket->rxq.count),
+        MP_OBJ_NEW_SMALL_INT(socket->rxq.depth),
+        mp_obj_new_int_from_uint(socket->rxq.drops),
+    };
+    return mp_obj_new_tuple(3, tuple);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_1(lwip_socket_rxqueue_obj, lwip_socket_rxqueue);
+
 mp_obj_t lwip_socket_makefile(mp_uint_t n_args, const mp_obj_t *args) {
     (void)n_args;
     return args[0];
@@ -1419,8 +3404,11 @@ mp_uint_t lwip_socket_read(mp_obj_t self_in, void *buf, mp_uint_t size, int *err
             return lwip_tcp_receive(socket, buf, size, errcode);
         case MOD_NETWORK_SOCK_DGRAM:
             return lwip_udp_receive(socket, buf, size, NULL, NULL, errcode);
+        case MOD_NETWORK_SOCK_RAW:
+            return lwip_raw_receive(socket, buf, size, NULL, errcode);
     }
     // Unreachable
+    *errcode = EOPNOTSUPP;
     return MP_STREAM_ERROR;
 }
 
@@ -1432,12 +3420,74 @@ mp_uint_t lwip_socket_write(mp_obj_t self_in, const void *buf, mp_uint_t size, i
             return lwip_tcp_send(socket, buf, size, errcode);
         case MOD_NETWORK_SOCK_DGRAM:
             return lwip_udp_send(socket, buf, size, NULL, 0, errcode);
+        case MOD_NETWORK_SOCK_RAW:
+            return lwip_raw_sendto(socket, buf, size, NULL, errcode);
     }
 
     // Unreachable
+    *errcode = EOPNOTSUPP;
     return MP_STREAM_ERROR;
 }
 
+mp_uint_t lwip_socket_ioctl(mp_obj_t self_in, mp_uint_t request, uintptr_t arg, int *errcode) {
+    lwip_socket_obj_t *socket = self_in;
+    mp_uint_t ret;
+
+    if (request == MP_STREAM_POLL) {
+        uintptr_t flags = arg;
+        ret = 0;
+
+        // queued data, or for listeners, connections waiting for accept()
+        if ((flags & MP_STREAM_POLL_RD) && !RXQ_EMPTY(socket)) {
+            ret |= MP_STREAM_POLL_RD;
+        }
+
+        if (socket->state < 0) {
+            // connection failed, was reset or the socket is closed
+            ret |= MP_STREAM_POLL_ERR | MP_STREAM_POLL_HUP;
+        } else if (socket->type == MOD_NETWORK_SOCK_RAW) {
+            if ((flags & MP_STREAM_POLL_RD) && socket->pcb.raw->count > 0) {
+                ret |= MP_STREAM_POLL_RD;
+            }
+            ret |= flags & MP_STREAM_POLL_WR;
+        } else if (socket->type == MOD_NETWORK_SOCK_STREAM) {
+            if (socket->state == STATE_PEER_CLOSED) {
+                // reading returns EOF once the queue is drained
+                ret |= MP_STREAM_POLL_HUP | (flags & MP_STREAM_POLL_RD);
+            }
+            if ((flags & MP_STREAM_POLL_WR) && socket->pcb.tcp != NULL
+                && socket->state >= STATE_CONNECTED && lwip_tcp_sndbuf(socket) > 0) {
+                ret |= MP_STREAM_POLL_WR;
+            }
+        } else {
+            if ((flags & MP_STREAM_POLL_WR) && socket->pcb.udp != NULL) {
+                ret |= MP_STREAM_POLL_WR;
+            }
+        }
+    } else {
+        *errcode = EINVAL;
+        ret = MP_STREAM_ERROR;
+    }
+
+    return ret;
+}
+
+// Called by uselect and httpd.serve() while they wait for sockets to
+// become ready; sleeps like the blocking socket calls once idle, but not
+// past start_ms + timeout_ms on the mp_hal_ticks_ms() clock (timeout_ms
+// -1: no timeout)
+void lwip_poll_hook(mp_uint_t start_ms, mp_uint_t timeout_ms) {
+    mp_uint_t wait_ms = LWIP_POLL_SLEEP_MAX_MS;
+    if (timeout_ms != (mp_uint_t)-1) {
+        mp_uint_t elapsed = mp_hal_ticks_ms() - start_ms;
+        mp_uint_t left = (elapsed < timeout_ms) ? timeout_ms - elapsed : 0;
+        if (left < wait_ms) {
+            wait_ms = left;
+        }
+    }
+    lwip_poll_wait(monotonic_clock() + MILLISECS(wait_ms));
+}
+
 STATIC const mp_map_elem_t lwip_socket_locals_dict_table[] = {
     { MP_OBJ_NEW_QSTR(MP_QSTR___del__), (mp_obj_t)&lwip_socket_close_obj },
     { MP_OBJ_NEW_QSTR(MP_QSTR_close), (mp_obj_t)&lwip_socket_close_obj },
@@ -1447,15 +3497,27 @@ STATIC const mp_map_elem_t lwip_socket_locals_dict_table[] = {
     { MP_OBJ_NEW_QSTR(MP_QSTR_connect), (mp_obj_t)&lwip_socket_connect_obj },
     { MP_OBJ_NEW_QSTR(MP_QSTR_send), (mp_obj_t)&lwip_socket_send_obj },
     { MP_OBJ_NEW_QSTR(MP_QSTR_recv), (mp_obj_t)&lwip_socket_recv_obj },
+    { MP_OBJ_NEW_QSTR(MP_QSTR_recv_into), (mp_obj_t)&lwip_socket_recv_into_obj },
+    { MP_OBJ_NEW_QSTR(MP_QSTR_recv_view), (mp_obj_t)&lwip_socket_recv_view_obj },
+    { MP_OBJ_NEW_QSTR(MP_QSTR_ws_recv_frames), (mp_obj_t)&lwip_socket_ws_recv_frames_obj },
+    { MP_OBJ_NEW_QSTR(MP_QSTR_ws_send), (mp_obj_t)&lwip_socket_ws_send_obj },
+    { MP_OBJ_NEW_QSTR(MP_QSTR_recv_batch), (mp_obj_t)&lwip_socket_recv_batch_obj },
+    { MP_OBJ_NEW_QSTR(MP_QSTR_send_batch), (mp_obj_t)&lwip_socket_send_batch_obj },
     { MP_OBJ_NEW_QSTR(MP_QSTR_sendto), (mp_obj_t)&lwip_socket_sendto_obj },
+    { MP_OBJ_NEW_QSTR(MP_QSTR_sendmany), (mp_obj_t)&lwip_socket_sendmany_obj },
     { MP_OBJ_NEW_QSTR(MP_QSTR_recvfrom), (mp_obj_t)&lwip_socket_recvfrom_obj },
     { MP_OBJ_NEW_QSTR(MP_QSTR_sendall), (mp_obj_t)&lwip_socket_sendall_obj },
+    { MP_OBJ_NEW_QSTR(MP_QSTR_sendfile), (mp_obj_t)&lwip_socket_sendfile_obj },
     { MP_OBJ_NEW_QSTR(MP_QSTR_settimeout), (mp_obj_t)&lwip_socket_settimeout_obj },
     { MP_OBJ_NEW_QSTR(MP_QSTR_setblocking), (mp_obj_t)&lwip_socket_setblocking_obj },
     { MP_OBJ_NEW_QSTR(MP_QSTR_setsockopt), (mp_obj_t)&lwip_socket_setsockopt_obj },
+    { MP_OBJ_NEW_QSTR(MP_QSTR_rxqueue), (mp_obj_t)&lwip_socket_rxqueue_obj },
+    { MP_OBJ_NEW_QSTR(MP_QSTR_flush), (mp_obj_t)&lwip_socket_flush_obj },
+    { MP_OBJ_NEW_QSTR(MP_QSTR_stats), (mp_obj_t)&lwip_socket_stats_obj },
     { MP_OBJ_NEW_QSTR(MP_QSTR_makefile), (mp_obj_t)&lwip_socket_makefile_obj },
 
     { MP_OBJ_NEW_QSTR(MP_QSTR_read), (mp_obj_t)&mp_stream_read_obj },
+    { MP_OBJ_NEW_QSTR(MP_QSTR_readinto), (mp_obj_t)&mp_stream_readinto_obj },
     { MP_OBJ_NEW_QSTR(MP_QSTR_readline), (mp_obj_t)&mp_stream_unbuffered_readline_obj},
     { MP_OBJ_NEW_QSTR(MP_QSTR_write), (mp_obj_t)&mp_stream_write_obj },
 };
@@ -1464,9 +3526,10 @@ STATIC MP_DEFINE_CONST_DICT(lwip_socket_locals_dict, lwip_socket_locals_dict_tab
 STATIC const mp_stream_p_t lwip_socket_stream_p = {
     .read = lwip_socket_read,
     .write = lwip_socket_write,
+    .ioctl = lwip_socket_ioctl,
 };
 
-STATIC const mp_obj_type_t lwip_socket_type = {
+const mp_obj_type_t lwip_socket_type = {
     { &mp_type_type },
     .name = MP_QSTR_socket,
     .print = lwip_socket_print,
@@ -1568,62 +3631,216 @@ STATIC mp_obj_t mod_lwip_callback() {
 
 //MP_DEFINE_CONST_FUN_OBJ_0(mod_lwip_callback_obj, mod_lwip_callback);
 
-typedef struct _getaddrinfo_state_t {
-    volatile int status;
-    volatile ip_addr_t ipaddr;
-} getaddrinfo_state_t;
-
-// Callback for incoming DNS requests.
-STATIC void lwip_getaddrinfo_cb(const char *name, ip_addr_t *ipaddr, void *arg) {
-    getaddrinfo_state_t *state = arg;
-    if (ipaddr != NULL) {
-        state->status = 1;
-        state->ipaddr = *ipaddr;
-    } else {
-        // error
-        state->status = -2;
+// lwip.getaddrinfo: resolved through the udns cache
+mp_obj_t lwip_getaddrinfo(mp_obj_t host_in, mp_obj_t port_in) {
+    return dns_getaddrinfo(host_in, port_in);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_2(lwip_getaddrinfo_obj, lwip_getaddrinfo);
+
+// Statistics
+
+#if LWIP_STATS
+STATIC mp_obj_t lwip_stats_proto(const struct stats_proto *sp) {
+    mp_obj_t d = mp_obj_new_dict(0);
+    lwip_stats_store(d, MP_QSTR_xmit, sp->xmit);
+    lwip_stats_store(d, MP_QSTR_recv, sp->recv);
+    lwip_stats_store(d, MP_QSTR_fw, sp->fw);
+    lwip_stats_store(d, MP_QSTR_drop, sp->drop);
+    lwip_stats_store(d, MP_QSTR_chkerr, sp->chkerr);
+    lwip_stats_store(d, MP_QSTR_lenerr, sp->lenerr);
+    lwip_stats_store(d, MP_QSTR_memerr, sp->memerr);
+    lwip_stats_store(d, MP_QSTR_rterr, sp->rterr);
+    lwip_stats_store(d, MP_QSTR_proterr, sp->proterr);
+    lwip_stats_store(d, MP_QSTR_opterr, sp->opterr);
+    lwip_stats_store(d, MP_QSTR_err, sp->err);
+    return d;
+}
+
+#if MEM_STATS || MEMP_STATS
+STATIC mp_obj_t lwip_stats_mem(const struct stats_mem *sm) {
+    mp_obj_t d = mp_obj_new_dict(0);
+    lwip_stats_store(d, MP_QSTR_avail, sm->avail);
+    lwip_stats_store(d, MP_QSTR_used, sm->used);
+    lwip_stats_store(d, MP_QSTR_max, sm->max);
+    lwip_stats_store(d, MP_QSTR_err, sm->err);
+    return d;
+}
+#endif
+
+#if MEMP_STATS
+#if LWIP_VERSION_MAJOR >= 2
+#define LWIP_STATS_MEMP(i) (lwip_stats.memp[(i)])
+#else
+#define LWIP_STATS_MEMP(i) (&lwip_stats.memp[(i)])
+#endif
+
+// Pool name -> usage of every memp pool (pbufs, pcbs, segments, ...)
+STATIC mp_obj_t lwip_stats_memp(void) {
+    mp_obj_t d = mp_obj_new_dict(0);
+    for (int i = 0; i < MEMP_MAX; i++) {
+        const struct stats_mem *sm = LWIP_STATS_MEMP(i);
+        if (sm == NULL || sm->name == NULL) {
+            continue;
+        }
+        mp_obj_dict_store(d, mp_obj_new_str(sm->name, strlen(sm->name), false),
+                          lwip_stats_mem(sm));
     }
+    return d;
 }
+#endif
 
-// lwip.getaddrinfo
-mp_obj_t lwip_getaddrinfo(mp_obj_t host_in, mp_obj_t port_in) {
-    mp_uint_t hlen;
-    const char *host = mp_obj_str_get_data(host_in, &hlen);
-    mp_int_t port = mp_obj_get_int(port_in);
-
-    getaddrinfo_state_t state;
-    state.status = 0;
-
-    err_t ret = dns_gethostbyname(host, (ip_addr_t*)&state.ipaddr, lwip_getaddrinfo_cb, &state);
-    switch (ret) {
-        case ERR_OK:
-            // cached
-            state.status = 1;
-            break;
-        case ERR_INPROGRESS:
-            while (state.status == 0) {
-                poll_sockets();
-            }
-            break;
-        default:
-            state.status = ret;
+#if MIB2_STATS
+STATIC mp_obj_t lwip_stats_mib2(void) {
+    const struct stats_mib2 *m = &lwip_stats.mib2;
+    mp_obj_t d = mp_obj_new_dict(0);
+    lwip_stats_store(d, MP_QSTR_ipinreceives, m->ipinreceives);
+    lwip_stats_store(d, MP_QSTR_ipinhdrerrors, m->ipinhdrerrors);
+    lwip_stats_store(d, MP_QSTR_ipinaddrerrors, m->ipinaddrerrors);
+    lwip_stats_store(d, MP_QSTR_ipindiscards, m->ipindiscards);
+    lwip_stats_store(d, MP_QSTR_ipindelivers, m->ipindelivers);
+    lwip_stats_store(d, MP_QSTR_ipoutrequests, m->ipoutrequests);
+    lwip_stats_store(d, MP_QSTR_ipoutdiscards, m->ipoutdiscards);
+    lwip_stats_store(d, MP_QSTR_ipoutnoroutes, m->ipoutnoroutes);
+    lwip_stats_store(d, MP_QSTR_tcpactiveopens, m->tcpactiveopens);
+    lwip_stats_store(d, MP_QSTR_tcppassiveopens, m->tcppassiveopens);
+    lwip_stats_store(d, MP_QSTR_tcpattemptfails, m->tcpattemptfails);
+    lwip_stats_store(d, MP_QSTR_tcpestabresets, m->tcpestabresets);
+    lwip_stats_store(d, MP_QSTR_tcpinsegs, m->tcpinsegs);
+    lwip_stats_store(d, MP_QSTR_tcpoutsegs, m->tcpoutsegs);
+    lwip_stats_store(d, MP_QSTR_tcpretranssegs, m->tcpretranssegs);
+    lwip_stats_store(d, MP_QSTR_tcpinerrs, m->tcpinerrs);
+    lwip_stats_store(d, MP_QSTR_tcpoutrsts, m->tcpoutrsts);
+    lwip_stats_store(d, MP_QSTR_udpindatagrams, m->udpindatagrams);
+    lwip_stats_store(d, MP_QSTR_udpoutdatagrams, m->udpoutdatagrams);
+    lwip_stats_store(d, MP_QSTR_udpnoports, m->udpnoports);
+    lwip_stats_store(d, MP_QSTR_udpinerrors, m->udpinerrors);
+    return d;
+}
+#endif
+#endif // LWIP_STATS
+
+// One dict per netfront interface set up by lwip_addif
+STATIC mp_obj_t lwip_stats_netif(void) {
+    mp_obj_t l = mp_obj_new_list(0, NULL);
+    for (struct netif *nif = netif_list; nif != NULL; nif = nif->next) {
+        if (nif->input == lwip_ether_input) {
+            mp_obj_list_append(l, lwip_ether_stats_dict(LWIP_ETHER_OF(nif)));
+        }
     }
+    return l;
+}
+
+// Interface polling (see poll_sockets_conly)
+STATIC mp_obj_t lwip_stats_poll(void) {
+    mp_obj_t d = mp_obj_new_dict(0);
+    lwip_stats_store(d, MP_QSTR_busy, lwip_poll.busy);
+    lwip_stats_store(d, MP_QSTR_passes, lwip_poll.stats.passes);
+    lwip_stats_store(d, MP_QSTR_frames, lwip_poll.stats.frames);
+    lwip_stats_store(d, MP_QSTR_exhausted, lwip_poll.stats.exhausted);
+    lwip_stats_store(d, MP_QSTR_busy_waits, lwip_poll.stats.busy_waits);
+    lwip_stats_store(d, MP_QSTR_sleeps, lwip_poll.stats.sleeps);
+    lwip_stats_store(d, MP_QSTR_to_busy, lwip_poll.stats.to_busy);
+    lwip_stats_store(d, MP_QSTR_to_sleep, lwip_poll.stats.to_sleep);
+    lwip_cb_batch_t *b = MP_STATE_PORT(lwip_cb_batch);
+    if (b != NULL) {
+        lwip_stats_store(d, MP_QSTR_callbacks, b->calls);
+        lwip_stats_store(d, MP_QSTR_coalesced, b->coalesced);
+        lwip_stats_store(d, MP_QSTR_direct, b->direct);
+    }
+    return d;
+}
 
-    if (state.status < 0) {
-        // TODO: CPython raises gaierror, we raise with native lwIP negative error
-        // values, to differentiate from normal errno's at least in such way.
-        nlr_raise(mp_obj_new_exception_arg1(&mp_type_OSError, MP_OBJ_NEW_SMALL_INT(state.status)));
+STATIC mp_obj_t lwip_stats_section(qstr section) {
+    switch (section) {
+    case MP_QSTR_netif: return lwip_stats_netif();
+    case MP_QSTR_poll: return lwip_stats_poll();
+    #if LWIP_STATS
+    #if LINK_STATS
+    case MP_QSTR_link: return lwip_stats_proto(&lwip_stats.link);
+    #endif
+    #if ETHARP_STATS
+    case MP_QSTR_etharp: return lwip_stats_proto(&lwip_stats.etharp);
+    #endif
+    #if IP_STATS
+    case MP_QSTR_ip: return lwip_stats_proto(&lwip_stats.ip);
+    #endif
+    #if ICMP_STATS
+    case MP_QSTR_icmp: return lwip_stats_proto(&lwip_stats.icmp);
+    #endif
+    #if UDP_STATS
+    case MP_QSTR_udp: return lwip_stats_proto(&lwip_stats.udp);
+    #endif
+    #if TCP_STATS
+    case MP_QSTR_tcp: return lwip_stats_proto(&lwip_stats.tcp);
+    #endif
+    #if MEM_STATS
+    case MP_QSTR_mem: return lwip_stats_mem(&lwip_stats.mem);
+    #endif
+    #if MEMP_STATS
+    case MP_QSTR_memp: return lwip_stats_memp();
+    #endif
+    #if MIB2_STATS
+    case MP_QSTR_mib2: return lwip_stats_mib2();
+    #endif
+    #endif // LWIP_STATS
+    default: return MP_OBJ_NULL;
     }
-    
-    mp_obj_tuple_t *tuple = mp_obj_new_tuple(5, NULL);
-    tuple->items[0] = MP_OBJ_NEW_SMALL_INT(MOD_NETWORK_AF_INET);
-    tuple->items[1] = MP_OBJ_NEW_SMALL_INT(MOD_NETWORK_SOCK_STREAM);
-    tuple->items[2] = MP_OBJ_NEW_SMALL_INT(0);
-    tuple->items[3] = MP_OBJ_NEW_QSTR(MP_QSTR_);
-    tuple->items[4] = netutils_format_inet_addr((uint8_t*)&state.ipaddr, port, NETUTILS_BIG);
-    return mp_obj_new_list(1, (mp_obj_t*)&tuple);
 }
-STATIC MP_DEFINE_CONST_FUN_OBJ_2(lwip_getaddrinfo_obj, lwip_getaddrinfo);
+
+// lwip.stats([section]): snapshot of the stack counters as a dict keyed
+// by section; sections compiled out of lwIP are omitted.  Passing a
+// section name returns just that section.
+STATIC mp_obj_t lwip_stats_get(size_t n_args, const mp_obj_t *args) {
+    static const qstr sections[] = {
+        MP_QSTR_netif, MP_QSTR_poll, MP_QSTR_link, MP_QSTR_etharp, MP_QSTR_ip,
+        MP_QSTR_icmp, MP_QSTR_udp, MP_QSTR_tcp, MP_QSTR_mem,
+        MP_QSTR_memp, MP_QSTR_mib2,
+    };
+
+    if (n_args > 0) {
+        mp_obj_t d = lwip_stats_section(mp_obj_str_get_qstr(args[0]));
+        if (d == MP_OBJ_NULL) {
+            nlr_raise(mp_obj_new_exception_msg(&mp_type_ValueError, "unknown stats section"));
+        }
+        return d;
+    }
+
+    mp_obj_t d = mp_obj_new_dict(0);
+    for (size_t i = 0; i < MP_ARRAY_SIZE(sections); i++) {
+        mp_obj_t s = lwip_stats_section(sections[i]);
+        if (s != MP_OBJ_NULL) {
+            mp_obj_dict_store(d, MP_OBJ_NEW_QSTR(sections[i]), s);
+        }
+    }
+    return d;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(lwip_stats_obj, 0, 1, lwip_stats_get);
+
+// lwip.poll_config([budget[, idle]]): frames taken per polling pass and
+// the empty passes after which waits sleep instead of busy polling.
+// Returns the settings in effect as (budget, idle).
+STATIC mp_obj_t lwip_poll_config(size_t n_args, const mp_obj_t *args) {
+    if (n_args > 0) {
+        mp_int_t budget = mp_obj_get_int(args[0]);
+        if (budget < 1) {
+            nlr_raise(mp_obj_new_exception_msg(&mp_type_ValueError, "budget must be positive"));
+        }
+        lwip_poll.budget = budget;
+    }
+    if (n_args > 1) {
+        mp_int_t idle = mp_obj_get_int(args[1]);
+        if (idle < 1) {
+            nlr_raise(mp_obj_new_exception_msg(&mp_type_ValueError, "idle must be positive"));
+        }
+        lwip_poll.idle = idle;
+    }
+    mp_obj_t tuple[2] = {
+        mp_obj_new_int_from_uint(lwip_poll.budget),
+        mp_obj_new_int_from_uint(lwip_poll.idle),
+    };
+    return mp_obj_new_tuple(2, tuple);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(lwip_poll_config_obj, 0, 2, lwip_poll_config);
 
 // Debug functions
 
@@ -1640,6 +3857,8 @@ STATIC const mp_map_elem_t mp_module_lwip_globals_table[] = {
     { MP_OBJ_NEW_QSTR(MP_QSTR_reset), (mp_obj_t)&mod_lwip_reset_obj },
     { MP_OBJ_NEW_QSTR(MP_QSTR_getaddrinfo), (mp_obj_t)&lwip_getaddrinfo_obj },
     { MP_OBJ_NEW_QSTR(MP_QSTR_print_pcbs), (mp_obj_t)&lwip_print_pcbs_obj },
+    { MP_OBJ_NEW_QSTR(MP_QSTR_stats), (mp_obj_t)&lwip_stats_obj },
+    { MP_OBJ_NEW_QSTR(MP_QSTR_poll_config), (mp_obj_t)&lwip_poll_config_obj },
     //    { MP_OBJ_NEW_QSTR(MP_QSTR_netifadd), (mp_obj_t)&mod_lwip_netifadd_obj },
     //{ MP_OBJ_NEW_QSTR(MP_QSTR_poll), (mp_obj_t)&mod_lwip_poll_obj },        
     // objects
@@ -1651,6 +3870,7 @@ STATIC const mp_map_elem_t mp_module_lwip_globals_table[] = {
     // class constants
     { MP_OBJ_NEW_QSTR(MP_QSTR_AF_INET), MP_OBJ_NEW_SMALL_INT(MOD_NETWORK_AF_INET) },
     { MP_OBJ_NEW_QSTR(MP_QSTR_AF_INET6), MP_OBJ_NEW_SMALL_INT(MOD_NETWORK_AF_INET6) },
+    { MP_OBJ_NEW_QSTR(MP_QSTR_AF_PACKET), MP_OBJ_NEW_SMALL_INT(MOD_NETWORK_AF_PACKET) },
 
     { MP_OBJ_NEW_QSTR(MP_QSTR_SOCK_STREAM), MP_OBJ_NEW_SMALL_INT(MOD_NETWORK_SOCK_STREAM) },
     { MP_OBJ_NEW_QSTR(MP_QSTR_SOCK_DGRAM), MP_OBJ_NEW_SMALL_INT(MOD_NETWORK_SOCK_DGRAM) },
@@ -1658,6 +3878,21 @@ STATIC const mp_map_elem_t mp_module_lwip_globals_table[] = {
 
     { MP_OBJ_NEW_QSTR(MP_QSTR_SOL_SOCKET), MP_OBJ_NEW_SMALL_INT(1) },
     { MP_OBJ_NEW_QSTR(MP_QSTR_SO_REUSEADDR), MP_OBJ_NEW_SMALL_INT(SOF_REUSEADDR) },
+    { MP_OBJ_NEW_QSTR(MP_QSTR_SO_CALLBACK), MP_OBJ_NEW_SMALL_INT(MOD_LWIP_SO_CALLBACK) },
+    { MP_OBJ_NEW_QSTR(MP_QSTR_SO_XBUF), MP_OBJ_NEW_SMALL_INT(MOD_LWIP_SO_XBUF) },
+    { MP_OBJ_NEW_QSTR(MP_QSTR_SO_RXQUEUE), MP_OBJ_NEW_SMALL_INT(MOD_LWIP_SO_RXQUEUE) },
+    { MP_OBJ_NEW_QSTR(MP_QSTR_SO_SNDBUF), MP_OBJ_NEW_SMALL_INT(MOD_LWIP_SO_SNDBUF) },
+    { MP_OBJ_NEW_QSTR(MP_QSTR_SO_RCVBUF), MP_OBJ_NEW_SMALL_INT(MOD_LWIP_SO_RCVBUF) },
+
+    { MP_OBJ_NEW_QSTR(MP_QSTR_IPPROTO_TCP), MP_OBJ_NEW_SMALL_INT(MOD_LWIP_IPPROTO_TCP) },
+    { MP_OBJ_NEW_QSTR(MP_QSTR_TCP_NODELAY), MP_OBJ_NEW_SMALL_INT(MOD_LWIP_TCP_NODELAY) },
+    { MP_OBJ_NEW_QSTR(MP_QSTR_TCP_CORK), MP_OBJ_NEW_SMALL_INT(MOD_LWIP_TCP_CORK) },
+
+    { MP_OBJ_NEW_QSTR(MP_QSTR_WS_TEXT), MP_OBJ_NEW_SMALL_INT(LWIP_WS_OP_TEXT) },
+    { MP_OBJ_NEW_QSTR(MP_QSTR_WS_BINARY), MP_OBJ_NEW_SMALL_INT(LWIP_WS_OP_BINARY) },
+    { MP_OBJ_NEW_QSTR(MP_QSTR_WS_CLOSE), MP_OBJ_NEW_SMALL_INT(LWIP_WS_OP_CLOSE) },
+    { MP_OBJ_NEW_QSTR(MP_QSTR_WS_PING), MP_OBJ_NEW_SMALL_INT(LWIP_WS_OP_PING) },
+    { MP_OBJ_NEW_QSTR(MP_QSTR_WS_PONG), MP_OBJ_NEW_SMALL_INT(LWIP_WS_OP_PONG) },
 };
 
 STATIC MP_DEFINE_CONST_DICT(mp_module_lwip_globals, mp_module_lwip_globals_table);
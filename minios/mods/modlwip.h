@@ -47,26 +47,91 @@
 #include "lwip/inet.h"
 #include <mini-os/lwip-net.h>
 
+// Per-socket receive queue: up to depth (<= LWIP_SOCKET_RXQ_MAX) pbufs
+// are held until they are read. UDP datagrams arriving on a full queue
+// are dropped; for TCP lwIP keeps the data and the window closes.
+// Listening sockets queue connections waiting for accept() instead;
+// the depth follows the listen() backlog.
+#ifndef LWIP_SOCKET_RXQ_MAX
+#define LWIP_SOCKET_RXQ_MAX (16)
+#endif
+#ifndef LWIP_SOCKET_RXQ_DEFAULT
+#define LWIP_SOCKET_RXQ_DEFAULT (8)
+#endif
+
+typedef struct _lwip_rxq_slot_t {
+    union {
+        struct pbuf *pbuf;
+        struct tcp_pcb *connection; // NULL if reset before accept()
+    };
+    byte peer[4];       // source of a UDP datagram
+    uint16_t peer_port;
+} lwip_rxq_slot_t;
+
+// SHFS cache buffers handed to tcp_write() without copying, by sendfile()
+// and httpd. Each entry stays pinned until lwIP has seen the ACK for its
+// last byte (end_seq).
+#ifndef LWIP_SENDFILE_PIN_MAX
+#define LWIP_SENDFILE_PIN_MAX (8)
+#endif
+
+typedef struct _lwip_pinq_t {
+    struct {
+        struct shfs_cache_entry *cce;
+        u32_t end_seq;
+    } e[LWIP_SENDFILE_PIN_MAX];
+    uint8_t head;
+    uint8_t count;
+    uint8_t open; // the last entry is still being written from
+} lwip_pinq_t;
+
 typedef struct _lwip_socket_obj_t {
     mp_obj_base_t base;
 
     volatile union {
         struct tcp_pcb *tcp;
         struct udp_pcb *udp;
+        struct _lwip_raw_ring_t *raw; // raw sockets have no pcb, only a ring
     } pcb;
-    volatile union {
-        struct pbuf *pbuf;
-        struct tcp_pcb *connection;
-    } incoming;
+    struct {
+        lwip_rxq_slot_t slot[LWIP_SOCKET_RXQ_MAX];
+        volatile uint8_t head;
+        volatile uint8_t count;
+        uint8_t depth;
+        mp_uint_t drops;  // UDP datagrams dropped, TCP segments pushed back,
+                          // connections refused by a listener
+    } rxq;
     mp_obj_t callback;
+    struct _lwip_pinq_t *pinq; // buffers lent to lwIP while in sendfile()
+    struct _lwip_ws_rx_t *ws_rx; // WebSocket frame being reassembled
+    struct {
+        mp_uint_t rx_bytes;
+        mp_uint_t rx_packets; // datagrams, or TCP pbuf chains
+        mp_uint_t tx_bytes;   // TCP: acknowledged by the peer
+        mp_uint_t tx_packets; // datagrams
+    } stats;
+    mp_obj_t io_task[2];  // uevent tasks waiting to read/write
+    mp_int_t io_slot;     // index in the uevent socket table, -1 if none
     byte peer[4];
     mp_uint_t peer_port;
-    mp_uint_t timeout;
+    uint64_t timeout;   // us; -1: blocking, 0: non-blocking
     uint16_t leftover_count;
 
     uint8_t domain;
     uint8_t type;
 
+    #define SOCKET_FLAG_XBUF (0x01) // recv()/recvfrom() return xbuf objects
+    #define SOCKET_FLAG_CORK (0x02) // TCP: hold back partial segments until flushed
+    #define SOCKET_FLAG_NODELAY (0x04) // TCP: Nagle's algorithm disabled
+    #define SOCKET_FLAG_CB_QUEUED (0x08) // callback waits in the batch
+    uint8_t flags;
+
+    // TCP buffer limits below the lwIP defaults, 0 if not set
+    uint32_t sndbuf;
+    uint32_t rcvbuf;
+    uint32_t rcv_withheld; // receive window still to be taken off for rcvbuf
+    uint32_t unpushed;     // bytes written while corked since the last push
+
     #define STATE_NEW 0
     #define STATE_CONNECTING 1
     #define STATE_CONNECTED 2
@@ -75,6 +140,28 @@ typedef struct _lwip_socket_obj_t {
     int8_t state;
 } lwip_socket_obj_t;
 
+extern const mp_obj_type_t lwip_socket_type;
+
+// Values exported by usocket, as in lwip/sockets.h (which is only
+// available with LWIP_SOCKET)
+#define MOD_LWIP_AF_INET (2)
+#define MOD_LWIP_SOCK_STREAM (1)
+#define MOD_LWIP_SOCK_DGRAM (2)
+#define MOD_LWIP_SOL_SOCKET (0xfff)
+#define MOD_LWIP_IPPROTO_UDP (17)
+
+// Port-specific options for setsockopt(SOL_SOCKET, ...)
+#define MOD_LWIP_SO_CALLBACK (20)
+#define MOD_LWIP_SO_XBUF (21)
+#define MOD_LWIP_SO_RXQUEUE (22) // receive queue depth
+#define MOD_LWIP_SO_SNDBUF (0x1001) // as in lwIP/BSD
+#define MOD_LWIP_SO_RCVBUF (0x1002)
+
+// Options for setsockopt(IPPROTO_TCP, ...)
+#define MOD_LWIP_IPPROTO_TCP (6)
+#define MOD_LWIP_TCP_NODELAY (0x01)
+#define MOD_LWIP_TCP_CORK (0x03) // as on Linux
+
 struct mcargs {
   struct eth_addr mac;
   struct netif    netif;
@@ -97,14 +184,31 @@ mp_obj_t lwip_socket_connect(mp_obj_t self_in, mp_obj_t addr_in);
 void lwip_socket_check_connected(lwip_socket_obj_t *socket);
 mp_obj_t lwip_socket_send(mp_obj_t self_in, mp_obj_t buf_in);
 mp_obj_t lwip_socket_recv(mp_obj_t self_in, mp_obj_t len_in);
+mp_obj_t lwip_socket_recv_into(mp_uint_t n_args, const mp_obj_t *args);
+mp_obj_t lwip_socket_recv_view(mp_uint_t n_args, const mp_obj_t *args);
+mp_obj_t lwip_socket_ws_recv_frames(mp_uint_t n_args, const mp_obj_t *args);
+mp_obj_t lwip_socket_ws_send(mp_uint_t n_args, const mp_obj_t *args);
+mp_obj_t lwip_socket_recv_batch(mp_obj_t self_in, mp_obj_t buf_in, mp_obj_t n_in);
+mp_obj_t lwip_socket_send_batch(mp_uint_t n_args, const mp_obj_t *args);
 mp_obj_t lwip_socket_sendto(mp_obj_t self_in, mp_obj_t data_in, mp_obj_t addr_in);
+mp_obj_t lwip_socket_sendmany(mp_obj_t self_in, mp_obj_t items_in);
 mp_obj_t lwip_socket_recvfrom(mp_obj_t self_in, mp_obj_t len_in);
 mp_obj_t lwip_socket_sendall(mp_obj_t self_in, mp_obj_t buf_in);
+mp_obj_t lwip_socket_sendfile(mp_uint_t n_args, const mp_obj_t *args);
 mp_obj_t lwip_socket_settimeout(mp_obj_t self_in, mp_obj_t timeout_in);
 mp_obj_t lwip_socket_setblocking(mp_obj_t self_in, mp_obj_t flag_in);
 mp_obj_t lwip_socket_setsockopt(mp_uint_t n_args, const mp_obj_t *args);
+mp_obj_t lwip_socket_rxqueue(mp_obj_t self_in);
+mp_obj_t lwip_socket_flush(mp_obj_t self_in);
+mp_obj_t lwip_socket_stats(mp_obj_t self_in);
 mp_obj_t lwip_socket_makefile(mp_uint_t n_args, const mp_obj_t *args);
 mp_uint_t lwip_socket_read(mp_obj_t self_in, void *buf, mp_uint_t size, int *errcode);
 mp_uint_t lwip_socket_write(mp_obj_t self_in, const void *buf, mp_uint_t size, int *errcode);
+mp_uint_t lwip_socket_ioctl(mp_obj_t self_in, mp_uint_t request, uintptr_t arg, int *errcode);
+#if SHFS_ENABLE
+void lwip_pinq_release(lwip_pinq_t *q, struct tcp_pcb *pcb);
+#endif
+void lwip_poll_hook(mp_uint_t start_ms, mp_uint_t timeout_ms);
+void lwip_poll_wait(uint64_t until_ns);
 mp_obj_t lwip_socket_make_new(const mp_obj_type_t *type, mp_uint_t n_args, mp_uint_t n_kw, const mp_obj_t *args);
 mp_obj_t lwip_getaddrinfo(mp_obj_t host_in, mp_obj_t port_in);
@@ -0,0 +1,414 @@
+/*
+ * This file is part of the Micro Python project, http://micropython.org/
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2017 NEC Europe Ltd., NEC Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/time.h>
+
+#include "py/nlr.h"
+#include "py/runtime.h"
+
+#include "lwip/pbuf.h"
+#include "lwip/timers.h"
+#include <mini-os/time.h>
+#include "blkdev.h"
+#include "modpcap.h"
+
+// Packet capture to a block device.
+//
+// The tap copies the first snaplen bytes of every frame passing the
+// netfront interfaces into a ring of fixed-size blocks as a classic pcap
+// stream; a timer writes completed blocks to the device with async I/O
+// while the network keeps running. The tap never waits: when the ring
+// is full the frame is dropped and counted (lossy) or, if the trace has
+// to stay complete, the capture stops.
+//
+// pcap has no length field, so the last block is padded with zeros on
+// stop(); the trace is the first stop() bytes of the device.
+#ifndef PCAP_BLOCK_SIZE
+#define PCAP_BLOCK_SIZE (32 * 1024) // bytes per write, <= BLKIF_MAX_SEGMENTS_PER_REQUEST pages
+#endif
+#ifndef PCAP_RING_DEFAULT
+#define PCAP_RING_DEFAULT (256 * 1024)
+#endif
+#ifndef PCAP_SNAPLEN_DEFAULT
+#define PCAP_SNAPLEN_DEFAULT (128)
+#endif
+#define PCAP_SNAPLEN_MAX (65535)
+#define PCAP_TMR_MS (10)
+#define PCAP_ALIGN(x, a) (((x) + (a) - 1) / (a) * (a))
+
+#define PCAP_MAGIC (0xa1b2c3d4)
+#define PCAP_LINKTYPE_ETHERNET (1)
+#define PCAP_HDR_LEN (24)
+#define PCAP_REC_LEN (16)
+
+// Ethernet + longest IPv4 header + ports, all the filter looks at
+#define PCAP_PEEK_LEN (14 + 60 + 4)
+#define PCAP_ETHTYPE_IP (0x0800)
+#define PCAP_PROTO_TCP (6)
+#define PCAP_PROTO_UDP (17)
+
+typedef struct _pcap_filter_t {
+    uint16_t proto; // 0: any, <= 0xff: IP protocol, otherwise ethertype
+    uint16_t port;  // 0: any, else TCP/UDP source or destination port
+    int vif;        // -1: any
+} pcap_filter_t;
+
+typedef struct _pcap_state_t {
+    struct blkdev *bd;
+    uint8_t *ring;
+    uint8_t *busy;       // per block: write in flight
+    uint32_t nblocks;
+    uint32_t snaplen;
+    bool lossy;
+    bool overflow;       // stopped capturing on a full ring or device
+    pcap_filter_t filter;
+    uint64_t wall_base;  // ns between the monotonic and the wall clock
+
+    // byte offsets into the trace: appended, submitted to the device and
+    // written; the ring holds [done, head)
+    uint64_t head;
+    uint64_t submitted;
+    uint64_t done;
+    uint64_t limit;      // device size
+
+    mp_uint_t captured;
+    mp_uint_t dropped;
+    mp_uint_t filtered;
+    mp_uint_t errors;
+} pcap_state_t;
+
+bool pcap_enabled = false;
+STATIC pcap_state_t pcap_state;
+
+#define PCAP_RING_SIZE(st) ((uint64_t)(st)->nblocks * PCAP_BLOCK_SIZE)
+
+/******************************************************************************/
+// Ring
+
+STATIC void pcap_put(pcap_state_t *st, const void *data, uint32_t len) {
+    uint32_t pos = st->head % PCAP_RING_SIZE(st);
+    uint32_t n = MIN(len, PCAP_RING_SIZE(st) - pos);
+    memcpy(st->ring + pos, data, n);
+    memcpy(st->ring, (const uint8_t*)data + n, len - n);
+    st->head += len;
+}
+
+STATIC void pcap_put_pbuf(pcap_state_t *st, struct pbuf *p, uint32_t len) {
+    uint32_t pos = st->head % PCAP_RING_SIZE(st);
+    uint32_t n = MIN(len, PCAP_RING_SIZE(st) - pos);
+    pbuf_copy_partial(p, st->ring + pos, n, 0);
+    if (n < len) {
+        pbuf_copy_partial(p, st->ring, len - n, n);
+    }
+    st->head += len;
+}
+
+STATIC bool pcap_match(const pcap_filter_t *f, int vif, struct pbuf *p) {
+    if (f->vif >= 0 && f->vif != vif) {
+        return false;
+    }
+    if (f->proto == 0 && f->port == 0) {
+        return true;
+    }
+
+    uint8_t b[PCAP_PEEK_LEN];
+    uint32_t len = pbuf_copy_partial(p, b, sizeof(b), 0);
+    if (len < 14) {
+        return false;
+    }
+    uint16_t ethtype = (b[12] << 8) | b[13];
+    if (f->proto > 0xff) {
+        return ethtype == f->proto && f->port == 0;
+    }
+    if (ethtype != PCAP_ETHTYPE_IP || len < 14 + 20) {
+        return false;
+    }
+    uint8_t proto = b[14 + 9];
+    if (f->proto != 0 && proto != f->proto) {
+        return false;
+    }
+    if (f->port == 0) {
+        return true;
+    }
+    if (proto != PCAP_PROTO_TCP && proto != PCAP_PROTO_UDP) {
+        return false;
+    }
+    uint32_t off = 14 + (b[14] & 0x0f) * 4;
+    if (len < off + 4) {
+        return false;
+    }
+    return ((b[off] << 8) | b[off + 1]) == f->port
+        || ((b[off + 2] << 8) | b[off + 3]) == f->port;
+}
+
+// Called from the netfront input and output paths of the lwip module;
+// costs one filter check and one copy of at most snaplen bytes
+void pcap_tap(int vif, struct pbuf *p) {
+    pcap_state_t *st = &pcap_state;
+
+    if (!pcap_match(&st->filter, vif, p)) {
+        st->filtered++;
+        return;
+    }
+
+    uint32_t caplen = MIN(p->tot_len, st->snaplen);
+    uint32_t reclen = PCAP_REC_LEN + caplen;
+    if (st->head + reclen - st->done > PCAP_RING_SIZE(st)
+        || st->head + reclen > st->limit) {
+        st->dropped++;
+        if (!st->lossy || st->head + reclen > st->limit) {
+            st->overflow = true;
+            pcap_enabled = false;
+        }
+        return;
+    }
+
+    uint64_t ts = st->wall_base + (uint64_t)monotonic_clock();
+    uint32_t rec[4] = {
+        ts / 1000000000ULL,
+        (ts % 1000000000ULL) / 1000,
+        caplen,
+        p->tot_len,
+    };
+    pcap_put(st, rec, sizeof(rec));
+    pcap_put_pbuf(st, p, caplen);
+    st->captured++;
+}
+
+/******************************************************************************/
+// Writer
+
+STATIC void pcap_write_cb(int ret, void *argp) {
+    pcap_state_t *st = &pcap_state;
+
+    if (ret < 0) {
+        st->errors++;
+    }
+    st->busy[(uintptr_t)argp] = 0;
+    // blocks may complete out of order; done only moves over written ones
+    while (st->done < st->submitted
+           && !st->busy[(st->done / PCAP_BLOCK_SIZE) % st->nblocks]) {
+        st->done = MIN(st->done + PCAP_BLOCK_SIZE, st->submitted);
+    }
+}
+
+// Submits the block at the submitted offset, up to end (padded to full
+// sectors). Returns false if the device has no free request slot.
+STATIC bool pcap_submit(pcap_state_t *st, uint64_t end) {
+    uint32_t ssize = blkdev_ssize(st->bd);
+    uintptr_t idx = (st->submitted / PCAP_BLOCK_SIZE) % st->nblocks;
+    uint32_t len = end - st->submitted;
+    uint8_t *buf = st->ring + idx * PCAP_BLOCK_SIZE;
+
+    if (blkdev_avail_req(st->bd) == 0) {
+        return false;
+    }
+    memset(buf + len, 0, PCAP_ALIGN(len, ssize) - len);
+    st->busy[idx] = 1;
+    int ret = blkdev_async_write(st->bd, st->submitted / ssize, PCAP_ALIGN(len, ssize) / ssize,
+                                 buf, pcap_write_cb, (void*)idx);
+    if (ret < 0) {
+        st->busy[idx] = 0;
+        st->errors++;
+        return false;
+    }
+    st->submitted = end;
+    return true;
+}
+
+// Writes every completed block
+STATIC void pcap_flush(pcap_state_t *st) {
+    bool queued = false;
+
+    blkdev_poll_req(st->bd);
+    while (st->submitted + PCAP_BLOCK_SIZE <= st->head) {
+        if (!pcap_submit(st, st->submitted + PCAP_BLOCK_SIZE)) {
+            break;
+        }
+        queued = true;
+    }
+    if (queued) {
+        blkdev_async_io_submit(st->bd);
+    }
+}
+
+STATIC void pcap_tmr(void *arg) {
+    (void)arg;
+    pcap_flush(&pcap_state);
+    sys_timeout(PCAP_TMR_MS, pcap_tmr, NULL);
+}
+
+/******************************************************************************/
+// Module functions
+
+// start(dev[, snaplen[, ring[, lossy]]]): captures to the block device
+// with vbd id dev (e.g. 51728 for xvdb). ring is the buffer size in
+// bytes; without lossy the capture stops when the ring overflows.
+STATIC mp_obj_t mod_pcap_start(size_t n_args, const mp_obj_t *args) {
+    pcap_state_t *st = &pcap_state;
+    mp_int_t snaplen = n_args > 1 ? mp_obj_get_int(args[1]) : PCAP_SNAPLEN_DEFAULT;
+    mp_int_t ring = n_args > 2 ? mp_obj_get_int(args[2]) : PCAP_RING_DEFAULT;
+
+    if (st->bd != NULL) {
+        nlr_raise(mp_obj_new_exception_arg1(&mp_type_OSError, MP_OBJ_NEW_SMALL_INT(EBUSY)));
+    }
+    if (snaplen < 14 || snaplen > PCAP_SNAPLEN_MAX || ring < 2 * PCAP_BLOCK_SIZE) {
+        nlr_raise(mp_obj_new_exception_arg1(&mp_type_OSError, MP_OBJ_NEW_SMALL_INT(EINVAL)));
+    }
+
+    struct blkdev *bd = open_blkdev(mp_obj_get_int(args[0]), O_WRONLY | O_EXCL);
+    if (bd == NULL) {
+        nlr_raise(mp_obj_new_exception_arg1(&mp_type_OSError, MP_OBJ_NEW_SMALL_INT(errno)));
+    }
+    uint32_t nblocks = ring / PCAP_BLOCK_SIZE;
+    uint8_t *buf = _xmalloc(nblocks * PCAP_BLOCK_SIZE, PAGE_SIZE);
+    uint8_t *busy = _xmalloc(nblocks, 0);
+    if (buf == NULL || busy == NULL) {
+        xfree(buf);
+        xfree(busy);
+        close_blkdev(bd);
+        nlr_raise(mp_obj_new_exception_arg1(&mp_type_OSError, MP_OBJ_NEW_SMALL_INT(ENOMEM)));
+    }
+
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    memset(st, 0, sizeof(*st));
+    st->bd = bd;
+    st->ring = buf;
+    st->busy = busy;
+    memset(busy, 0, nblocks);
+    st->nblocks = nblocks;
+    st->snaplen = snaplen;
+    st->lossy = n_args > 3 ? mp_obj_is_true(args[3]) : true;
+    st->filter.vif = -1;
+    st->wall_base = (uint64_t)tv.tv_sec * 1000000000ULL + tv.tv_usec * 1000ULL
+        - (uint64_t)monotonic_clock();
+    st->limit = blkdev_size(bd);
+
+    uint32_t hdr[PCAP_HDR_LEN / 4] = {
+        PCAP_MAGIC,
+        2 | (4 << 16), // version 2.4
+        0,             // GMT
+        0,
+        snaplen,
+        PCAP_LINKTYPE_ETHERNET,
+    };
+    pcap_put(st, hdr, sizeof(hdr));
+
+    sys_timeout(PCAP_TMR_MS, pcap_tmr, NULL);
+    pcap_enabled = true;
+    return mp_const_none;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(mod_pcap_start_obj, 1, 4, mod_pcap_start);
+
+// stop(): writes what is left in the ring and closes the device;
+// returns the length of the trace in bytes
+STATIC mp_obj_t mod_pcap_stop(void) {
+    pcap_state_t *st = &pcap_state;
+
+    if (st->bd == NULL) {
+        return mp_const_none;
+    }
+    pcap_enabled = false;
+    sys_untimeout(pcap_tmr, NULL);
+
+    while (st->submitted < st->head) {
+        uint64_t end = MIN(st->head, st->submitted + PCAP_BLOCK_SIZE);
+        if (pcap_submit(st, end)) {
+            blkdev_async_io_submit(st->bd);
+        } else {
+            blkdev_poll_req(st->bd);
+            schedule();
+        }
+    }
+    while (st->done < st->submitted) {
+        blkdev_poll_req(st->bd);
+        schedule();
+    }
+
+    close_blkdev(st->bd);
+    xfree(st->ring);
+    xfree(st->busy);
+    st->bd = NULL;
+    st->ring = NULL;
+    st->busy = NULL;
+    return mp_obj_new_int_from_ull(st->head);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_0(mod_pcap_stop_obj, mod_pcap_stop);
+
+// filter([proto[, port[, vif]]]): captures only frames of an IP protocol
+// number (or an ethertype if > 255), to or from a TCP/UDP port and of one
+// interface; None or no argument matches any
+STATIC mp_obj_t mod_pcap_filter(size_t n_args, const mp_obj_t *args) {
+    pcap_filter_t f = { 0, 0, -1 };
+
+    if (n_args > 0 && args[0] != mp_const_none) {
+        f.proto = mp_obj_get_int(args[0]);
+    }
+    if (n_args > 1 && args[1] != mp_const_none) {
+        f.port = mp_obj_get_int(args[1]);
+    }
+    if (n_args > 2 && args[2] != mp_const_none) {
+        f.vif = mp_obj_get_int(args[2]);
+    }
+    pcap_state.filter = f;
+    return mp_const_none;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(mod_pcap_filter_obj, 0, 3, mod_pcap_filter);
+
+STATIC mp_obj_t mod_pcap_stats(void) {
+    pcap_state_t *st = &pcap_state;
+    mp_obj_t d = mp_obj_new_dict(0);
+    mp_obj_dict_store(d, MP_OBJ_NEW_QSTR(MP_QSTR_active), mp_obj_new_bool(pcap_enabled));
+    mp_obj_dict_store(d, MP_OBJ_NEW_QSTR(MP_QSTR_overflow), mp_obj_new_bool(st->overflow));
+    mp_obj_dict_store(d, MP_OBJ_NEW_QSTR(MP_QSTR_captured), mp_obj_new_int_from_uint(st->captured));
+    mp_obj_dict_store(d, MP_OBJ_NEW_QSTR(MP_QSTR_dropped), mp_obj_new_int_from_uint(st->dropped));
+    mp_obj_dict_store(d, MP_OBJ_NEW_QSTR(MP_QSTR_filtered), mp_obj_new_int_from_uint(st->filtered));
+    mp_obj_dict_store(d, MP_OBJ_NEW_QSTR(MP_QSTR_errors), mp_obj_new_int_from_uint(st->errors));
+    mp_obj_dict_store(d, MP_OBJ_NEW_QSTR(MP_QSTR_bytes), mp_obj_new_int_from_ull(st->head));
+    mp_obj_dict_store(d, MP_OBJ_NEW_QSTR(MP_QSTR_written), mp_obj_new_int_from_ull(st->done));
+    return d;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_0(mod_pcap_stats_obj, mod_pcap_stats);
+
+STATIC const mp_rom_map_elem_t mp_module_pcap_globals_table[] = {
+    { MP_ROM_QSTR(MP_QSTR___name__), MP_ROM_QSTR(MP_QSTR_pcap) },
+    { MP_ROM_QSTR(MP_QSTR_start), MP_ROM_PTR(&mod_pcap_start_obj) },
+    { MP_ROM_QSTR(MP_QSTR_stop), MP_ROM_PTR(&mod_pcap_stop_obj) },
+    { MP_ROM_QSTR(MP_QSTR_filter), MP_ROM_PTR(&mod_pcap_filter_obj) },
+    { MP_ROM_QSTR(MP_QSTR_stats), MP_ROM_PTR(&mod_pcap_stats_obj) },
+};
+
+STATIC MP_DEFINE_CONST_DICT(mp_module_pcap_globals, mp_module_pcap_globals_table);
+
+const mp_obj_module_t mp_module_pcap = {
+    .base = { &mp_type_module },
+    .name = MP_QSTR_pcap,
+    .globals = (mp_obj_dict_t*)&mp_module_pcap_globals,
+};
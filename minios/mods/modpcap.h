@@ -0,0 +1,50 @@
+/*
+ * This file is part of the Micro Python project, http://micropython.org/
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2017 NEC Europe Ltd., NEC Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef MICROPY_INCLUDED_MINIOS_MODPCAP_H
+#define MICROPY_INCLUDED_MINIOS_MODPCAP_H
+
+#include <stdbool.h>
+
+struct pbuf;
+
+// Set while pcap.start() is capturing
+extern bool pcap_enabled;
+
+// Records a frame received or sent on netfront interface vif
+void pcap_tap(int vif, struct pbuf *p);
+
+#ifdef __MINIOS__
+#define PCAP_TAP(vif, p) do { \
+    if (pcap_enabled) { \
+        pcap_tap((vif), (p)); \
+    } \
+} while (0)
+#else
+// No block devices to flush to on the host build
+#define PCAP_TAP(vif, p) do { } while (0)
+#endif
+
+#endif // MICROPY_INCLUDED_MINIOS_MODPCAP_H
@@ -28,6 +28,7 @@
 #include <errno.h>
 #include <string.h>
 #include <math.h>
+#include <mini-os/time.h>
 
 #include "py/runtime.h"
 #include "py/smallint.h"
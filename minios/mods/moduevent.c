@@ -0,0 +1,448 @@
+/*
+ * This file is part of the Micro Python project, http://micropython.org/
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2017 NEC Europe Ltd., NEC Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <string.h>
+#include <errno.h>
+
+#include "py/nlr.h"
+#include "py/runtime.h"
+#include "py/stream.h"
+
+#include "modlwip.h"
+#include "moduevent.h"
+#include "moddns.h"
+
+#ifdef __MINIOS__
+#include <mini-os/time.h>
+#define uevent_now_ns() ((uint64_t)monotonic_clock())
+#else
+#include <time.h>
+static inline uint64_t uevent_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+#endif
+
+// Longest time the loop blocks without polling the network interfaces,
+// bounds the latency of events whose notification was missed
+#ifndef UEVENT_IDLE_MAX_MS
+#define UEVENT_IDLE_MAX_MS (10)
+#endif
+
+#define UEVENT_IO_READ  (0)
+#define UEVENT_IO_WRITE (1)
+
+// A task is a generator. At any time it is either running, in the run
+// queue, in the timer heap or waiting on a socket (socket->io_task[]).
+// The run queue can hold all tasks at once, so waking a task from an
+// lwIP callback never allocates.
+typedef struct _uevent_timer_t {
+    uint64_t deadline; // ns
+    mp_obj_t task;
+} uevent_timer_t;
+
+typedef struct _uevent_state_t {
+    mp_obj_t *runq;
+    mp_uint_t runq_alloc;
+    mp_uint_t runq_head;
+    mp_uint_t runq_len;
+
+    uevent_timer_t *timers; // binary min-heap on deadline
+    mp_uint_t timers_alloc;
+    mp_uint_t timers_len;
+
+    lwip_socket_obj_t **io; // sockets with waiting tasks
+    mp_uint_t io_alloc;
+    mp_uint_t io_len;
+
+    mp_uint_t ntasks;
+    bool running;
+    bool stop;
+
+    mp_uint_t switches;
+    mp_uint_t wakeups;
+    mp_uint_t idles;
+} uevent_state_t;
+
+typedef struct _uevent_io_obj_t {
+    mp_obj_base_t base;
+    lwip_socket_obj_t *socket;
+    uint8_t dir;
+} uevent_io_obj_t;
+
+STATIC const mp_obj_type_t uevent_io_type;
+
+STATIC uevent_state_t *uevent_get_state(void) {
+    uevent_state_t *st = MP_STATE_PORT(uevent_state);
+    if (st == NULL) {
+        st = m_new0(uevent_state_t, 1);
+        MP_STATE_PORT(uevent_state) = st;
+    }
+    return st;
+}
+
+/******************************************************************************/
+// Run queue
+
+STATIC void uevent_runq_push(uevent_state_t *st, mp_obj_t task) {
+    assert(st->runq_len < st->runq_alloc);
+    st->runq[(st->runq_head + st->runq_len) % st->runq_alloc] = task;
+    st->runq_len++;
+}
+
+STATIC mp_obj_t uevent_runq_pop(uevent_state_t *st) {
+    mp_obj_t task = st->runq[st->runq_head];
+    st->runq[st->runq_head] = MP_OBJ_NULL;
+    st->runq_head = (st->runq_head + 1) % st->runq_alloc;
+    st->runq_len--;
+    return task;
+}
+
+// Adds a new task; the run queue grows to keep room for every task
+STATIC void uevent_spawn(uevent_state_t *st, mp_obj_t task) {
+    if (st->ntasks + 1 > st->runq_alloc) {
+        mp_uint_t alloc = MAX(16, st->runq_alloc * 2);
+        mp_obj_t *runq = m_new0(mp_obj_t, alloc);
+        for (mp_uint_t i = 0; i < st->runq_len; i++) {
+            runq[i] = st->runq[(st->runq_head + i) % st->runq_alloc];
+        }
+        m_del(mp_obj_t, st->runq, st->runq_alloc);
+        st->runq = runq;
+        st->runq_alloc = alloc;
+        st->runq_head = 0;
+    }
+    st->ntasks++;
+    uevent_runq_push(st, task);
+}
+
+/******************************************************************************/
+// Timer heap
+
+STATIC void uevent_timer_add(uevent_state_t *st, uint64_t deadline, mp_obj_t task) {
+    if (st->timers_len == st->timers_alloc) {
+        mp_uint_t alloc = MAX(16, st->timers_alloc * 2);
+        st->timers = m_renew(uevent_timer_t, st->timers, st->timers_alloc, alloc);
+        st->timers_alloc = alloc;
+    }
+    mp_uint_t i = st->timers_len++;
+    while (i > 0) {
+        mp_uint_t parent = (i - 1) / 2;
+        if (st->timers[parent].deadline <= deadline) {
+            break;
+        }
+        st->timers[i] = st->timers[parent];
+        i = parent;
+    }
+    st->timers[i].deadline = deadline;
+    st->timers[i].task = task;
+}
+
+STATIC mp_obj_t uevent_timer_pop(uevent_state_t *st) {
+    mp_obj_t task = st->timers[0].task;
+    uevent_timer_t last = st->timers[--st->timers_len];
+    mp_uint_t i = 0;
+    for (;;) {
+        mp_uint_t child = 2 * i + 1;
+        if (child >= st->timers_len) {
+            break;
+        }
+        if (child + 1 < st->timers_len && st->timers[child + 1].deadline < st->timers[child].deadline) {
+            child++;
+        }
+        if (last.deadline <= st->timers[child].deadline) {
+            break;
+        }
+        st->timers[i] = st->timers[child];
+        i = child;
+    }
+    st->timers[i] = last;
+    st->timers[st->timers_len].task = MP_OBJ_NULL;
+    return task;
+}
+
+/******************************************************************************/
+// Socket waiters
+
+STATIC void uevent_io_remove(uevent_state_t *st, lwip_socket_obj_t *socket) {
+    mp_uint_t slot = socket->io_slot;
+    st->io[slot] = st->io[--st->io_len];
+    st->io[slot]->io_slot = slot;
+    st->io[st->io_len] = NULL;
+    socket->io_slot = -1;
+}
+
+void uevent_socket_notify(lwip_socket_obj_t *socket) {
+    uevent_state_t *st = MP_STATE_PORT(uevent_state);
+    int errcode;
+
+    if (st == NULL || socket->io_slot < 0) {
+        return;
+    }
+    mp_uint_t ev = lwip_socket_ioctl(socket, MP_STREAM_POLL, MP_STREAM_POLL_RD | MP_STREAM_POLL_WR, &errcode);
+    if (socket->io_task[UEVENT_IO_READ] != MP_OBJ_NULL
+        && (ev & (MP_STREAM_POLL_RD | MP_STREAM_POLL_ERR | MP_STREAM_POLL_HUP))) {
+        uevent_runq_push(st, socket->io_task[UEVENT_IO_READ]);
+        socket->io_task[UEVENT_IO_READ] = MP_OBJ_NULL;
+        st->wakeups++;
+    }
+    if (socket->io_task[UEVENT_IO_WRITE] != MP_OBJ_NULL
+        && (ev & (MP_STREAM_POLL_WR | MP_STREAM_POLL_ERR | MP_STREAM_POLL_HUP))) {
+        uevent_runq_push(st, socket->io_task[UEVENT_IO_WRITE]);
+        socket->io_task[UEVENT_IO_WRITE] = MP_OBJ_NULL;
+        st->wakeups++;
+    }
+    if (socket->io_task[UEVENT_IO_READ] == MP_OBJ_NULL && socket->io_task[UEVENT_IO_WRITE] == MP_OBJ_NULL) {
+        uevent_io_remove(st, socket);
+    }
+}
+
+void uevent_wake(mp_obj_t task) {
+    uevent_state_t *st = MP_STATE_PORT(uevent_state);
+    if (st != NULL) {
+        uevent_runq_push(st, task);
+        st->wakeups++;
+    }
+}
+
+STATIC void uevent_io_wait(uevent_state_t *st, uevent_io_obj_t *io, mp_obj_t task) {
+    lwip_socket_obj_t *socket = io->socket;
+
+    if (socket->io_task[io->dir] != MP_OBJ_NULL) {
+        nlr_raise(mp_obj_new_exception_arg1(&mp_type_OSError, MP_OBJ_NEW_SMALL_INT(EBUSY)));
+    }
+    if (socket->io_slot < 0) {
+        if (st->io_len == st->io_alloc) {
+            mp_uint_t alloc = MAX(16, st->io_alloc * 2);
+            st->io = m_renew(lwip_socket_obj_t*, st->io, st->io_alloc, alloc);
+            st->io_alloc = alloc;
+        }
+        socket->io_slot = st->io_len;
+        st->io[st->io_len++] = socket;
+    }
+    socket->io_task[io->dir] = task;
+    // the socket may be ready already
+    uevent_socket_notify(socket);
+}
+
+/******************************************************************************/
+// Loop
+
+// Handles what a task yielded; errors are raised and thrown into the task
+STATIC void uevent_dispatch(uevent_state_t *st, mp_obj_t task, mp_obj_t cmd) {
+    if (cmd == mp_const_none) {
+        uevent_runq_push(st, task);
+    } else if (MP_OBJ_IS_SMALL_INT(cmd)) {
+        mp_int_t ms = MP_OBJ_SMALL_INT_VALUE(cmd);
+        uevent_timer_add(st, uevent_now_ns() + (uint64_t)MAX(ms, 0) * 1000000ULL, task);
+    } else if (MP_OBJ_IS_TYPE(cmd, &uevent_io_type)) {
+        uevent_io_wait(st, cmd, task);
+    } else if (MP_OBJ_IS_TYPE(cmd, &dns_query_type)) {
+        dns_query_wait(cmd, task);
+    } else if (MP_OBJ_IS_TYPE(cmd, &mp_type_gen_instance)) {
+        // yielding a new coroutine starts it next to the current one
+        uevent_spawn(st, cmd);
+        uevent_runq_push(st, task);
+    } else {
+        nlr_raise(mp_obj_new_exception_msg(&mp_type_TypeError, "unsupported value yielded to uevent"));
+    }
+}
+
+STATIC void uevent_step(uevent_state_t *st, mp_obj_t task) {
+    mp_obj_t send = mp_const_none;
+    mp_obj_t throw = MP_OBJ_NULL;
+
+    for (;;) {
+        mp_obj_t ret;
+        st->switches++;
+        mp_vm_return_kind_t kind = mp_resume(task, send, throw, &ret);
+
+        if (kind == MP_VM_RETURN_NORMAL) {
+            st->ntasks--;
+            return;
+        } else if (kind == MP_VM_RETURN_EXCEPTION) {
+            st->ntasks--;
+            mp_printf(&mp_plat_print, "uevent: task %p failed\n", task);
+            mp_obj_print_exception(&mp_plat_print, ret);
+            return;
+        }
+
+        nlr_buf_t nlr;
+        if (nlr_push(&nlr) == 0) {
+            uevent_dispatch(st, task, ret);
+            nlr_pop();
+            return;
+        }
+        // let the task handle the error
+        throw = nlr.ret_val;
+    }
+}
+
+// Waits until the next timer is due, an event arrives or UEVENT_IDLE_MAX_MS
+// passed, then polls the network interfaces; under network load it polls
+// right away (see lwip_poll_wait)
+STATIC void uevent_idle(uevent_state_t *st) {
+    uint64_t until = uevent_now_ns() + UEVENT_IDLE_MAX_MS * 1000000ULL;
+
+    if (st->timers_len > 0 && st->timers[0].deadline < until) {
+        until = st->timers[0].deadline;
+    }
+    st->idles++;
+    lwip_poll_wait(until);
+}
+
+STATIC mp_obj_t mod_uevent_run(void) {
+    uevent_state_t *st = uevent_get_state();
+
+    if (st->running) {
+        nlr_raise(mp_obj_new_exception_msg(&mp_type_RuntimeError, "loop already running"));
+    }
+    st->running = true;
+    st->stop = false;
+
+    nlr_buf_t nlr;
+    if (nlr_push(&nlr) == 0) {
+        while (!st->stop && st->ntasks > 0) {
+            uint64_t now = uevent_now_ns();
+            while (st->timers_len > 0 && st->timers[0].deadline <= now) {
+                uevent_runq_push(st, uevent_timer_pop(st));
+            }
+
+            if (st->runq_len == 0) {
+                uevent_idle(st);
+                continue;
+            }
+
+            // tasks made runnable during this round run in the next one,
+            // after the network has been polled, without waiting
+            for (mp_uint_t n = st->runq_len; n > 0 && !st->stop; n--) {
+                uevent_step(st, uevent_runq_pop(st));
+            }
+            lwip_poll_wait(0);
+        }
+        nlr_pop();
+    } else {
+        st->running = false;
+        nlr_jump(nlr.ret_val);
+    }
+    st->running = false;
+    return mp_const_none;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_0(mod_uevent_run_obj, mod_uevent_run);
+
+/******************************************************************************/
+// Module functions
+
+// create_task(coro): schedules a generator
+STATIC mp_obj_t mod_uevent_create_task(mp_obj_t coro) {
+    if (!MP_OBJ_IS_TYPE(coro, &mp_type_gen_instance)) {
+        nlr_raise(mp_obj_new_exception_msg(&mp_type_TypeError, "coroutine expected"));
+    }
+    uevent_spawn(uevent_get_state(), coro);
+    return coro;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_1(mod_uevent_create_task_obj, mod_uevent_create_task);
+
+// yield sleep_ms(ms): resumes the task after ms milliseconds
+STATIC mp_obj_t mod_uevent_sleep_ms(mp_obj_t ms_in) {
+    return MP_OBJ_NEW_SMALL_INT(mp_obj_get_int(ms_in));
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_1(mod_uevent_sleep_ms_obj, mod_uevent_sleep_ms);
+
+STATIC mp_obj_t uevent_io_new(mp_obj_t socket_in, uint8_t dir) {
+    if (!MP_OBJ_IS_TYPE(socket_in, &lwip_socket_type)) {
+        nlr_raise(mp_obj_new_exception_msg(&mp_type_TypeError, "lwip socket expected"));
+    }
+    uevent_io_obj_t *io = m_new_obj(uevent_io_obj_t);
+    io->base.type = &uevent_io_type;
+    io->socket = socket_in;
+    io->dir = dir;
+    return io;
+}
+
+// yield IORead(sock)/IOWrite(sock): resumes the task once sock is readable
+// (writable), has been closed by the peer or has failed
+STATIC mp_obj_t mod_uevent_ioread(mp_obj_t socket_in) {
+    return uevent_io_new(socket_in, UEVENT_IO_READ);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_1(mod_uevent_ioread_obj, mod_uevent_ioread);
+
+STATIC mp_obj_t mod_uevent_iowrite(mp_obj_t socket_in) {
+    return uevent_io_new(socket_in, UEVENT_IO_WRITE);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_1(mod_uevent_iowrite_obj, mod_uevent_iowrite);
+
+STATIC void uevent_io_print(const mp_print_t *print, mp_obj_t self_in, mp_print_kind_t kind) {
+    uevent_io_obj_t *self = self_in;
+    mp_printf(print, "<%s %p>", self->dir == UEVENT_IO_READ ? "IORead" : "IOWrite", self->socket);
+}
+
+STATIC const mp_obj_type_t uevent_io_type = {
+    { &mp_type_type },
+    .name = MP_QSTR_IOWait,
+    .print = uevent_io_print,
+};
+
+// stop(): makes run() return after the current task
+STATIC mp_obj_t mod_uevent_stop(void) {
+    uevent_get_state()->stop = true;
+    return mp_const_none;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_0(mod_uevent_stop_obj, mod_uevent_stop);
+
+STATIC mp_obj_t mod_uevent_stats(void) {
+    uevent_state_t *st = uevent_get_state();
+    mp_obj_t d = mp_obj_new_dict(0);
+
+    mp_obj_dict_store(d, MP_OBJ_NEW_QSTR(MP_QSTR_tasks), mp_obj_new_int_from_uint(st->ntasks));
+    mp_obj_dict_store(d, MP_OBJ_NEW_QSTR(MP_QSTR_runnable), mp_obj_new_int_from_uint(st->runq_len));
+    mp_obj_dict_store(d, MP_OBJ_NEW_QSTR(MP_QSTR_timers), mp_obj_new_int_from_uint(st->timers_len));
+    mp_obj_dict_store(d, MP_OBJ_NEW_QSTR(MP_QSTR_sockets), mp_obj_new_int_from_uint(st->io_len));
+    mp_obj_dict_store(d, MP_OBJ_NEW_QSTR(MP_QSTR_switches), mp_obj_new_int_from_uint(st->switches));
+    mp_obj_dict_store(d, MP_OBJ_NEW_QSTR(MP_QSTR_wakeups), mp_obj_new_int_from_uint(st->wakeups));
+    mp_obj_dict_store(d, MP_OBJ_NEW_QSTR(MP_QSTR_idles), mp_obj_new_int_from_uint(st->idles));
+    return d;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_0(mod_uevent_stats_obj, mod_uevent_stats);
+
+STATIC const mp_rom_map_elem_t mp_module_uevent_globals_table[] = {
+    { MP_ROM_QSTR(MP_QSTR___name__), MP_ROM_QSTR(MP_QSTR_uevent) },
+    { MP_ROM_QSTR(MP_QSTR_create_task), MP_ROM_PTR(&mod_uevent_create_task_obj) },
+    { MP_ROM_QSTR(MP_QSTR_run), MP_ROM_PTR(&mod_uevent_run_obj) },
+    { MP_ROM_QSTR(MP_QSTR_stop), MP_ROM_PTR(&mod_uevent_stop_obj) },
+    { MP_ROM_QSTR(MP_QSTR_sleep_ms), MP_ROM_PTR(&mod_uevent_sleep_ms_obj) },
+    { MP_ROM_QSTR(MP_QSTR_IORead), MP_ROM_PTR(&mod_uevent_ioread_obj) },
+    { MP_ROM_QSTR(MP_QSTR_IOWrite), MP_ROM_PTR(&mod_uevent_iowrite_obj) },
+    { MP_ROM_QSTR(MP_QSTR_stats), MP_ROM_PTR(&mod_uevent_stats_obj) },
+};
+
+STATIC MP_DEFINE_CONST_DICT(mp_module_uevent_globals, mp_module_uevent_globals_table);
+
+const mp_obj_module_t mp_module_uevent = {
+    .base = { &mp_type_module },
+    .name = MP_QSTR_uevent,
+    .globals = (mp_obj_dict_t*)&mp_module_uevent_globals,
+};
@@ -0,0 +1,942 @@
+/*
+ * This file is part of the Micro Python project, http://micropython.org/
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2017 NEC Europe Ltd., NEC Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+
+#include "py/nlr.h"
+#include "py/runtime.h"
+#include "py/objtuple.h"
+#include "py/stream.h"
+
+#include "shfs/http_parser.h"
+#include "modlwip.h"
+#include "moddns.h"
+
+// The parser copies the request/status line and the headers (incl. the
+// trailer of a chunked message) into a per-object buffer, so they may be
+// split over any number of feed() calls. Bodies are not copied: feed()
+// reports them as (offset, length) spans of the buffer it was given.
+#ifndef UHTTP_HEADER_BUF
+#define UHTTP_HEADER_BUF (2048)
+#endif
+#ifndef UHTTP_MAX_HEADERS
+#define UHTTP_MAX_HEADERS (32)
+#endif
+
+#define UHTTP_LAST_NONE  (0)
+#define UHTTP_LAST_URL   (1)
+#define UHTTP_LAST_FIELD (2)
+#define UHTTP_LAST_VALUE (3)
+
+typedef struct _uhttp_span_t {
+    uint16_t off;
+    uint16_t len;
+} uhttp_span_t;
+
+typedef struct _uhttp_parser_obj_t {
+    mp_obj_base_t base;
+    http_parser parser;
+    mp_obj_t body;          // spans of the current feed(), NULL if none
+    const char *input;      // start of the buffer given to feed()
+    bool headers_done;
+    bool done;
+    bool overflow;          // header buffer exhausted
+    bool skip_body;         // client: response to a HEAD request
+    uint8_t last;           // kind of the previous data callback
+    uint8_t nhdrs;
+    uint16_t used;          // bytes in data[]
+    uint64_t content_length;
+    byte *sink;             // client: where the body goes, NULL to drop it
+    size_t sink_len;
+    uhttp_span_t url;       // request target or status text
+    struct {
+        uhttp_span_t name;
+        uhttp_span_t value;
+    } hdr[UHTTP_MAX_HEADERS];
+    char data[UHTTP_HEADER_BUF];
+} uhttp_parser_obj_t;
+
+STATIC const mp_obj_type_t uhttp_parser_type;
+
+STATIC int uhttp_append(uhttp_parser_obj_t *self, uhttp_span_t *span, const char *at, size_t len) {
+    if (len > UHTTP_HEADER_BUF - self->used) {
+        self->overflow = true;
+        return -1;
+    }
+    memcpy(self->data + self->used, at, len);
+    self->used += len;
+    span->len += len;
+    return 0;
+}
+
+STATIC void uhttp_begin(uhttp_parser_obj_t *self, uhttp_span_t *span, uint8_t kind) {
+    self->last = kind;
+    span->off = self->used;
+    span->len = 0;
+}
+
+STATIC int uhttp_on_message_begin(http_parser *p) {
+    uhttp_parser_obj_t *self = p->data;
+    self->headers_done = false;
+    self->done = false;
+    self->last = UHTTP_LAST_NONE;
+    self->nhdrs = 0;
+    self->used = 0;
+    self->url.off = self->url.len = 0;
+    return 0;
+}
+
+STATIC int uhttp_on_url(http_parser *p, const char *at, size_t len) {
+    uhttp_parser_obj_t *self = p->data;
+    if (self->last != UHTTP_LAST_URL) {
+        uhttp_begin(self, &self->url, UHTTP_LAST_URL);
+    }
+    return uhttp_append(self, &self->url, at, len);
+}
+
+STATIC int uhttp_on_header_field(http_parser *p, const char *at, size_t len) {
+    uhttp_parser_obj_t *self = p->data;
+    if (self->last != UHTTP_LAST_FIELD) {
+        if (self->nhdrs == UHTTP_MAX_HEADERS) {
+            self->overflow = true;
+            return -1;
+        }
+        self->hdr[self->nhdrs].value.off = self->hdr[self->nhdrs].value.len = 0;
+        uhttp_begin(self, &self->hdr[self->nhdrs++].name, UHTTP_LAST_FIELD);
+    }
+    return uhttp_append(self, &self->hdr[self->nhdrs - 1].name, at, len);
+}
+
+STATIC int uhttp_on_header_value(http_parser *p, const char *at, size_t len) {
+    uhttp_parser_obj_t *self = p->data;
+    if (self->nhdrs == 0) {
+        return -1;
+    }
+    if (self->last != UHTTP_LAST_VALUE) {
+        uhttp_begin(self, &self->hdr[self->nhdrs - 1].value, UHTTP_LAST_VALUE);
+    }
+    return uhttp_append(self, &self->hdr[self->nhdrs - 1].value, at, len);
+}
+
+// Both stop feed() so that the caller can look at the headers or the
+// completed message before the parser moves on to the next one
+STATIC int uhttp_on_headers_complete(http_parser *p) {
+    uhttp_parser_obj_t *self = p->data;
+    self->headers_done = true;
+    self->last = UHTTP_LAST_NONE;
+    self->content_length = p->content_length;
+    http_parser_pause(p, 1);
+    return 0;
+}
+
+STATIC int uhttp_on_message_complete(http_parser *p) {
+    uhttp_parser_obj_t *self = p->data;
+    self->done = true;
+    http_parser_pause(p, 1);
+    return 0;
+}
+
+STATIC int uhttp_on_body(http_parser *p, const char *at, size_t len) {
+    uhttp_parser_obj_t *self = p->data;
+    mp_obj_t span[2] = {
+        mp_obj_new_int(at - self->input),
+        mp_obj_new_int(len),
+    };
+    if (self->body == MP_OBJ_NULL) {
+        self->body = mp_obj_new_list(0, NULL);
+    }
+    mp_obj_list_append(self->body, mp_obj_new_tuple(2, span));
+    return 0;
+}
+
+STATIC const http_parser_settings uhttp_settings = {
+    .on_message_begin = uhttp_on_message_begin,
+    .on_url = uhttp_on_url,
+    .on_status = uhttp_on_url,
+    .on_header_field = uhttp_on_header_field,
+    .on_header_value = uhttp_on_header_value,
+    .on_headers_complete = uhttp_on_headers_complete,
+    .on_body = uhttp_on_body,
+    .on_message_complete = uhttp_on_message_complete,
+};
+
+STATIC mp_obj_t uhttp_span_bytes(uhttp_parser_obj_t *self, const uhttp_span_t *span) {
+    return mp_obj_new_bytes((const byte *)self->data + span->off, span->len);
+}
+
+// parser(kind=REQUEST)
+STATIC mp_obj_t uhttp_parser_make_new(const mp_obj_type_t *type, mp_uint_t n_args, mp_uint_t n_kw, const mp_obj_t *args) {
+    mp_arg_check_num(n_args, n_kw, 0, 1, false);
+    mp_int_t kind = n_args > 0 ? mp_obj_get_int(args[0]) : HTTP_REQUEST;
+    if (kind != HTTP_REQUEST && kind != HTTP_RESPONSE) {
+        nlr_raise(mp_obj_new_exception_msg(&mp_type_ValueError, "invalid parser kind"));
+    }
+    uhttp_parser_obj_t *self = m_new_obj(uhttp_parser_obj_t);
+    memset(self, 0, sizeof(*self));
+    self->base.type = &uhttp_parser_type;
+    self->parser.data = self;
+    http_parser_init(&self->parser, kind);
+    self->body = MP_OBJ_NULL;
+    return self;
+}
+
+STATIC void uhttp_parser_print(const mp_print_t *print, mp_obj_t self_in, mp_print_kind_t kind) {
+    uhttp_parser_obj_t *self = self_in;
+    mp_printf(print, "<uhttp.parser %s headers=%u%s>",
+              self->parser.type == HTTP_REQUEST ? "request" : "response",
+              (uint)self->nhdrs, self->done ? " done" : "");
+}
+
+// feed(buf[, offset]): parses buf from offset on, returns the offset where
+// parsing stopped. It stops early once the headers are complete and when
+// a message is complete; call again with the returned offset to go on.
+// An empty buf signals the end of the stream.
+STATIC mp_obj_t uhttp_parser_feed(mp_uint_t n_args, const mp_obj_t *args) {
+    uhttp_parser_obj_t *self = args[0];
+    mp_buffer_info_t bufinfo;
+    mp_get_buffer_raise(args[1], &bufinfo, MP_BUFFER_READ);
+    mp_int_t off = n_args > 2 ? mp_obj_get_int(args[2]) : 0;
+    if (off < 0 || (mp_uint_t)off > bufinfo.len) {
+        nlr_raise(mp_obj_new_exception_msg(&mp_type_ValueError, "offset out of range"));
+    }
+
+    if (HTTP_PARSER_ERRNO(&self->parser) == HPE_PAUSED) {
+        http_parser_pause(&self->parser, 0);
+    }
+    if (self->done) {
+        // the next message starts; drop the headers of the previous one
+        self->done = false;
+        self->headers_done = false;
+    }
+    self->body = MP_OBJ_NULL;
+    self->input = bufinfo.buf;
+    size_t n = http_parser_execute(&self->parser, &uhttp_settings,
+                                   self->input + off, bufinfo.len - off);
+    self->input = NULL;
+
+    enum http_errno err = HTTP_PARSER_ERRNO(&self->parser);
+    if (err != HPE_OK && err != HPE_PAUSED) {
+        if (self->overflow) {
+            nlr_raise(mp_obj_new_exception_msg(&mp_type_ValueError, "headers too large"));
+        }
+        nlr_raise(mp_obj_new_exception_msg(&mp_type_ValueError, http_errno_description(err)));
+    }
+    return MP_OBJ_NEW_SMALL_INT(off + n);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(uhttp_parser_feed_obj, 2, 3, uhttp_parser_feed);
+
+// body(): (offset, length) spans of message body in the buffer given to
+// the last feed(), with any chunked transfer coding removed
+STATIC mp_obj_t uhttp_parser_body(mp_obj_t self_in) {
+    uhttp_parser_obj_t *self = self_in;
+    if (self->body == MP_OBJ_NULL) {
+        return mp_obj_new_list(0, NULL);
+    }
+    return self->body;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_1(uhttp_parser_body_obj, uhttp_parser_body);
+
+STATIC mp_obj_t uhttp_parser_method(mp_obj_t self_in) {
+    uhttp_parser_obj_t *self = self_in;
+    if (self->parser.type != HTTP_REQUEST || !self->headers_done) {
+        return mp_const_none;
+    }
+    const char *m = http_method_str(self->parser.method);
+    return mp_obj_new_str(m, strlen(m), true);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_1(uhttp_parser_method_obj, uhttp_parser_method);
+
+// path(): request target of a request, reason phrase of a response
+STATIC mp_obj_t uhttp_parser_path(mp_obj_t self_in) {
+    uhttp_parser_obj_t *self = self_in;
+    if (!self->headers_done) {
+        return mp_const_none;
+    }
+    return uhttp_span_bytes(self, &self->url);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_1(uhttp_parser_path_obj, uhttp_parser_path);
+
+STATIC mp_obj_t uhttp_parser_status(mp_obj_t self_in) {
+    uhttp_parser_obj_t *self = self_in;
+    if (self->parser.type != HTTP_RESPONSE || !self->headers_done) {
+        return mp_const_none;
+    }
+    return MP_OBJ_NEW_SMALL_INT(self->parser.status_code);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_1(uhttp_parser_status_obj, uhttp_parser_status);
+
+STATIC mp_obj_t uhttp_parser_version(mp_obj_t self_in) {
+    uhttp_parser_obj_t *self = self_in;
+    mp_obj_t v[2] = {
+        MP_OBJ_NEW_SMALL_INT(self->parser.http_major),
+        MP_OBJ_NEW_SMALL_INT(self->parser.http_minor),
+    };
+    return mp_obj_new_tuple(2, v);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_1(uhttp_parser_version_obj, uhttp_parser_version);
+
+// header(name): value of the first header called name (any case), or None
+STATIC mp_obj_t uhttp_parser_header(mp_obj_t self_in, mp_obj_t name_in) {
+    uhttp_parser_obj_t *self = self_in;
+    mp_buffer_info_t name;
+    mp_get_buffer_raise(name_in, &name, MP_BUFFER_READ);
+    for (uint i = 0; i < self->nhdrs; i++) {
+        if (self->hdr[i].name.len == name.len &&
+            strncasecmp(self->data + self->hdr[i].name.off, name.buf, name.len) == 0) {
+            return uhttp_span_bytes(self, &self->hdr[i].value);
+        }
+    }
+    return mp_const_none;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_2(uhttp_parser_header_obj, uhttp_parser_header);
+
+// headers(): list of (name, value) in the order received
+STATIC mp_obj_t uhttp_parser_headers(mp_obj_t self_in) {
+    uhttp_parser_obj_t *self = self_in;
+    mp_obj_t l = mp_obj_new_list(0, NULL);
+    for (uint i = 0; i < self->nhdrs; i++) {
+        mp_obj_t t[2] = {
+            uhttp_span_bytes(self, &self->hdr[i].name),
+            uhttp_span_bytes(self, &self->hdr[i].value),
+        };
+        mp_obj_list_append(l, mp_obj_new_tuple(2, t));
+    }
+    return l;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_1(uhttp_parser_headers_obj, uhttp_parser_headers);
+
+// content_length(): declared body length, None if chunked or not given
+STATIC mp_obj_t uhttp_parser_content_length(mp_obj_t self_in) {
+    uhttp_parser_obj_t *self = self_in;
+    if (!self->headers_done || !(self->parser.flags & F_CONTENTLENGTH)) {
+        return mp_const_none;
+    }
+    return mp_obj_new_int_from_ull(self->content_length);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_1(uhttp_parser_content_length_obj, uhttp_parser_content_length);
+
+STATIC mp_obj_t uhttp_parser_chunked(mp_obj_t self_in) {
+    uhttp_parser_obj_t *self = self_in;
+    return mp_obj_new_bool(self->headers_done && (self->parser.flags & F_CHUNKED));
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_1(uhttp_parser_chunked_obj, uhttp_parser_chunked);
+
+STATIC mp_obj_t uhttp_parser_keep_alive(mp_obj_t self_in) {
+    uhttp_parser_obj_t *self = self_in;
+    return mp_obj_new_bool(self->headers_done && http_should_keep_alive(&self->parser));
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_1(uhttp_parser_keep_alive_obj, uhttp_parser_keep_alive);
+
+// upgrade(): True if the connection switches protocols after this
+// message; any data past the offset returned by feed() belongs to it
+STATIC mp_obj_t uhttp_parser_upgrade(mp_obj_t self_in) {
+    uhttp_parser_obj_t *self = self_in;
+    return mp_obj_new_bool(self->parser.upgrade);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_1(uhttp_parser_upgrade_obj, uhttp_parser_upgrade);
+
+STATIC mp_obj_t uhttp_parser_headers_done(mp_obj_t self_in) {
+    uhttp_parser_obj_t *self = self_in;
+    return mp_obj_new_bool(self->headers_done);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_1(uhttp_parser_headers_done_obj, uhttp_parser_headers_done);
+
+STATIC mp_obj_t uhttp_parser_done(mp_obj_t self_in) {
+    uhttp_parser_obj_t *self = self_in;
+    return mp_obj_new_bool(self->done);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_1(uhttp_parser_done_obj, uhttp_parser_done);
+
+// reset(): drops any partial message, e.g. for a new connection
+STATIC mp_obj_t uhttp_parser_reset(mp_obj_t self_in) {
+    uhttp_parser_obj_t *self = self_in;
+    uhttp_on_message_begin(&self->parser);
+    self->overflow = false;
+    self->body = MP_OBJ_NULL;
+    http_parser_init(&self->parser, self->parser.type);
+    return mp_const_none;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_1(uhttp_parser_reset_obj, uhttp_parser_reset);
+
+STATIC const mp_rom_map_elem_t uhttp_parser_locals_dict_table[] = {
+    { MP_ROM_QSTR(MP_QSTR_feed), MP_ROM_PTR(&uhttp_parser_feed_obj) },
+    { MP_ROM_QSTR(MP_QSTR_reset), MP_ROM_PTR(&uhttp_parser_reset_obj) },
+    { MP_ROM_QSTR(MP_QSTR_headers_done), MP_ROM_PTR(&uhttp_parser_headers_done_obj) },
+    { MP_ROM_QSTR(MP_QSTR_done), MP_ROM_PTR(&uhttp_parser_done_obj) },
+    { MP_ROM_QSTR(MP_QSTR_method), MP_ROM_PTR(&uhttp_parser_method_obj) },
+    { MP_ROM_QSTR(MP_QSTR_path), MP_ROM_PTR(&uhttp_parser_path_obj) },
+    { MP_ROM_QSTR(MP_QSTR_status), MP_ROM_PTR(&uhttp_parser_status_obj) },
+    { MP_ROM_QSTR(MP_QSTR_version), MP_ROM_PTR(&uhttp_parser_version_obj) },
+    { MP_ROM_QSTR(MP_QSTR_header), MP_ROM_PTR(&uhttp_parser_header_obj) },
+    { MP_ROM_QSTR(MP_QSTR_headers), MP_ROM_PTR(&uhttp_parser_headers_obj) },
+    { MP_ROM_QSTR(MP_QSTR_content_length), MP_ROM_PTR(&uhttp_parser_content_length_obj) },
+    { MP_ROM_QSTR(MP_QSTR_chunked), MP_ROM_PTR(&uhttp_parser_chunked_obj) },
+    { MP_ROM_QSTR(MP_QSTR_keep_alive), MP_ROM_PTR(&uhttp_parser_keep_alive_obj) },
+    { MP_ROM_QSTR(MP_QSTR_upgrade), MP_ROM_PTR(&uhttp_parser_upgrade_obj) },
+    { MP_ROM_QSTR(MP_QSTR_body), MP_ROM_PTR(&uhttp_parser_body_obj) },
+};
+STATIC MP_DEFINE_CONST_DICT(uhttp_parser_locals_dict, uhttp_parser_locals_dict_table);
+
+STATIC const mp_obj_type_t uhttp_parser_type = {
+    { &mp_type_type },
+    .name = MP_QSTR_parser,
+    .print = uhttp_parser_print,
+    .make_new = uhttp_parser_make_new,
+    .locals_dict = (mp_obj_t)&uhttp_parser_locals_dict,
+};
+
+/******************************************************************************/
+// Client connections
+//
+// A connection keeps its socket open across requests (HTTP/1.1 keep-alive)
+// and may have up to UHTTP_PIPELINE_MAX requests in flight; responses are
+// read back in order. Bodies are decoded (chunked or not) straight into the
+// buffer given to readinto(), without any allocation per response.
+// release() hands an idle connection to a per-host pool that connect()
+// takes it from again.
+
+#ifndef UHTTP_CONN_RBUF
+#define UHTTP_CONN_RBUF (2048)
+#endif
+#ifndef UHTTP_PIPELINE_MAX
+#define UHTTP_PIPELINE_MAX (16) // at most 32, see head_mask
+#endif
+#ifndef UHTTP_POOL_MAX
+#define UHTTP_POOL_MAX (16)
+#endif
+#ifndef UHTTP_POOL_PER_HOST
+#define UHTTP_POOL_PER_HOST (4)
+#endif
+
+typedef struct _uhttp_conn_obj_t {
+    mp_obj_base_t base;
+    mp_obj_t socket;        // MP_OBJ_NULL once closed
+    mp_obj_t host;
+    mp_uint_t port;
+    uhttp_parser_obj_t *resp;
+    uint32_t head_mask;     // bit i: the i-th pending request is a HEAD
+    uint8_t pending;        // requests whose response was not read yet
+    bool reading;           // a response body is being read
+    bool reusable;          // the last response allows keep-alive
+    uint16_t rpos;          // parsed up to here in rbuf
+    uint16_t rlen;
+    mp_uint_t requests;
+    byte rbuf[UHTTP_CONN_RBUF];
+} uhttp_conn_obj_t;
+
+typedef struct _uhttp_pool_t {
+    uhttp_conn_obj_t *idle[UHTTP_POOL_MAX]; // oldest first
+    mp_uint_t len;
+    mp_uint_t per_host;
+    mp_uint_t hits;
+    mp_uint_t misses;
+    mp_uint_t stale;        // closed by the server while idle
+    mp_uint_t evicted;
+} uhttp_pool_t;
+
+STATIC const mp_obj_type_t uhttp_conn_type;
+
+STATIC uhttp_pool_t *uhttp_pool_get(void) {
+    if (MP_STATE_VM(uhttp_pool) == NULL) {
+        uhttp_pool_t *pool = m_new0(uhttp_pool_t, 1);
+        pool->per_host = UHTTP_POOL_PER_HOST;
+        MP_STATE_VM(uhttp_pool) = pool;
+    }
+    return MP_STATE_VM(uhttp_pool);
+}
+
+// The body goes into the sink; uhttp_conn_body() never feeds more than
+// fits, so len cannot exceed what is left of it
+STATIC int uhttp_client_on_body(http_parser *p, const char *at, size_t len) {
+    uhttp_parser_obj_t *self = p->data;
+    if (self->sink != NULL) {
+        memcpy(self->sink, at, len);
+        self->sink += len;
+        self->sink_len -= len;
+    }
+    return 0;
+}
+
+STATIC int uhttp_client_on_headers_complete(http_parser *p) {
+    uhttp_parser_obj_t *self = p->data;
+    uhttp_on_headers_complete(p);
+    // a response to HEAD carries no body whatever its headers say
+    return self->skip_body ? 1 : 0;
+}
+
+STATIC const http_parser_settings uhttp_client_settings = {
+    .on_message_begin = uhttp_on_message_begin,
+    .on_status = uhttp_on_url,
+    .on_header_field = uhttp_on_header_field,
+    .on_header_value = uhttp_on_header_value,
+    .on_headers_complete = uhttp_client_on_headers_complete,
+    .on_body = uhttp_client_on_body,
+    .on_message_complete = uhttp_on_message_complete,
+};
+
+STATIC void uhttp_conn_drop(uhttp_conn_obj_t *self) {
+    if (self->socket != MP_OBJ_NULL) {
+        lwip_socket_close(self->socket);
+        self->socket = MP_OBJ_NULL;
+    }
+    self->pending = 0;
+    self->reading = false;
+    self->reusable = false;
+}
+
+STATIC NORETURN void uhttp_conn_raise(uhttp_conn_obj_t *self, int errcode) {
+    uhttp_conn_drop(self);
+    nlr_raise(mp_obj_new_exception_arg1(&mp_type_OSError, MP_OBJ_NEW_SMALL_INT(errcode)));
+}
+
+STATIC void uhttp_conn_check(uhttp_conn_obj_t *self) {
+    if (self->socket == MP_OBJ_NULL) {
+        nlr_raise(mp_obj_new_exception_arg1(&mp_type_OSError, MP_OBJ_NEW_SMALL_INT(EBADF)));
+    }
+}
+
+STATIC void uhttp_conn_write(uhttp_conn_obj_t *self, const byte *buf, mp_uint_t len) {
+    while (len > 0) {
+        int errcode;
+        mp_uint_t n = lwip_socket_write(self->socket, buf, len, &errcode);
+        if (n == MP_STREAM_ERROR) {
+            uhttp_conn_raise(self, errcode);
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+// Reads more of the stream into rbuf, returns false at its end
+STATIC bool uhttp_conn_fill(uhttp_conn_obj_t *self) {
+    int errcode;
+    self->rpos = self->rlen = 0;
+    mp_uint_t n = lwip_socket_read(self->socket, self->rbuf, UHTTP_CONN_RBUF, &errcode);
+    if (n == MP_STREAM_ERROR) {
+        uhttp_conn_raise(self, errcode);
+    }
+    self->rlen = n;
+    return n > 0;
+}
+
+// Runs the parser over len bytes at rpos (len 0: end of stream)
+STATIC void uhttp_conn_execute(uhttp_conn_obj_t *self, size_t len) {
+    http_parser *parser = &self->resp->parser;
+    if (HTTP_PARSER_ERRNO(parser) == HPE_PAUSED) {
+        http_parser_pause(parser, 0);
+    }
+    self->rpos += http_parser_execute(parser, &uhttp_client_settings,
+                                      (const char *)self->rbuf + self->rpos, len);
+    enum http_errno err = HTTP_PARSER_ERRNO(parser);
+    if (err != HPE_OK && err != HPE_PAUSED) {
+        uhttp_conn_drop(self);
+        if (self->resp->overflow) {
+            nlr_raise(mp_obj_new_exception_msg(&mp_type_ValueError, "headers too large"));
+        }
+        nlr_raise(mp_obj_new_exception_msg(&mp_type_ValueError, http_errno_description(err)));
+    }
+}
+
+// Decodes up to size bytes of the current body into buf (NULL: drops them)
+// and returns how many; 0 once the body is complete. Only blocks if no
+// body data is buffered.
+STATIC mp_uint_t uhttp_conn_body(uhttp_conn_obj_t *self, byte *buf, mp_uint_t size) {
+    uhttp_parser_obj_t *resp = self->resp;
+    resp->sink = buf;
+    resp->sink_len = size;
+    while (self->reading && resp->sink_len > 0) {
+        if (http_body_is_final(&resp->parser)) {
+            // completion was held back by the pause after the headers
+            uhttp_conn_execute(self, 0);
+        } else if (self->rpos < self->rlen) {
+            uhttp_conn_execute(self, MIN(self->rlen - self->rpos, resp->sink_len));
+        } else if (resp->sink_len < size) {
+            break;
+        } else if (!uhttp_conn_fill(self)) {
+            // end of stream: completes a body delimited by it, fails otherwise
+            uhttp_conn_execute(self, 0);
+            self->reusable = false;
+            if (!resp->done) {
+                uhttp_conn_raise(self, ECONNRESET);
+            }
+        }
+        if (resp->done) {
+            self->reading = false;
+        }
+    }
+    resp->sink = NULL;
+    return size - resp->sink_len;
+}
+
+STATIC void uhttp_conn_print(const mp_print_t *print, mp_obj_t self_in, mp_print_kind_t kind) {
+    uhttp_conn_obj_t *self = self_in;
+    mp_printf(print, "<uhttp.connection %s:%u requests=%u pending=%u%s>",
+              mp_obj_str_get_str(self->host), (uint)self->port, (uint)self->requests,
+              (uint)self->pending, self->socket == MP_OBJ_NULL ? " closed" : "");
+}
+
+// request(method, path[, headers[, body]]): sends a request without waiting
+// for the responses to the previous ones. headers is a dict or a sequence
+// of (name, value); Host and, with a body, Content-Length are added.
+STATIC mp_obj_t uhttp_conn_request(mp_uint_t n_args, const mp_obj_t *args) {
+    uhttp_conn_obj_t *self = args[0];
+    uhttp_conn_check(self);
+    if (self->pending == UHTTP_PIPELINE_MAX) {
+        nlr_raise(mp_obj_new_exception_msg(&mp_type_RuntimeError, "too many pending requests"));
+    }
+    if (!self->reusable) {
+        // the server closes the connection after the last response
+        nlr_raise(mp_obj_new_exception_arg1(&mp_type_OSError, MP_OBJ_NEW_SMALL_INT(ENOTCONN)));
+    }
+
+    mp_uint_t len;
+    const char *method = mp_obj_str_get_data(args[1], &len);
+    bool head = (len == 4 && strncasecmp(method, "HEAD", 4) == 0);
+
+    vstr_t vstr;
+    vstr_init(&vstr, 256);
+    vstr_add_strn(&vstr, method, len);
+    vstr_add_char(&vstr, ' ');
+    const char *s = mp_obj_str_get_data(args[2], &len);
+    vstr_add_strn(&vstr, s, len);
+    vstr_add_str(&vstr, " HTTP/1.1\r\nHost: ");
+    s = mp_obj_str_get_data(self->host, &len);
+    vstr_add_strn(&vstr, s, len);
+    if (self->port != 80) {
+        vstr_printf(&vstr, ":%u", (uint)self->port);
+    }
+    vstr_add_str(&vstr, "\r\n");
+
+    if (n_args > 3 && args[3] != mp_const_none) {
+        mp_map_t *map = NULL;
+        size_t n = 0;
+        mp_obj_t *items = NULL;
+        if (MP_OBJ_IS_TYPE(args[3], &mp_type_dict)) {
+            map = mp_obj_dict_get_map(args[3]);
+            n = map->alloc;
+        } else {
+            mp_obj_get_array(args[3], &n, &items);
+        }
+        for (size_t i = 0; i < n; i++) {
+            mp_obj_t kv[2];
+            if (map != NULL) {
+                if (!MP_MAP_SLOT_IS_FILLED(map, i)) {
+                    continue;
+                }
+                kv[0] = map->table[i].key;
+                kv[1] = map->table[i].value;
+            } else {
+                mp_obj_t *pair;
+                mp_obj_get_array_fixed_n(items[i], 2, &pair);
+                kv[0] = pair[0];
+                kv[1] = pair[1];
+            }
+            s = mp_obj_str_get_data(kv[0], &len);
+            vstr_add_strn(&vstr, s, len);
+            vstr_add_str(&vstr, ": ");
+            s = mp_obj_str_get_data(kv[1], &len);
+            vstr_add_strn(&vstr, s, len);
+            vstr_add_str(&vstr, "\r\n");
+        }
+    }
+
+    mp_buffer_info_t body = { .buf = NULL, .len = 0 };
+    if (n_args > 4 && args[4] != mp_const_none) {
+        mp_get_buffer_raise(args[4], &body, MP_BUFFER_READ);
+        vstr_printf(&vstr, "Content-Length: %u\r\n", (uint)body.len);
+    }
+    vstr_add_str(&vstr, "\r\n");
+
+    // the socket is corked: head and body leave in full segments on flush
+    uhttp_conn_write(self, (const byte *)vstr.buf, vstr.len);
+    vstr_clear(&vstr);
+    uhttp_conn_write(self, body.buf, body.len);
+    lwip_socket_flush(self->socket);
+
+    self->head_mask |= (uint32_t)head << self->pending;
+    self->pending++;
+    self->requests++;
+    return mp_const_none;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(uhttp_conn_request_obj, 3, 5, uhttp_conn_request);
+
+// getresponse(): reads the status line and headers of the response to the
+// oldest pending request, dropping what is left of the previous body. The
+// parser returned describes it until the next getresponse().
+STATIC mp_obj_t uhttp_conn_getresponse(mp_obj_t self_in) {
+    uhttp_conn_obj_t *self = self_in;
+    uhttp_conn_check(self);
+    while (self->reading) {
+        uhttp_conn_body(self, NULL, UHTTP_CONN_RBUF);
+    }
+    if (self->pending == 0) {
+        nlr_raise(mp_obj_new_exception_msg(&mp_type_RuntimeError, "no pending request"));
+    }
+
+    uhttp_parser_obj_t *resp = self->resp;
+    resp->skip_body = self->head_mask & 1;
+    resp->headers_done = false;
+    resp->done = false;
+    self->head_mask >>= 1;
+    self->pending--;
+    while (!resp->headers_done) {
+        if (self->rpos < self->rlen) {
+            uhttp_conn_execute(self, self->rlen - self->rpos);
+        } else if (!uhttp_conn_fill(self)) {
+            uhttp_conn_raise(self, ECONNRESET);
+        }
+    }
+    self->reading = true;
+    self->reusable = http_should_keep_alive(&resp->parser);
+    return resp;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_1(uhttp_conn_getresponse_obj, uhttp_conn_getresponse);
+
+// readinto(buf[, nbytes]): body of the current response; returns 0 at its end
+STATIC mp_obj_t uhttp_conn_readinto(mp_uint_t n_args, const mp_obj_t *args) {
+    uhttp_conn_obj_t *self = args[0];
+    mp_buffer_info_t bufinfo;
+    mp_get_buffer_raise(args[1], &bufinfo, MP_BUFFER_WRITE);
+    mp_uint_t len = bufinfo.len;
+    if (n_args > 2) {
+        len = MIN(len, (mp_uint_t)mp_obj_get_int(args[2]));
+    }
+    return MP_OBJ_NEW_SMALL_INT(uhttp_conn_body(self, bufinfo.buf, len));
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(uhttp_conn_readinto_obj, 2, 3, uhttp_conn_readinto);
+
+// read([nbytes]): up to nbytes of the body, or all of the rest of it
+STATIC mp_obj_t uhttp_conn_read(mp_uint_t n_args, const mp_obj_t *args) {
+    uhttp_conn_obj_t *self = args[0];
+    mp_int_t size = n_args > 1 ? mp_obj_get_int(args[1]) : -1;
+    vstr_t vstr;
+    if (size >= 0) {
+        vstr_init_len(&vstr, size);
+        vstr.len = uhttp_conn_body(self, (byte *)vstr.buf, size);
+    } else {
+        vstr_init(&vstr, UHTTP_CONN_RBUF);
+        mp_uint_t n;
+        do {
+            char *p = vstr_add_len(&vstr, UHTTP_CONN_RBUF);
+            n = uhttp_conn_body(self, (byte *)p, UHTTP_CONN_RBUF);
+            vstr_cut_tail_bytes(&vstr, UHTTP_CONN_RBUF - n);
+        } while (n > 0);
+    }
+    return mp_obj_new_str_from_vstr(&mp_type_bytes, &vstr);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(uhttp_conn_read_obj, 1, 2, uhttp_conn_read);
+
+// release(): gives the connection back to the pool if the server keeps it
+// open and all responses were read to the end; closes it otherwise
+STATIC mp_obj_t uhttp_conn_release(mp_obj_t self_in) {
+    uhttp_conn_obj_t *self = self_in;
+    uhttp_pool_t *pool = uhttp_pool_get();
+    if (self->socket == MP_OBJ_NULL) {
+        return mp_const_none;
+    }
+    if (!self->reusable || self->reading || self->pending > 0
+        || self->rpos < self->rlen || pool->per_host == 0) {
+        uhttp_conn_drop(self);
+        return mp_const_none;
+    }
+
+    mp_uint_t same = 0;
+    for (mp_uint_t i = 0; i < pool->len; i++) {
+        if (pool->idle[i] == self) {
+            return mp_const_none;
+        }
+        if (pool->idle[i]->port == self->port && mp_obj_equal(pool->idle[i]->host, self->host)) {
+            same++;
+        }
+    }
+    if (same >= pool->per_host) {
+        uhttp_conn_drop(self);
+        return mp_const_none;
+    }
+    if (pool->len == UHTTP_POOL_MAX) {
+        uhttp_conn_drop(pool->idle[0]);
+        memmove(&pool->idle[0], &pool->idle[1], (UHTTP_POOL_MAX - 1) * sizeof(pool->idle[0]));
+        pool->len--;
+        pool->evicted++;
+    }
+    pool->idle[pool->len++] = self;
+    return mp_const_none;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_1(uhttp_conn_release_obj, uhttp_conn_release);
+
+STATIC mp_obj_t uhttp_conn_close(mp_obj_t self_in) {
+    uhttp_conn_drop(self_in);
+    return mp_const_none;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_1(uhttp_conn_close_obj, uhttp_conn_close);
+
+STATIC mp_obj_t uhttp_conn_pending(mp_obj_t self_in) {
+    uhttp_conn_obj_t *self = self_in;
+    return MP_OBJ_NEW_SMALL_INT(self->pending);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_1(uhttp_conn_pending_obj, uhttp_conn_pending);
+
+STATIC mp_obj_t uhttp_conn_socket(mp_obj_t self_in) {
+    uhttp_conn_obj_t *self = self_in;
+    uhttp_conn_check(self);
+    return self->socket;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_1(uhttp_conn_socket_obj, uhttp_conn_socket);
+
+STATIC const mp_rom_map_elem_t uhttp_conn_locals_dict_table[] = {
+    { MP_ROM_QSTR(MP_QSTR_request), MP_ROM_PTR(&uhttp_conn_request_obj) },
+    { MP_ROM_QSTR(MP_QSTR_getresponse), MP_ROM_PTR(&uhttp_conn_getresponse_obj) },
+    { MP_ROM_QSTR(MP_QSTR_readinto), MP_ROM_PTR(&uhttp_conn_readinto_obj) },
+    { MP_ROM_QSTR(MP_QSTR_read), MP_ROM_PTR(&uhttp_conn_read_obj) },
+    { MP_ROM_QSTR(MP_QSTR_release), MP_ROM_PTR(&uhttp_conn_release_obj) },
+    { MP_ROM_QSTR(MP_QSTR_close), MP_ROM_PTR(&uhttp_conn_close_obj) },
+    { MP_ROM_QSTR(MP_QSTR_pending), MP_ROM_PTR(&uhttp_conn_pending_obj) },
+    { MP_ROM_QSTR(MP_QSTR_socket), MP_ROM_PTR(&uhttp_conn_socket_obj) },
+};
+STATIC MP_DEFINE_CONST_DICT(uhttp_conn_locals_dict, uhttp_conn_locals_dict_table);
+
+STATIC const mp_obj_type_t uhttp_conn_type = {
+    { &mp_type_type },
+    .name = MP_QSTR_connection,
+    .print = uhttp_conn_print,
+    .locals_dict = (mp_obj_t)&uhttp_conn_locals_dict,
+};
+
+// An idle connection is stale if the server closed it or sent anything
+STATIC bool uhttp_conn_stale(uhttp_conn_obj_t *self) {
+    int errcode;
+    return lwip_socket_ioctl(self->socket, MP_STREAM_POLL, MP_STREAM_POLL_RD, &errcode) != 0;
+}
+
+// connect(host[, port[, timeout]]): an idle pooled connection to host:port
+// if there is one, a new one otherwise; timeout as for settimeout()
+STATIC mp_obj_t uhttp_connect(mp_uint_t n_args, const mp_obj_t *args) {
+    mp_obj_t host = args[0];
+    mp_uint_t port = n_args > 1 ? mp_obj_get_int(args[1]) : 80;
+    mp_obj_t timeout = n_args > 2 ? args[2] : mp_const_none;
+    uhttp_pool_t *pool = uhttp_pool_get();
+
+    // most recently released first
+    for (mp_uint_t i = pool->len; i-- > 0;) {
+        uhttp_conn_obj_t *c = pool->idle[i];
+        if (c->port != port || !mp_obj_equal(c->host, host)) {
+            continue;
+        }
+        memmove(&pool->idle[i], &pool->idle[i + 1], (pool->len - i - 1) * sizeof(pool->idle[0]));
+        pool->len--;
+        if (uhttp_conn_stale(c)) {
+            uhttp_conn_drop(c);
+            pool->stale++;
+            continue;
+        }
+        pool->hits++;
+        lwip_socket_settimeout(c->socket, timeout);
+        return c;
+    }
+    pool->misses++;
+
+    size_t naddr;
+    mp_obj_t *ai, *entry;
+    mp_obj_list_get(dns_getaddrinfo(host, MP_OBJ_NEW_SMALL_INT(port)), &naddr, &ai);
+    if (naddr == 0) {
+        nlr_raise(mp_obj_new_exception_arg1(&mp_type_OSError, MP_OBJ_NEW_SMALL_INT(EHOSTUNREACH)));
+    }
+    mp_obj_get_array_fixed_n(ai[0], 5, &entry);
+
+    uhttp_conn_obj_t *self = m_new_obj(uhttp_conn_obj_t);
+    memset(self, 0, sizeof(*self));
+    self->base.type = &uhttp_conn_type;
+    self->host = host;
+    self->port = port;
+    self->reusable = true;
+    mp_obj_t parser_kind = MP_OBJ_NEW_SMALL_INT(HTTP_RESPONSE);
+    self->resp = uhttp_parser_make_new(&uhttp_parser_type, 1, 0, &parser_kind);
+
+    self->socket = lwip_socket_make_new(&lwip_socket_type, 0, 0, NULL);
+    lwip_socket_settimeout(self->socket, timeout);
+    mp_obj_t opt[4] = {
+        self->socket,
+        MP_OBJ_NEW_SMALL_INT(MOD_LWIP_IPPROTO_TCP),
+        MP_OBJ_NEW_SMALL_INT(MOD_LWIP_TCP_NODELAY),
+        MP_OBJ_NEW_SMALL_INT(1),
+    };
+    lwip_socket_setsockopt(4, opt);
+    opt[2] = MP_OBJ_NEW_SMALL_INT(MOD_LWIP_TCP_CORK);
+    lwip_socket_setsockopt(4, opt);
+    lwip_socket_connect(self->socket, entry[4]);
+    return self;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(uhttp_connect_obj, 1, 3, uhttp_connect);
+
+STATIC void uhttp_pool_store(mp_obj_t d, qstr key, mp_uint_t value) {
+    mp_obj_dict_store(d, MP_OBJ_NEW_QSTR(key), mp_obj_new_int_from_uint(value));
+}
+
+// pool([per_host]): sets how many idle connections are kept per host (0
+// disables pooling and closes them) and returns the pool counters
+STATIC mp_obj_t uhttp_pool(mp_uint_t n_args, const mp_obj_t *args) {
+    uhttp_pool_t *pool = uhttp_pool_get();
+    if (n_args > 0) {
+        mp_int_t per_host = mp_obj_get_int(args[0]);
+        if (per_host < 0) {
+            nlr_raise(mp_obj_new_exception_msg(&mp_type_ValueError, "invalid pool size"));
+        }
+        pool->per_host = per_host;
+        if (per_host == 0) {
+            while (pool->len > 0) {
+                uhttp_conn_drop(pool->idle[--pool->len]);
+            }
+        }
+    }
+    mp_obj_t d = mp_obj_new_dict(0);
+    uhttp_pool_store(d, MP_QSTR_idle, pool->len);
+    uhttp_pool_store(d, MP_QSTR_per_host, pool->per_host);
+    uhttp_pool_store(d, MP_QSTR_hits, pool->hits);
+    uhttp_pool_store(d, MP_QSTR_misses, pool->misses);
+    uhttp_pool_store(d, MP_QSTR_stale, pool->stale);
+    uhttp_pool_store(d, MP_QSTR_evicted, pool->evicted);
+    return d;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(uhttp_pool_obj, 0, 1, uhttp_pool);
+
+STATIC const mp_rom_map_elem_t mp_module_uhttp_globals_table[] = {
+    { MP_ROM_QSTR(MP_QSTR___name__), MP_ROM_QSTR(MP_QSTR_uhttp) },
+    { MP_ROM_QSTR(MP_QSTR_parser), MP_ROM_PTR(&uhttp_parser_type) },
+    { MP_ROM_QSTR(MP_QSTR_connect), MP_ROM_PTR(&uhttp_connect_obj) },
+    { MP_ROM_QSTR(MP_QSTR_pool), MP_ROM_PTR(&uhttp_pool_obj) },
+    { MP_ROM_QSTR(MP_QSTR_REQUEST), MP_ROM_INT(HTTP_REQUEST) },
+    { MP_ROM_QSTR(MP_QSTR_RESPONSE), MP_ROM_INT(HTTP_RESPONSE) },
+};
+
+STATIC MP_DEFINE_CONST_DICT(mp_module_uhttp_globals, mp_module_uhttp_globals_table);
+
+const mp_obj_module_t mp_module_uhttp = {
+    .base = { &mp_type_module },
+    .name = MP_QSTR_uhttp,
+    .globals = (mp_obj_dict_t*)&mp_module_uhttp_globals,
+};
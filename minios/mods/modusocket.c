@@ -1,6 +1,5 @@
 #include "modlwip.h"
 #include "py/obj.h"
-#include "lwip/sockets.h"
 
 #define SEC_SOCKET           100    /* Secured Socket Layer (SSL,TLS)     */
 
@@ -13,10 +12,16 @@ STATIC const mp_map_elem_t socket_locals_dict_table[] = {
   { MP_OBJ_NEW_QSTR(MP_QSTR_connect),         (mp_obj_t)&lwip_socket_connect },
   { MP_OBJ_NEW_QSTR(MP_QSTR_send),            (mp_obj_t)&lwip_socket_send },
   { MP_OBJ_NEW_QSTR(MP_QSTR_sendall),         (mp_obj_t)&lwip_socket_sendall },
+  { MP_OBJ_NEW_QSTR(MP_QSTR_sendfile),        (mp_obj_t)&lwip_socket_sendfile },
   { MP_OBJ_NEW_QSTR(MP_QSTR_recv),            (mp_obj_t)&lwip_socket_recv },
+  { MP_OBJ_NEW_QSTR(MP_QSTR_recv_into),       (mp_obj_t)&lwip_socket_recv_into },
   { MP_OBJ_NEW_QSTR(MP_QSTR_sendto),          (mp_obj_t)&lwip_socket_sendto },
+  { MP_OBJ_NEW_QSTR(MP_QSTR_sendmany),        (mp_obj_t)&lwip_socket_sendmany },
   { MP_OBJ_NEW_QSTR(MP_QSTR_recvfrom),        (mp_obj_t)&lwip_socket_recvfrom },
   { MP_OBJ_NEW_QSTR(MP_QSTR_setsockopt),      (mp_obj_t)&lwip_socket_setsockopt },
+  { MP_OBJ_NEW_QSTR(MP_QSTR_rxqueue),         (mp_obj_t)&lwip_socket_rxqueue },
+  { MP_OBJ_NEW_QSTR(MP_QSTR_flush),           (mp_obj_t)&lwip_socket_flush },
+  { MP_OBJ_NEW_QSTR(MP_QSTR_stats),           (mp_obj_t)&lwip_socket_stats },
   { MP_OBJ_NEW_QSTR(MP_QSTR_settimeout),      (mp_obj_t)&lwip_socket_settimeout },
   { MP_OBJ_NEW_QSTR(MP_QSTR_setblocking),     (mp_obj_t)&lwip_socket_setblocking },
   { MP_OBJ_NEW_QSTR(MP_QSTR_makefile),        (mp_obj_t)&lwip_socket_makefile },
@@ -49,16 +54,22 @@ STATIC const mp_map_elem_t mp_module_usocket_globals_table[] = {
   //  { MP_OBJ_NEW_QSTR(MP_QSTR_timeout),         (mp_obj_t)&mp_type_TimeoutError },
 
   // class constants
-  { MP_OBJ_NEW_QSTR(MP_QSTR_AF_INET),         MP_OBJ_NEW_SMALL_INT(AF_INET) },
+  { MP_OBJ_NEW_QSTR(MP_QSTR_AF_INET),         MP_OBJ_NEW_SMALL_INT(MOD_LWIP_AF_INET) },
 
-  { MP_OBJ_NEW_QSTR(MP_QSTR_SOCK_STREAM),     MP_OBJ_NEW_SMALL_INT(SOCK_STREAM) },
-  { MP_OBJ_NEW_QSTR(MP_QSTR_SOCK_DGRAM),      MP_OBJ_NEW_SMALL_INT(SOCK_DGRAM) },
-  { MP_OBJ_NEW_QSTR(MP_QSTR_SO_REUSEADDR),      MP_OBJ_NEW_SMALL_INT(SO_REUSEADDR) },  
+  { MP_OBJ_NEW_QSTR(MP_QSTR_SOCK_STREAM),     MP_OBJ_NEW_SMALL_INT(MOD_LWIP_SOCK_STREAM) },
+  { MP_OBJ_NEW_QSTR(MP_QSTR_SOCK_DGRAM),      MP_OBJ_NEW_SMALL_INT(MOD_LWIP_SOCK_DGRAM) },
+  { MP_OBJ_NEW_QSTR(MP_QSTR_SO_REUSEADDR),      MP_OBJ_NEW_SMALL_INT(SOF_REUSEADDR) },  
+  { MP_OBJ_NEW_QSTR(MP_QSTR_SO_XBUF),          MP_OBJ_NEW_SMALL_INT(MOD_LWIP_SO_XBUF) },
+  { MP_OBJ_NEW_QSTR(MP_QSTR_SO_RXQUEUE),       MP_OBJ_NEW_SMALL_INT(MOD_LWIP_SO_RXQUEUE) },
+  { MP_OBJ_NEW_QSTR(MP_QSTR_SO_SNDBUF),        MP_OBJ_NEW_SMALL_INT(MOD_LWIP_SO_SNDBUF) },
+  { MP_OBJ_NEW_QSTR(MP_QSTR_SO_RCVBUF),        MP_OBJ_NEW_SMALL_INT(MOD_LWIP_SO_RCVBUF) },
+  { MP_OBJ_NEW_QSTR(MP_QSTR_TCP_NODELAY),      MP_OBJ_NEW_SMALL_INT(MOD_LWIP_TCP_NODELAY) },
+  { MP_OBJ_NEW_QSTR(MP_QSTR_TCP_CORK),         MP_OBJ_NEW_SMALL_INT(MOD_LWIP_TCP_CORK) },
 
   { MP_OBJ_NEW_QSTR(MP_QSTR_IPPROTO_SEC),     MP_OBJ_NEW_SMALL_INT(SEC_SOCKET) },
-  { MP_OBJ_NEW_QSTR(MP_QSTR_SOL_SOCKET),      MP_OBJ_NEW_SMALL_INT(SOL_SOCKET) },  
-  { MP_OBJ_NEW_QSTR(MP_QSTR_IPPROTO_TCP),     MP_OBJ_NEW_SMALL_INT(IPPROTO_TCP) },
-  { MP_OBJ_NEW_QSTR(MP_QSTR_IPPROTO_UDP),     MP_OBJ_NEW_SMALL_INT(IPPROTO_UDP) },
+  { MP_OBJ_NEW_QSTR(MP_QSTR_SOL_SOCKET),      MP_OBJ_NEW_SMALL_INT(MOD_LWIP_SOL_SOCKET) },  
+  { MP_OBJ_NEW_QSTR(MP_QSTR_IPPROTO_TCP),     MP_OBJ_NEW_SMALL_INT(MOD_LWIP_IPPROTO_TCP) },
+  { MP_OBJ_NEW_QSTR(MP_QSTR_IPPROTO_UDP),     MP_OBJ_NEW_SMALL_INT(MOD_LWIP_IPPROTO_UDP) },
 };
 
 STATIC MP_DEFINE_CONST_DICT(mp_module_usocket_globals, mp_module_usocket_globals_table);
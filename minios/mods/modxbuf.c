@@ -0,0 +1,436 @@
+/*
+ * This file is part of the Micro Python project, http://micropython.org/
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2017 NEC Europe Ltd., NEC Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <string.h>
+#include <errno.h>
+
+#include "py/nlr.h"
+#include "py/runtime.h"
+#include "py/stream.h"
+#include "py/gc.h"
+
+#include "modxbuf.h"
+#include "gccollect.h"
+
+// Payload alignment; keeps xbufs usable as sector-aligned I/O buffers
+#define XBUF_ALIGN (64)
+// Initial capacity used by readfile() when the size is not known
+#define XBUF_READ_CHUNK (32768)
+
+// Size classes served from mempools. Pools are allocated on first use;
+// requests above the largest class (or when a pool is exhausted) are
+// served by _xmalloc().
+typedef struct _xbuf_class_t {
+    mp_uint_t size;
+    uint32_t nb_objs;
+    struct mempool *pool;
+} xbuf_class_t;
+
+STATIC xbuf_class_t xbuf_classes[] = {
+    { 2048,   64, NULL },
+    { 8192,   32, NULL },
+    { 32768,  16, NULL },
+    { 131072,  8, NULL },
+};
+
+#define XBUF_NB_CLASSES (sizeof(xbuf_classes) / sizeof(xbuf_classes[0]))
+
+STATIC mp_uint_t xbuf_xmalloc_bytes = 0;
+
+STATIC int xbuf_alloc_data(xbuf_obj_t *self, mp_uint_t size) {
+    for (mp_uint_t i = 0; i < XBUF_NB_CLASSES; i++) {
+        xbuf_class_t *c = &xbuf_classes[i];
+        if (size > c->size) {
+            continue;
+        }
+        if (c->pool == NULL) {
+            c->pool = alloc_enhanced_mempool(c->nb_objs, c->size, XBUF_ALIGN,
+                                             0, 0, 0, MEMPOOL_SEP_DATA,
+                                             NULL, NULL, NULL, NULL, NULL, NULL);
+            if (c->pool == NULL) {
+                continue;
+            }
+        }
+        struct mempool_obj *pobj = mempool_pick(c->pool);
+        if (pobj != NULL) {
+            self->pobj = pobj;
+            self->data = pobj->data;
+            self->alloc = c->size;
+            return 0;
+        }
+        // exhausted, try the next larger class
+    }
+
+    self->data = _xmalloc(size ? size : 1, XBUF_ALIGN);
+    if (self->data == NULL) {
+        return -1;
+    }
+    self->pobj = NULL;
+    self->alloc = size;
+    xbuf_xmalloc_bytes += size;
+    return 0;
+}
+
+STATIC void xbuf_free_payload(byte *data, struct mempool_obj *pobj, mp_uint_t alloc) {
+    if (pobj != NULL) {
+        mempool_put(pobj);
+    } else if (data != NULL) {
+        xfree(data);
+        xbuf_xmalloc_bytes -= alloc;
+    }
+}
+
+// Payloads of collected xbufs that had been exported through the buffer
+// protocol. A memoryview only holds the payload address and does not keep
+// the xbuf alive, so they stay here until a collection finds no live
+// reference into them. The table is off the GC heap since entries are
+// added from the finaliser.
+typedef struct _xbuf_held_t {
+    byte *data;
+    mp_uint_t alloc;
+    struct mempool_obj *pobj;
+    bool referenced;
+} xbuf_held_t;
+
+STATIC xbuf_held_t *xbuf_held = NULL;
+STATIC mp_uint_t xbuf_held_len = 0;
+STATIC mp_uint_t xbuf_held_max = 0;
+
+STATIC void xbuf_hold(xbuf_obj_t *self) {
+    if (xbuf_held_len == xbuf_held_max) {
+        mp_uint_t max = xbuf_held_max ? 2 * xbuf_held_max : 64;
+        xbuf_held_t *h = _xmalloc(max * sizeof(xbuf_held_t), __alignof__(xbuf_held_t));
+        if (h == NULL) {
+            // leaking the payload is the only safe way out
+            return;
+        }
+        if (xbuf_held != NULL) {
+            memcpy(h, xbuf_held, xbuf_held_len * sizeof(xbuf_held_t));
+            xfree(xbuf_held);
+        }
+        xbuf_held = h;
+        xbuf_held_max = max;
+    }
+    xbuf_held_t *e = &xbuf_held[xbuf_held_len++];
+    e->data = self->data;
+    e->alloc = self->alloc ? self->alloc : 1;
+    e->pobj = self->pobj;
+}
+
+typedef struct _xbuf_held_span_t {
+    byte *lo;
+    byte *hi;
+} xbuf_held_span_t;
+
+STATIC void xbuf_held_scan(void **ptrs, mp_uint_t len, void *arg) {
+    xbuf_held_span_t *span = arg;
+    for (mp_uint_t i = 0; i < len; i++) {
+        byte *p = ptrs[i];
+        if (p < span->lo || p >= span->hi) {
+            continue;
+        }
+        for (mp_uint_t j = 0; j < xbuf_held_len; j++) {
+            xbuf_held_t *e = &xbuf_held[j];
+            if (p >= e->data && p < e->data + e->alloc) {
+                e->referenced = true;
+                break;
+            }
+        }
+    }
+}
+
+void xbuf_collect_held(void) {
+    xbuf_held_span_t span = { (byte*)-1, NULL };
+
+    if (xbuf_held_len == 0) {
+        return;
+    }
+    for (mp_uint_t j = 0; j < xbuf_held_len; j++) {
+        xbuf_held_t *e = &xbuf_held[j];
+        e->referenced = false;
+        if (e->data < span.lo) {
+            span.lo = e->data;
+        }
+        if (e->data + e->alloc > span.hi) {
+            span.hi = e->data + e->alloc;
+        }
+    }
+    gc_collect_scan_live(xbuf_held_scan, &span);
+
+    mp_uint_t n = 0;
+    for (mp_uint_t j = 0; j < xbuf_held_len; j++) {
+        xbuf_held_t *e = &xbuf_held[j];
+        if (e->referenced) {
+            xbuf_held[n++] = *e;
+        } else {
+            xbuf_free_payload(e->data, e->pobj, e->alloc);
+        }
+    }
+    xbuf_held_len = n;
+}
+
+STATIC void xbuf_free_data(xbuf_obj_t *self) {
+    if (self->parent != MP_OBJ_NULL) {
+        // a slice: the payload belongs to the parent
+        self->parent = MP_OBJ_NULL;
+    } else if (self->exported && self->data != NULL) {
+        xbuf_hold(self);
+    } else {
+        xbuf_free_payload(self->data, self->pobj, self->alloc);
+    }
+    self->exported = false;
+    self->pobj = NULL;
+    self->data = NULL;
+    self->alloc = 0;
+}
+
+// The GC does not see payload memory, so a failing allocation may just
+// mean that unreachable xbufs were not finalised yet: collect and retry.
+STATIC void xbuf_alloc_data_raise(xbuf_obj_t *self, mp_uint_t size) {
+    if (xbuf_alloc_data(self, size) == 0) {
+        return;
+    }
+    gc_collect_set_reason(GC_REASON_XBUF);
+    gc_collect();
+    if (xbuf_alloc_data(self, size) != 0) {
+        nlr_raise(mp_obj_new_exception_msg(&mp_type_MemoryError, "xbuf: out of memory"));
+    }
+}
+
+xbuf_obj_t *xbuf_new(mp_uint_t size) {
+    xbuf_obj_t *self = m_new_obj_with_finaliser(xbuf_obj_t);
+    self->base.type = &xbuf_type;
+    self->data = NULL;
+    self->pobj = NULL;
+    self->parent = MP_OBJ_NULL;
+    self->exported = false;
+    self->alloc = 0;
+    self->len = 0;
+    xbuf_alloc_data_raise(self, size);
+    self->len = size;
+    return self;
+}
+
+void xbuf_release(xbuf_obj_t *self) {
+    xbuf_free_data(self);
+    self->len = 0;
+}
+
+// Moves the payload to an area with capacity >= size, keeping the content.
+// Only for xbufs not handed to Python yet, which cannot have views.
+STATIC void xbuf_grow(xbuf_obj_t *self, mp_uint_t size) {
+    xbuf_obj_t tmp;
+
+    if (size <= self->alloc) {
+        return;
+    }
+    xbuf_alloc_data_raise(&tmp, size);
+    memcpy(tmp.data, self->data, self->len);
+    xbuf_free_data(self);
+    self->data = tmp.data;
+    self->pobj = tmp.pobj;
+    self->alloc = tmp.alloc;
+}
+
+STATIC void xbuf_print(const mp_print_t *print, mp_obj_t self_in, mp_print_kind_t kind) {
+    xbuf_obj_t *self = self_in;
+    mp_printf(print, "<xbuf len=%u alloc=%u>", (uint)self->len, (uint)self->alloc);
+}
+
+// xbuf(size): payload content is zero-initialised, like bytearray(size)
+STATIC mp_obj_t xbuf_make_new(const mp_obj_type_t *type, mp_uint_t n_args, mp_uint_t n_kw, const mp_obj_t *args) {
+    mp_arg_check_num(n_args, n_kw, 1, 1, false);
+    mp_int_t size = mp_obj_get_int(args[0]);
+    if (size < 0) {
+        nlr_raise(mp_obj_new_exception_msg(&mp_type_ValueError, "negative size"));
+    }
+    xbuf_obj_t *self = xbuf_new(size);
+    memset(self->data, 0, size);
+    return self;
+}
+
+STATIC mp_obj_t xbuf_unary_op(mp_uint_t op, mp_obj_t self_in) {
+    xbuf_obj_t *self = self_in;
+    switch (op) {
+        case MP_UNARY_OP_BOOL: return mp_obj_new_bool(self->len != 0);
+        case MP_UNARY_OP_LEN: return MP_OBJ_NEW_SMALL_INT(self->len);
+        default: return MP_OBJ_NULL; // op not supported
+    }
+}
+
+// xbuf[a:b] is an xbuf sharing the payload without copying it; it keeps
+// the xbuf it was taken from alive.
+STATIC mp_obj_t xbuf_subscr(mp_obj_t self_in, mp_obj_t index_in, mp_obj_t value) {
+    xbuf_obj_t *self = self_in;
+    if (value == MP_OBJ_NULL) {
+        // delete
+        return MP_OBJ_NULL; // op not supported
+    }
+    #if MICROPY_PY_BUILTINS_SLICE
+    if (value == MP_OBJ_SENTINEL && MP_OBJ_IS_TYPE(index_in, &mp_type_slice)) {
+        mp_bound_slice_t slice;
+        if (!mp_seq_get_fast_slice_indexes(self->len, index_in, &slice)) {
+            nlr_raise(mp_obj_new_exception_msg(&mp_type_NotImplementedError, "only slices with step=1 are supported"));
+        }
+        xbuf_obj_t *view = m_new_obj(xbuf_obj_t);
+        view->base.type = &xbuf_type;
+        view->parent = self->parent != MP_OBJ_NULL ? self->parent : self;
+        view->data = self->data + slice.start;
+        view->len = slice.stop - slice.start;
+        view->alloc = view->len;
+        view->pobj = NULL;
+        view->exported = false;
+        return view;
+    }
+    #endif
+    if (!MP_OBJ_IS_SMALL_INT(index_in)) {
+        return MP_OBJ_NULL; // op not supported
+    }
+    mp_uint_t index = mp_get_index(&xbuf_type, self->len, index_in, false);
+    if (value == MP_OBJ_SENTINEL) {
+        // load
+        return MP_OBJ_NEW_SMALL_INT(self->data[index]);
+    }
+    // store
+    self->data[index] = mp_obj_get_int(value);
+    return mp_const_none;
+}
+
+// memoryview(xbuf) only holds the payload address, not the xbuf: once
+// exported, the payload outlives the xbuf until no live object points
+// into it (see xbuf_collect_held())
+STATIC mp_int_t xbuf_get_buffer(mp_obj_t self_in, mp_buffer_info_t *bufinfo, mp_uint_t flags) {
+    xbuf_obj_t *self = self_in;
+    xbuf_obj_t *owner = (self->parent != MP_OBJ_NULL) ? self->parent : self;
+    owner->exported = true;
+    bufinfo->buf = self->data;
+    bufinfo->len = self->len;
+    bufinfo->typecode = 'B';
+    return 0;
+}
+
+// The payload is only returned through the finaliser, which holds it back
+// while views from get_buffer() may exist. There is no release() for
+// Python code, since there is no way to know whether views exist.
+STATIC mp_obj_t xbuf_del(mp_obj_t self_in) {
+    xbuf_release(self_in);
+    return mp_const_none;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_1(xbuf_del_obj, xbuf_del);
+
+STATIC const mp_map_elem_t xbuf_locals_dict_table[] = {
+    { MP_OBJ_NEW_QSTR(MP_QSTR___del__), (mp_obj_t)&xbuf_del_obj },
+};
+STATIC MP_DEFINE_CONST_DICT(xbuf_locals_dict, xbuf_locals_dict_table);
+
+const mp_obj_type_t xbuf_type = {
+    { &mp_type_type },
+    .name = MP_QSTR_xbuf,
+    .print = xbuf_print,
+    .make_new = xbuf_make_new,
+    .unary_op = xbuf_unary_op,
+    .subscr = xbuf_subscr,
+    .buffer_p = { .get_buffer = xbuf_get_buffer },
+    .locals_dict = (mp_obj_t)&xbuf_locals_dict,
+};
+
+/******************************************************************************/
+// Module functions
+
+// xbuf.readfile(stream[, size]): reads size bytes (or up to EOF) from
+// a stream object, e.g. a file returned by open(), into a new xbuf.
+STATIC mp_obj_t mod_xbuf_readfile(size_t n_args, const mp_obj_t *args) {
+    const mp_obj_type_t *type = mp_obj_get_type(args[0]);
+    if (type->stream_p == NULL || type->stream_p->read == NULL) {
+        nlr_raise(mp_obj_new_exception_msg(&mp_type_TypeError, "stream expected"));
+    }
+
+    mp_int_t size = -1;
+    if (n_args > 1) {
+        size = mp_obj_get_int(args[1]);
+    }
+
+    xbuf_obj_t *self = xbuf_new(size >= 0 ? size : XBUF_READ_CHUNK);
+    mp_uint_t total = 0;
+    self->len = 0;
+    for (;;) {
+        mp_uint_t limit = (size >= 0) ? (mp_uint_t)size : self->alloc;
+        if (total == limit) {
+            if (size >= 0) {
+                break;
+            }
+            xbuf_grow(self, self->alloc * 2);
+            limit = self->alloc;
+        }
+
+        int errcode;
+        mp_uint_t out_sz = type->stream_p->read(args[0], self->data + total, limit - total, &errcode);
+        if (out_sz == MP_STREAM_ERROR) {
+            xbuf_release(self);
+            nlr_raise(mp_obj_new_exception_arg1(&mp_type_OSError, MP_OBJ_NEW_SMALL_INT(errcode)));
+        }
+        if (out_sz == 0) {
+            break;
+        }
+        total += out_sz;
+        self->len = total;
+    }
+    return self;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(mod_xbuf_readfile_obj, 1, 2, mod_xbuf_readfile);
+
+// xbuf.stats(): ([(class size, objects, free objects), ...], bytes in _xmalloc() areas)
+STATIC mp_obj_t mod_xbuf_stats(void) {
+    mp_obj_t classes = mp_obj_new_list(0, NULL);
+    for (mp_uint_t i = 0; i < XBUF_NB_CLASSES; i++) {
+        xbuf_class_t *c = &xbuf_classes[i];
+        mp_obj_t t[3];
+        t[0] = MP_OBJ_NEW_SMALL_INT(c->size);
+        t[1] = MP_OBJ_NEW_SMALL_INT(c->pool ? mempool_nb_objs(c->pool) : 0);
+        t[2] = MP_OBJ_NEW_SMALL_INT(c->pool ? mempool_free_count(c->pool) : 0);
+        mp_obj_list_append(classes, mp_obj_new_tuple(3, t));
+    }
+    mp_obj_t tuple[2];
+    tuple[0] = classes;
+    tuple[1] = mp_obj_new_int_from_uint(xbuf_xmalloc_bytes);
+    return mp_obj_new_tuple(2, tuple);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_0(mod_xbuf_stats_obj, mod_xbuf_stats);
+
+STATIC const mp_rom_map_elem_t mp_module_xbuf_globals_table[] = {
+    { MP_ROM_QSTR(MP_QSTR___name__), MP_ROM_QSTR(MP_QSTR_xbuf) },
+    { MP_ROM_QSTR(MP_QSTR_xbuf), MP_ROM_PTR(&xbuf_type) },
+    { MP_ROM_QSTR(MP_QSTR_readfile), MP_ROM_PTR(&mod_xbuf_readfile_obj) },
+    { MP_ROM_QSTR(MP_QSTR_stats), MP_ROM_PTR(&mod_xbuf_stats_obj) },
+};
+
+STATIC MP_DEFINE_CONST_DICT(mp_module_xbuf_globals, mp_module_xbuf_globals_table);
+
+const mp_obj_module_t mp_module_xbuf = {
+    .base = { &mp_type_module },
+    .name = MP_QSTR_xbuf,
+    .globals = (mp_obj_dict_t*)&mp_module_xbuf_globals,
+};
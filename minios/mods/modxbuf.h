@@ -0,0 +1,60 @@
+/*
+ * This file is part of the Micro Python project, http://micropython.org/
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2017 NEC Europe Ltd., NEC Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef MICROPY_INCLUDED_MINIOS_MODXBUF_H
+#define MICROPY_INCLUDED_MINIOS_MODXBUF_H
+
+#include "py/obj.h"
+#include "mempool.h"
+
+// An xbuf is a small GC object whose payload lives outside of the GC
+// heap: either in one of the size-classed xbuf mempools or, for large
+// requests, in a dedicated _xmalloc() area. The GC neither scans nor
+// accounts the payload; it is returned by the finaliser, or once no live
+// object points into it if it was ever exported (see xbuf_collect_held()).
+typedef struct _xbuf_obj_t {
+    mp_obj_base_t base;
+    byte *data;
+    mp_uint_t len;    // bytes in use
+    mp_uint_t alloc;  // capacity of data
+    struct mempool_obj *pobj; // NULL if data was allocated with _xmalloc()
+    mp_obj_t parent;  // for slices: the xbuf owning data, else MP_OBJ_NULL
+    bool exported;    // data was handed out by get_buffer()
+} xbuf_obj_t;
+
+extern const mp_obj_type_t xbuf_type;
+
+// Allocates an xbuf with capacity >= size and len = size. Raises
+// MemoryError if no memory is left even after a garbage collection.
+xbuf_obj_t *xbuf_new(mp_uint_t size);
+// Returns the payload memory; the object stays valid with len = 0. Only
+// safe while no view on the payload exists, i.e. before the xbuf is
+// handed to Python code, and from the finaliser.
+void xbuf_release(xbuf_obj_t *self);
+// Called by gc_collect() after the sweep: frees the payloads of collected,
+// exported xbufs that no live object or stack word points into anymore
+void xbuf_collect_held(void);
+
+#endif // MICROPY_INCLUDED_MINIOS_MODXBUF_H
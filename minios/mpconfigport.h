@@ -166,11 +166,25 @@ extern const struct _mp_obj_module_t mp_module_time;
 extern const struct _mp_obj_module_t mp_module_usocket;
 extern const struct _mp_obj_module_t mp_module_os;
 extern const struct _mp_obj_module_t mp_module_lwip;
+extern const struct _mp_obj_module_t mp_module_xbuf;
+extern const struct _mp_obj_module_t mp_module_gcstats;
+extern const struct _mp_obj_module_t mp_module_uevent;
+extern const struct _mp_obj_module_t mp_module_httpd;
+extern const struct _mp_obj_module_t mp_module_uhttp;
+extern const struct _mp_obj_module_t mp_module_udns;
+extern const struct _mp_obj_module_t mp_module_pcap;
 #define MICROPY_PORT_BUILTIN_MODULES \
   { MP_OBJ_NEW_QSTR(MP_QSTR_usocket), (mp_obj_t)&mp_module_usocket }, \
   { MP_ROM_QSTR(MP_QSTR_utime), MP_ROM_PTR(&mp_module_time) }, \
   { MP_ROM_QSTR(MP_QSTR_uos), MP_ROM_PTR(&mp_module_os) }, \
   { MP_ROM_QSTR(MP_QSTR_lwip), MP_ROM_PTR(&mp_module_lwip) }, \
+  { MP_ROM_QSTR(MP_QSTR_xbuf), MP_ROM_PTR(&mp_module_xbuf) }, \
+  { MP_ROM_QSTR(MP_QSTR_gcstats), MP_ROM_PTR(&mp_module_gcstats) }, \
+  { MP_ROM_QSTR(MP_QSTR_uevent), MP_ROM_PTR(&mp_module_uevent) }, \
+  { MP_ROM_QSTR(MP_QSTR_httpd), MP_ROM_PTR(&mp_module_httpd) }, \
+  { MP_ROM_QSTR(MP_QSTR_uhttp), MP_ROM_PTR(&mp_module_uhttp) }, \
+  { MP_ROM_QSTR(MP_QSTR_udns), MP_ROM_PTR(&mp_module_udns) }, \
+  { MP_ROM_QSTR(MP_QSTR_pcap), MP_ROM_PTR(&mp_module_pcap) }, \
 
 // type definitions for the specific machine
 // assume that if we already defined the obj repr then we also defined types
@@ -227,12 +241,42 @@ typedef const void *machine_const_ptr_t; // must be of pointer size
 #endif
 #endif
 
+// Native code is placed in executable regions managed by alloc.c
+void mp_unix_alloc_exec(mp_uint_t min_size, void** ptr, mp_uint_t *size);
+void mp_unix_free_exec(void *ptr, mp_uint_t size);
+#define MP_PLAT_ALLOC_EXEC(min_size, ptr, size) mp_unix_alloc_exec(min_size, ptr, size)
+#define MP_PLAT_FREE_EXEC(ptr, size) mp_unix_free_exec(ptr, size)
+
+#if MICROPY_PY_USELECT
+// uselect.poll()/select() drive the network interfaces while waiting; the
+// hook is expanded in their wait loop, where timeout (ms, -1 for none) and
+// start_tick are in scope, so that it does not sleep past the timeout
+void lwip_poll_hook(mp_uint_t start_ms, mp_uint_t timeout_ms);
+#define MICROPY_EVENT_POLL_HOOK lwip_poll_hook(start_tick, timeout);
+#endif
+
+#if MICROPY_ENABLE_GC
+// The bytecode VM runs a due gcstats hook where it checks for pending
+// exceptions, on backwards jumps and returns, so that the hook does not
+// wait for the network to be polled
+#include <stdbool.h>
+extern bool gc_hook_pending;
+void gc_collect_hook_run(void);
+#define MICROPY_VM_HOOK_LOOP if (gc_hook_pending) { gc_collect_hook_run(); }
+#define MICROPY_VM_HOOK_RETURN MICROPY_VM_HOOK_LOOP
+#endif
+
 #define MP_STATE_PORT MP_STATE_VM
 
 #define MICROPY_PORT_ROOT_POINTERS \
     const char *readline_hist[50]; \
     mp_obj_t keyboard_interrupt_obj; \
-    void *mmap_region_head; \
+    mp_obj_t gc_stats_hook; \
+    struct _uevent_state_t *uevent_state; \
+    mp_obj_t httpd_handler; \
+    struct _dns_state_t *dns_state; \
+    struct _lwip_cb_batch_t *lwip_cb_batch; \
+    struct _uhttp_pool_t *uhttp_pool; \
 
 // We need to provide a declaration/definition of alloca()
 // unless support for it is disabled.
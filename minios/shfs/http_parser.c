@@ -0,0 +1,991 @@
+/*
+ * Incremental HTTP/1.x parser for SHFS tools and Mini-OS
+ *
+ *
+ * Copyright (c) 2017, NEC Europe Ltd., NEC Corporation All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * THIS HEADER MAY NOT BE EXTRACTED OR MODIFIED IN ANY WAY.
+ */
+
+#include <string.h>
+#include <limits.h>
+#include "http_parser.h"
+
+#ifndef MIN
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+
+#define CR '\r'
+#define LF '\n'
+#define CONTENT_LENGTH_UNKNOWN UINT64_MAX
+
+enum state {
+	s_dead = 1, /* connection: close message is complete */
+
+	s_start_req,
+	s_req_method,
+	s_req_url_start,
+	s_req_url,
+	s_req_http_start,
+	s_req_http_major,
+	s_req_http_minor,
+	s_req_line_almost_done,
+
+	s_start_res,
+	s_res_http_start,
+	s_res_http_major,
+	s_res_http_minor,
+	s_res_status_code,
+	s_res_status_start,
+	s_res_status,
+	s_res_line_almost_done,
+
+	s_header_field_start,
+	s_header_field,
+	s_header_value_discard_ws,
+	s_header_value,
+	s_header_almost_done,
+	s_header_value_lws,
+	s_headers_almost_done,
+	/* states up to here count against HTTP_MAX_HEADER_SIZE */
+
+	s_chunk_size_start,
+	s_chunk_size,
+	s_chunk_parameters,
+	s_chunk_size_almost_done,
+	s_chunk_data,
+	s_chunk_data_almost_done,
+	s_chunk_data_done,
+
+	s_body_identity,
+	s_body_identity_eof,
+
+	s_message_done, /* on_message_complete still to be called */
+};
+
+#define PARSING_HEADER(state) ((state) <= s_headers_almost_done)
+
+enum header_state {
+	h_general = 0,
+	h_content_length,
+	h_transfer_encoding,
+	h_connection,
+	h_upgrade,
+};
+
+static const char *method_strings[] = {
+#define XX(num, name, string) [num] = #string,
+	HTTP_METHOD_MAP(XX)
+#undef XX
+};
+
+static const struct {
+	const char *name;
+	const char *description;
+} http_strerror_tab[] = {
+#define XX(n, s) { "HPE_" #n, s },
+	HTTP_ERRNO_MAP(XX)
+#undef XX
+};
+
+#define SET_ERRNO(e) \
+	do { parser->http_errno = (e); } while (0)
+
+/*
+ * Calls a notification callback; returns from http_parser_execute() with
+ * consumed bytes if it failed or paused the parser
+ */
+#define CALLBACK_NOTIFY(FOR, consumed) \
+	do { \
+		if (settings->on_##FOR) { \
+			if (settings->on_##FOR(parser) != 0) \
+				SET_ERRNO(HPE_CB_##FOR); \
+			if (HTTP_PARSER_ERRNO(parser) != HPE_OK) \
+				return (consumed); \
+		} \
+	} while (0)
+
+/*
+ * Completes a message: on_message_complete is deferred to the next call if
+ * the parser was paused before, so a pause never drops the notification
+ */
+#define MESSAGE_DONE(consumed) \
+	do { \
+		parser->state = s_message_done; \
+		if (HTTP_PARSER_ERRNO(parser) != HPE_OK) \
+			return (consumed); \
+		parser->state = new_message(parser); \
+		CALLBACK_NOTIFY(message_complete, consumed); \
+	} while (0)
+
+/* Reports the data from mark up to (excluding) end */
+#define CALLBACK_DATA(FOR, mark, end, consumed) \
+	do { \
+		if (mark) { \
+			if (settings->on_##FOR && (end) != (mark) && \
+			    settings->on_##FOR(parser, (mark), (end) - (mark)) != 0) \
+				SET_ERRNO(HPE_CB_##FOR); \
+			(mark) = NULL; \
+			if (HTTP_PARSER_ERRNO(parser) != HPE_OK) \
+				return (consumed); \
+		} \
+	} while (0)
+
+#define LOWER(c) ((unsigned char) ((c) | 0x20))
+#define IS_ALPHA(c) (LOWER(c) >= 'a' && LOWER(c) <= 'z')
+#define IS_NUM(c) ((c) >= '0' && (c) <= '9')
+
+static inline int is_token(unsigned char c)
+{
+	if (IS_ALPHA(c) || IS_NUM(c))
+		return 1;
+	return c != '\0' && strchr("!#$%&'*+-.^_`|~", c) != NULL;
+}
+
+static inline int unhex(unsigned char c)
+{
+	if (IS_NUM(c))
+		return c - '0';
+	c = LOWER(c);
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	return -1;
+}
+
+static enum header_state match_header(const char *name)
+{
+	if (strcmp(name, "content-length") == 0)
+		return h_content_length;
+	if (strcmp(name, "transfer-encoding") == 0)
+		return h_transfer_encoding;
+	if (strcmp(name, "connection") == 0)
+		return h_connection;
+	if (strcmp(name, "upgrade") == 0)
+		return h_upgrade;
+	return h_general;
+}
+
+/*
+ * Evaluates a token of a Transfer-Encoding or Connection header value;
+ * chunked has to be the last transfer coding to count
+ */
+static void header_token_done(struct http_parser *parser)
+{
+	const char *t = parser->token;
+
+	if (parser->index >= sizeof(parser->token))
+		t = ""; /* too long to match anything */
+	else
+		parser->token[parser->index] = '\0';
+
+	if (parser->header_state == h_transfer_encoding) {
+		if (parser->index == 0)
+			return;
+		if (strcmp(t, "chunked") == 0)
+			parser->flags |= F_CHUNKED;
+		else
+			parser->flags &= ~F_CHUNKED;
+	} else if (parser->header_state == h_connection) {
+		if (strcmp(t, "close") == 0)
+			parser->flags |= F_CONNECTION_CLOSE;
+		else if (strcmp(t, "keep-alive") == 0)
+			parser->flags |= F_CONNECTION_KEEP_ALIVE;
+		else if (strcmp(t, "upgrade") == 0)
+			parser->flags |= F_CONNECTION_UPGRADE;
+	}
+	parser->index = 0;
+}
+
+static void message_reset(struct http_parser *parser)
+{
+	parser->flags = 0;
+	parser->nread = 0;
+	parser->content_length = CONTENT_LENGTH_UNKNOWN;
+	parser->http_major = 0;
+	parser->http_minor = 0;
+	parser->index = 0;
+}
+
+static inline enum state start_state(const struct http_parser *parser)
+{
+	return (parser->type == HTTP_REQUEST) ? s_start_req : s_start_res;
+}
+
+/* State after a complete message */
+static inline enum state new_message(const struct http_parser *parser)
+{
+	if (http_should_keep_alive(parser))
+		return start_state(parser);
+	return s_dead;
+}
+
+int http_message_needs_eof(const struct http_parser *parser)
+{
+	if (parser->type == HTTP_REQUEST)
+		return 0;
+	/* see RFC 7230, section 3.3.3 */
+	if (parser->status_code / 100 == 1 ||
+	    parser->status_code == 204 ||
+	    parser->status_code == 304 ||
+	    (parser->flags & F_SKIPBODY))
+		return 0;
+	if ((parser->flags & F_CHUNKED) ||
+	    parser->content_length != CONTENT_LENGTH_UNKNOWN)
+		return 0;
+	return 1;
+}
+
+int http_should_keep_alive(const struct http_parser *parser)
+{
+	if (parser->http_major > 0 && parser->http_minor > 0) {
+		/* HTTP/1.1 */
+		if (parser->flags & F_CONNECTION_CLOSE)
+			return 0;
+	} else {
+		/* HTTP/1.0 or earlier */
+		if (!(parser->flags & F_CONNECTION_KEEP_ALIVE))
+			return 0;
+	}
+	return !http_message_needs_eof(parser);
+}
+
+size_t http_parser_execute(struct http_parser *parser,
+			   const struct http_parser_settings *settings,
+			   const char *data, size_t len)
+{
+	const char *p;
+	const char *end = data + len;
+	const char *url_mark = NULL;
+	const char *status_mark = NULL;
+	const char *field_mark = NULL;
+	const char *value_mark = NULL;
+	enum state state = (enum state) parser->state;
+	unsigned char ch;
+	size_t n;
+	int d;
+
+	if (HTTP_PARSER_ERRNO(parser) != HPE_OK)
+		return 0;
+
+	if (state == s_message_done) {
+		MESSAGE_DONE(0);
+		state = (enum state) parser->state;
+	}
+
+	if (len == 0) {
+		/* end of stream */
+		switch (state) {
+		case s_body_identity_eof:
+			MESSAGE_DONE(0);
+			return 0;
+		case s_dead:
+		case s_start_req:
+		case s_start_res:
+			return 0;
+		default:
+			SET_ERRNO(HPE_INVALID_EOF_STATE);
+			return 1;
+		}
+	}
+
+	/* tokens continued from the previous buffer */
+	switch (state) {
+	case s_req_url:
+		url_mark = data;
+		break;
+	case s_res_status:
+		status_mark = data;
+		break;
+	case s_header_field:
+		field_mark = data;
+		break;
+	case s_header_value:
+		value_mark = data;
+		break;
+	default:
+		break;
+	}
+
+/* consumed count when stopping after the current character */
+#define CONSUMED ((size_t) (p - data + 1))
+#define ERROR(e) \
+	do { SET_ERRNO(e); goto error; } while (0)
+#define UPDATE_STATE(s) \
+	do { state = (s); parser->state = state; } while (0)
+
+	for (p = data; p != end; p++) {
+		ch = (unsigned char) *p;
+
+		if (PARSING_HEADER(state) ||
+		    (state >= s_chunk_size_start && state <= s_chunk_size_almost_done)) {
+			if (++parser->nread > HTTP_MAX_HEADER_SIZE)
+				ERROR(HPE_HEADER_OVERFLOW);
+		}
+
+reexecute:
+		switch (state) {
+		case s_dead:
+			if (ch == CR || ch == LF)
+				break;
+			ERROR(HPE_CLOSED_CONNECTION);
+
+		case s_start_req:
+			if (ch == CR || ch == LF)
+				break;
+			message_reset(parser);
+			if (!is_token(ch))
+				ERROR(HPE_INVALID_METHOD);
+			parser->token[parser->index++] = ch;
+			UPDATE_STATE(s_req_method);
+			CALLBACK_NOTIFY(message_begin, CONSUMED);
+			break;
+
+		case s_req_method:
+			if (ch == ' ') {
+				int m;
+
+				parser->token[parser->index] = '\0';
+				for (m = 0; m < (int) (sizeof(method_strings) / sizeof(method_strings[0])); m++) {
+					if (method_strings[m] && strcmp(method_strings[m], parser->token) == 0)
+						break;
+				}
+				if (m == (int) (sizeof(method_strings) / sizeof(method_strings[0])))
+					ERROR(HPE_INVALID_METHOD);
+				parser->method = m;
+				UPDATE_STATE(s_req_url_start);
+				break;
+			}
+			if (!is_token(ch) || parser->index >= sizeof(parser->token) - 1)
+				ERROR(HPE_INVALID_METHOD);
+			parser->token[parser->index++] = ch;
+			break;
+
+		case s_req_url_start:
+			if (ch <= ' ' || ch == 0x7f)
+				ERROR(HPE_INVALID_URL);
+			url_mark = p;
+			UPDATE_STATE(s_req_url);
+			break;
+
+		case s_req_url:
+			if (ch == ' ') {
+				UPDATE_STATE(s_req_http_start);
+				parser->index = 0;
+				CALLBACK_DATA(url, url_mark, p, CONSUMED);
+				break;
+			}
+			if (ch < ' ' || ch == 0x7f)
+				ERROR(HPE_INVALID_URL); /* incl. HTTP/0.9 request lines */
+			break;
+
+		case s_req_http_start:
+		case s_res_http_start:
+			if (ch != (unsigned char) "HTTP/"[parser->index])
+				ERROR(HPE_INVALID_CONSTANT);
+			if (++parser->index == 5) {
+				parser->index = 0;
+				parser->http_major = 0;
+				UPDATE_STATE(state == s_req_http_start ? s_req_http_major : s_res_http_major);
+			}
+			break;
+
+		case s_req_http_major:
+		case s_res_http_major:
+			if (IS_NUM(ch) && parser->index < 3) {
+				parser->http_major = parser->http_major * 10 + (ch - '0');
+				parser->index++;
+				break;
+			}
+			if (ch != '.' || parser->index == 0)
+				ERROR(HPE_INVALID_VERSION);
+			parser->index = 0;
+			parser->http_minor = 0;
+			UPDATE_STATE(state == s_req_http_major ? s_req_http_minor : s_res_http_minor);
+			break;
+
+		case s_req_http_minor:
+		case s_res_http_minor:
+			if (IS_NUM(ch) && parser->index < 3) {
+				parser->http_minor = parser->http_minor * 10 + (ch - '0');
+				parser->index++;
+				break;
+			}
+			if (parser->index == 0)
+				ERROR(HPE_INVALID_VERSION);
+			if (state == s_res_http_minor) {
+				if (ch != ' ')
+					ERROR(HPE_INVALID_VERSION);
+				parser->index = 0;
+				parser->status_code = 0;
+				UPDATE_STATE(s_res_status_code);
+			} else if (ch == CR) {
+				UPDATE_STATE(s_req_line_almost_done);
+			} else if (ch == LF) {
+				UPDATE_STATE(s_header_field_start);
+			} else {
+				ERROR(HPE_INVALID_VERSION);
+			}
+			break;
+
+		case s_req_line_almost_done:
+		case s_res_line_almost_done:
+		case s_header_almost_done:
+			if (ch != LF)
+				ERROR(HPE_STRICT);
+			UPDATE_STATE(state == s_header_almost_done ? s_header_value_lws : s_header_field_start);
+			break;
+
+		case s_start_res:
+			if (ch == CR || ch == LF)
+				break;
+			message_reset(parser);
+			parser->status_code = 0;
+			if (ch != 'H')
+				ERROR(HPE_INVALID_CONSTANT);
+			parser->index = 1;
+			UPDATE_STATE(s_res_http_start);
+			CALLBACK_NOTIFY(message_begin, CONSUMED);
+			break;
+
+		case s_res_status_code:
+			if (IS_NUM(ch) && parser->index < 3) {
+				parser->status_code = parser->status_code * 10 + (ch - '0');
+				parser->index++;
+				break;
+			}
+			if (parser->index != 3)
+				ERROR(HPE_INVALID_STATUS);
+			if (ch == ' ')
+				UPDATE_STATE(s_res_status_start);
+			else if (ch == CR)
+				UPDATE_STATE(s_res_line_almost_done);
+			else if (ch == LF)
+				UPDATE_STATE(s_header_field_start);
+			else
+				ERROR(HPE_INVALID_STATUS);
+			break;
+
+		case s_res_status_start:
+			if (ch == CR) {
+				UPDATE_STATE(s_res_line_almost_done);
+				break;
+			}
+			if (ch == LF) {
+				UPDATE_STATE(s_header_field_start);
+				break;
+			}
+			status_mark = p;
+			UPDATE_STATE(s_res_status);
+			break;
+
+		case s_res_status:
+			if (ch == CR || ch == LF) {
+				UPDATE_STATE(ch == CR ? s_res_line_almost_done : s_header_field_start);
+				CALLBACK_DATA(status, status_mark, p, CONSUMED);
+			}
+			break;
+
+		case s_header_field_start:
+			if (ch == CR) {
+				UPDATE_STATE(s_headers_almost_done);
+				break;
+			}
+			if (ch == LF)
+				goto headers_done;
+			if (!is_token(ch))
+				ERROR(HPE_INVALID_HEADER_TOKEN);
+			field_mark = p;
+			parser->index = 0;
+			parser->token[parser->index++] = LOWER(ch);
+			UPDATE_STATE(s_header_field);
+			break;
+
+		case s_header_field:
+			if (is_token(ch)) {
+				if (parser->index < sizeof(parser->token) - 1)
+					parser->token[parser->index] = LOWER(ch);
+				if (parser->index < sizeof(parser->token))
+					parser->index++;
+				break;
+			}
+			if (ch != ':')
+				ERROR(HPE_INVALID_HEADER_TOKEN);
+			if (parser->index < sizeof(parser->token)) {
+				parser->token[parser->index] = '\0';
+				parser->header_state = match_header(parser->token);
+			} else {
+				parser->header_state = h_general;
+			}
+			if (parser->header_state == h_content_length) {
+				if (parser->flags & F_CONTENTLENGTH)
+					ERROR(HPE_UNEXPECTED_CONTENT_LENGTH);
+				parser->flags |= F_CONTENTLENGTH;
+				parser->content_length = 0;
+			} else if (parser->header_state == h_upgrade) {
+				parser->flags |= F_UPGRADE;
+			}
+			parser->index = 0;
+			UPDATE_STATE(s_header_value_discard_ws);
+			CALLBACK_DATA(header_field, field_mark, p, CONSUMED);
+			break;
+
+		case s_header_value_discard_ws:
+			if (ch == ' ' || ch == '\t')
+				break;
+			if (ch == CR || ch == LF) {
+				if (parser->header_state == h_content_length &&
+				    parser->index == 0)
+					ERROR(HPE_INVALID_CONTENT_LENGTH);
+				UPDATE_STATE(ch == CR ? s_header_almost_done : s_header_value_lws);
+				break;
+			}
+			value_mark = p;
+			UPDATE_STATE(s_header_value);
+			goto reexecute;
+
+		case s_header_value:
+			if (ch == CR || ch == LF) {
+				if (parser->header_state == h_content_length) {
+					if (parser->index == 0)
+						ERROR(HPE_INVALID_CONTENT_LENGTH);
+				} else if (parser->header_state != h_general) {
+					header_token_done(parser);
+				}
+				UPDATE_STATE(ch == CR ? s_header_almost_done : s_header_value_lws);
+				CALLBACK_DATA(header_value, value_mark, p, CONSUMED);
+				break;
+			}
+			if (ch < ' ' && ch != '\t')
+				ERROR(HPE_INVALID_HEADER_TOKEN);
+
+			switch (parser->header_state) {
+			case h_content_length:
+				/* index: 0 no digits yet, 1 in digits, 2 trailing space */
+				if (IS_NUM(ch) && parser->index < 2) {
+					if (parser->content_length > (UINT64_MAX - 10) / 10)
+						ERROR(HPE_INVALID_CONTENT_LENGTH);
+					parser->content_length = parser->content_length * 10 + (ch - '0');
+					parser->index = 1;
+				} else if ((ch == ' ' || ch == '\t') && parser->index > 0) {
+					parser->index = 2;
+				} else {
+					ERROR(HPE_INVALID_CONTENT_LENGTH);
+				}
+				break;
+			case h_transfer_encoding:
+			case h_connection:
+				if (ch == ',') {
+					header_token_done(parser);
+				} else if (ch != ' ' && ch != '\t') {
+					if (parser->index < sizeof(parser->token) - 1)
+						parser->token[parser->index] = LOWER(ch);
+					if (parser->index < sizeof(parser->token))
+						parser->index++;
+				}
+				break;
+			default:
+				break;
+			}
+			break;
+
+		case s_header_value_lws:
+			if (ch == ' ' || ch == '\t') {
+				/* obsolete line folding, continues the value */
+				UPDATE_STATE(s_header_value_discard_ws);
+				break;
+			}
+			UPDATE_STATE(s_header_field_start);
+			goto reexecute;
+
+		case s_headers_almost_done:
+			if (ch != LF)
+				ERROR(HPE_STRICT);
+		headers_done:
+			parser->nread = 0;
+			if (parser->flags & F_TRAILING) {
+				/* end of the trailer of a chunked message */
+				UPDATE_STATE(s_message_done);
+				CALLBACK_NOTIFY(chunk_complete, CONSUMED);
+				MESSAGE_DONE(CONSUMED);
+				state = (enum state) parser->state;
+				break;
+			}
+
+			if (parser->flags & F_CHUNKED) {
+				/* the transfer coding overrides any Content-Length */
+				parser->flags &= ~F_CONTENTLENGTH;
+				parser->content_length = 0;
+			}
+			parser->upgrade =
+				((parser->flags & (F_UPGRADE | F_CONNECTION_UPGRADE)) ==
+				 (F_UPGRADE | F_CONNECTION_UPGRADE) &&
+				 (parser->type == HTTP_REQUEST || parser->status_code == 101)) ||
+				(parser->type == HTTP_REQUEST && parser->method == HTTP_CONNECT);
+
+			if (settings->on_headers_complete) {
+				switch (settings->on_headers_complete(parser)) {
+				case 0:
+					break;
+				case 1:
+					parser->flags |= F_SKIPBODY;
+					break;
+				default:
+					SET_ERRNO(HPE_CB_headers_complete);
+					return CONSUMED;
+				}
+			}
+
+			if (parser->upgrade) {
+				/* the rest of the data belongs to another protocol */
+				MESSAGE_DONE(CONSUMED);
+				return CONSUMED;
+			}
+
+			if (parser->flags & F_SKIPBODY) {
+				MESSAGE_DONE(CONSUMED);
+				state = (enum state) parser->state;
+				break;
+			} else if (parser->flags & F_CHUNKED) {
+				UPDATE_STATE(s_chunk_size_start);
+			} else if (parser->content_length != CONTENT_LENGTH_UNKNOWN &&
+				   parser->content_length > 0) {
+				UPDATE_STATE(s_body_identity);
+			} else if (http_message_needs_eof(parser)) {
+				UPDATE_STATE(s_body_identity_eof);
+			} else {
+				MESSAGE_DONE(CONSUMED);
+				state = (enum state) parser->state;
+				break;
+			}
+			if (HTTP_PARSER_ERRNO(parser) != HPE_OK)
+				return CONSUMED; /* paused */
+			break;
+
+		case s_body_identity:
+			n = MIN(parser->content_length, (uint64_t) (end - p));
+			parser->content_length -= n;
+			if (parser->content_length == 0)
+				UPDATE_STATE(s_message_done);
+			if (settings->on_body && settings->on_body(parser, p, n) != 0)
+				SET_ERRNO(HPE_CB_body);
+			p += n - 1;
+			if (parser->content_length == 0) {
+				MESSAGE_DONE(CONSUMED);
+				state = (enum state) parser->state;
+			} else if (HTTP_PARSER_ERRNO(parser) != HPE_OK) {
+				return CONSUMED;
+			}
+			break;
+
+		case s_body_identity_eof:
+			n = end - p;
+			if (settings->on_body && settings->on_body(parser, p, n) != 0)
+				SET_ERRNO(HPE_CB_body);
+			p += n - 1;
+			if (HTTP_PARSER_ERRNO(parser) != HPE_OK)
+				return CONSUMED;
+			break;
+
+		case s_chunk_size_start:
+			if ((d = unhex(ch)) < 0)
+				ERROR(HPE_INVALID_CHUNK_SIZE);
+			parser->content_length = d;
+			UPDATE_STATE(s_chunk_size);
+			break;
+
+		case s_chunk_size:
+			if ((d = unhex(ch)) >= 0) {
+				if (parser->content_length > (UINT64_MAX - 16) / 16)
+					ERROR(HPE_INVALID_CHUNK_SIZE);
+				parser->content_length = parser->content_length * 16 + d;
+				break;
+			}
+			if (ch == ';' || ch == ' ' || ch == '\t') {
+				UPDATE_STATE(s_chunk_parameters);
+				break;
+			}
+			if (ch == CR) {
+				UPDATE_STATE(s_chunk_size_almost_done);
+				break;
+			}
+			if (ch != LF)
+				ERROR(HPE_INVALID_CHUNK_SIZE);
+			goto chunk_size_done;
+
+		case s_chunk_parameters:
+			/* chunk extensions are ignored */
+			if (ch == CR)
+				UPDATE_STATE(s_chunk_size_almost_done);
+			else if (ch == LF)
+				goto chunk_size_done;
+			break;
+
+		case s_chunk_size_almost_done:
+			if (ch != LF)
+				ERROR(HPE_STRICT);
+		chunk_size_done:
+			parser->nread = 0;
+			if (parser->content_length == 0) {
+				/* last chunk, a trailer may follow */
+				parser->flags |= F_TRAILING;
+				UPDATE_STATE(s_header_field_start);
+			} else {
+				UPDATE_STATE(s_chunk_data);
+			}
+			CALLBACK_NOTIFY(chunk_header, CONSUMED);
+			break;
+
+		case s_chunk_data:
+			n = MIN(parser->content_length, (uint64_t) (end - p));
+			parser->content_length -= n;
+			if (parser->content_length == 0)
+				UPDATE_STATE(s_chunk_data_almost_done);
+			if (settings->on_body && settings->on_body(parser, p, n) != 0)
+				SET_ERRNO(HPE_CB_body);
+			p += n - 1;
+			if (HTTP_PARSER_ERRNO(parser) != HPE_OK)
+				return CONSUMED;
+			break;
+
+		case s_chunk_data_almost_done:
+			if (ch != CR)
+				ERROR(HPE_STRICT);
+			UPDATE_STATE(s_chunk_data_done);
+			break;
+
+		case s_chunk_data_done:
+			if (ch != LF)
+				ERROR(HPE_STRICT);
+			parser->nread = 0;
+			UPDATE_STATE(s_chunk_size_start);
+			CALLBACK_NOTIFY(chunk_complete, CONSUMED);
+			break;
+
+		default:
+			ERROR(HPE_UNKNOWN);
+		}
+	}
+
+	/* report the parts of tokens that continue in the next buffer */
+	CALLBACK_DATA(url, url_mark, end, len);
+	CALLBACK_DATA(status, status_mark, end, len);
+	CALLBACK_DATA(header_field, field_mark, end, len);
+	CALLBACK_DATA(header_value, value_mark, end, len);
+	return len;
+
+error:
+	if (HTTP_PARSER_ERRNO(parser) == HPE_OK)
+		SET_ERRNO(HPE_UNKNOWN);
+	return p - data;
+
+#undef CONSUMED
+#undef ERROR
+#undef UPDATE_STATE
+}
+
+void http_parser_init(struct http_parser *parser, enum http_parser_type type)
+{
+	void *data = parser->data; /* preserved across resets */
+
+	memset(parser, 0, sizeof(*parser));
+	parser->data = data;
+	parser->type = type;
+	parser->state = start_state(parser);
+	parser->content_length = CONTENT_LENGTH_UNKNOWN;
+	parser->http_errno = HPE_OK;
+}
+
+void http_parser_settings_init(struct http_parser_settings *settings)
+{
+	memset(settings, 0, sizeof(*settings));
+}
+
+int http_body_is_final(const struct http_parser *parser)
+{
+	return parser->state == s_message_done;
+}
+
+void http_parser_pause(struct http_parser *parser, int paused)
+{
+	if (HTTP_PARSER_ERRNO(parser) == HPE_OK ||
+	    HTTP_PARSER_ERRNO(parser) == HPE_PAUSED)
+		SET_ERRNO(paused ? HPE_PAUSED : HPE_OK);
+}
+
+const char *http_method_str(enum http_method m)
+{
+	if ((unsigned) m >= sizeof(method_strings) / sizeof(method_strings[0]) ||
+	    method_strings[m] == NULL)
+		return "<unknown>";
+	return method_strings[m];
+}
+
+const char *http_errno_name(enum http_errno err)
+{
+	if ((unsigned) err >= sizeof(http_strerror_tab) / sizeof(http_strerror_tab[0]))
+		err = HPE_UNKNOWN;
+	return http_strerror_tab[err].name;
+}
+
+const char *http_errno_description(enum http_errno err)
+{
+	if ((unsigned) err >= sizeof(http_strerror_tab) / sizeof(http_strerror_tab[0]))
+		err = HPE_UNKNOWN;
+	return http_strerror_tab[err].description;
+}
+
+/*
+ * URL parsing
+ */
+void http_parser_url_init(struct http_parser_url *u)
+{
+	memset(u, 0, sizeof(*u));
+}
+
+static inline void url_set(struct http_parser_url *u, enum http_parser_url_fields f,
+			   const char *buf, const char *start, const char *end)
+{
+	u->field_set |= (1 << f);
+	u->field_data[f].off = start - buf;
+	u->field_data[f].len = end - start;
+}
+
+/* Parses [userinfo@]host[:port] of [start, end) */
+static int parse_authority(const char *buf, const char *start, const char *end,
+			   struct http_parser_url *u)
+{
+	const char *p, *h, *host, *host_end, *port;
+
+	for (p = start; p < end && *p != '@'; p++)
+		;
+	if (p < end) {
+		url_set(u, UF_USERINFO, buf, start, p);
+		start = p + 1;
+	}
+
+	if (start < end && *start == '[') {
+		/* IPv6 literal */
+		for (p = start + 1; p < end && *p != ']'; p++)
+			;
+		if (p == end)
+			return 1;
+		host = start + 1;
+		host_end = p;
+		p++;
+	} else {
+		for (p = start; p < end && *p != ':'; p++)
+			;
+		host = start;
+		host_end = p;
+	}
+	if (host == host_end)
+		return 1;
+	for (h = host; h < host_end; h++) {
+		if ((unsigned char) *h <= ' ' || *h == '/' || *h == '?' || *h == '#')
+			return 1;
+	}
+	url_set(u, UF_HOST, buf, host, host_end);
+
+	if (p < end) {
+		unsigned long v = 0;
+
+		if (*p != ':')
+			return 1;
+		port = p + 1;
+		if (port == end)
+			return 1;
+		for (p = port; p < end; p++) {
+			if (!IS_NUM(*p))
+				return 1;
+			v = v * 10 + (*p - '0');
+			if (v > 0xffff)
+				return 1;
+		}
+		url_set(u, UF_PORT, buf, port, end);
+		u->port = (uint16_t) v;
+	}
+	return 0;
+}
+
+int http_parser_parse_url(const char *buf, size_t buflen, int is_connect,
+			  struct http_parser_url *u)
+{
+	const char *p = buf;
+	const char *end = buf + buflen;
+	const char *s;
+
+	http_parser_url_init(u);
+	if (buflen == 0 || buflen > 0xffff)
+		return 1;
+	for (s = buf; s < end; s++) {
+		if ((unsigned char) *s <= ' ' || *s == 0x7f)
+			return 1;
+	}
+
+	if (is_connect) {
+		/* CONNECT requests carry host:port only */
+		if (parse_authority(buf, buf, end, u) != 0 ||
+		    !(u->field_set & (1 << UF_PORT)) ||
+		    (u->field_set & (1 << UF_USERINFO)))
+			return 1;
+		return 0;
+	}
+
+	if (*p != '/' && *p != '*') {
+		/* absolute form: schema "://" authority */
+		if (!IS_ALPHA(*p))
+			return 1;
+		for (s = p; s < end && (IS_ALPHA(*s) || IS_NUM(*s) ||
+					*s == '+' || *s == '-' || *s == '.'); s++)
+			;
+		if (end - s < 3 || strncmp(s, "://", 3) != 0)
+			return 1;
+		url_set(u, UF_SCHEMA, buf, p, s);
+		p = s + 3;
+		for (s = p; s < end && *s != '/' && *s != '?' && *s != '#'; s++)
+			;
+		if (parse_authority(buf, p, s, u) != 0)
+			return 1;
+		p = s;
+	}
+
+	for (s = p; s < end && *s != '?' && *s != '#'; s++)
+		;
+	if (s > p)
+		url_set(u, UF_PATH, buf, p, s);
+	p = s;
+	if (p < end && *p == '?') {
+		for (s = ++p; s < end && *s != '#'; s++)
+			;
+		url_set(u, UF_QUERY, buf, p, s);
+		p = s;
+	}
+	if (p < end && *p == '#')
+		url_set(u, UF_FRAGMENT, buf, p + 1, end);
+	return 0;
+}
@@ -0,0 +1,233 @@
+/*
+ * Incremental HTTP/1.x parser for SHFS tools and Mini-OS
+ *
+ *
+ * Copyright (c) 2017, NEC Europe Ltd., NEC Corporation All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * THIS HEADER MAY NOT BE EXTRACTED OR MODIFIED IN ANY WAY.
+ */
+
+#ifndef _HTTP_PARSER_H_
+#define _HTTP_PARSER_H_
+
+/*
+ * Callback based, non-copying HTTP/1.x request and response parser.
+ * The interface follows the one of the Joyent/Node.js http_parser, so
+ * that code written against it (e.g., shfs_admin) works unmodified.
+ *
+ * Data is passed in arbitrarily sized pieces with http_parser_execute();
+ * URL, status, header and body data is reported through callbacks with
+ * pointers into the passed buffer. A token that spans two buffers is
+ * reported in two pieces. Chunked transfer encoding is decoded: on_body
+ * only sees the payload of the chunks.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifndef HTTP_MAX_HEADER_SIZE
+#define HTTP_MAX_HEADER_SIZE (8 * 1024) /* request/status line plus headers */
+#endif
+
+enum http_parser_type {
+	HTTP_REQUEST,
+	HTTP_RESPONSE,
+};
+
+#define HTTP_METHOD_MAP(XX) \
+	XX(0, DELETE,  DELETE)  \
+	XX(1, GET,     GET)     \
+	XX(2, HEAD,    HEAD)    \
+	XX(3, POST,    POST)    \
+	XX(4, PUT,     PUT)     \
+	XX(5, CONNECT, CONNECT) \
+	XX(6, OPTIONS, OPTIONS) \
+	XX(7, TRACE,   TRACE)   \
+	XX(28, PATCH,  PATCH)
+
+enum http_method {
+#define XX(num, name, string) HTTP_##name = num,
+	HTTP_METHOD_MAP(XX)
+#undef XX
+};
+
+enum flags {
+	F_CHUNKED               = 1 << 0,
+	F_CONNECTION_KEEP_ALIVE = 1 << 1,
+	F_CONNECTION_CLOSE      = 1 << 2,
+	F_CONNECTION_UPGRADE    = 1 << 3,
+	F_TRAILING              = 1 << 4,
+	F_UPGRADE               = 1 << 5,
+	F_SKIPBODY              = 1 << 6,
+	F_CONTENTLENGTH         = 1 << 7,
+};
+
+#define HTTP_ERRNO_MAP(XX) \
+	XX(OK, "success") \
+	XX(CB_message_begin, "the on_message_begin callback failed") \
+	XX(CB_url, "the on_url callback failed") \
+	XX(CB_header_field, "the on_header_field callback failed") \
+	XX(CB_header_value, "the on_header_value callback failed") \
+	XX(CB_headers_complete, "the on_headers_complete callback failed") \
+	XX(CB_body, "the on_body callback failed") \
+	XX(CB_message_complete, "the on_message_complete callback failed") \
+	XX(CB_status, "the on_status callback failed") \
+	XX(CB_chunk_header, "the on_chunk_header callback failed") \
+	XX(CB_chunk_complete, "the on_chunk_complete callback failed") \
+	XX(INVALID_EOF_STATE, "stream ended at an unexpected time") \
+	XX(HEADER_OVERFLOW, "too many header bytes seen") \
+	XX(CLOSED_CONNECTION, "data received after completed connection: close message") \
+	XX(INVALID_VERSION, "invalid HTTP version") \
+	XX(INVALID_STATUS, "invalid HTTP status code") \
+	XX(INVALID_METHOD, "invalid HTTP method") \
+	XX(INVALID_URL, "invalid URL") \
+	XX(INVALID_HEADER_TOKEN, "invalid character in header") \
+	XX(INVALID_CONTENT_LENGTH, "invalid character in content-length header") \
+	XX(UNEXPECTED_CONTENT_LENGTH, "unexpected content-length header") \
+	XX(INVALID_CHUNK_SIZE, "invalid character in chunk size header") \
+	XX(INVALID_CONSTANT, "invalid constant string") \
+	XX(STRICT, "strict mode assertion failed") \
+	XX(PAUSED, "parser is paused") \
+	XX(UNKNOWN, "an unknown error occurred")
+
+enum http_errno {
+#define XX(n, s) HPE_##n,
+	HTTP_ERRNO_MAP(XX)
+#undef XX
+};
+
+#define HTTP_PARSER_ERRNO(p) ((enum http_errno) (p)->http_errno)
+
+struct http_parser {
+	uint8_t type;          /* enum http_parser_type */
+	uint8_t flags;         /* enum flags */
+	uint8_t state;         /* private */
+	uint8_t header_state;  /* private */
+	uint8_t index;         /* private */
+	uint8_t http_errno;
+	uint8_t upgrade;       /* set when the connection switches protocols */
+	uint8_t method;        /* enum http_method, requests only */
+
+	uint32_t nread;        /* header bytes read so far */
+	uint64_t content_length; /* body bytes left, chunk bytes left if chunked */
+
+	uint16_t http_major;
+	uint16_t http_minor;
+	uint16_t status_code;  /* responses only */
+
+	char token[20];        /* private: method, header name or value token */
+
+	void *data;            /* for the user */
+};
+
+typedef struct http_parser http_parser;
+typedef int (*http_data_cb)(struct http_parser *, const char *at, size_t length);
+typedef int (*http_cb)(struct http_parser *);
+
+/*
+ * A non-zero return value of a callback stops the parser with the
+ * corresponding HPE_CB_* error. on_headers_complete may return 1 to
+ * indicate that the message has no body (e.g., responses to HEAD).
+ */
+struct http_parser_settings {
+	http_cb      on_message_begin;
+	http_data_cb on_url;
+	http_data_cb on_status;
+	http_data_cb on_header_field;
+	http_data_cb on_header_value;
+	http_cb      on_headers_complete;
+	http_data_cb on_body;
+	http_cb      on_message_complete;
+	http_cb      on_chunk_header; /* content_length holds the chunk size */
+	http_cb      on_chunk_complete;
+};
+typedef struct http_parser_settings http_parser_settings;
+
+enum http_parser_url_fields {
+	UF_SCHEMA   = 0,
+	UF_HOST     = 1,
+	UF_PORT     = 2,
+	UF_PATH     = 3,
+	UF_QUERY    = 4,
+	UF_FRAGMENT = 5,
+	UF_USERINFO = 6,
+	UF_MAX      = 7,
+};
+
+/*
+ * Result of http_parser_parse_url(): field_set has a bit (1 << UF_*)
+ * for every field found, field_data holds its offset and length within
+ * the URL string
+ */
+struct http_parser_url {
+	uint16_t field_set;
+	uint16_t port;         /* converted UF_PORT */
+	struct {
+		uint16_t off;
+		uint16_t len;
+	} field_data[UF_MAX];
+};
+
+void http_parser_init(struct http_parser *parser, enum http_parser_type type);
+void http_parser_settings_init(struct http_parser_settings *settings);
+
+/*
+ * Parses len bytes of data. Returns the number of bytes parsed; this is
+ * less than len on errors (see HTTP_PARSER_ERRNO()), when the parser was
+ * paused from a callback or when the connection was upgraded. Passing
+ * len = 0 signals the end of the stream.
+ */
+size_t http_parser_execute(struct http_parser *parser,
+			   const struct http_parser_settings *settings,
+			   const char *data, size_t len);
+
+/*
+ * Returns 0 if this is the last message on the connection, the
+ * connection needs to be closed after it has been answered
+ */
+int http_should_keep_alive(const struct http_parser *parser);
+
+/* Returns 1 if the body of the current message ends at the end of the stream */
+int http_message_needs_eof(const struct http_parser *parser);
+
+const char *http_method_str(enum http_method m);
+const char *http_errno_name(enum http_errno err);
+const char *http_errno_description(enum http_errno err);
+
+void http_parser_url_init(struct http_parser_url *u);
+/* Returns 0 on success, 1 if the URL could not be parsed */
+int http_parser_parse_url(const char *buf, size_t buflen, int is_connect,
+			  struct http_parser_url *u);
+
+/* Pauses (paused = 1) or resumes (paused = 0) the parser */
+void http_parser_pause(struct http_parser *parser, int paused);
+
+/* Returns 1 if the message body has been completely parsed */
+int http_body_is_final(const struct http_parser *parser);
+
+#endif /* _HTTP_PARSER_H_ */
@@ -150,7 +150,7 @@ int shfs_alloc_cache(void)
 					 0,
 					 0,
 					 sizeof(struct shfs_cache_entry),
-					 1,
+					 SHFS_CACHE_POOL_SEP_DATA,
 					 NULL, NULL,
 					 _cce_pobj_init, NULL,
 					 NULL, NULL);
@@ -161,7 +161,7 @@ int shfs_alloc_cache(void)
 				      0,
 				      0,
 				      sizeof(struct shfs_cache_entry),
-				      1,
+				      SHFS_CACHE_POOL_SEP_DATA,
 				      NULL, NULL,
 				      _cce_pobj_init, NULL,
 				      NULL, NULL);
@@ -776,6 +776,10 @@ int shcmd_shfs_cache_info(FILE *cio, int argc, char *argv[])
 	fprintf(cio, " Number pre-allocated buffers:       %12"PRIu32" (pool size: %7"PRIu64" KiB)\n",
 	        nb_objs, pool_size / 1024);
 #endif
+#ifdef SHFS_CACHE_LARGEPAGES
+	fprintf(cio, " Large page-backed buffers:              %s\n",
+	        (shfs_vol.chunkcache->pool && mempool_large_data(shfs_vol.chunkcache->pool)) ? " enabled" : "disabled");
+#endif
 #ifdef SHFS_CACHE_GROW
 	fprintf(cio, " Dynamic buffer allocation:               enabled");
 #ifdef SHFS_CACHE_GROW_THRESHOLD
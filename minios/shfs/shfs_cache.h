@@ -73,6 +73,13 @@
 #endif
 #endif
 
+#ifdef SHFS_CACHE_LARGEPAGES /* if enabled, the pre-allocated pool requests a large page-backed
+			      * buffer area (falls back to regular pages if not available) */
+#define SHFS_CACHE_POOL_SEP_DATA MEMPOOL_SEP_DATA_LARGE
+#else
+#define SHFS_CACHE_POOL_SEP_DATA MEMPOOL_SEP_DATA
+#endif
+
 /*#define SHFS_CACHE_GROW*/ /* uncomment this line to allow the cache to grow in size by
 			     * allocating more buffers on demand (via malloc()). When
 			     * SHFS_GROW_THRESHOLD is defined, left system memory 